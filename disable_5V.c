@@ -1,9 +1,7 @@
-#include <wiringPi.h>
+#include "gh_io.h"
 
 int main (void)
 {
-  wiringPiSetupGpio();
-  pinMode (27, OUTPUT);
-  digitalWrite (27,  LOW);
+  io_gpio_output_persistent (27,  0);
   return 0;
 }
@@ -1,11 +1,8 @@
-#include <wiringPi.h>
+#include "gh_io.h"
 
 int main (void)
 {
-  wiringPiSetupGpio();
-  pinMode (17, OUTPUT);
-  pinMode (27, OUTPUT);
-  digitalWrite (17, HIGH);
-  digitalWrite (27,  HIGH);
+  io_gpio_output_persistent (17, 1);
+  io_gpio_output_persistent (27, 1);
   return 0;
 }
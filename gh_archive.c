@@ -0,0 +1,498 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "gh_archive.h"
+
+struct archive_cursor {
+  sqlite3* conn;
+  bool txn_p; // Whether the cursor began the transaction, and so ends it
+  int n_cols;
+  char* cols[ARCHIVE_COLUMNS_MAX];
+  long long sec_from, sec_to;
+  sqlite3_stmt* pStmt_blocks; // NULL once done with the archive, or if there is none
+  sqlite3_stmt* pStmt_live;
+  // The current block
+  struct archive_row* rows;
+  int n_rows, pos, rows_size;
+  int map[ARCHIVE_COLUMNS_MAX]; // Block column of each of the cursor's columns, or -1 if the block doesn't have it, e.g. because it was archived before the column was added
+};
+
+static void check_conn(sqlite3* conn, int rc, const char* msg) {
+  if(rc!=SQLITE_OK && rc!=SQLITE_ROW && rc!=SQLITE_DONE) {
+    fprintf(stderr, "%s: %s\n", msg, sqlite3_errmsg(conn));
+    exit(rc);
+  }
+}
+
+static void buf_reserve(struct archive_buf* b, size_t n) {
+  if(b->len+n <= b->size) return;
+  size_t size = b->size?b->size*2:4096;
+  while(size < b->len+n) size *= 2;
+  b->data = (unsigned char*)realloc(b->data, size);
+  if(!b->data) {
+    fprintf(stderr, "Out of memory for archive block\n");
+    exit(-1);
+  }
+  b->size = size;
+}
+
+static void put_varint(struct archive_buf* b, unsigned long long u) {
+  buf_reserve(b, 10);
+  while(u>=0x80) {
+    b->data[b->len++] = (unsigned char)(u | 0x80);
+    u >>= 7;
+  }
+  b->data[b->len++] = (unsigned char)u;
+}
+
+static bool get_varint(const unsigned char** p, const unsigned char* end, unsigned long long* u) {
+  *u = 0;
+  for(int shift=0; (*p<end) && (shift<64); shift+=7) {
+    unsigned char byte = *(*p)++;
+    *u |= (unsigned long long)(byte & 0x7f) << shift;
+    if(!(byte & 0x80)) return true;
+  }
+  return false;
+}
+
+static unsigned long long zigzag(long long x) {
+  return ((unsigned long long)x << 1) ^ (unsigned long long)(x >> 63);
+}
+
+static long long unzigzag(unsigned long long u) {
+  return (long long)(u >> 1) ^ -(long long)(u & 1);
+}
+
+// Each stream of zigzagged numbers (the timestamps, and each column's values) is bit-packed in groups of ARCHIVE_GROUP: a byte for the group's width, i.e. the bits in its largest number, then each number in that many bits. So a steady period costs no bits per row, and a column that changes by a few units costs a few bits.
+static void pack_stream(struct archive_buf* b, const unsigned long long* v, int n) {
+  for(int g=0; g<n; g+=ARCHIVE_GROUP) {
+    int n_group = (n-g<ARCHIVE_GROUP)?(n-g):ARCHIVE_GROUP;
+    int width = 0;
+    for(int i=0; i<n_group; i++)
+      while((width<64) && (v[g+i]>>width)) width++;
+    size_t n_bytes = ((size_t)n_group*width + 7)/8;
+    buf_reserve(b, 1+n_bytes);
+    b->data[b->len++] = (unsigned char)width;
+    unsigned char* d = b->data + b->len;
+    memset(d, 0, n_bytes);
+    size_t bit = 0;
+    for(int i=0; i<n_group; i++)
+      for(int k=0; k<width; ) {
+	int off = bit%8, chunk = (8-off < width-k)?(8-off):(width-k);
+	d[bit/8] |= ((v[g+i] >> k) & ((1u<<chunk)-1)) << off;
+	k += chunk;
+	bit += chunk;
+      }
+    b->len += n_bytes;
+  }
+}
+
+static bool unpack_stream(const unsigned char** p, const unsigned char* end, unsigned long long* v, int n) {
+  for(int g=0; g<n; g+=ARCHIVE_GROUP) {
+    int n_group = (n-g<ARCHIVE_GROUP)?(n-g):ARCHIVE_GROUP;
+    if(*p>=end) return false;
+    int width = *(*p)++;
+    size_t n_bytes = ((size_t)n_group*width + 7)/8;
+    if((width>64) || ((size_t)(end-*p) < n_bytes)) return false;
+    const unsigned char* d = *p;
+    size_t bit = 0;
+    for(int i=0; i<n_group; i++) {
+      unsigned long long x = 0;
+      for(int k=0; k<width; ) {
+	int off = bit%8, chunk = (8-off < width-k)?(8-off):(width-k);
+	x |= (unsigned long long)((d[bit/8] >> off) & ((1u<<chunk)-1)) << k;
+	k += chunk;
+	bit += chunk;
+      }
+      v[g+i] = x;
+    }
+    *p += n_bytes;
+  }
+  return true;
+}
+
+static unsigned long long* alloc_stream(int n_rows) {
+  unsigned long long* v = (unsigned long long*)malloc((n_rows?n_rows:1)*sizeof(unsigned long long));
+  if(!v) {
+    fprintf(stderr, "Out of memory for archive block\n");
+    exit(-1);
+  }
+  return v;
+}
+
+void archive_encode(struct archive_row* rows, int n_rows, int n_cols, struct archive_buf* out) {
+  unsigned long long* v = alloc_stream(n_rows);
+  put_varint(out, ARCHIVE_VERSION);
+  put_varint(out, n_rows);
+  put_varint(out, n_cols);
+  long long prev_t = 0, prev_d = 0;
+  for(int i=0; i<n_rows; i++) {
+    long long t = (long long)(rows[i].sec - rows[0].sec)*ARCHIVE_TICKS_PER_SEC + rows[i].cs;
+    long long d = t - prev_t;
+    v[i] = zigzag(i?(d - prev_d):t);
+    if(i) prev_d = d;
+    prev_t = t;
+  }
+  pack_stream(out, v, n_rows);
+  for(int c=0; c<n_cols; c++) {
+    int n_nulls = 0;
+    for(int i=0; i<n_rows; i++) if(rows[i].nulls & (1u<<c)) n_nulls++;
+    put_varint(out, (n_nulls==0)?0:((n_nulls<n_rows)?1:2)); // No nulls, some, or all
+    if(n_nulls==n_rows) continue;
+    if(n_nulls) {
+      size_t n_bytes = (n_rows+7)/8;
+      buf_reserve(out, n_bytes);
+      memset(out->data+out->len, 0, n_bytes);
+      for(int i=0; i<n_rows; i++) if(rows[i].nulls & (1u<<c)) out->data[out->len + i/8] |= 1 << (i%8);
+      out->len += n_bytes;
+    }
+    long long prev = 0;
+    int n = 0;
+    for(int i=0; i<n_rows; i++) {
+      if(rows[i].nulls & (1u<<c)) continue;
+      v[n++] = zigzag(rows[i].vals[c] - prev);
+      prev = rows[i].vals[c];
+    }
+    pack_stream(out, v, n);
+  }
+  free(v);
+}
+
+// v is scratch space for a stream
+static bool decode_streams(const unsigned char* p, const unsigned char* end, int sec_first, int n_rows, int n_cols, struct archive_row* rows, unsigned long long* v) {
+  unsigned long long u;
+  if(!unpack_stream(&p, end, v, n_rows)) return false;
+  long long prev_t = 0, prev_d = 0;
+  for(int i=0; i<n_rows; i++) {
+    long long t;
+    if(i) {
+      prev_d += unzigzag(v[i]);
+      t = prev_t + prev_d;
+    } else t = unzigzag(v[i]);
+    if((t<prev_t) || (t>=(long long)(ARCHIVE_BLOCK_SPAN+1)*ARCHIVE_TICKS_PER_SEC)) return false;
+    rows[i].sec = sec_first + (int)(t/ARCHIVE_TICKS_PER_SEC);
+    rows[i].cs = (int)(t%ARCHIVE_TICKS_PER_SEC);
+    rows[i].nulls = 0;
+    prev_t = t;
+  }
+  for(int c=0; c<n_cols; c++) {
+    if(!get_varint(&p, end, &u) || (u>2)) return false;
+    if(u==2) {
+      for(int i=0; i<n_rows; i++) {
+	rows[i].nulls |= 1u<<c;
+	rows[i].vals[c] = 0;
+      }
+      continue;
+    }
+    const unsigned char* bitmap = NULL;
+    int n = n_rows;
+    if(u==1) {
+      if((size_t)(end-p) < (size_t)(n_rows+7)/8) return false;
+      bitmap = p;
+      p += (n_rows+7)/8;
+      for(int i=0; i<n_rows; i++) if(bitmap[i/8] & (1 << (i%8))) n--;
+    }
+    if(!unpack_stream(&p, end, v, n)) return false;
+    long long prev = 0;
+    for(int i=0, j=0; i<n_rows; i++) {
+      if(bitmap && (bitmap[i/8] & (1 << (i%8)))) {
+	rows[i].nulls |= 1u<<c;
+	rows[i].vals[c] = 0;
+	continue;
+      }
+      prev += unzigzag(v[j++]);
+      rows[i].vals[c] = (int)prev;
+    }
+  }
+  return p==end;
+}
+
+bool archive_decode(const unsigned char* data, size_t len, int sec_first, int n_rows, int n_cols, struct archive_row* rows) {
+  const unsigned char *p = data, *end = data+len;
+  unsigned long long u;
+  if(!get_varint(&p, end, &u) || (u!=ARCHIVE_VERSION)) return false;
+  if(!get_varint(&p, end, &u) || (u!=(unsigned long long)n_rows)) return false;
+  if(!get_varint(&p, end, &u) || (u!=(unsigned long long)n_cols) || (n_cols>ARCHIVE_COLUMNS_MAX)) return false;
+  unsigned long long* v = alloc_stream(n_rows);
+  bool ok_p = decode_streams(p, end, sec_first, n_rows, n_cols, rows, v);
+  free(v);
+  return ok_p;
+}
+
+void archive_encode_series(const long long* t, const int* vals, int n, struct archive_buf* out) {
+  unsigned long long* v = alloc_stream(n);
+  put_varint(out, n);
+  long long prev_d = 0;
+  for(int i=0; i<n; i++) {
+    long long d = i?(t[i] - t[i-1]):0;
+    v[i] = zigzag(i?(d - prev_d):t[0]);
+    prev_d = d;
+  }
+  pack_stream(out, v, n);
+  for(int i=0; i<n; i++) v[i] = zigzag((long long)vals[i] - (i?vals[i-1]:0));
+  pack_stream(out, v, n);
+  free(v);
+}
+
+bool archive_decode_series(const unsigned char** p, const unsigned char* end, long long* t, int* vals, int n_max, int* n) {
+  unsigned long long u;
+  if(!get_varint(p, end, &u) || (u>(unsigned long long)n_max)) return false;
+  *n = (int)u;
+  unsigned long long* v = alloc_stream(*n);
+  bool ok_p = unpack_stream(p, end, v, *n);
+  long long prev_d = 0;
+  for(int i=0; ok_p && (i<*n); i++) {
+    if(i) {
+      prev_d += unzigzag(v[i]);
+      t[i] = t[i-1] + prev_d;
+    } else t[i] = unzigzag(v[i]);
+  }
+  if(ok_p) ok_p = unpack_stream(p, end, v, *n);
+  long long prev = 0;
+  for(int i=0; ok_p && (i<*n); i++) {
+    prev += unzigzag(v[i]);
+    vals[i] = (int)prev;
+  }
+  free(v);
+  return ok_p;
+}
+
+bool archive_present_p(sqlite3* conn) {
+  sqlite3_stmt* pStmt;
+  int rc = sqlite3_prepare_v3(conn, "SELECT 1 FROM sqlite_master WHERE type='table' AND name='Archive_blocks'", -1, 0, &pStmt, NULL);
+  check_conn(conn, rc, "sqlite3_prepare failure in archive_present_p");
+  rc = sqlite3_step(pStmt);
+  check_conn(conn, rc, "sqlite3_step failure in archive_present_p");
+  sqlite3_finalize(pStmt);
+  return rc==SQLITE_ROW;
+}
+
+static char* select_cols(const char** cols, int n_cols) {
+  char* zCols = sqlite3_mprintf("sec, cs");
+  for(int i=0; i<n_cols; i++) {
+    char* tmp = sqlite3_mprintf("%s, \"%w\"", zCols, cols[i]);
+    sqlite3_free(zCols);
+    zCols = tmp;
+  }
+  return zCols;
+}
+
+static void read_live_row(sqlite3_stmt* pStmt, int n_cols, struct archive_row* r) {
+  r->sec = sqlite3_column_int(pStmt, 0);
+  r->cs = sqlite3_column_int(pStmt, 1);
+  r->nulls = 0;
+  for(int i=0; i<n_cols; i++) {
+    if(sqlite3_column_type(pStmt, i+2)==SQLITE_NULL) r->nulls |= 1u<<i;
+    r->vals[i] = sqlite3_column_int(pStmt, i+2);
+  }
+}
+
+// Block column of each of cols, from the block's comma-separated column list
+static void map_cols(const char* block_cols, const char** cols, int n_cols, int* map) {
+  for(int i=0; i<n_cols; i++) {
+    map[i] = -1;
+    const char* p = block_cols;
+    size_t len = strlen(cols[i]);
+    for(int c=0; p; c++) {
+      if(!strncmp(p, cols[i], len) && ((p[len]==',') || !p[len])) {
+	map[i] = c;
+	break;
+      }
+      p = strchr(p, ',');
+      if(p) p++;
+    }
+  }
+}
+
+static int count_cols(const char* block_cols) {
+  int n = 1;
+  for(const char* p=block_cols; *p; p++) if(*p==',') n++;
+  return n;
+}
+
+// Decodes the block at the current row of pStmt, which is sec_first, n_rows, columns, data. Returns the number of rows, into *rows, which is grown as needed.
+static int load_block(sqlite3_stmt* pStmt, const char** cols, int n_cols, struct archive_row** rows, int* rows_size, int* map) {
+  int sec_first = sqlite3_column_int(pStmt, 0);
+  int n_rows = sqlite3_column_int(pStmt, 1);
+  const char* block_cols = (const char*)sqlite3_column_text(pStmt, 2);
+  const unsigned char* data = (const unsigned char*)sqlite3_column_blob(pStmt, 3);
+  size_t len = sqlite3_column_bytes(pStmt, 3);
+  if(n_rows>*rows_size) {
+    *rows = (struct archive_row*)realloc(*rows, n_rows*sizeof(struct archive_row));
+    if(!*rows) {
+      fprintf(stderr, "Out of memory for archive block\n");
+      exit(-1);
+    }
+    *rows_size = n_rows;
+  }
+  if(!archive_decode(data, len, sec_first, n_rows, count_cols(block_cols), *rows)) {
+    fprintf(stderr, "Corrupt archive block of %s at %d\n", sqlite3_column_text(pStmt, 4), sec_first);
+    exit(-1);
+  }
+  map_cols(block_cols, cols, n_cols, map);
+  return n_rows;
+}
+
+static void map_row(struct archive_row* src, int* map, int n_cols, struct archive_row* r) {
+  r->sec = src->sec;
+  r->cs = src->cs;
+  r->nulls = 0;
+  for(int i=0; i<n_cols; i++) {
+    if((map[i]<0) || (src->nulls & (1u<<map[i]))) {
+      r->nulls |= 1u<<i;
+      r->vals[i] = 0;
+    } else r->vals[i] = src->vals[map[i]];
+  }
+}
+
+static void bind_sensor(sqlite3_stmt* pStmt, int i, bool ds18b20_p, int sensor_ID) {
+  if(ds18b20_p) sqlite3_bind_int(pStmt, i, sensor_ID);
+  else sqlite3_bind_null(pStmt, i);
+}
+
+struct archive_cursor* archive_open(sqlite3* conn, const char* table, bool ds18b20_p, int sensor_ID, const char** cols, int n_cols, long long sec_from, long long sec_to) {
+  struct archive_cursor* c = (struct archive_cursor*)calloc(1, sizeof(struct archive_cursor));
+  if(!c || (n_cols>ARCHIVE_COLUMNS_MAX)) {
+    fprintf(stderr, "Can't open archive cursor for %s\n", table);
+    exit(-1);
+  }
+  c->conn = conn;
+  c->n_cols = n_cols;
+  for(int i=0; i<n_cols; i++) c->cols[i] = sqlite3_mprintf("%s", cols[i]);
+  c->sec_from = sec_from;
+  c->sec_to = sec_to;
+  int rc;
+  if(sqlite3_get_autocommit(conn)) {
+    rc = sqlite3_exec(conn, "BEGIN", NULL, NULL, NULL);
+    check_conn(conn, rc, "sqlite3_exec failure in archive_open");
+    c->txn_p = true;
+  }
+  if(archive_present_p(conn)) {
+    rc = sqlite3_prepare_v3(conn, "SELECT sec_first, n_rows, columns, data, log_table FROM Archive_blocks WHERE log_table=? AND sensor_ID IS ? AND sec_first>? AND sec_first<? AND sec_last>=? ORDER BY sec_first", -1, 0, &c->pStmt_blocks, NULL);
+    check_conn(conn, rc, "sqlite3_prepare failure in archive_open");
+    sqlite3_bind_text(c->pStmt_blocks, 1, table, -1, SQLITE_TRANSIENT);
+    bind_sensor(c->pStmt_blocks, 2, ds18b20_p, sensor_ID);
+    sqlite3_bind_int64(c->pStmt_blocks, 3, sec_from - ARCHIVE_BLOCK_SPAN);
+    sqlite3_bind_int64(c->pStmt_blocks, 4, sec_to);
+    sqlite3_bind_int64(c->pStmt_blocks, 5, sec_from);
+  }
+  char* zCols = select_cols(cols, n_cols);
+  char* zSql = sqlite3_mprintf("SELECT %s FROM \"%w\" WHERE %s sec>=? AND sec<? ORDER BY sec, cs", zCols, table, ds18b20_p?"sensor_ID=? AND":"");
+  rc = sqlite3_prepare_v3(conn, zSql, -1, 0, &c->pStmt_live, NULL);
+  sqlite3_free(zSql);
+  sqlite3_free(zCols);
+  check_conn(conn, rc, "sqlite3_prepare failure in archive_open");
+  int i = 1;
+  if(ds18b20_p) sqlite3_bind_int(c->pStmt_live, i++, sensor_ID);
+  sqlite3_bind_int64(c->pStmt_live, i++, sec_from);
+  sqlite3_bind_int64(c->pStmt_live, i, sec_to);
+  return c;
+}
+
+// Archived rows all precede the table's, since ghpi_archive moves whole days, oldest first, so the archive is read first
+bool archive_step(struct archive_cursor* c, struct archive_row* r) {
+  while(c->pStmt_blocks) {
+    while(c->pos<c->n_rows) {
+      struct archive_row* src = &c->rows[c->pos++];
+      if(src->sec<c->sec_from) continue;
+      if(src->sec>=c->sec_to) break;
+      map_row(src, c->map, c->n_cols, r);
+      return true;
+    }
+    int rc = sqlite3_step(c->pStmt_blocks);
+    check_conn(c->conn, rc, "sqlite3_step failure in archive_step for blocks");
+    if(rc==SQLITE_DONE) {
+      sqlite3_finalize(c->pStmt_blocks);
+      c->pStmt_blocks = NULL;
+      break;
+    }
+    c->n_rows = load_block(c->pStmt_blocks, (const char**)c->cols, c->n_cols, &c->rows, &c->rows_size, c->map);
+    c->pos = 0;
+  }
+  int rc = sqlite3_step(c->pStmt_live);
+  check_conn(c->conn, rc, "sqlite3_step failure in archive_step");
+  if(rc!=SQLITE_ROW) return false;
+  read_live_row(c->pStmt_live, c->n_cols, r);
+  return true;
+}
+
+void archive_close(struct archive_cursor* c) {
+  sqlite3_finalize(c->pStmt_blocks);
+  sqlite3_finalize(c->pStmt_live);
+  if(c->txn_p) {
+    int rc = sqlite3_exec(c->conn, "COMMIT", NULL, NULL, NULL);
+    check_conn(c->conn, rc, "sqlite3_exec failure in archive_close");
+  }
+  for(int i=0; i<c->n_cols; i++) sqlite3_free(c->cols[i]);
+  free(c->rows);
+  free(c);
+}
+
+bool archive_last_before(sqlite3* conn, const char* table, bool ds18b20_p, int sensor_ID, const char** cols, int n_cols, long long sec, struct archive_row* r) {
+  sqlite3_stmt* pStmt;
+  char* zCols = select_cols(cols, n_cols);
+  char* zSql = sqlite3_mprintf("SELECT %s FROM \"%w\" WHERE %s sec<? ORDER BY sec DESC, cs DESC LIMIT 1", zCols, table, ds18b20_p?"sensor_ID=? AND":"");
+  int rc = sqlite3_prepare_v3(conn, zSql, -1, 0, &pStmt, NULL);
+  sqlite3_free(zSql);
+  sqlite3_free(zCols);
+  check_conn(conn, rc, "sqlite3_prepare failure in archive_last_before");
+  int i = 1;
+  if(ds18b20_p) sqlite3_bind_int(pStmt, i++, sensor_ID);
+  sqlite3_bind_int64(pStmt, i, sec);
+  rc = sqlite3_step(pStmt);
+  check_conn(conn, rc, "sqlite3_step failure in archive_last_before");
+  bool found_p = rc==SQLITE_ROW;
+  if(found_p) read_live_row(pStmt, n_cols, r);
+  sqlite3_finalize(pStmt);
+  if(found_p || !archive_present_p(conn)) return found_p;
+  // Not in the table, so it's in the last block that starts before sec
+  rc = sqlite3_prepare_v3(conn, "SELECT sec_first, n_rows, columns, data, log_table FROM Archive_blocks WHERE log_table=? AND sensor_ID IS ? AND sec_first<? ORDER BY sec_first DESC LIMIT 1", -1, 0, &pStmt, NULL);
+  check_conn(conn, rc, "sqlite3_prepare failure in archive_last_before");
+  sqlite3_bind_text(pStmt, 1, table, -1, SQLITE_STATIC);
+  bind_sensor(pStmt, 2, ds18b20_p, sensor_ID);
+  sqlite3_bind_int64(pStmt, 3, sec);
+  rc = sqlite3_step(pStmt);
+  check_conn(conn, rc, "sqlite3_step failure in archive_last_before");
+  if(rc==SQLITE_ROW) {
+    struct archive_row* rows = NULL;
+    int rows_size = 0, map[ARCHIVE_COLUMNS_MAX];
+    int n_rows = load_block(pStmt, cols, n_cols, &rows, &rows_size, map);
+    for(i=n_rows-1; i>=0; i--)
+      if(rows[i].sec<sec) {
+	map_row(&rows[i], map, n_cols, r);
+	found_p = true;
+	break;
+      }
+    free(rows);
+  }
+  sqlite3_finalize(pStmt);
+  return found_p;
+}
+
+bool archive_first_sec(sqlite3* conn, const char* table, bool ds18b20_p, int sensor_ID, long long* sec) {
+  sqlite3_stmt* pStmt;
+  int rc;
+  if(archive_present_p(conn)) {
+    rc = sqlite3_prepare_v3(conn, "SELECT min(sec_first) FROM Archive_blocks WHERE log_table=? AND sensor_ID IS ?", -1, 0, &pStmt, NULL);
+    check_conn(conn, rc, "sqlite3_prepare failure in archive_first_sec");
+    sqlite3_bind_text(pStmt, 1, table, -1, SQLITE_STATIC);
+    bind_sensor(pStmt, 2, ds18b20_p, sensor_ID);
+    rc = sqlite3_step(pStmt);
+    check_conn(conn, rc, "sqlite3_step failure in archive_first_sec");
+    bool found_p = sqlite3_column_type(pStmt, 0)!=SQLITE_NULL;
+    *sec = sqlite3_column_int64(pStmt, 0);
+    sqlite3_finalize(pStmt);
+    if(found_p) return true;
+  }
+  char* zSql = sqlite3_mprintf("SELECT min(sec) FROM \"%w\" WHERE %s 1", table, ds18b20_p?"sensor_ID=? AND":"");
+  rc = sqlite3_prepare_v3(conn, zSql, -1, 0, &pStmt, NULL);
+  sqlite3_free(zSql);
+  check_conn(conn, rc, "sqlite3_prepare failure in archive_first_sec");
+  if(ds18b20_p) sqlite3_bind_int(pStmt, 1, sensor_ID);
+  rc = sqlite3_step(pStmt);
+  check_conn(conn, rc, "sqlite3_step failure in archive_first_sec");
+  bool found_p = sqlite3_column_type(pStmt, 0)!=SQLITE_NULL;
+  *sec = sqlite3_column_int64(pStmt, 0);
+  sqlite3_finalize(pStmt);
+  return found_p;
+}
@@ -0,0 +1,40 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include "sqlite3.h"
+
+// Archived logs: ghpi_archive moves each log table's rows older than some number of days out of the table, into compressed blocks in Archive_blocks (see ghpi-arch.sql), one per table (or DS18B20) per day. The archive cursor reads a time range of a table's rows from both, so readers needn't care where the rows are.
+// A block holds its rows column by column. Timestamps are counted in ticks, i.e. cs units (so ARCHIVE_TICKS_PER_SEC per second), from the block's sec_first, and stored as the first tick, the first delta, then delta-of-deltas, since readings are usually taken at a steady period. Each data column is a null bitmap (only if it has nulls), then each non-null value as the delta from the column's previous one. The numbers are zigzagged, so small ones of either sign stay small, and bit-packed in groups of ARCHIVE_GROUP (see pack_stream).
+
+#define ARCHIVE_VERSION 1
+#define ARCHIVE_COLUMNS_MAX 8 // Data columns per table
+#define ARCHIVE_TICKS_PER_SEC 120 // I.e. TS_CS_MAX+1
+#define ARCHIVE_GROUP 64 // Numbers per bit-packed group
+#define ARCHIVE_BLOCK_SPAN 86400 // seconds. Blocks never span more than this, so a range query needn't look further back for blocks overlapping it.
+
+struct archive_row {
+  int sec, cs;
+  unsigned nulls; // Bit per column
+  int vals[ARCHIVE_COLUMNS_MAX];
+};
+
+struct archive_buf {
+  unsigned char* data;
+  size_t len, size;
+};
+
+// Codec. rows must be in time order, and within ARCHIVE_BLOCK_SPAN of rows[0].sec.
+void archive_encode(struct archive_row* rows, int n_rows, int n_cols, struct archive_buf* out); // Appends to out, which can start zeroed
+bool archive_decode(const unsigned char* data, size_t len, int sec_first, int n_rows, int n_cols, struct archive_row* rows); // Returns false if the block is corrupt
+
+// Series codec, for a capture of samples (t, val) taken at a near-steady period, e.g. an INA260 burst (see INA260_events), with t in any unit: a count, then t coded like a block's timestamps, and val like a column without nulls. Series can be appended one after another, since decoding one advances *p past it.
+void archive_encode_series(const long long* t, const int* vals, int n, struct archive_buf* out);
+bool archive_decode_series(const unsigned char** p, const unsigned char* end, long long* t, int* vals, int n_max, int* n); // Returns false if the series is corrupt, or has more than n_max samples
+
+// Union reader, of a table (or one DS18B20's rows of DS18B20_logs), for the named columns, from sec_from to sec_to (exclusive), in time order. If conn isn't in a transaction, the cursor holds one open until it's closed, so that a concurrent ghpi_archive can't move a day out from under it.
+struct archive_cursor;
+struct archive_cursor* archive_open(sqlite3* conn, const char* table, bool ds18b20_p, int sensor_ID, const char** cols, int n_cols, long long sec_from, long long sec_to);
+bool archive_step(struct archive_cursor* c, struct archive_row* r); // Returns false once there are no more rows
+void archive_close(struct archive_cursor* c);
+bool archive_last_before(sqlite3* conn, const char* table, bool ds18b20_p, int sensor_ID, const char** cols, int n_cols, long long sec, struct archive_row* r); // The latest row before sec, i.e. the reading in effect then. Returns false if there's none.
+bool archive_first_sec(sqlite3* conn, const char* table, bool ds18b20_p, int sensor_ID, long long* sec); // Of the earliest row. Returns false if there's none.
+bool archive_present_p(sqlite3* conn); // Whether the DB has Archive_blocks, i.e. has been upgraded
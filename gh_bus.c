@@ -0,0 +1,123 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include "gh_live.h"
+#include "gh_bus.h"
+
+#define LOAD(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define STORE(x, v) __atomic_store_n(&(x), (v), __ATOMIC_RELAXED)
+#define ADD(x, v) __atomic_add_fetch(&(x), (v), __ATOMIC_RELAXED)
+
+static struct bus_segment* bus_seg; // NULL until bus_enable
+static __thread int bus_tid;
+static __thread int bus_window_slot = -1; // The calling thread's window, if it has one
+
+static const char* env_or(const char* var, const char* dflt) {
+  const char* value = getenv(var);
+  return value?value:dflt;
+}
+
+unsigned bus_now_us() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+}
+
+struct bus_segment* bus_map(bool writer_p) {
+  return (struct bus_segment*)shm_segment_map(env_or("GHPI_BUS_SHM", GHPI_BUS_SHM_NAME), sizeof(struct bus_segment), GHPI_BUS_MAGIC, GHPI_BUS_VERSION, "bus", writer_p);
+}
+
+void bus_enable() {
+  if(!bus_seg) bus_seg = bus_map(true);
+}
+
+static int thread_id() {
+  if(!bus_tid) bus_tid = syscall(SYS_gettid);
+  return bus_tid;
+}
+
+// Start and stop conditions, then each message's address byte and data, at 9 clocks a byte counting the ack
+unsigned bus_transfer_us(int bytes, int nmsgs) {
+  return (unsigned)((bytes*9LL + nmsgs*2)*1000000/GHPI_I2C_HZ) + BUS_TRANSFER_OVERHEAD;
+}
+
+// Whether a window of class wcls holds off a client of class cls
+static bool holds_off_p(int wcls, int cls) {
+  if(wcls==BUS_RECOVERY) return true;
+  return (wcls==BUS_REALTIME) && (cls==BUS_NORMAL);
+}
+
+unsigned bus_wait(int cls, unsigned est_us) {
+  if(!bus_seg) return 0;
+  int tid = thread_id();
+  unsigned t0 = bus_now_us(), now = t0;
+  while(1) {
+    int until = 0; // us from now
+    for(int i=0; i<GHPI_BUS_WINDOWS_MAX; i++) {
+      struct bus_window* w = &bus_seg->windows[i];
+      int owner = LOAD(w->owner);
+      if(!owner || (owner==tid) || !holds_off_p(LOAD(w->cls), cls)) continue;
+      int to_start = (int)(LOAD(w->start_us) - now), to_end = (int)(LOAD(w->end_us) - now);
+      if((to_end>0) && (to_start<(int)est_us) && (to_end>until)) until = to_end;
+    }
+    if(!until) break;
+    if(until>BUS_WINDOW_MAX) until = BUS_WINDOW_MAX; // Shouldn't happen, since bus_reserve caps windows, but a torn read could make one look long
+    struct timespec ts = {until/1000000, (until%1000000)*1000L};
+    nanosleep(&ts, NULL);
+    now = bus_now_us();
+  }
+  return now - t0;
+}
+
+// The calling thread's slot, if it still holds one, else a free or expired one
+static struct bus_window* window_claim(unsigned now) {
+  int tid = thread_id();
+  if((bus_window_slot>=0) && (LOAD(bus_seg->windows[bus_window_slot].owner)==tid)) return &bus_seg->windows[bus_window_slot];
+  for(int i=0; i<GHPI_BUS_WINDOWS_MAX; i++) {
+    struct bus_window* w = &bus_seg->windows[i];
+    int owner = LOAD(w->owner);
+    if(owner && ((int)(LOAD(w->end_us) - now)>0)) continue; // In use
+    if(__atomic_compare_exchange_n(&w->owner, &owner, tid, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+      bus_window_slot = i;
+      return w;
+    }
+  }
+  return NULL;
+}
+
+void bus_reserve(int cls, unsigned start_us, unsigned end_us) {
+  static bool warned_p;
+  if(!bus_seg) return;
+  if((int)(end_us - start_us)>BUS_WINDOW_MAX) end_us = start_us + BUS_WINDOW_MAX;
+  struct bus_window* w = window_claim(bus_now_us());
+  if(!w) {
+    if(!warned_p) fprintf(stderr, "No free I2C bus window; max is %d, so running without reservations\n", GHPI_BUS_WINDOWS_MAX);
+    warned_p = true;
+    return;
+  }
+  STORE(w->end_us, LOAD(w->start_us)); // Empty while it's changed, so it's never read as the old start with the new end
+  STORE(w->cls, cls);
+  STORE(w->start_us, start_us);
+  __atomic_store_n(&w->end_us, end_us, __ATOMIC_RELEASE);
+}
+
+void bus_account(int addr, int bytes, unsigned busy_us, unsigned wait_us, bool error_p) {
+  if(!bus_seg) return;
+  struct bus_device* d = &bus_seg->devices[addr % GHPI_BUS_ADDRS];
+  ADD(d->transfers, 1);
+  ADD(d->bytes, bytes);
+  ADD(d->busy_us, busy_us);
+  if(wait_us) {
+    ADD(d->waits, 1);
+    ADD(d->wait_us, wait_us);
+  }
+  if(error_p) ADD(d->errors, 1);
+}
+
+void bus_recovered() {
+  if(!bus_seg) return;
+  ADD(bus_seg->recoveries, 1);
+  STORE(bus_seg->last_recovery_us, bus_now_us());
+}
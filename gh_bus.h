@@ -0,0 +1,49 @@
+#include <stdbool.h>
+
+// Arbitration of the I2C bus between the processes sharing it, e.g. read_ina260's sample bursts vs the other sensor daemons. The kernel already serializes individual transfers, but nothing stops a BME680 or TSL2591 transfer from landing between two of the INA260's timed samples, delaying that one and stretching the burst's grid. So, in a shared memory segment:
+//  - windows: a client of class BUS_REALTIME reserves the bus for a span of time, e.g. a burst, or ahead of time, as a hint of when its next burst is due. Before each transfer, a BUS_NORMAL client estimates how long it'll take (see bus_transfer_us), and if it would overlap another thread's window, sleeps until that ends; so the slow sensors' transfers get packed into the gaps between the bursts, rather than into them. A BUS_RECOVERY window, held while the bus is being unstuck (see io_i2c_recover), holds off every other client, of either class.
+//  - occupancy: per I2C address, transfers, bytes, time on the bus, and time spent waiting for windows, across all the processes; ghpi_bus prints them
+// Times are CLOCK_MONOTONIC microseconds, truncated to 32 bits and compared modulo 2^32, and counters are 32 bits and wrap, so everything is a plain 32-bit atomic, and nothing needs libatomic on the Pi; readers take differences over an interval.
+// A window is written field by field by the one thread that holds it, and read without a lock, so a reader racing with a change can see a mix of the old and new window. Which at worst makes one transfer wait a little longer, or not wait, once.
+
+#define GHPI_BUS_SHM_NAME "/ghpi-bus" // Overridden by the GHPI_BUS_SHM environment variable
+#define GHPI_BUS_MAGIC 0x62706867 // "ghpb"
+#define GHPI_BUS_VERSION 1
+#define GHPI_BUS_WINDOWS_MAX 8
+#define GHPI_BUS_ADDRS 128
+#define GHPI_I2C_HZ 100000 // Bus clock, i.e. the i2c-bcm2835 default, for estimating transfer times
+#define BUS_TRANSFER_OVERHEAD 200 // us. Added to each transfer's estimated bus time, for the syscall and the driver's interrupt latency.
+#define BUS_WINDOW_MAX 500000 // us. Longest a window can be reserved for, so a window left by a killed client can't hold off the others for long.
+
+enum bus_class {BUS_NORMAL, BUS_REALTIME, BUS_RECOVERY};
+
+struct bus_window {
+  int owner; // Thread ID, or 0 if the slot is free
+  int cls; // enum bus_class
+  unsigned start_us, end_us;
+} __attribute__((aligned(16)));
+
+struct bus_device { // Per I2C address
+  unsigned transfers, bytes; // bytes as counted by io_i2c_get_stats
+  unsigned busy_us; // In the transfers' ioctls
+  unsigned waits, wait_us; // Transfers that waited for a window, and how long they waited
+  unsigned errors; // Failed transfers
+};
+
+struct bus_segment {
+  unsigned magic, version;
+  unsigned recoveries; // See io_i2c_recover
+  unsigned last_recovery_us;
+  struct bus_window windows[GHPI_BUS_WINDOWS_MAX] __attribute__((aligned(64)));
+  struct bus_device devices[GHPI_BUS_ADDRS] __attribute__((aligned(64)));
+};
+
+unsigned bus_now_us();
+struct bus_segment* bus_map(bool writer_p); // Returns NULL for a reader if the segment doesn't exist (yet)
+// Client side. Each is a no-op until bus_enable has been called, e.g. when replaying, where there's no bus to share.
+void bus_enable();
+unsigned bus_transfer_us(int bytes, int nmsgs); // Estimate of a transfer's time on the bus
+unsigned bus_wait(int cls, unsigned est_us); // Sleep until a transfer taking est_us wouldn't overlap another thread's window that holds off cls. Returns the time waited, in us.
+void bus_reserve(int cls, unsigned start_us, unsigned end_us); // Replace the calling thread's window. end_us==start_us releases it.
+void bus_account(int addr, int bytes, unsigned busy_us, unsigned wait_us, bool error_p);
+void bus_recovered();
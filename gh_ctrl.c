@@ -1,18 +1,25 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 #include <stdbool.h>
+#include <stdarg.h>
+#include <signal.h>
+#include <poll.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
 #include <execinfo.h>
 #include "gh_ctrl.h"
 
 #define IDLE_HEARTBEAT_LOGGING_PERIOD 5 // seconds
 #define BT_BUF_SIZE 100
+#define GHPI_WAL_CHECKPOINT_FALLBACK 16384 // pages, i.e. 64MiB. See ghpi_wal_hook.
 #ifndef DEBUG_PRINT_BACKTRACE
 #define DEBUG_PRINT_BACKTRACE false
 #endif
 
 sqlite3* db;
-sqlite3_stmt* pStmt_log;
 sqlite3_stmt* pStmt_hb;
 const char* Sqlite_type_names[] = {
   "",
@@ -25,7 +32,54 @@ const char* Sqlite_type_names[] = {
 
 const char zSql_hb[] = "INSERT INTO Idle_heartbeats VALUES (?, ?) ON CONFLICT(sensor_name) DO UPDATE SET sec=excluded.sec";
 
-struct timespec ts_heartbeat; // Time of last record insertion, or last idle heartbeat, whichever is later.
+// Group commit state. Batching is disabled (i.e. autocommit, one transaction per record) while batch_max_rows is 0.
+int batch_max_rows, batch_max_age_ms;
+int batch_rows; // Rows held in batch_pending, waiting for the next flush
+struct timespec ts_batch_first, ts_batch_last; // Monotonic times of first and latest row held
+struct timespec ts_batch_stats; // Start of the current stats period
+long batch_stats_commits, batch_stats_rows, batch_stats_frames;
+long batch_stats_commit_max_us; // Longest flush, i.e. the worst stall a commit caused the daemon
+int batch_wal_frames_prev;
+volatile sig_atomic_t terminate_requested;
+
+// Writer thread and its queue. See writer_thread_enable.
+enum {REC_LOG, REC_HEARTBEAT};
+struct ghpi_record { // Fixed size, so that pushing one never allocates
+  struct ghpi_sensor* sensor;
+  int kind;
+  struct timespec rt; // Acquisition time for REC_LOG. For REC_HEARTBEAT, tv_sec is the idle time.
+  struct timespec mono; // insert_record's CLOCK_MONOTONIC, for REC_LOG
+  int cData;
+  int arrData[GHPI_RECORD_MAX_FIELDS];
+  bool arrNull[GHPI_RECORD_MAX_FIELDS];
+  unsigned char* blob; // See insert_record_blob. Allocated by the pusher, and freed once written. NULL for most records.
+  int n_blob;
+};
+struct ghpi_record* batch_pending; // batch_max_rows of them. See batch_commit_enable.
+struct ghpi_queue_slot {
+  unsigned seq; // Slot is free for the producer claiming position p when seq==p, and holds a record for the consumer at position p when seq==p+1
+  struct ghpi_record rec;
+};
+struct ghpi_queue_slot queue[GHPI_QUEUE_SIZE];
+unsigned queue_head, queue_tail; // Positions; the slot index is position % GHPI_QUEUE_SIZE. Only the writer thread advances the head.
+bool writer_requested, writer_running, writer_stop_p;
+__thread bool in_writer_thread_p;
+int writer_sleeping_p;
+int writer_efd; // eventfd that wakes the writer thread when it's sleeping
+pthread_t writer_tid;
+struct ghpi_sensor* writer_sensors[GHPI_WRITER_SENSORS_MAX]; // Sensors that have pushed records, for the queue stats
+int n_writer_sensors;
+struct timespec ts_writer_stats;
+
+// Live values segment. See live_publish_enable.
+struct live_segment* live_seg;
+struct ghpi_sensor* live_sensors[GHPI_WRITER_SENSORS_MAX];
+int n_live_sensors;
+
+// Metrics. See metrics_enable.
+const char* daemon_name; // argv[0]
+struct metrics_local metrics_db; // Daemon-wide, i.e. the DB connection's
+__thread long long step_logging_ns; // Time spent in insert_record and update_idle_heartbeat during the current step, which isn't counted as the step's
 
 // timespec diff. Result value is tv_sec + tv_nsec, as usual. Result can be negative, and tv_sec is integer floor of the real value; tv_nsec is thus always positive.
 void ts_diff(struct timespec* result, struct timespec* a, struct timespec* b) {
@@ -60,6 +114,23 @@ bool reading_change(bool* px_prev_inc_p, int* px_mem, int x) {
   return false;
 }
 
+void ns_to_ts(struct timespec* ts, long long ns) {
+  ts->tv_sec = ns/NS_PER_SEC;
+  ts->tv_nsec = ns%NS_PER_SEC;
+}
+
+long long ts_to_ns(struct timespec* ts) {
+  return ts->tv_sec*NS_PER_SEC + ts->tv_nsec;
+}
+
+// Milliseconds elapsed on CLOCK_MONOTONIC since *then
+long ms_since(struct timespec* then) {
+  struct timespec now, diff;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  ts_diff(&diff, &now, then);
+  return diff.tv_sec*1000 + diff.tv_nsec/1000000;
+}
+
 void check_sql(int rc, const char* msg) {
   if(rc!=SQLITE_OK && rc!=SQLITE_ROW && rc!=SQLITE_DONE) {
     fprintf(stderr, "%s", msg);
@@ -89,6 +160,7 @@ int ghpi_sqlite_busy_handler(void* argv0, int count) {
     if(DEBUG_PRINT_BACKTRACE) print_backtrace();
     return 0;
   }
+  metrics_count(&metrics_db, METRIC_BUSY_RETRIES, 1);
   if(count>=GHPI_SQL_BUSY_NOTICE_THRESHOLD) {
     fprintf(stderr, "%s: DB busy; sleeping %dms after try #%d\n", prog_name, GHPI_SQL_BUSY_WAIT/1000000, count);
     if(DEBUG_PRINT_BACKTRACE) print_backtrace();
@@ -104,6 +176,7 @@ void ghpi_sqlite_init(const char* argv0, const char* db_file_name) {
   // rc = sqlite3_busy_timeout(db, 5000);
   rc = sqlite3_busy_handler(db, &ghpi_sqlite_busy_handler, (void*)argv0);
   check_sql(rc, "sqlite3_busy_handler failure");
+  sqlite3_wal_hook(db, &ghpi_wal_hook, NULL);
   char* zErrMsg = 0;
   rc = sqlite3_exec(db, GHPI_SQLITE_INIT_STRING, NULL, NULL, &zErrMsg);
   if(rc!=SQLITE_OK) {
@@ -126,7 +199,6 @@ void ghpi_sqlite_init(const char* argv0, const char* db_file_name) {
   int last_log_cs = sqlite3_column_int(pStmt_tmp, 1);
   sqlite3_finalize(pStmt_tmp);
   struct timespec ts;
-  clock_gettime(CLOCK_MONOTONIC, &ts_heartbeat);
   clock_gettime(CLOCK_REALTIME, &ts);
   if((ts.tv_sec < last_log_sec)
      || ((ts.tv_sec == last_log_sec)
@@ -134,8 +206,6 @@ void ghpi_sqlite_init(const char* argv0, const char* db_file_name) {
     fprintf(stderr, "Current time is %ld seconds (rounded down) behind last logged time. Aborting.\n", last_log_sec - ts.tv_sec);
     exit(-1);
   }
-  rc = sqlite3_prepare_v3(db, zSql_log, -1, SQLITE_PREPARE_PERSISTENT, &pStmt_log, NULL);
-  check_sql(rc, "sqlite3_prepare failure");
   rc = sqlite3_prepare_v3(db, zSql_hb, -1, SQLITE_PREPARE_PERSISTENT, &pStmt_hb, NULL);
   check_sql(rc, "sqlite3_prepare failure");
 }
@@ -152,72 +222,602 @@ void daemon_init(int argc, char** argv) {
   strftime(ts_buf, 64, "%Y-%m-%d %H:%M:%S", tm_info);
   fprintf(stderr, "%s Starting %s%s\n", ts_buf, argv[0],
 	  DEBUG_PRINT_BACKTRACE?" with backtracing enabled":"");
+  daemon_name = argv[0];
   ghpi_sqlite_init(argv[0], argv[1]);
 }
 
-// If arrNull_p is non-null, then it must point to an array of length cData of bools. For each true bool, a null is inserted, and the corresponding value of arrData is ignored.
-void insert_record(sqlite3_stmt* pStmt, int* arrData, int cData, bool* arrNull_p) {
-  int rc, i;
+void terminate_handler(int sig) {
+  terminate_requested = 1;
+}
+
+// For daemons that hold writes in memory (group commit, writer thread), so they can be committed before exiting. See batch_poll.
+void install_terminate_handler() {
+  struct sigaction sa;
+  sa.sa_handler = &terminate_handler;
+  sigemptyset(&sa.sa_mask);
+  sa.sa_flags = 0; // No SA_RESTART, so that the signal cuts short the daemon's sleep in its main loop, and the flush happens promptly.
+  sigaction(SIGTERM, &sa, NULL);
+  sigaction(SIGINT, &sa, NULL);
+}
+
+// Installed on every connection by ghpi_sqlite_init. Installing a WAL hook replaces Sqlite's built-in auto-checkpoint (which is itself just a WAL hook), under which whichever commit took the WAL past 1000 pages did a checkpoint inline, stalling that daemon's acquisition for up to hundreds of ms. Checkpoints are instead done by ghpi_checkpoint, in the background; this only does one if the WAL grows past GHPI_WAL_CHECKPOINT_FALLBACK anyway, e.g. if ghpi_checkpoint isn't running.
+// Also counts WAL frames appended per commit, for the group commit stats.
+int ghpi_wal_hook(void* arg, sqlite3* db_hook, const char* zDb, int nFrames) {
+  batch_stats_frames += (nFrames>=batch_wal_frames_prev)?(nFrames - batch_wal_frames_prev):nFrames; // WAL restarts from zero after a checkpoint
+  batch_wal_frames_prev = nFrames;
+  if(nFrames>=GHPI_WAL_CHECKPOINT_FALLBACK) sqlite3_wal_checkpoint_v2(db_hook, zDb, SQLITE_CHECKPOINT_PASSIVE, NULL, NULL);
+  return SQLITE_OK;
+}
+
+// Opt in to group commit: instead of each record being its own WAL transaction, records (and idle heartbeats) are held in memory, and written together in one short transaction once there are max_rows of them or the oldest is max_age_ms old. They're also written when the daemon goes idle (no new row for GHPI_BATCH_IDLE_FLUSH ms), and on SIGTERM or SIGINT, after which the daemon exits. Must be called after daemon_init.
+// The write lock is only taken for the flush itself, i.e. for a few ms, rather than from the first row of the batch to its commit; holding it the whole time left other writers (the other daemons, ghpi_checkpoint, ghpi_rollup, read_DS18B20.py) only the gap between one COMMIT and the next BEGIN, which their busy handler's GHPI_SQL_BUSY_WAIT sleeps almost never hit, so they ran out of retries and exited.
+// Readers (poll_stream) don't see a row until it's written, so max_age_ms is also the worst-case added display latency; but the live values segment has it as soon as it's acquired.
+void batch_commit_enable(int max_rows, int max_age_ms) {
+  batch_commit_flush(); // Of rows held under the previous setting
+  free(batch_pending);
+  batch_pending = max_rows?(struct ghpi_record*)malloc(max_rows*sizeof(struct ghpi_record)):NULL;
+  if(max_rows && !batch_pending) {
+    fprintf(stderr, "Out of memory for %d group commit rows\n", max_rows);
+    exit(-1);
+  }
+  batch_max_rows = max_rows;
+  batch_max_age_ms = max_age_ms;
+  clock_gettime(CLOCK_MONOTONIC, &ts_batch_stats);
+  install_terminate_handler();
+}
+
+void batch_print_stats() {
+  long elapsed_ms = ms_since(&ts_batch_stats);
+  char ts_buf[64];
+  time_t now = time(NULL);
+  struct tm* tm_info;
+  tm_info = localtime(&now);
+  strftime(ts_buf, 64, "%Y-%m-%d %H:%M:%S", tm_info);
+  fprintf(stderr, "%s Group commit: %.2f commits/s, %.1f rows/commit, %.2f WAL frames/row, longest commit %.1fms (%ld rows in %ld commits over %lds)\n", ts_buf,
+	  batch_stats_commits*1000.0/max(elapsed_ms, 1L),
+	  batch_stats_commits?(double)batch_stats_rows/batch_stats_commits:0.0,
+	  batch_stats_rows?(double)batch_stats_frames/batch_stats_rows:0.0,
+	  batch_stats_commit_max_us/1000.0,
+	  batch_stats_rows, batch_stats_commits, elapsed_ms/1000);
+  batch_stats_commits = batch_stats_rows = batch_stats_frames = batch_stats_commit_max_us = 0;
+  clock_gettime(CLOCK_MONOTONIC, &ts_batch_stats);
+}
+
+void write_record(struct ghpi_sensor* sensor, struct timespec* rt, struct timespec* mono, int* arrData, int cData, bool* arrNull_p, const unsigned char* blob, int n_blob);
+void write_heartbeat(struct ghpi_sensor* sensor, int idle_sec);
+
+// Write the held rows, if any, in one transaction. The write lock is taken by BEGIN IMMEDIATE, so any busy wait happens there, rather than partway through.
+void batch_commit_flush() {
+  if(batch_rows==0) return;
+  struct timespec ts_commit, ts_now;
+  clock_gettime(CLOCK_MONOTONIC, &ts_commit);
+  int rc = sqlite3_exec(db, "BEGIN IMMEDIATE", NULL, NULL, NULL);
+  check_sql(rc, "sqlite3_exec failure in batch_commit_flush for begin");
+  for(int i=0; i<batch_rows; i++) {
+    struct ghpi_record* rec = &batch_pending[i];
+    if(rec->kind==REC_LOG) {
+      write_record(rec->sensor, &rec->rt, &rec->mono, rec->arrData, rec->cData, rec->arrNull, rec->blob, rec->n_blob);
+      free(rec->blob);
+    } else write_heartbeat(rec->sensor, rec->rt.tv_sec);
+  }
+  rc = sqlite3_exec(db, "COMMIT", NULL, NULL, NULL);
+  check_sql(rc, "sqlite3_exec failure in batch_commit_flush");
+  clock_gettime(CLOCK_MONOTONIC, &ts_now);
+  long long ns = ts_to_ns(&ts_now) - ts_to_ns(&ts_commit);
+  batch_stats_commit_max_us = max(batch_stats_commit_max_us, (long)(ns/1000));
+  metrics_count(&metrics_db, METRIC_COMMITS, 1);
+  metrics_hist_add(&metrics_db, METRIC_COMMIT, ns);
+  batch_stats_commits++;
+  batch_stats_rows += batch_rows;
+  batch_rows = 0;
+  if(ms_since(&ts_batch_stats) >= GHPI_BATCH_STATS_PERIOD*1000) batch_print_stats();
+}
+
+// Hold the record for the next flush, taking over its blob
+void batch_add(struct ghpi_record* rec) {
+  if(!batch_rows) clock_gettime(CLOCK_MONOTONIC, &ts_batch_first);
+  batch_pending[batch_rows++] = *rec;
+  clock_gettime(CLOCK_MONOTONIC, &ts_batch_last);
+  if((batch_rows >= batch_max_rows)
+     || (ms_since(&ts_batch_first) >= batch_max_age_ms))
+    batch_commit_flush();
+}
+
+// Called from each daemon's main loop (via insert_record and update_idle_heartbeat), and from the writer thread, to commit on age, idleness, or termination, and to export the metrics
+void batch_poll() {
+  if(writer_running && !in_writer_thread_p) { // The writer thread owns the DB
+    if(terminate_requested) {
+      writer_thread_stop();
+      if(batch_max_rows) batch_print_stats();
+      sqlite3_close(db);
+      exit(0);
+    }
+    return;
+  }
+  metrics_export_poll(); // By the thread that owns the DB, since that's the one that isn't sampling
+  if(!batch_max_rows) return;
+  if(terminate_requested && !writer_running) {
+    batch_commit_flush();
+    batch_print_stats();
+    sqlite3_close(db);
+    exit(0);
+  }
+  if(batch_rows
+     && ((ms_since(&ts_batch_first) >= batch_max_age_ms)
+	 || (ms_since(&ts_batch_last) >= GHPI_BATCH_IDLE_FLUSH)))
+    batch_commit_flush();
+}
+
+// Lock-free bounded multi-producer queue (Vyukov's design, with the single consumer's side simplified). Returns false if the queue is full, in which case the record is dropped.
+bool queue_push(struct ghpi_record* rec) {
+  unsigned pos = __atomic_load_n(&queue_tail, __ATOMIC_RELAXED);
+  struct ghpi_queue_slot* slot;
+  while(1) {
+    slot = &queue[pos % GHPI_QUEUE_SIZE];
+    unsigned seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+    int dif = (int)(seq - pos);
+    if(dif==0) { // Slot is free; try to claim it
+      if(__atomic_compare_exchange_n(&queue_tail, &pos, pos+1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+	break;
+      // Another producer claimed it first, and pos was updated to the new tail; retry
+    } else if(dif<0) return false; // Slot still holds the record from one lap ago, i.e. queue is full
+    else pos = __atomic_load_n(&queue_tail, __ATOMIC_RELAXED);
+  }
+  slot->rec = *rec;
+  __atomic_store_n(&slot->seq, pos+1, __ATOMIC_RELEASE);
+  return true;
+}
+
+bool queue_ready() {
+  return __atomic_load_n(&queue[queue_head % GHPI_QUEUE_SIZE].seq, __ATOMIC_ACQUIRE) == queue_head+1;
+}
+
+bool queue_pop(struct ghpi_record* rec) {
+  if(!queue_ready()) return false; // Empty, or the producer that claimed the slot hasn't finished writing it yet
+  struct ghpi_queue_slot* slot = &queue[queue_head % GHPI_QUEUE_SIZE];
+  *rec = slot->rec;
+  __atomic_store_n(&slot->seq, queue_head+GHPI_QUEUE_SIZE, __ATOMIC_RELEASE);
+  __atomic_store_n(&queue_head, queue_head+1, __ATOMIC_RELEASE);
+  return true;
+}
+
+// Push a record for the writer thread, never blocking. Full queue is counted as an overflow in the sensor's stats, and returns false.
+bool writer_push(struct ghpi_record* rec) {
+  struct ghpi_sensor* sensor = rec->sensor;
+  if(!queue_push(rec)) {
+    __atomic_add_fetch(&sensor->queue_overflows, 1, __ATOMIC_RELAXED);
+    metrics_count(&sensor->metrics, METRIC_DROPPED, 1);
+    return false;
+  }
+  unsigned depth = __atomic_load_n(&queue_tail, __ATOMIC_RELAXED) - __atomic_load_n(&queue_head, __ATOMIC_RELAXED); // Including this record, unless the writer's already popped it
+  if(depth > __atomic_load_n(&sensor->queue_high_water, __ATOMIC_RELAXED))
+    __atomic_store_n(&sensor->queue_high_water, depth, __ATOMIC_RELAXED); // Racy, but a sensor's records are only pushed by its own thread
+  __atomic_thread_fence(__ATOMIC_SEQ_CST); // Pairs with writer_thread's: the store of the slot's seq mustn't be reordered after this load (which a release store and an acquire load allow, e.g. on ARMv7), or each side could miss the other's, and the record wait for the poll timeout
+  if(__atomic_load_n(&writer_sleeping_p, __ATOMIC_SEQ_CST)) {
+    uint64_t one = 1;
+    if(write(writer_efd, &one, sizeof(one))<0) {} // Can only fail if the counter saturates, in which case the writer is awake anyway
+  }
+  return true;
+}
+
+void writer_print_stats() {
+  char ts_buf[64];
+  time_t now = time(NULL);
+  struct tm* tm_info;
+  tm_info = localtime(&now);
+  strftime(ts_buf, 64, "%Y-%m-%d %H:%M:%S", tm_info);
+  for(int i=0; i<n_writer_sensors; i++) {
+    struct ghpi_sensor* sensor = writer_sensors[i];
+    unsigned overflows = __atomic_exchange_n(&sensor->queue_overflows, 0, __ATOMIC_RELAXED);
+    unsigned high_water = __atomic_exchange_n(&sensor->queue_high_water, 0, __ATOMIC_RELAXED);
+    fprintf(stderr, "%s Writer queue for %s: high water %u of %d, %u records dropped\n", ts_buf, sensor->sensor_type, high_water, GHPI_QUEUE_SIZE, overflows);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &ts_writer_stats);
+}
+
+void writer_note_sensor(struct ghpi_sensor* sensor) {
+  for(int i=0; i<n_writer_sensors; i++)
+    if(writer_sensors[i]==sensor) return;
+  if(n_writer_sensors<GHPI_WRITER_SENSORS_MAX) writer_sensors[n_writer_sensors++] = sensor;
+}
+
+void write_queued(struct ghpi_record* rec) {
+  writer_note_sensor(rec->sensor);
+  if(batch_max_rows) batch_add(rec);
+  else if(rec->kind==REC_LOG) {
+    write_record(rec->sensor, &rec->rt, &rec->mono, rec->arrData, rec->cData, rec->arrNull, rec->blob, rec->n_blob);
+    free(rec->blob);
+  } else write_heartbeat(rec->sensor, rec->rt.tv_sec);
+}
+
+void* writer_thread(void* arg) {
+  struct ghpi_record rec;
+  struct pollfd pfd;
+  pfd.fd = writer_efd;
+  pfd.events = POLLIN;
+  in_writer_thread_p = true;
+  while(1) {
+    while(queue_pop(&rec)) write_queued(&rec);
+    if(__atomic_load_n(&writer_stop_p, __ATOMIC_ACQUIRE)) break;
+    batch_poll();
+    if(ms_since(&ts_writer_stats) >= GHPI_WRITER_STATS_PERIOD*1000) writer_print_stats();
+    __atomic_store_n(&writer_sleeping_p, 1, __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST); // See writer_push
+    if(!queue_ready()) // Recheck after announcing sleep, so that a record pushed just before then isn't left waiting
+      poll(&pfd, 1, GHPI_BATCH_IDLE_FLUSH); // Timeout so that batch_poll gets to do its idle flush
+    __atomic_store_n(&writer_sleeping_p, 0, __ATOMIC_SEQ_CST);
+    uint64_t count;
+    if(read(writer_efd, &count, sizeof(count))<0) {} // Just resetting the eventfd; nothing to do if it wasn't set
+  }
+  batch_commit_flush();
+  return NULL;
+}
+
+// Opt in to having all DB writes done by a dedicated writer thread, so that the acquisition loop never blocks on Sqlite (busy waits of up to GHPI_SQL_BUSY_RETRY_MAX * GHPI_SQL_BUSY_WAIT, checkpoints, fsyncs). insert_record and update_idle_heartbeat just push fixed-size records onto a lock-free queue, timestamped at the time of the push. If the writer falls so far behind that the queue fills, records are dropped rather than blocking; the per-sensor overflow count and queue high water mark are printed every GHPI_WRITER_STATS_PERIOD seconds.
+// The thread is started by run_sensor (or by ghpid) after the sensor's init, since from then on only the writer thread may use the DB connection; Sqlite is built with SQLITE_THREADSAFE=0, which is fine for a connection used by one thread at a time, but not concurrently.
+void writer_thread_enable() {
+  writer_requested = true;
+  install_terminate_handler();
+}
+
+void writer_thread_start() {
+  if(!writer_requested || writer_running) return;
+  for(unsigned i=0; i<GHPI_QUEUE_SIZE; i++) queue[i].seq = i;
+  writer_efd = eventfd(0, EFD_NONBLOCK);
+  if(writer_efd<0) {
+    perror("eventfd failure in writer_thread_start");
+    exit(-1);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &ts_writer_stats);
+  // Signals are handled by the acquisition thread, which then stops the writer thread via writer_thread_stop
+  sigset_t set, oldset;
+  sigemptyset(&set);
+  sigaddset(&set, SIGTERM);
+  sigaddset(&set, SIGINT);
+  pthread_sigmask(SIG_BLOCK, &set, &oldset);
+  writer_running = true; // Before the thread starts, since it checks this in batch_poll
+  int rc = pthread_create(&writer_tid, NULL, &writer_thread, NULL);
+  pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+  if(rc) {
+    fprintf(stderr, "pthread_create failure in writer_thread_start: %d\n", rc);
+    exit(-1);
+  }
+}
+
+// Drain the queue, commit, and wait for the writer thread to finish. The DB connection then belongs to the calling thread again.
+void writer_thread_stop() {
+  if(!writer_running) return;
+  __atomic_store_n(&writer_stop_p, true, __ATOMIC_RELEASE);
+  uint64_t one = 1;
+  if(write(writer_efd, &one, sizeof(one))<0) {}
+  pthread_join(writer_tid, NULL);
+  writer_running = false;
+  writer_print_stats();
+}
+
+// A numeric value from the Config table, or dflt if it has none
+double config_double(const char* var, double dflt) {
+  sqlite3_stmt* pStmt;
+  int rc = sqlite3_prepare_v3(db, "SELECT val FROM Config WHERE var=?", -1, 0, &pStmt, NULL);
+  check_sql(rc, "sqlite3_prepare failure in config_double");
+  sqlite3_bind_text(pStmt, 1, var, -1, SQLITE_STATIC);
+  rc = sqlite3_step(pStmt);
+  check_sql(rc, "sqlite3_step failure in config_double");
+  double val = (rc==SQLITE_ROW)?sqlite3_column_double(pStmt, 0):dflt;
+  sqlite3_finalize(pStmt);
+  return val;
+}
+
+// Load the key of the latest row already in the sensor's log table, so that alloc_timestamp continues after it. Leaves the key at 0 for an empty table.
+void load_last_timestamp(struct ghpi_sensor* sensor) {
+  char* zSql = sqlite3_mprintf("select sec, cs from %s order by sec desc, cs desc limit 1", sensor->log_table);
+  sqlite3_stmt* pStmt_tmp;
+  int rc = sqlite3_prepare_v3(db, zSql, -1, 0, &pStmt_tmp, NULL);
+  sqlite3_free(zSql);
+  check_sql(rc, "sqlite3_prepare failure in load_last_timestamp");
+  rc = sqlite3_step(pStmt_tmp);
+  check_sql(rc, "sqlite3_step failure in load_last_timestamp");
+  sensor->last_sec = sensor->last_cs = 0;
+  if(rc==SQLITE_ROW) {
+    sensor->last_sec = sqlite3_column_int(pStmt_tmp, 0);
+    sensor->last_cs = sqlite3_column_int(pStmt_tmp, 1);
+  }
+  sqlite3_finalize(pStmt_tmp);
+}
+
+void live_release_all() {
+  for(int i=0; i<n_live_sensors; i++)
+    for(int j=0; j<live_sensors[i]->n_live; j++) live_release(live_seg, live_sensors[i]->live_slots[j]);
+}
+
+// Also publish each record to the live values segment (see gh_live.h) as it's inserted, for readers that want it before it's committed. Must be called before sensor_init. Daemons that log real readings call this; tools such as ghpi_bench, whose sensors aren't real, don't.
+void live_publish_enable() {
+  if(live_seg) return;
+  live_seg = live_map(live_shm_name(), true);
+  atexit(&live_release_all); // So readers know the values are no longer live. If the daemon is killed instead, they find out after GHPI_LIVE_STALE.
+}
+
+// Claim a live slot for each of the sensor's data columns
+void live_claim_sensor(struct ghpi_sensor* sensor) {
+  sqlite3_stmt* pStmt_tmp;
+  int rc = sqlite3_prepare_v3(db, "select name from pragma_table_info(?) where cid>=2 and type!='BLOB' order by cid", -1, 0, &pStmt_tmp, NULL);
+  check_sql(rc, "sqlite3_prepare failure in live_claim_sensor");
+  rc = sqlite3_bind_text(pStmt_tmp, 1, sensor->log_table, -1, SQLITE_STATIC);
+  check_sql(rc, "sqlite3_bind_text failure in live_claim_sensor");
+  sensor->n_live = 0;
+  while((rc = sqlite3_step(pStmt_tmp))==SQLITE_ROW) {
+    if(sensor->n_live==GHPI_RECORD_MAX_FIELDS) break;
+    char* zChannel = sqlite3_mprintf("%s.%s", sensor->log_table, sqlite3_column_text(pStmt_tmp, 0));
+    sensor->live_slots[sensor->n_live++] = live_claim(live_seg, zChannel);
+    sqlite3_free(zChannel);
+  }
+  check_sql(rc, "sqlite3_step failure in live_claim_sensor");
+  sqlite3_finalize(pStmt_tmp);
+  if(n_live_sensors<GHPI_WRITER_SENSORS_MAX) live_sensors[n_live_sensors++] = sensor;
+}
+
+// Export the daemon's and its sensors' metrics (see gh_metrics.h). Must be called after daemon_init, and before sensor_init. Like live_publish_enable, for the daemons that log real readings.
+void metrics_enable() {
+  metrics_export_enable(daemon_name?daemon_name:"ghpi", &metrics_db);
+}
+
+// Prepare the sensor's logging statement, and load its last timestamp. Must be called after daemon_init, and before the sensor's init.
+void sensor_init(struct ghpi_sensor* sensor) {
+  sqlite3_stmt* pStmt_tmp;
+  sensor->event_fd = -1;
+  int rc = sqlite3_prepare_v3(db, "select count(*) from pragma_table_info(?)", -1, 0, &pStmt_tmp, NULL);
+  check_sql(rc, "sqlite3_prepare failure in sensor_init");
+  rc = sqlite3_bind_text(pStmt_tmp, 1, sensor->log_table, -1, SQLITE_STATIC);
+  check_sql(rc, "sqlite3_bind_text failure in sensor_init");
+  rc = sqlite3_step(pStmt_tmp);
+  check_sql(rc, "sqlite3_step failure in sensor_init");
+  int cColumns = sqlite3_column_int(pStmt_tmp, 0);
+  sqlite3_finalize(pStmt_tmp);
+  if(cColumns<3) {
+    fprintf(stderr, "%s: log table %s missing, or has no data columns\n", sensor->sensor_type, sensor->log_table);
+    exit(-1);
+  }
+  char* zSql = sqlite3_mprintf("insert into %s values (?", sensor->log_table);
+  for(int i=1; i<cColumns; i++) {
+    char* zTmp = sqlite3_mprintf("%s,?", zSql);
+    sqlite3_free(zSql);
+    zSql = zTmp;
+  }
+  char* zTmp = sqlite3_mprintf("%s)", zSql);
+  sqlite3_free(zSql);
+  zSql = zTmp;
+  rc = sqlite3_prepare_v3(db, zSql, -1, SQLITE_PREPARE_PERSISTENT, &sensor->pStmt_log, NULL);
+  sqlite3_free(zSql);
+  check_sql(rc, "sqlite3_prepare failure in sensor_init");
+  load_last_timestamp(sensor);
+  if(live_seg) live_claim_sensor(sensor);
+  metrics_register(&sensor->metrics, sensor->sensor_type, METRICS_SENSOR);
+  clock_gettime(CLOCK_MONOTONIC, &sensor->ts_heartbeat);
+  clock_gettime(CLOCK_MONOTONIC, &sensor->ts_blur_stats);
+}
+
+// Call the sensor's step, timing it, and counting its I2C transfers, for the metrics
+long long sensor_step(struct ghpi_sensor* sensor) {
+  struct timespec ts_start, ts_end;
+  struct io_i2c_stats i2c_start, i2c_end;
+  step_logging_ns = 0;
+  io_i2c_get_stats(&i2c_start);
+  clock_gettime(CLOCK_MONOTONIC, &ts_start);
+  long long ns = sensor->step();
+  clock_gettime(CLOCK_MONOTONIC, &ts_end);
+  io_i2c_get_stats(&i2c_end);
+  metrics_hist_add(&sensor->metrics, METRIC_STEP, ts_to_ns(&ts_end) - ts_to_ns(&ts_start) - step_logging_ns);
+  if(i2c_end.transfers!=i2c_start.transfers) {
+    metrics_count(&sensor->metrics, METRIC_I2C_TRANSFERS, i2c_end.transfers - i2c_start.transfers);
+    metrics_count(&sensor->metrics, METRIC_I2C_BYTES, i2c_end.bytes - i2c_start.bytes);
+    metrics_count(&sensor->metrics, METRIC_I2C_US, (i2c_end.ns - i2c_start.ns)/1000);
+  }
+  return ns;
+}
+
+// Main loop of a standalone driver daemon
+void run_sensor(struct ghpi_sensor* sensor) {
+  struct timespec ts;
+  live_publish_enable();
+  metrics_enable();
+  sensor_init(sensor);
+  long long ns = sensor->init();
+  writer_thread_start();
+  while(1) {
+    if(ns>0) {
+      ns_to_ts(&ts, ns);
+      if(sensor->event_fd>=0) io_wait_fd(sensor->event_fd, &ts);
+      else io_nanosleep(&ts);
+    }
+    batch_poll();
+    ns = sensor_step(sensor);
+  }
+}
+
+static void print_timestamp_notice(struct ghpi_sensor* sensor, time_t sec, const char* format, ...) {
+  char ts_buf[64];
+  va_list args;
+  strftime(ts_buf, 64, "%Y-%m-%d %H:%M:%S", localtime(&sec));
+  fprintf(stderr, "%s %s: ", ts_buf, sensor->sensor_type);
+  va_start(args, format);
+  vfprintf(stderr, format, args);
+  va_end(args);
+}
+
+// Assign the (sec, cs) key for a row acquired at rt. Keys are handed out strictly increasing from the last one issued for the sensor's table, so an insert never fails on the primary key. If rt rounds to a key that's already been issued (more than one record per cs, or the clock stepped back), the row is blurred forward to the next free cs, and counted in ts_blurs, which is printed every TIMESTAMP_STATS_PERIOD seconds.
+// After a step back of more than TIMESTAMP_STEP_BACK_MAX, the rows are keyed ahead of when they were taken, by up to the step, until the clock catches up with the last key; that's logged when it happens, and again when it's over. Reloading the last key from the table wouldn't help, since the rows logged before the step are ahead of the clock too.
+void alloc_timestamp(struct ghpi_sensor* sensor, struct timespec* rt, int* sec, int* cs) {
+  *sec = rt->tv_sec;
+  *cs = rt->tv_nsec >> TS_TV_NSEC_SHIFT;
+  if((*sec < sensor->last_sec)
+     || ((*sec == sensor->last_sec) && (*cs <= sensor->last_cs))) {
+    long long behind_cs = ((long long)sensor->last_sec - *sec)*(TS_CS_MAX+1) + sensor->last_cs - *cs;
+    if(!sensor->ts_stepped_back_p && (behind_cs > TIMESTAMP_STEP_BACK_MAX*(TS_CS_MAX+1))) {
+      sensor->ts_stepped_back_p = true;
+      sensor->ts_step_blurs = 0;
+      clock_gettime(CLOCK_MONOTONIC, &sensor->ts_step_back);
+      print_timestamp_notice(sensor, rt->tv_sec, "clock stepped back %.2fs behind the last key; rows are keyed after it, so ahead of their time, until the clock catches up\n", (double)behind_cs/(TS_CS_MAX+1));
+    }
+    *sec = sensor->last_sec;
+    *cs = sensor->last_cs + 1;
+    if(*cs > TS_CS_MAX) {
+      *cs = 0;
+      *sec += 1;
+    }
+    sensor->ts_blurs++;
+    if(sensor->ts_stepped_back_p) sensor->ts_step_blurs++;
+    metrics_count(&sensor->metrics, METRIC_BLURS, 1);
+  } else if(sensor->ts_stepped_back_p) {
+    sensor->ts_stepped_back_p = false;
+    print_timestamp_notice(sensor, rt->tv_sec, "clock caught up with the keys after %.1fs; %u rows were keyed ahead of their time\n", ms_since(&sensor->ts_step_back)/1000.0, sensor->ts_step_blurs);
+  }
+  sensor->last_sec = *sec;
+  sensor->last_cs = *cs;
+  if(ms_since(&sensor->ts_blur_stats) >= TIMESTAMP_STATS_PERIOD*1000) {
+    if(sensor->ts_blurs) print_timestamp_notice(sensor, rt->tv_sec, "%u timestamps blurred forward in last %ds\n", sensor->ts_blurs, TIMESTAMP_STATS_PERIOD);
+    sensor->ts_blurs = 0;
+    clock_gettime(CLOCK_MONOTONIC, &sensor->ts_blur_stats);
+  }
+}
+
+// Insert a record timestamped rt into the sensor's log table. mono is when insert_record was called. If blob is non-null, it goes in the column after the data.
+void write_record(struct ghpi_sensor* sensor, struct timespec* rt, struct timespec* mono, int* arrData, int cData, bool* arrNull_p, const unsigned char* blob, int n_blob) {
+  sqlite3_stmt* pStmt = sensor->pStmt_log;
+  int rc, i, sec, cs;
   for(i=0; i<cData; i++) {
     // parameters are numbered from 1, and first two are the timestamp (sec and cs), not sensor reading data
     if(arrNull_p && (arrNull_p[i]==true)) rc = sqlite3_bind_null(pStmt, i+3);
       else rc = sqlite3_bind_int(pStmt, i+3, arrData[i]);
     check_sql(rc, "sqlite3_bind_null or sqlite3_bind_int failure in insert_record while binding data");
   }
+  if(blob) {
+    rc = sqlite3_bind_blob(pStmt, cData+3, blob, n_blob, SQLITE_STATIC);
+    check_sql(rc, "sqlite3_bind_blob failure in insert_record");
+  }
+  alloc_timestamp(sensor, rt, &sec, &cs);
+  rc = sqlite3_bind_int(pStmt, 1, sec);
+  check_sql(rc, "sqlite3_bind_int failure in insert_record while binding sec");
+  rc = sqlite3_bind_int(pStmt, 2, cs);
+  check_sql(rc, "sqlite3_bind_int failure in insert_record while binding cs");
+  rc = sqlite3_step(pStmt);
+  if(rc==SQLITE_CONSTRAINT_PRIMARYKEY) { // Only possible if some other process is writing the same table. Catch up with it, and try once more.
+    sqlite3_reset(pStmt);
+    fprintf(stderr, "%s: timestamp collision in %s; another writer? Reloading last timestamp.\n", sensor->sensor_type, sensor->log_table);
+    metrics_count(&sensor->metrics, METRIC_COLLISIONS, 1);
+    load_last_timestamp(sensor);
+    alloc_timestamp(sensor, rt, &sec, &cs);
+    rc = sqlite3_bind_int(pStmt, 1, sec);
+    check_sql(rc, "sqlite3_bind_int failure in insert_record while binding sec");
+    rc = sqlite3_bind_int(pStmt, 2, cs);
+    check_sql(rc, "sqlite3_bind_int failure in insert_record while binding cs");
+    rc = sqlite3_step(pStmt);
+  }
+  check_sql(rc, "sqlite3_step failure in insert_record");
+  sqlite3_reset(pStmt);
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  metrics_hist_add(&sensor->metrics, METRIC_INSERT, ts_to_ns(&now) - ts_to_ns(mono));
+}
+
+// If arrNull_p is non-null, then it must point to an array of length cData of bools. For each true bool, a null is inserted, and the corresponding value of arrData is ignored.
+void insert_record(struct ghpi_sensor* sensor, int* arrData, int cData, bool* arrNull_p) {
   struct timespec rt;
   clock_gettime(CLOCK_REALTIME, &rt);
-  for(i=0; i<TIMESTAMP_RETRY_MAX; i++) {
-    rc = sqlite3_bind_int(pStmt, 1, rt.tv_sec);
-    check_sql(rc, "sqlite3_bind_int failure in insert_record while binding rt.tv_sec");
-    rc = sqlite3_bind_int(pStmt, 2, (rt.tv_nsec >> TS_TV_NSEC_SHIFT));
-    check_sql(rc, "sqlite3_bind_int failure in insert_record while binding rt.tv_nsec");
-    rc = sqlite3_step(pStmt);
-    if(rc==SQLITE_CONSTRAINT_UNIQUE) { // Timestamp collision
-      rt.tv_nsec += 1 << TS_TV_NSEC_SHIFT; // Increment by approximately one centisecond
-      if(rt.tv_nsec >= 1000000000) {
-	rt.tv_nsec -= 1000000000;
-	rt.tv_sec += 1;
+  insert_record_at(sensor, &rt, arrData, cData, arrNull_p);
+}
+
+static void insert_record_full(struct ghpi_sensor* sensor, struct timespec* rt_acq, int* arrData, int cData, bool* arrNull_p, const unsigned char* blob, int n_blob) {
+  struct timespec rt = *rt_acq, mono;
+  clock_gettime(CLOCK_MONOTONIC, &mono);
+  sensor->ts_heartbeat = mono;
+  metrics_count(&sensor->metrics, METRIC_SAMPLES, 1);
+  if(live_seg) // Before the record is queued, so it's live even if the writer thread is behind
+    for(int i=0; (i<cData) && (i<sensor->n_live); i++)
+      live_publish(live_seg, sensor->live_slots[i], arrData[i], arrNull_p && arrNull_p[i], &rt);
+  if(writer_running || batch_max_rows) { // Written later, so the record, and any blob, are copied
+    struct ghpi_record rec;
+    if(cData>GHPI_RECORD_MAX_FIELDS) {
+      fprintf(stderr, "%s record has %d fields; max is %d\n", sensor->sensor_type, cData, GHPI_RECORD_MAX_FIELDS);
+      exit(-1);
+    }
+    rec.sensor = sensor;
+    rec.kind = REC_LOG;
+    rec.rt = rt;
+    rec.mono = mono;
+    rec.cData = cData;
+    for(int i=0; i<cData; i++) {
+      rec.arrData[i] = arrData[i];
+      rec.arrNull[i] = arrNull_p && arrNull_p[i];
+    }
+    rec.blob = NULL;
+    rec.n_blob = n_blob;
+    if(blob) {
+      rec.blob = (unsigned char*)malloc(n_blob?n_blob:1);
+      if(!rec.blob) {
+	fprintf(stderr, "Out of memory for %s record\n", sensor->sensor_type);
+	exit(-1);
       }
-      sqlite3_reset(pStmt);
-      char ts_buf[64];
-      struct tm* tm_info;
-      tm_info = localtime(&(rt.tv_sec));
-      strftime(ts_buf, 64, "%Y-%m-%d %H:%M:%S", tm_info);
-      fprintf(stderr, "%s Timestamp collision during attempt %d to insert log record. Retrying.\n", ts_buf, i);
-      continue;
+      memcpy(rec.blob, blob, n_blob);
     }
-    check_sql(rc, "sqlite3_step failure in insert_record");
-    sqlite3_reset(pStmt);
-    break;
-  }
-  if(i==TIMESTAMP_RETRY_MAX) {
-    char ts_buf[64];
-    struct tm* tm_info;
-    tm_info = localtime(&(rt.tv_sec));
-    strftime(ts_buf, 64, "%Y-%m-%d %H:%M:%S", tm_info);
-    fprintf(stderr, "%s Failed to insert record due to timestamp collisions in excess of %d. Dropping it.\n", ts_buf, TIMESTAMP_RETRY_MAX);
-    return;
-  }
-  clock_gettime(CLOCK_MONOTONIC, &ts_heartbeat);
+    if(!writer_running) batch_add(&rec);
+    else if(!writer_push(&rec)) free(rec.blob);
+  } else write_record(sensor, &rt, &mono, arrData, cData, arrNull_p, blob, n_blob);
+  batch_poll();
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  step_logging_ns += ts_to_ns(&now) - ts_to_ns(&mono);
+}
+
+// For a reading acquired at rt, rather than now, e.g. a GPIO edge timestamped by the kernel
+void insert_record_at(struct ghpi_sensor* sensor, struct timespec* rt, int* arrData, int cData, bool* arrNull_p) {
+  insert_record_full(sensor, rt, arrData, cData, arrNull_p, NULL, 0);
+}
+
+// For a log table whose last column is a BLOB, e.g. a waveform capture: the record's data, then n_blob bytes for that column. With the writer thread, the blob is copied, so unlike the other inserts this allocates; it's meant for rare records.
+void insert_record_blob(struct ghpi_sensor* sensor, struct timespec* rt, int* arrData, int cData, const unsigned char* blob, int n_blob) {
+  insert_record_full(sensor, rt, arrData, cData, NULL, blob, n_blob);
 }
 
 // Shorter signature for when no nulls need to be inserted
-void insert_record(sqlite3_stmt* pStmt, int* arrData, int cData) {
-  insert_record(pStmt, arrData, cData, NULL);
+void insert_record(struct ghpi_sensor* sensor, int* arrData, int cData) {
+  insert_record(sensor, arrData, cData, NULL);
+}
+
+void write_heartbeat(struct ghpi_sensor* sensor, int idle_sec) {
+  int rc = sqlite3_bind_text(pStmt_hb, 1, sensor->sensor_type, -1, SQLITE_STATIC);
+  check_sql(rc, "sqlite3_bind_text failure in write_heartbeat");
+  rc = sqlite3_bind_int(pStmt_hb, 2, idle_sec);
+  check_sql(rc, "sqlite3_bind_int failure in write_heartbeat");
+  rc = sqlite3_step(pStmt_hb);
+  check_sql(rc, "sqlite3_step failure in write_heartbeat");
+  sqlite3_reset(pStmt_hb);
+  metrics_count(&sensor->metrics, METRIC_IDLE_HEARTBEATS, 1);
 }
 
-void update_idle_heartbeat() {
+void update_idle_heartbeat(struct ghpi_sensor* sensor) {
   struct timespec mono, diff;
   clock_gettime(CLOCK_MONOTONIC, &mono);
-  ts_diff(&diff, &mono, &ts_heartbeat);
-  ts_heartbeat = mono;
+  ts_diff(&diff, &mono, &sensor->ts_heartbeat);
+  sensor->ts_heartbeat = mono;
+  if(live_seg) {
+    struct timespec rt;
+    clock_gettime(CLOCK_REALTIME, &rt);
+    for(int i=0; i<sensor->n_live; i++) live_beat(live_seg, sensor->live_slots[i], &rt);
+  }
   if(diff.tv_sec >= IDLE_HEARTBEAT_LOGGING_PERIOD) {
-    int rc = sqlite3_bind_text(pStmt_hb, 1, sensor_type, -1, SQLITE_STATIC);
-    check_sql(rc, "sqlite3_bind_text failure in update_idle_heartbeat");
-    rc = sqlite3_bind_int(pStmt_hb, 2, diff.tv_sec);
-    check_sql(rc, "sqlite3_bind_int failure in update_idle_heartbeat");
-    rc = sqlite3_step(pStmt_hb);
-    check_sql(rc, "sqlite3_step failure in update_idle_heartbeat");
-    sqlite3_reset(pStmt_hb);
+    if(writer_running || batch_max_rows) {
+      struct ghpi_record rec;
+      rec.sensor = sensor;
+      rec.kind = REC_HEARTBEAT;
+      rec.rt.tv_sec = diff.tv_sec;
+      rec.cData = 0;
+      rec.blob = NULL;
+      if(writer_running) writer_push(&rec);
+      else batch_add(&rec);
+    } else write_heartbeat(sensor, diff.tv_sec);
   }
+  batch_poll();
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  step_logging_ns += ts_to_ns(&now) - ts_to_ns(&mono);
 }
@@ -3,6 +3,10 @@
 #include <time.h>
 #include <stdbool.h>
 #include "sqlite3.h"
+#include "gh_io.h"
+#include "gh_bus.h"
+#include "gh_live.h"
+#include "gh_metrics.h"
 
 #define GHPI_SQLITE_INIT_STRING "\
 pragma journal_mode = WAL; \
@@ -12,12 +16,35 @@ pragma recursive_triggers = true; \
 pragma cache_size = -256; \
 pragma secure_delete = false;"
 
+// Dashboard queries, shared by poll_stream and ghpi_bench
+#define GHPI_SQL_LAST_LOGS "SELECT * FROM Last_logs"
+#define GHPI_SQL_DATA_VERSION "PRAGMA data_version" // Changes when another connection commits
+#define GHPI_SQL_DS18B20_IDS_VERSION "SELECT version FROM Table_versions WHERE table_name='DS18B20_IDs'"
+#define GHPI_SQL_DS18B20_IDS "SELECT sensor_ID, label from DS18B20_IDs ORDER BY sensor_ID"
+// Each sensor's latest reading in the last hour, in one pass over DS18B20_IDs, with one seek of DS18B20_logs_by_sensor per sensor. Columns are sensor_ID, whether there's a reading (so a logged null can be told from no data), and temp.
+#define GHPI_SQL_DS18B20_LAST "SELECT i.sensor_ID, l.sec IS NOT NULL, l.temp FROM DS18B20_IDs AS i LEFT JOIN DS18B20_logs AS l ON (l.sec, l.cs, l.sensor_ID) = (SELECT sec, cs, sensor_ID FROM DS18B20_logs WHERE sensor_ID=i.sensor_ID AND sec>(strftime('%s', 'now')-3600) ORDER BY sec DESC, cs DESC LIMIT 1) ORDER BY i.sensor_ID"
+
 #define TS_TV_NSEC_SHIFT 23 // To quickly convert ts.tv_nsec approximately to centiseconds
+#define TS_CS_MAX ((int)((NS_PER_SEC-1) >> TS_TV_NSEC_SHIFT)) // Largest cs value; i.e. 119, not 99
 #define HYST_SCALE 4 // For hysteresis of sensor readings
 #define GHPI_SQL_BUSY_WAIT 100*1000000 // ns. I.e. 100ms.
 #define GHPI_SQL_BUSY_RETRY_MAX 50
 #define GHPI_SQL_BUSY_NOTICE_THRESHOLD 1
-#define TIMESTAMP_RETRY_MAX 20
+#define TIMESTAMP_STATS_PERIOD 600 // seconds. See alloc_timestamp.
+#define TIMESTAMP_STEP_BACK_MAX 5 // seconds. A clock step back further than this behind the last key (e.g. an NTP correction) is logged. See alloc_timestamp.
+#define NS_PER_SEC 1000000000LL
+
+// Group commit (see batch_commit_enable). Defaults for daemons that opt in.
+#define GHPI_BATCH_MAX_ROWS 50
+#define GHPI_BATCH_MAX_AGE 2000 // ms. Longest a row is held in memory before being written.
+#define GHPI_BATCH_IDLE_FLUSH 500 // ms. Commit early once no row has been added for this long.
+#define GHPI_BATCH_STATS_PERIOD 600 // seconds
+
+// Writer thread (see writer_thread_enable)
+#define GHPI_QUEUE_SIZE 256 // records. Must be a power of 2, so that positions wrap around cleanly.
+#define GHPI_RECORD_MAX_FIELDS 8
+#define GHPI_WRITER_SENSORS_MAX 16
+#define GHPI_WRITER_STATS_PERIOD 600 // seconds
 
 // Due to the anti-joy of C.
 // Cribbed from https://stackoverflow.com/questions/3437404/min-and-max-in-c
@@ -27,18 +54,56 @@ pragma secure_delete = false;"
       __typeof__ (b) _b = (b); \
     _a > _b ? _a : _b; })
 
+// A sensor's logging state, plus its driver's entry points. Each read_* driver defines one. Standalone, the driver's main() just hands it to run_sensor(); ghpid instead hosts all of them on one event loop sharing one DB connection.
+// Drivers are written as non-blocking state machines: rather than sleeping while a conversion completes, step returns, and asks to be called again once it's done.
+struct ghpi_sensor {
+  const char* sensor_type; // Name in Idle_heartbeats
+  const char* log_table; // The insert statement is generated from the table's columns, which are sec, cs, then the data
+  long long (*init)(); // Set up the hardware. Called once, after the DB is open. Returns ns to wait before the first step.
+  long long (*step)(); // Do one unit of work, e.g. start a conversion, or read and log its result. Returns ns to wait before the next step.
+  int event_fd; // Set by init, for a driver that's woken by events (see io_gpio_event_fd) as well as by its step's timeouts: its step is then also called as soon as this is readable. -1 otherwise.
+  sqlite3_stmt* pStmt_log;
+  struct timespec ts_heartbeat; // Time of last record insertion, or last idle heartbeat, whichever is later.
+  unsigned queue_overflows, queue_high_water; // Writer thread queue stats, since they were last printed
+  int last_sec, last_cs; // Key of the latest row in log_table. See alloc_timestamp.
+  unsigned ts_blurs; // Timestamps bumped forward since last printed
+  bool ts_stepped_back_p; // The clock stepped back more than TIMESTAMP_STEP_BACK_MAX, and hasn't yet caught up with the last key
+  unsigned ts_step_blurs; // Timestamps bumped forward since then
+  struct timespec ts_step_back;
+  struct timespec ts_blur_stats;
+  int n_live; // Data columns with a live slot. See live_publish_enable.
+  int live_slots[GHPI_RECORD_MAX_FIELDS];
+  struct metrics_local metrics; // See metrics_enable
+};
+
 extern sqlite3* db;
-extern sqlite3_stmt* pStmt_log;
+extern struct metrics_local metrics_db; // Daemon-wide, i.e. the DB connection's, e.g. METRIC_BUSY_RETRIES
 extern const char* Sqlite_type_names[];
-extern const char* sensor_type;
-extern const char* zSql_log;
 
 void ts_diff(struct timespec* result, struct timespec* a, struct timespec* b);
+void ns_to_ts(struct timespec* ts, long long ns);
+long long ts_to_ns(struct timespec* ts);
+long ms_since(struct timespec* then);
 bool reading_change(bool* px_prev_inc_p, int* px_mem, int x);
 void check_sql(int rc, const char* msg);
 int ghpi_sqlite_busy_handler(void* argv0, int count);
 void ghpi_sqlite_init(const char* argv0, const char* db_file_name);
+int ghpi_wal_hook(void* arg, sqlite3* db_hook, const char* zDb, int nFrames);
 void daemon_init(int argc, char** argv);
-void insert_record(sqlite3_stmt* pStmt, int* arrData, int cData);
-void insert_record(sqlite3_stmt* pStmt, int* arrData, int cData, bool* arrNull_p);
-void update_idle_heartbeat();
+void sensor_init(struct ghpi_sensor* sensor);
+double config_double(const char* var, double dflt);
+void run_sensor(struct ghpi_sensor* sensor);
+void live_publish_enable();
+void metrics_enable();
+long long sensor_step(struct ghpi_sensor* sensor);
+void insert_record(struct ghpi_sensor* sensor, int* arrData, int cData);
+void insert_record(struct ghpi_sensor* sensor, int* arrData, int cData, bool* arrNull_p);
+void insert_record_at(struct ghpi_sensor* sensor, struct timespec* rt, int* arrData, int cData, bool* arrNull_p);
+void insert_record_blob(struct ghpi_sensor* sensor, struct timespec* rt, int* arrData, int cData, const unsigned char* blob, int n_blob);
+void update_idle_heartbeat(struct ghpi_sensor* sensor);
+void batch_commit_enable(int max_rows, int max_age_ms);
+void batch_commit_flush();
+void batch_poll();
+void writer_thread_enable();
+void writer_thread_start();
+void writer_thread_stop();
@@ -0,0 +1,774 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // For ppoll
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <linux/i2c-dev.h>
+#include <linux/gpio.h>
+#include "gh_io.h"
+#include "gh_bus.h"
+
+#define IO_DEVICE_KEYS 256 // I2C addresses, then 128 + GPIO pin
+#define IO_TRACE_LINE_MAX (IO_I2C_MSGS_MAX*(IO_I2C_MSG_LEN_MAX*2+3)+128)
+#define IO_MISMATCH_PRINT_MAX 10
+#define IO_GPIO_REG_PINS 54 // BCM283x GPIOs that are in the function select registers
+
+enum {IO_LINUX, IO_RECORD, IO_REPLAY};
+enum {OP_I2C, OP_GPIO_IN, OP_GPIO_OUT, OP_GPIO_READ, OP_GPIO_WRITE, OP_GPIO_WATCH, OP_GPIO_EVENT, N_OPS};
+static const char* op_names[] = {"i2c", "gin", "gout", "grd", "gwr", "gwatch", "gev"};
+
+static int io_backend = -1; // Not yet initialized
+static const char* trace_file_name;
+static FILE* trace_fp;
+static struct timespec ts_trace_start;
+
+static int i2c_fd = -1;
+static int i2c_addrs[IO_I2C_DEVICES_MAX];
+static int n_i2c_devices;
+static int i2c_classes[IO_I2C_DEVICES_MAX]; // enum bus_class
+static int i2c_stuck_count; // Consecutive failed transfers that look like a stuck bus
+static __thread struct io_i2c_stats i2c_stats;
+
+static int gpio_chip_fd = -1;
+static int gpio_line_fds[IO_GPIO_PINS]; // 0 if the line hasn't been requested
+static bool gpio_pending_p[IO_GPIO_PINS]; // Whether gpio_pending holds the line's next event, read ahead so the lines' events can be merged in time order
+static struct gpio_v2_line_event gpio_pending[IO_GPIO_PINS];
+static bool gpio_soft_p; // While set, a GPIO failure just sets gpio_failed_p, rather than being fatal; so a failed io_i2c_recover fails only the transfer, not the process, and in ghpid, all the other drivers
+static bool gpio_failed_p;
+
+// Replay trace, loaded whole at startup. Each device has its own cursor, so the transactions of different drivers hosted together in ghpid needn't interleave the same way they did when recorded.
+struct io_entry {
+  long long t; // ns from start of trace
+  int op, dev, rc;
+  int nmsgs;
+  bool msg_read_p[IO_I2C_MSGS_MAX];
+  int msg_len[IO_I2C_MSGS_MAX];
+  int data_off; // Into replay_data. The bytes of the entry's messages are consecutive.
+  int lineno;
+  int next; // Next entry for the same device, or -1
+};
+static struct io_entry* replay_entries;
+static int n_replay_entries, replay_entries_size;
+static unsigned char* replay_data;
+static int replay_data_len, replay_data_size;
+static int replay_first[IO_DEVICE_KEYS], replay_last[IO_DEVICE_KEYS], replay_cursor[IO_DEVICE_KEYS];
+static long replay_count, replay_mismatches;
+
+static int device_key(int op, int dev) {
+  return (op==OP_I2C)?(dev & 0x7f):(128 + dev%IO_GPIO_PINS);
+}
+
+static long long ns_since(struct timespec* ts_start, struct timespec* ts) {
+  return (ts->tv_sec - ts_start->tv_sec)*1000000000LL + ts->tv_nsec - ts_start->tv_nsec;
+}
+
+static void replay_append_byte(unsigned char b) {
+  if(replay_data_len==replay_data_size) {
+    replay_data_size = replay_data_size?replay_data_size*2:4096;
+    replay_data = (unsigned char*)realloc(replay_data, replay_data_size);
+    if(!replay_data) {
+      fprintf(stderr, "Out of memory loading replay trace\n");
+      exit(-1);
+    }
+  }
+  replay_data[replay_data_len++] = b;
+}
+
+static void replay_append_entry(struct io_entry* e) {
+  if(n_replay_entries==replay_entries_size) {
+    replay_entries_size = replay_entries_size?replay_entries_size*2:1024;
+    replay_entries = (struct io_entry*)realloc(replay_entries, replay_entries_size*sizeof(struct io_entry));
+    if(!replay_entries) {
+      fprintf(stderr, "Out of memory loading replay trace\n");
+      exit(-1);
+    }
+  }
+  int key = device_key(e->op, e->dev);
+  if(replay_last[key]<0) replay_first[key] = n_replay_entries;
+  else replay_entries[replay_last[key]].next = n_replay_entries;
+  replay_last[key] = n_replay_entries;
+  replay_entries[n_replay_entries++] = *e;
+}
+
+static void replay_load(const char* file_name) {
+  char line[IO_TRACE_LINE_MAX];
+  int lineno = 0;
+  FILE* fp = fopen(file_name, "r");
+  if(!fp) {
+    fprintf(stderr, "Can't open replay trace %s: %s\n", file_name, strerror(errno));
+    exit(-1);
+  }
+  for(int k=0; k<IO_DEVICE_KEYS; k++) replay_first[k] = replay_last[k] = -1;
+  while(fgets(line, sizeof(line), fp)) {
+    struct io_entry e;
+    char op[8];
+    long long t, dur;
+    int pos;
+    lineno++;
+    if((line[0]=='#') || (line[0]=='\n')) continue;
+    memset(&e, 0, sizeof(e));
+    e.lineno = lineno;
+    e.next = -1;
+    e.data_off = replay_data_len;
+    if(sscanf(line, "%lld %lld %7s %d %d%n", &t, &dur, op, &e.dev, &e.rc, &pos)!=5) {
+      fprintf(stderr, "%s:%d: malformed trace line\n", file_name, lineno);
+      exit(-1);
+    }
+    e.t = t;
+    for(e.op=0; e.op<N_OPS; e.op++)
+      if(!strcmp(op, op_names[e.op])) break;
+    if(e.op==N_OPS) {
+      fprintf(stderr, "%s:%d: unknown operation %s\n", file_name, lineno, op);
+      exit(-1);
+    }
+    char* p = line + pos;
+    while(1) {
+      while(*p==' ') p++;
+      if((*p=='\n') || (*p=='\0')) break;
+      if((e.nmsgs==IO_I2C_MSGS_MAX) || ((*p!='r') && (*p!='w')) || (p[1]!=':')) {
+	fprintf(stderr, "%s:%d: malformed I2C message\n", file_name, lineno);
+	exit(-1);
+      }
+      e.msg_read_p[e.nmsgs] = (*p=='r');
+      p += 2;
+      int len = 0;
+      while(isxdigit(p[0]) && isxdigit(p[1])) {
+	unsigned b;
+	sscanf(p, "%2x", &b);
+	replay_append_byte(b);
+	len++;
+	p += 2;
+      }
+      e.msg_len[e.nmsgs++] = len;
+    }
+    replay_append_entry(&e);
+  }
+  fclose(fp);
+  if(!n_replay_entries) {
+    fprintf(stderr, "Replay trace %s has no transactions\n", file_name);
+    exit(-1);
+  }
+  memcpy(replay_cursor, replay_first, sizeof(replay_cursor));
+}
+
+static void io_init() {
+  if(io_backend>=0) return;
+  const char* spec = getenv("GHPI_IO");
+  io_backend = IO_LINUX;
+  if(!spec || !*spec || !strcmp(spec, "linux")) return;
+  if(!strncmp(spec, "record:", 7)) {
+    io_backend = IO_RECORD;
+    trace_file_name = spec + 7;
+    trace_fp = fopen(trace_file_name, "w");
+    if(!trace_fp) {
+      fprintf(stderr, "Can't open trace %s for recording: %s\n", trace_file_name, strerror(errno));
+      exit(-1);
+    }
+    setvbuf(trace_fp, NULL, _IOLBF, 0); // So that a killed daemon's trace is complete
+    fprintf(trace_fp, "# t_ns dur_ns op dev rc [r|w:hex]...\n");
+  } else if(!strncmp(spec, "replay:", 7)) {
+    io_backend = IO_REPLAY;
+    trace_file_name = spec + 7;
+    replay_load(trace_file_name);
+    fprintf(stderr, "Replaying %d transactions from %s\n", n_replay_entries, trace_file_name);
+  } else {
+    fprintf(stderr, "Unknown GHPI_IO backend: %s\n", spec);
+    exit(-1);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &ts_trace_start);
+}
+
+bool io_replay_p() {
+  io_init();
+  return io_backend==IO_REPLAY;
+}
+
+static void trace_begin(struct timespec* t0) {
+  if(io_backend==IO_RECORD) clock_gettime(CLOCK_MONOTONIC, t0);
+}
+
+// Trace line: start time and duration (ns, monotonic, from start of trace), op, device (I2C address or GPIO pin), rc (for GPIO ops, the value or pull-up flag), and for I2C, each message's direction and bytes. For an edge event, the start is the edge, and the duration how long it took the daemon to take it.
+static void trace_end(struct timespec* t0, int op, int dev, int rc, struct i2c_msg* msgs, int nmsgs) {
+  if(io_backend!=IO_RECORD) return;
+  struct timespec t1;
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  int saved_errno = errno;
+  fprintf(trace_fp, "%lld %lld %s %d %d", ns_since(&ts_trace_start, t0), ns_since(t0, &t1), op_names[op], dev, rc);
+  for(int i=0; i<nmsgs; i++) {
+    fprintf(trace_fp, " %c:", (msgs[i].flags & I2C_M_RD)?'r':'w');
+    for(int j=0; j<msgs[i].len && j<IO_I2C_MSG_LEN_MAX; j++) fprintf(trace_fp, "%02x", msgs[i].buf[j]);
+  }
+  fputc('\n', trace_fp);
+  errno = saved_errno;
+}
+
+// Print the stats, and start over from the beginning of the trace. SIGTERM ends the run: daemons with a terminate handler flush and exit from their next batch_poll, meanwhile replaying from the start again; others just die.
+static void replay_end() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  double elapsed = ns_since(&ts_trace_start, &ts)/1e9;
+  fprintf(stderr, "Replay of %s finished: %ld transactions, %ld mismatches, %.3fs (%.0f transactions/s)\n",
+	  trace_file_name, replay_count, replay_mismatches, elapsed, replay_count/(elapsed>0?elapsed:1e-9));
+  memcpy(replay_cursor, replay_first, sizeof(replay_cursor));
+  replay_count = replay_mismatches = 0;
+  ts_trace_start = ts;
+  raise(SIGTERM);
+}
+
+static struct io_entry* replay_next(int op, int dev) {
+  int key = device_key(op, dev);
+  if(replay_first[key]<0) {
+    fprintf(stderr, "Replay trace %s has no transactions for %s %d\n", trace_file_name, (op==OP_I2C)?"I2C address":"GPIO pin", dev);
+    exit(-1);
+  }
+  if(replay_cursor[key]<0) replay_end();
+  struct io_entry* e = &replay_entries[replay_cursor[key]];
+  replay_cursor[key] = e->next;
+  replay_count++;
+  return e;
+}
+
+// The driver didn't do what it did when the trace was recorded
+static void replay_mismatch(struct io_entry* e, int op) {
+  if(replay_mismatches++ < IO_MISMATCH_PRINT_MAX)
+    fprintf(stderr, "%s:%d: replay mismatch; trace has %s, driver did %s\n", trace_file_name, e->lineno, op_names[e->op], op_names[op]);
+}
+
+static int replay_i2c(int addr, struct i2c_msg* msgs, int nmsgs) {
+  struct io_entry* e = replay_next(OP_I2C, addr);
+  const unsigned char* data = replay_data + e->data_off;
+  bool mismatch_p = (e->op!=OP_I2C) || (e->nmsgs!=nmsgs);
+  for(int i=0; i<nmsgs && i<e->nmsgs; i++) {
+    int len = (msgs[i].len<IO_I2C_MSG_LEN_MAX)?msgs[i].len:IO_I2C_MSG_LEN_MAX;
+    if(len!=e->msg_len[i]) mismatch_p = true;
+    if(len>e->msg_len[i]) len = e->msg_len[i];
+    if(msgs[i].flags & I2C_M_RD) {
+      memcpy(msgs[i].buf, data, len);
+      if(!e->msg_read_p[i]) mismatch_p = true;
+    } else if(e->msg_read_p[i] || memcmp(msgs[i].buf, data, len)) mismatch_p = true;
+    data += e->msg_len[i];
+  }
+  if(mismatch_p) replay_mismatch(e, OP_I2C);
+  if(e->rc<0) errno = EIO;
+  return e->rc;
+}
+
+static int replay_gpio(int op, int pin, int value) {
+  struct io_entry* e = replay_next(op, pin);
+  if((e->op!=op) || ((op!=OP_GPIO_READ) && (e->rc!=value))) replay_mismatch(e, op);
+  return e->rc;
+}
+
+int io_i2c_open(int addr) {
+  io_init();
+  if(n_i2c_devices==IO_I2C_DEVICES_MAX) {
+    errno = EMFILE;
+    return -1;
+  }
+  if((io_backend!=IO_REPLAY) && (i2c_fd<0)) {
+    i2c_fd = open(GHPI_I2C_BUS, O_RDWR);
+    if(i2c_fd<0) return -1;
+    bus_enable();
+  }
+  i2c_addrs[n_i2c_devices] = addr;
+  i2c_classes[n_i2c_devices] = BUS_NORMAL;
+  return n_i2c_devices++;
+}
+
+void io_i2c_set_class(int h, int cls) {
+  i2c_classes[h] = cls;
+}
+
+void io_i2c_reserve(int h, long long start_ns, long long end_ns) {
+  if(io_backend==IO_REPLAY) return;
+  if(end_ns<start_ns) end_ns = start_ns;
+  bus_reserve(i2c_classes[h], start_ns/1000, end_ns/1000);
+}
+
+// One I2C_RDWR, after waiting out any other process's reservation of the bus
+static int i2c_transfer(int h, struct i2c_msg* msgs, int nmsgs, int bytes) {
+  struct timespec t0;
+  int addr = i2c_addrs[h];
+  unsigned wait_us = bus_wait(i2c_classes[h], bus_transfer_us(bytes, nmsgs));
+  struct i2c_rdwr_ioctl_data d;
+  d.msgs = msgs;
+  d.nmsgs = nmsgs;
+  trace_begin(&t0);
+  long long t_start = io_now_ns();
+  int rc = ioctl(i2c_fd, I2C_RDWR, &d);
+  long long ns = io_now_ns() - t_start;
+  i2c_stats.ns += ns;
+  trace_end(&t0, OP_I2C, addr, rc, msgs, nmsgs);
+  int saved_errno = errno;
+  bus_account(addr, bytes, ns/1000, wait_us, rc<0);
+  errno = saved_errno;
+  return rc;
+}
+
+// Failures the bus itself causes: i2c-bcm2835 times out a transfer that can't complete (ETIMEDOUT), e.g. because SDA is held low, and a clock stretched too long (EIO). Unlike a NACK (EREMOTEIO), which just means the device isn't answering, e.g. an SHT31 mid-conversion.
+static bool i2c_stuck_p(int err) {
+  return (err==ETIMEDOUT) || (err==EIO);
+}
+
+int io_i2c_rdwr(int h, struct i2c_msg* msgs, int nmsgs) {
+  int addr = i2c_addrs[h];
+  int bytes = 0;
+  i2c_stats.transfers++;
+  for(int i=0; i<nmsgs; i++) {
+    msgs[i].addr = addr;
+    bytes += 1 + msgs[i].len;
+  }
+  i2c_stats.bytes += bytes;
+  if(io_backend==IO_REPLAY) return replay_i2c(addr, msgs, nmsgs);
+  int rc = i2c_transfer(h, msgs, nmsgs, bytes);
+  if(rc>=0) i2c_stuck_count = 0;
+  else if(i2c_stuck_p(errno) && (++i2c_stuck_count>=IO_I2C_RECOVER_AFTER)) {
+    fprintf(stderr, "I2C transfer to 0x%02x failed: %s; recovering the bus\n", addr, strerror(errno));
+    if(io_i2c_recover()) {
+      i2c_stats.transfers++;
+      i2c_stats.bytes += bytes;
+      rc = i2c_transfer(h, msgs, nmsgs, bytes);
+      if(rc>=0) i2c_stuck_count = 0;
+    }
+  }
+  return rc;
+}
+
+void io_i2c_get_stats(struct io_i2c_stats* s) {
+  *s = i2c_stats;
+}
+
+int io_i2c_read_byte(int h) {
+  __u8 b;
+  struct i2c_msg m[] = {{0, I2C_M_RD, 1, &b}};
+  return (io_i2c_rdwr(h, m, 1)==1)?b:-1;
+}
+
+int io_i2c_write_byte(int h, int val) {
+  __u8 b = val;
+  struct i2c_msg m[] = {{0, 0, 1, &b}};
+  return (io_i2c_rdwr(h, m, 1)==1)?0:-1;
+}
+
+int io_i2c_write_reg8(int h, int reg, int val) {
+  __u8 buf[2] = {(__u8)reg, (__u8)val};
+  struct i2c_msg m[] = {{0, 0, 2, buf}};
+  return (io_i2c_rdwr(h, m, 1)==1)?0:-1;
+}
+
+// Register address write, then repeated start and two-byte read, i.e. an SMBus read word
+int io_i2c_read_reg16(int h, int reg) {
+  __u8 r = reg;
+  __u8 buf[2];
+  struct i2c_msg m[] = {
+    {0, 0, 1, &r},
+    {0, I2C_M_RD, 2, buf}};
+  return (io_i2c_rdwr(h, m, 2)==2)?(buf[0] | (buf[1]<<8)):-1;
+}
+
+int io_i2c_read_regs(int h, int reg, unsigned char* buf, int len) {
+  __u8 r = reg;
+  struct i2c_msg m[] = {
+    {0, 0, 1, &r},
+    {0, I2C_M_RD, (__u16)len, buf}};
+  return (io_i2c_rdwr(h, m, 2)==2)?0:-1;
+}
+
+int io_i2c_read_reg16s(int h, const int* regs, int* vals, int n) {
+  __u8 r[IO_I2C_MSGS_MAX/2];
+  __u8 buf[IO_I2C_MSGS_MAX/2][2];
+  struct i2c_msg m[IO_I2C_MSGS_MAX];
+  if(n>IO_I2C_MSGS_MAX/2) {
+    fprintf(stderr, "io_i2c_read_reg16s of %d registers; max is %d\n", n, IO_I2C_MSGS_MAX/2);
+    exit(-1);
+  }
+  for(int i=0; i<n; i++) {
+    r[i] = regs[i];
+    m[2*i] = (struct i2c_msg){0, 0, 1, &r[i]};
+    m[2*i+1] = (struct i2c_msg){0, I2C_M_RD, 2, buf[i]};
+  }
+  if(io_i2c_rdwr(h, m, 2*n)!=2*n) return -1;
+  for(int i=0; i<n; i++) vals[i] = buf[i][0] | (buf[i][1]<<8);
+  return 0;
+}
+
+int io_i2c_write_reg16(int h, int reg, int val) {
+  __u8 buf[3] = {(__u8)reg, (__u8)(val & 0xff), (__u8)((val>>8) & 0xff)};
+  struct i2c_msg m[] = {{0, 0, 3, buf}};
+  return (io_i2c_rdwr(h, m, 1)==1)?0:-1;
+}
+
+static void gpio_release(int pin);
+static void gpio_set_alt0(int pin);
+
+// The sequence of i2c_reset, which this replaces, at bus speed rather than 1ms per step, so it takes well under a millisecond: up to IO_I2C_RECOVER_CLOCKS clocks, each of which lets a device holding SDA low shift out another bit, until it lets go; then a stop, so it's back to idle. SCL is only ever driven low, or released, since the bus is open collector.
+bool io_i2c_recover() {
+  io_init();
+  if(io_backend!=IO_REPLAY) bus_enable();
+  bus_wait(BUS_RECOVERY, 0); // In case another process is recovering it too
+  long long t = io_now_ns();
+  bus_reserve(BUS_RECOVERY, t/1000, t/1000 + IO_I2C_RECOVER_WINDOW);
+  gpio_soft_p = true;
+  gpio_failed_p = false;
+  io_gpio_input(IO_I2C_SDA, false);
+  t = io_now_ns();
+  for(int i=0; (i<IO_I2C_RECOVER_CLOCKS) && !gpio_failed_p; i++) {
+    io_gpio_output(IO_I2C_SCL, 0);
+    io_spin_until(t += IO_I2C_RECOVER_HALF_PERIOD);
+    io_gpio_input(IO_I2C_SCL, false);
+    io_spin_until(t += IO_I2C_RECOVER_HALF_PERIOD);
+    if(!gpio_failed_p && io_gpio_read(IO_I2C_SDA)) break;
+  }
+  if(!gpio_failed_p) {
+    // Stop: SDA rising while SCL is high
+    io_gpio_output(IO_I2C_SCL, 0);
+    io_spin_until(t += IO_I2C_RECOVER_HALF_PERIOD);
+    io_gpio_output(IO_I2C_SDA, 0);
+    io_spin_until(t += IO_I2C_RECOVER_HALF_PERIOD);
+    io_gpio_input(IO_I2C_SCL, false);
+    io_spin_until(t += IO_I2C_RECOVER_HALF_PERIOD);
+    io_gpio_input(IO_I2C_SDA, false);
+    io_spin_until(t += IO_I2C_RECOVER_HALF_PERIOD);
+  }
+  bool released_p = !gpio_failed_p && io_gpio_read(IO_I2C_SDA) && !gpio_failed_p;
+  gpio_release(IO_I2C_SCL);
+  gpio_release(IO_I2C_SDA);
+  gpio_set_alt0(IO_I2C_SCL);
+  gpio_set_alt0(IO_I2C_SDA);
+  t = io_now_ns();
+  bus_reserve(BUS_RECOVERY, t/1000, t/1000);
+  bus_recovered();
+  i2c_stuck_count = 0;
+  fprintf(stderr, "I2C bus recovery %s\n", released_p?"done":gpio_failed_p?"failed; the I2C pins couldn't be driven as GPIOs":"failed; SDA is still held low");
+  gpio_soft_p = false;
+  return released_p;
+}
+
+// Request the line, or reconfigure it if it's already held
+static void gpio_fail() {
+  if(!gpio_soft_p) exit(-1);
+  gpio_failed_p = true;
+}
+
+static void gpio_config(int pin, __u64 flags, int value, int debounce_us) {
+  struct gpio_v2_line_config config;
+  if((pin<0) || (pin>=IO_GPIO_PINS)) {
+    fprintf(stderr, "GPIO pin %d out of range\n", pin);
+    gpio_fail();
+    return;
+  }
+  memset(&config, 0, sizeof(config));
+  config.flags = flags;
+  if(flags & GPIO_V2_LINE_FLAG_OUTPUT) {
+    config.num_attrs = 1;
+    config.attrs[0].attr.id = GPIO_V2_LINE_ATTR_ID_OUTPUT_VALUES;
+    config.attrs[0].attr.values = value?1:0;
+    config.attrs[0].mask = 1;
+  }
+  if(debounce_us>0) {
+    config.attrs[config.num_attrs].attr.id = GPIO_V2_LINE_ATTR_ID_DEBOUNCE;
+    config.attrs[config.num_attrs].attr.debounce_period_us = debounce_us;
+    config.attrs[config.num_attrs].mask = 1;
+    config.num_attrs++;
+  }
+  if(gpio_line_fds[pin]>0) {
+    if(ioctl(gpio_line_fds[pin], GPIO_V2_LINE_SET_CONFIG_IOCTL, &config)<0) {
+      fprintf(stderr, "GPIO %d reconfiguration failure: %s\n", pin, strerror(errno));
+      gpio_fail();
+    }
+    return;
+  }
+  if(gpio_chip_fd<0) {
+    const char* chip = getenv("GHPI_GPIO_CHIP");
+    if(!chip || !*chip) chip = GHPI_GPIO_CHIP;
+    gpio_chip_fd = open(chip, O_RDWR);
+    if(gpio_chip_fd<0) {
+      fprintf(stderr, "Can't open %s: %s\n", chip, strerror(errno));
+      gpio_fail();
+      return;
+    }
+  }
+  struct gpio_v2_line_request req;
+  memset(&req, 0, sizeof(req));
+  req.offsets[0] = pin;
+  req.num_lines = 1;
+  strncpy(req.consumer, "ghpi", sizeof(req.consumer)-1);
+  req.config = config;
+  if(ioctl(gpio_chip_fd, GPIO_V2_GET_LINE_IOCTL, &req)<0) {
+    fprintf(stderr, "GPIO %d request failure: %s\n", pin, strerror(errno));
+    gpio_fail();
+    return;
+  }
+  gpio_line_fds[pin] = req.fd;
+}
+
+// Without pull_up, the bias is left alone, e.g. for the I2C pins, which have external pull-ups
+void io_gpio_input(int pin, bool pull_up) {
+  struct timespec t0;
+  io_init();
+  if(io_backend==IO_REPLAY) {
+    replay_gpio(OP_GPIO_IN, pin, pull_up);
+    return;
+  }
+  trace_begin(&t0);
+  gpio_config(pin, GPIO_V2_LINE_FLAG_INPUT | (pull_up?GPIO_V2_LINE_FLAG_BIAS_PULL_UP:0), 0, 0);
+  trace_end(&t0, OP_GPIO_IN, pin, pull_up, NULL, 0);
+}
+
+void io_gpio_output(int pin, int value) {
+  struct timespec t0;
+  io_init();
+  if(io_backend==IO_REPLAY) {
+    replay_gpio(OP_GPIO_OUT, pin, value);
+    return;
+  }
+  trace_begin(&t0);
+  gpio_config(pin, GPIO_V2_LINE_FLAG_OUTPUT, value, 0);
+  trace_end(&t0, OP_GPIO_OUT, pin, value, NULL, 0);
+}
+
+int io_gpio_read(int pin) {
+  struct timespec t0;
+  if(io_backend==IO_REPLAY) return replay_gpio(OP_GPIO_READ, pin, 0);
+  struct gpio_v2_line_values values;
+  values.bits = 0;
+  values.mask = 1;
+  trace_begin(&t0);
+  if(ioctl(gpio_line_fds[pin], GPIO_V2_LINE_GET_VALUES_IOCTL, &values)<0) {
+    fprintf(stderr, "GPIO %d read failure: %s\n", pin, strerror(errno));
+    gpio_fail();
+    return 0;
+  }
+  int value = values.bits & 1;
+  trace_end(&t0, OP_GPIO_READ, pin, value, NULL, 0);
+  return value;
+}
+
+void io_gpio_write(int pin, int value) {
+  struct timespec t0;
+  if(io_backend==IO_REPLAY) {
+    replay_gpio(OP_GPIO_WRITE, pin, value);
+    return;
+  }
+  struct gpio_v2_line_values values;
+  values.bits = value?1:0;
+  values.mask = 1;
+  trace_begin(&t0);
+  if(ioctl(gpio_line_fds[pin], GPIO_V2_LINE_SET_VALUES_IOCTL, &values)<0) {
+    fprintf(stderr, "GPIO %d write failure: %s\n", pin, strerror(errno));
+    exit(-1);
+  }
+  trace_end(&t0, OP_GPIO_WRITE, pin, value, NULL, 0);
+}
+
+// Give the line back to the GPIO chip, e.g. so its pin can go back to another function
+static void gpio_release(int pin) {
+  if(gpio_line_fds[pin]>0) close(gpio_line_fds[pin]);
+  gpio_line_fds[pin] = 0;
+  gpio_pending_p[pin] = false;
+}
+
+// The BCM283x's GPIO registers, mapped through /dev/gpiomem, for what the GPIO character device can't do: set a pin's function, or leave it set once the process exits. NULL if they can't be mapped, having said so, and what that means for pin.
+static volatile unsigned* gpio_regs_map(int pin, const char* consequence) {
+  static volatile unsigned* gpio_regs;
+  if(gpio_regs) return gpio_regs;
+  int fd = open(IO_GPIO_MEM, O_RDWR | O_SYNC);
+  if(fd<0) {
+    fprintf(stderr, "Can't open %s, so GPIO %d %s: %s\n", IO_GPIO_MEM, pin, consequence, strerror(errno));
+    return NULL;
+  }
+  void* p = mmap(NULL, 4096, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if(p==MAP_FAILED) {
+    fprintf(stderr, "mmap failure for %s, so GPIO %d %s: %s\n", IO_GPIO_MEM, pin, consequence, strerror(errno));
+    return NULL;
+  }
+  gpio_regs = (volatile unsigned*)p;
+  return gpio_regs;
+}
+
+static void gpio_set_function(volatile unsigned* gpio_regs, int pin, unsigned function) {
+  volatile unsigned* fsel = gpio_regs + pin/10; // GPFSELn: 3 bits per pin, 10 pins per register
+  int shift = (pin%10)*3;
+  *fsel = (*fsel & ~(7u<<shift)) | (function<<shift);
+}
+
+// Releasing a line leaves its pin a GPIO input, which the GPIO character device can't change, so the I2C pins are put back to their I2C function (ALT0) through the BCM283x's function select registers, as wiringPi did. Not when replaying, nor with GHPI_GPIO_CHIP overridden, since then the lines aren't the board's.
+static void gpio_set_alt0(int pin) {
+  const char* chip = getenv("GHPI_GPIO_CHIP");
+  if((io_backend==IO_REPLAY) || (chip && *chip)) return;
+  volatile unsigned* gpio_regs = gpio_regs_map(pin, "is left an input");
+  if(gpio_regs) gpio_set_function(gpio_regs, pin, 4); // 4 is ALT0
+}
+
+// Through the registers, as wiringPi's pinMode and digitalWrite did, since a line requested from the GPIO character device goes back to an input when the process exits. The level is set before the pin becomes an output, so there's no glitch. With GHPI_GPIO_CHIP overridden, the lines aren't the board's, so it's just io_gpio_output, which holds only until exit.
+void io_gpio_output_persistent(int pin, int value) {
+  struct timespec t0;
+  const char* chip = getenv("GHPI_GPIO_CHIP");
+  io_init();
+  if((io_backend==IO_REPLAY) || (chip && *chip)) {
+    io_gpio_output(pin, value);
+    return;
+  }
+  if((pin<0) || (pin>=IO_GPIO_REG_PINS)) {
+    fprintf(stderr, "GPIO pin %d out of range\n", pin);
+    exit(-1);
+  }
+  trace_begin(&t0);
+  gpio_release(pin); // In case this process holds the line, which would otherwise be set back to an input when it exits
+  volatile unsigned* gpio_regs = gpio_regs_map(pin, "can't be set");
+  if(!gpio_regs) exit(-1);
+  gpio_regs[(value?7:10) + pin/32] = 1u<<(pin%32); // GPSETn or GPCLRn
+  gpio_set_function(gpio_regs, pin, 1); // 1 is output
+  trace_end(&t0, OP_GPIO_OUT, pin, value, NULL, 0);
+}
+
+// Edge events. The kernel queues each edge on the line's fd, timestamped (CLOCK_MONOTONIC) when it happened. A driver waits on an epoll fd of just its own lines, so that drivers hosted together in ghpid don't take each other's events.
+void io_gpio_watch(int pin, bool pull_up, int edges, int debounce_us) {
+  struct timespec t0;
+  io_init();
+  if(io_backend==IO_REPLAY) {
+    replay_gpio(OP_GPIO_WATCH, pin, pull_up);
+    return;
+  }
+  trace_begin(&t0);
+  gpio_config(pin, GPIO_V2_LINE_FLAG_INPUT | ((edges & IO_EDGE_RISING)?GPIO_V2_LINE_FLAG_EDGE_RISING:0) | ((edges & IO_EDGE_FALLING)?GPIO_V2_LINE_FLAG_EDGE_FALLING:0)
+	      | (pull_up?GPIO_V2_LINE_FLAG_BIAS_PULL_UP:0), 0, debounce_us);
+  if(fcntl(gpio_line_fds[pin], F_SETFL, O_NONBLOCK)<0) {
+    fprintf(stderr, "GPIO %d fcntl failure: %s\n", pin, strerror(errno));
+    exit(-1);
+  }
+  trace_end(&t0, OP_GPIO_WATCH, pin, pull_up, NULL, 0);
+}
+
+// When replaying, an eventfd that's always readable, so the driver checks for the trace's next event as often as it can
+int io_gpio_event_fd(const int* pins, int n_pins) {
+  io_init();
+  if(io_backend==IO_REPLAY) {
+    int fd = eventfd(1, 0);
+    if(fd<0) {
+      fprintf(stderr, "eventfd failure: %s\n", strerror(errno));
+      exit(-1);
+    }
+    return fd;
+  }
+  int fd = epoll_create1(0);
+  if(fd<0) {
+    fprintf(stderr, "epoll_create1 failure: %s\n", strerror(errno));
+    exit(-1);
+  }
+  for(int i=0; i<n_pins; i++) {
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.u32 = pins[i];
+    if(epoll_ctl(fd, EPOLL_CTL_ADD, gpio_line_fds[pins[i]], &ev)<0) {
+      fprintf(stderr, "GPIO %d epoll_ctl failure: %s\n", pins[i], strerror(errno));
+      exit(-1);
+    }
+  }
+  return fd;
+}
+
+// The pin whose next trace entry is the earliest event, or -1 if none's next entry is an event
+static int replay_gpio_event_pin(const int* pins, int n_pins) {
+  int pin = -1;
+  long long t = 0;
+  for(int p=0; p<n_pins; p++) {
+    int i = replay_cursor[device_key(OP_GPIO_EVENT, pins[p])];
+    if((i<0) || (replay_entries[i].op!=OP_GPIO_EVENT)) continue;
+    if((pin<0) || (replay_entries[i].t<t)) {
+      pin = pins[p];
+      t = replay_entries[i].t;
+    }
+  }
+  return pin;
+}
+
+// Replayed events are timestamped when they're taken, like everything else that's replayed
+bool io_gpio_event(const int* pins, int n_pins, struct io_gpio_event* ev) {
+  if(io_backend==IO_REPLAY) {
+    int pin = replay_gpio_event_pin(pins, n_pins);
+    if(pin<0) return false;
+    ev->pin = pin;
+    ev->value = replay_next(OP_GPIO_EVENT, pin)->rc;
+    clock_gettime(CLOCK_REALTIME, &ev->rt);
+    return true;
+  }
+  int pin = -1;
+  for(int i=0; i<n_pins; i++) {
+    int p = pins[i];
+    if(!gpio_pending_p[p]) {
+      ssize_t n = read(gpio_line_fds[p], &gpio_pending[p], sizeof(gpio_pending[p]));
+      if(n<0) {
+	if(errno==EAGAIN) continue;
+	fprintf(stderr, "GPIO %d event read failure: %s\n", p, strerror(errno));
+	exit(-1);
+      }
+      gpio_pending_p[p] = true;
+    }
+    if((pin<0) || (gpio_pending[p].timestamp_ns<gpio_pending[pin].timestamp_ns)) pin = p;
+  }
+  if(pin<0) return false;
+  gpio_pending_p[pin] = false;
+  struct gpio_v2_line_event* e = &gpio_pending[pin];
+  struct timespec mono, rt, t0;
+  clock_gettime(CLOCK_MONOTONIC, &mono);
+  clock_gettime(CLOCK_REALTIME, &rt);
+  ev->pin = pin;
+  ev->value = (e->id==GPIO_V2_LINE_EVENT_RISING_EDGE)?1:0;
+  long long ns = rt.tv_sec*1000000000LL + rt.tv_nsec - (mono.tv_sec*1000000000LL + mono.tv_nsec - (long long)e->timestamp_ns);
+  ev->rt.tv_sec = ns/1000000000LL;
+  ev->rt.tv_nsec = ns%1000000000LL;
+  if(io_backend==IO_RECORD) { // Traced at the time of the edge, with the time it took to get to it as the duration
+    t0.tv_sec = e->timestamp_ns/1000000000ULL;
+    t0.tv_nsec = e->timestamp_ns%1000000000ULL;
+    trace_end(&t0, OP_GPIO_EVENT, pin, ev->value, NULL, 0);
+  }
+  return true;
+}
+
+void io_wait_fd(int fd, const struct timespec* ts) {
+  io_init();
+  if(io_backend==IO_REPLAY) return;
+  struct pollfd pfd;
+  pfd.fd = fd;
+  pfd.events = POLLIN;
+  ppoll(&pfd, 1, ts, NULL);
+}
+
+long long io_now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec*1000000000LL + ts.tv_nsec;
+}
+
+void io_spin_until(long long ns) {
+  if(io_backend==IO_REPLAY) return;
+  while(io_now_ns()<ns);
+}
+
+void io_sleep_until(long long ns) {
+  io_init();
+  if(io_backend==IO_REPLAY) return;
+  struct timespec ts;
+  ts.tv_sec = ns/1000000000LL;
+  ts.tv_nsec = ns%1000000000LL;
+  while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL)==EINTR);
+}
+
+void io_nanosleep(const struct timespec* ts) {
+  io_init();
+  if(io_backend==IO_REPLAY) return;
+  nanosleep(ts, NULL);
+}
@@ -0,0 +1,74 @@
+#include <stdbool.h>
+#include <time.h>
+#include <linux/i2c.h>
+
+// Thin I2C/GPIO layer that all the drivers and utilities go through, instead of wiringPi or raw ioctls, so the acquisition code can be run, profiled, and regression-tested off the Pi. The backend is selected by the GHPI_IO environment variable:
+//   unset, or "linux": /dev/i2c-1 and /dev/gpiochip0
+//   "record:FILE": same, but also log every transaction, with its data and timing, to FILE
+//   "replay:FILE": no hardware; feed the transactions in FILE back to the driver, at full speed (io_nanosleep doesn't sleep)
+// The GPIO chip can be overridden by the GHPI_GPIO_CHIP environment variable, e.g. to a gpio-sim chip, to exercise edge events (see io_gpio_watch) against lines driven from sysfs rather than the board.
+// Trace files are plain text, one transaction per line; see io_trace_write. Lines starting with # are comments, so synthetic traces can be written by hand or by script.
+
+#define GHPI_I2C_BUS "/dev/i2c-1"
+#define GHPI_GPIO_CHIP "/dev/gpiochip0" // Line offsets are BCM pin numbers. Overridden by the GHPI_GPIO_CHIP environment variable.
+#define IO_I2C_DEVICES_MAX 16
+#define IO_GPIO_PINS 64
+#define IO_I2C_MSGS_MAX 4 // Per io_i2c_rdwr call
+#define IO_I2C_MSG_LEN_MAX 256 // bytes. Longest message that's recorded in a trace.
+#define IO_I2C_SDA 2 // BCM pins of /dev/i2c-1, for io_i2c_recover
+#define IO_I2C_SCL 3
+#define IO_I2C_RECOVER_AFTER 2 // Consecutive transfers failing as if the bus were stuck, before recovering it
+#define IO_I2C_RECOVER_CLOCKS 16
+#define IO_I2C_RECOVER_HALF_PERIOD 5000 // ns. Of the recovery clock, i.e. 100kHz, the bus's own speed.
+#define IO_I2C_RECOVER_WINDOW 5000 // us. Held while recovering, so no other process starts a transfer meanwhile; far longer than the recovery takes.
+#define IO_GPIO_MEM "/dev/gpiomem" // For putting the I2C pins back to their I2C function after a recovery, and for io_gpio_output_persistent
+
+// I2C. Handles are small ints, returned by io_i2c_open, or -1 with errno set on failure.
+int io_i2c_open(int addr);
+int io_i2c_rdwr(int h, struct i2c_msg* msgs, int nmsgs); // Like ioctl(I2C_RDWR), except that each msg's addr is filled in from the handle. Returns nmsgs on success, or negative on failure.
+// Same semantics as the wiringPiI2C functions they replace: words are in SMBus (little endian) byte order, and -1 is returned on failure.
+int io_i2c_read_byte(int h);
+int io_i2c_write_byte(int h, int val);
+int io_i2c_write_reg8(int h, int reg, int val);
+int io_i2c_read_reg16(int h, int reg);
+int io_i2c_write_reg16(int h, int reg, int val);
+// Several reads in one I2C_RDWR, i.e. one syscall, and on the bus, repeated starts instead of a stop and start between them, and no separate transaction to set each register. Both return 0 on success, or -1.
+int io_i2c_read_regs(int h, int reg, unsigned char* buf, int len); // Register write, then a read of len bytes, for chips that auto-increment the register, e.g. to read all of a sensor's channels at once
+int io_i2c_read_reg16s(int h, const int* regs, int* vals, int n); // Register write and two-byte read for each of n (up to IO_I2C_MSGS_MAX/2) registers, for chips that don't auto-increment. vals are as from io_i2c_read_reg16.
+// Totals of the calling thread's io_i2c_rdwr calls, i.e. I2C_RDWR ioctls, so their cost can be attributed to whatever made them; see sensor_step
+struct io_i2c_stats {
+  unsigned long long transfers; // io_i2c_rdwr calls
+  unsigned long long bytes; // On the bus, counting each message's address byte, but not the start and stop conditions
+  unsigned long long ns; // In the ioctls, i.e. bus time plus the syscalls'. 0 when replaying.
+};
+void io_i2c_get_stats(struct io_i2c_stats* s);
+// Sharing the bus with other processes (see gh_bus.h). Not when replaying, since there's no bus, and the replay doesn't wait anyway.
+void io_i2c_set_class(int h, int cls); // enum bus_class of the handle's transfers. BUS_NORMAL by default.
+void io_i2c_reserve(int h, long long start_ns, long long end_ns); // Reserve the bus for the calling thread from start_ns to end_ns (as io_now_ns), replacing its previous reservation; end_ns<=start_ns releases it. For a BUS_REALTIME handle, i.e. one whose transfers need exact timing, and which can say ahead of time when they'll be.
+// Clear a stuck bus, i.e. a device holding SDA low because it lost track of where it was in a transfer, e.g. after a glitch, or its host was interrupted: clock SCL until it lets go, then issue a stop, and put the pins back to I2C. io_i2c_rdwr does this itself after IO_I2C_RECOVER_AFTER consecutive failures (except when replaying, since a trace's failures don't say why), and retries the transfer once. Returns whether SDA was released; false too if the pins couldn't be driven as GPIOs, which unlike other GPIO failures isn't fatal, so that the caller can just skip the read.
+bool io_i2c_recover();
+
+// GPIO. Pins are BCM numbers. Setting a pin's mode requests the line from the GPIO chip if it isn't already held; failures are fatal, except during io_i2c_recover.
+void io_gpio_input(int pin, bool pull_up);
+void io_gpio_output(int pin, int value); // Drives value from the moment the line becomes an output, so there's no glitch
+void io_gpio_output_persistent(int pin, int value); // Like io_gpio_output, but the pin keeps driving value after the process exits, e.g. for the power enable utilities
+int io_gpio_read(int pin);
+void io_gpio_write(int pin, int value);
+// Edge events: each change of a watched line's level is queued by the kernel, timestamped when it happened, so a daemon can sleep until one does, and still log it at the right time. Debouncing is also done by the kernel, which reports an edge once the line has held its new level for debounce_us, so the timestamp is that much after the edge itself.
+struct io_gpio_event {
+  int pin;
+  int value; // Level after the edge
+  struct timespec rt; // CLOCK_REALTIME of the edge, as reported
+};
+enum io_edges {IO_EDGE_RISING=1, IO_EDGE_FALLING=2, IO_EDGE_BOTH=3};
+void io_gpio_watch(int pin, bool pull_up, int edges, int debounce_us); // Like io_gpio_input, plus detection of the given enum io_edges. io_gpio_read still works on the pin.
+int io_gpio_event_fd(const int* pins, int n_pins); // A new fd that's readable while any of the watched pins has events queued; for poll or epoll. Always readable when replaying.
+bool io_gpio_event(const int* pins, int n_pins, struct io_gpio_event* ev); // Take the earliest queued event of the pins, without blocking. Returns false if there's none.
+void io_wait_fd(int fd, const struct timespec* ts); // Like io_nanosleep, but returns early once fd is readable
+
+void io_nanosleep(const struct timespec* ts); // For waiting on the hardware. No-op when replaying.
+// For bit-banging, whose delays are microseconds, far under io_nanosleep's wakeup latency (tens of us, plus a syscall each). Deadlines rather than durations, so the time the GPIO ioctls themselves take counts toward each delay, rather than being added to it.
+long long io_now_ns(); // CLOCK_MONOTONIC. No syscall, since it's in the vDSO.
+void io_spin_until(long long ns); // Busy-wait until io_now_ns() reaches ns. No-op when replaying.
+void io_sleep_until(long long ns); // Sleep until io_now_ns() reaches ns, e.g. for sampling on a fixed grid, where relative sleeps would let each one's lateness push back all the rest. No-op when replaying.
+bool io_replay_p();
@@ -0,0 +1,201 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "gh_live.h"
+
+#define LIVE_INIT_WAIT 1000 // ms. How long to wait for another process to finish creating and initializing a segment.
+
+// Every field that's shared between processes is accessed with the __atomic builtins, all on 32-bit values, so nothing needs libatomic on the Pi.
+#define LOAD(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define STORE(x, v) __atomic_store_n(&(x), (v), __ATOMIC_RELAXED)
+
+const char* live_shm_name() {
+  const char* name = getenv("GHPI_LIVE_SHM");
+  return name?name:GHPI_LIVE_SHM_NAME;
+}
+
+// The process that creates the segment (O_EXCL guarantees there's just one) initializes it, and the others wait until it's done, i.e. until magic is set.
+void* shm_segment_map(const char* name, size_t size, unsigned magic, unsigned version, const char* what, bool writer_p) {
+  bool creator_p = false;
+  int fd = -1;
+  if(writer_p) {
+    fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0644); // Readable by readers running as other users, e.g. poll_stream as websocketd's
+    if(fd>=0) {
+      creator_p = true;
+      if(ftruncate(fd, size)<0) {
+	fprintf(stderr, "ftruncate failure for shared memory %s: %s\n", name, strerror(errno));
+	exit(-1);
+      }
+    } else if(errno==EEXIST) fd = shm_open(name, O_RDWR, 0);
+  } else fd = shm_open(name, O_RDONLY, 0);
+  if(fd<0) {
+    if(!writer_p && (errno==ENOENT)) return NULL;
+    fprintf(stderr, "shm_open failure for %s: %s\n", name, strerror(errno));
+    exit(-1);
+  }
+  struct stat st;
+  for(int ms=0; !creator_p; ms++) { // Not yet truncated to size, if the creator's only just opened it
+    if(fstat(fd, &st)<0) {
+      fprintf(stderr, "fstat failure for shared memory %s: %s\n", name, strerror(errno));
+      exit(-1);
+    }
+    if(st.st_size>=(off_t)size) break;
+    if(ms==LIVE_INIT_WAIT) {
+      if(!writer_p) {
+	close(fd);
+	return NULL;
+      }
+      fprintf(stderr, "Shared memory %s is too small; remove it, and restart its writers\n", name);
+      exit(-1);
+    }
+    usleep(1000);
+  }
+  unsigned* header = (unsigned*)mmap(NULL, size, writer_p?(PROT_READ | PROT_WRITE):PROT_READ, MAP_SHARED, fd, 0); // magic, then version
+  close(fd); // The mapping stays
+  if(header==MAP_FAILED) {
+    fprintf(stderr, "mmap failure for shared memory %s: %s\n", name, strerror(errno));
+    exit(-1);
+  }
+  if(creator_p) { // Already zeroed by ftruncate
+    header[1] = version;
+    __atomic_store_n(&header[0], magic, __ATOMIC_RELEASE);
+    return header;
+  }
+  for(int ms=0; __atomic_load_n(&header[0], __ATOMIC_ACQUIRE)!=magic; ms++) {
+    if(ms==LIVE_INIT_WAIT) break;
+    usleep(1000);
+  }
+  if((__atomic_load_n(&header[0], __ATOMIC_ACQUIRE)!=magic) || (header[1]!=version)) {
+    if(!writer_p) {
+      munmap(header, size);
+      return NULL;
+    }
+    fprintf(stderr, "Shared memory %s isn't a version %d %s segment; remove it, and restart its writers\n", name, version, what);
+    exit(-1);
+  }
+  return header;
+}
+
+struct live_segment* live_map(const char* name, bool writer_p) { // Slots are free while zeroed
+  return (struct live_segment*)shm_segment_map(name, sizeof(struct live_segment), GHPI_LIVE_MAGIC, GHPI_LIVE_VERSION, "live values", writer_p);
+}
+
+void live_unmap(struct live_segment* seg) {
+  munmap(seg, sizeof(struct live_segment));
+}
+
+static void slot_begin(struct live_slot* s) {
+  STORE(s->seq, LOAD(s->seq)+1);
+  __atomic_thread_fence(__ATOMIC_RELEASE); // So no reader sees any of the new values without also seeing seq odd
+}
+
+static void slot_end(struct live_slot* s) {
+  __atomic_store_n(&s->seq, LOAD(s->seq)+1, __ATOMIC_RELEASE);
+}
+
+int live_find(struct live_segment* seg, const char* channel) {
+  for(int i=0; i<GHPI_LIVE_SLOTS_MAX; i++) {
+    struct live_slot* s = &seg->slots[i];
+    unsigned state = __atomic_load_n(&s->state, __ATOMIC_ACQUIRE); // The channel name is written before the state becomes ready
+    if(state==LIVE_SLOT_FREE) return -1; // Slots are claimed in order
+    if((state==LIVE_SLOT_READY) && !strncmp(s->channel, channel, GHPI_LIVE_CHANNEL_LEN)) return i;
+  }
+  return -1;
+}
+
+// Reuses the channel's slot if it already has one (e.g. the daemon was restarted), else takes the first free one
+int live_claim(struct live_segment* seg, const char* channel) {
+  if(strlen(channel)>=GHPI_LIVE_CHANNEL_LEN) {
+    fprintf(stderr, "Live channel name %s too long; max is %d characters\n", channel, GHPI_LIVE_CHANNEL_LEN-1);
+    exit(-1);
+  }
+  int i = live_find(seg, channel);
+  for(i=(i<0)?0:i; i<GHPI_LIVE_SLOTS_MAX; i++) {
+    struct live_slot* s = &seg->slots[i];
+    unsigned state = LIVE_SLOT_FREE;
+    if(__atomic_compare_exchange_n(&s->state, &state, LIVE_SLOT_CLAIMING, false, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+      strcpy(s->channel, channel);
+      __atomic_store_n(&s->state, LIVE_SLOT_READY, __ATOMIC_RELEASE);
+    } else {
+      while(state==LIVE_SLOT_CLAIMING) { // By another process, which might be claiming the same channel
+	usleep(1000);
+	state = __atomic_load_n(&s->state, __ATOMIC_ACQUIRE);
+      }
+      if(strncmp(s->channel, channel, GHPI_LIVE_CHANNEL_LEN)) continue;
+    }
+    // Ours now. If the previous writer died in the middle of an update, seq is still odd, so even it up. The previous writer's reading isn't live, until this one publishes.
+    unsigned seq = LOAD(s->seq);
+    if(seq&1) __atomic_store_n(&s->seq, seq+1, __ATOMIC_RELEASE);
+    slot_begin(s);
+    STORE(s->pid, (int)getpid());
+    STORE(s->flags, 0);
+    slot_end(s);
+    return i;
+  }
+  fprintf(stderr, "No free live slot for %s; max is %d\n", channel, GHPI_LIVE_SLOTS_MAX);
+  return -1;
+}
+
+void live_publish(struct live_segment* seg, int slot, int val, bool null_p, struct timespec* rt) {
+  if(slot<0) return;
+  struct live_slot* s = &seg->slots[slot];
+  slot_begin(s);
+  STORE(s->flags, LIVE_ALIVE | (null_p?LIVE_NULL:0));
+  STORE(s->val, null_p?0:val);
+  STORE(s->acq_sec, (int)rt->tv_sec);
+  STORE(s->acq_nsec, (int)rt->tv_nsec);
+  STORE(s->beat_sec, (int)rt->tv_sec);
+  slot_end(s);
+  __atomic_add_fetch(&seg->generation, 1, __ATOMIC_RELEASE);
+}
+
+// The reading hasn't changed, but it's still current. Doesn't bump the generation, since there's nothing new to read.
+void live_beat(struct live_segment* seg, int slot, struct timespec* rt) {
+  if(slot<0) return;
+  struct live_slot* s = &seg->slots[slot];
+  if(LOAD(s->beat_sec)==(int)rt->tv_sec) return; // Staleness is only checked to the second, so don't churn seq for sensors that step many times per second
+  slot_begin(s);
+  STORE(s->beat_sec, (int)rt->tv_sec);
+  slot_end(s);
+}
+
+void live_release(struct live_segment* seg, int slot) {
+  if(slot<0) return;
+  struct live_slot* s = &seg->slots[slot];
+  slot_begin(s);
+  STORE(s->flags, LOAD(s->flags) & ~LIVE_ALIVE);
+  slot_end(s);
+  __atomic_add_fetch(&seg->generation, 1, __ATOMIC_RELEASE);
+}
+
+bool live_read(struct live_segment* seg, int slot, struct live_reading* r) {
+  if(slot<0) return false;
+  struct live_slot* s = &seg->slots[slot];
+  int flags = 0;
+  for(int tries=0; tries<GHPI_LIVE_READ_RETRIES; tries++) {
+    unsigned seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+    if(seq&1) continue; // Being updated
+    flags = LOAD(s->flags);
+    r->val = LOAD(s->val);
+    r->acq.tv_sec = LOAD(s->acq_sec);
+    r->acq.tv_nsec = LOAD(s->acq_nsec);
+    r->beat_sec = LOAD(s->beat_sec);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE); // So the copies are done before seq is checked again
+    if(LOAD(s->seq)!=seq) continue;
+    r->null_p = flags & LIVE_NULL;
+    if(!(flags & LIVE_ALIVE)) return false;
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (now.tv_sec - r->beat_sec) < GHPI_LIVE_STALE;
+  }
+  return false;
+}
+
+unsigned live_generation(struct live_segment* seg) {
+  return __atomic_load_n(&seg->generation, __ATOMIC_ACQUIRE);
+}
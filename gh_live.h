@@ -0,0 +1,57 @@
+#include <stdbool.h>
+#include <time.h>
+#include <stddef.h>
+
+// Latest reading of each channel, in a shared memory segment, so that live readers (e.g. poll_stream) can get it as soon as it's acquired, rather than once it's committed, and without touching the DB. The sensor daemons (or ghpid) publish each record there as they insert it (see insert_record), from the sampling thread, so it's independent of the writer thread, group commit, and WAL checkpoints.
+// Each slot is a seqlock with exactly one writer, i.e. the process hosting the sensor: the writer makes seq odd, updates the slot, then makes seq even again, and a reader copies the slot, and retries if seq was odd or changed meanwhile. So readers never block the writer, or each other, and take no locks.
+// Channels are named "<log table>.<column>", e.g. "INA260_logs.Vrms". Slots are claimed by name, so a restarted daemon gets its old slots back.
+
+#define GHPI_LIVE_SHM_NAME "/ghpi-live" // I.e. /dev/shm/ghpi-live. Overridden by the GHPI_LIVE_SHM environment variable, e.g. for testing.
+#define GHPI_LIVE_MAGIC 0x6c706867 // "ghpl"
+#define GHPI_LIVE_VERSION 1
+#define GHPI_LIVE_SLOTS_MAX 64
+#define GHPI_LIVE_CHANNEL_LEN 32 // Including the terminating null
+#define GHPI_LIVE_STALE 30 // seconds. A slot that its writer hasn't touched for this long is dead, e.g. because the daemon was killed, or the sensor stopped responding.
+#define GHPI_LIVE_READ_RETRIES 1000 // Before giving up on a slot, in case its writer died in the middle of updating it
+
+enum live_slot_state {LIVE_SLOT_FREE, LIVE_SLOT_CLAIMING, LIVE_SLOT_READY};
+enum live_flags {LIVE_ALIVE=1, LIVE_NULL=2};
+
+struct live_slot { // One cache line, so writers of different slots don't contend
+  unsigned state; // enum live_slot_state. Only goes forward.
+  unsigned seq; // Odd while the writer is updating the slot
+  char channel[GHPI_LIVE_CHANNEL_LEN]; // Set once, while the slot is being claimed
+  int pid; // Writer
+  int flags; // enum live_flags. LIVE_ALIVE is set by each publish, and cleared when the writer exits cleanly, or a new writer claims the slot.
+  int val;
+  int acq_sec, acq_nsec; // CLOCK_REALTIME of the acquisition
+  int beat_sec; // CLOCK_REALTIME of the writer's last step for the sensor, whether or not the reading changed
+} __attribute__((aligned(64)));
+
+struct live_segment {
+  unsigned magic, version;
+  unsigned generation; // Bumped by every publish, so a reader can cheaply check whether anything changed
+  struct live_slot slots[GHPI_LIVE_SLOTS_MAX] __attribute__((aligned(64)));
+};
+
+struct live_reading { // A reader's copy of a slot
+  bool null_p;
+  int val;
+  struct timespec acq;
+  int beat_sec;
+};
+
+// Map the shared memory segment name, of size bytes, which starts with its magic and version (each unsigned). A writer creates it, zeroed, if it doesn't exist, and exits if it exists but isn't of this magic and version. Returns NULL for a reader if it doesn't exist (yet), or isn't. what names the kind of segment, for error messages. Also used by gh_metrics.
+void* shm_segment_map(const char* name, size_t size, unsigned magic, unsigned version, const char* what, bool writer_p);
+const char* live_shm_name();
+struct live_segment* live_map(const char* name, bool writer_p); // A writer creates the segment if it doesn't exist. Returns NULL for a reader if it doesn't exist (yet).
+void live_unmap(struct live_segment* seg);
+// Writer side
+int live_claim(struct live_segment* seg, const char* channel); // Returns the slot, or -1 if they're all taken
+void live_publish(struct live_segment* seg, int slot, int val, bool null_p, struct timespec* rt);
+void live_beat(struct live_segment* seg, int slot, struct timespec* rt);
+void live_release(struct live_segment* seg, int slot);
+// Reader side
+int live_find(struct live_segment* seg, const char* channel); // Returns the slot, or -1 if no writer has claimed the channel
+bool live_read(struct live_segment* seg, int slot, struct live_reading* r); // Returns whether the slot's writer is alive, in which case r holds its latest reading
+unsigned live_generation(struct live_segment* seg);
@@ -0,0 +1,280 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include "gh_live.h"
+#include "gh_metrics.h"
+
+#define METRICS_READ_RETRIES 1000 // Before giving up on a slot, in case its exporter died in the middle of updating it
+#define METRICS_WORDS (sizeof(struct metrics_values)/sizeof(unsigned))
+
+#define LOAD(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define STORE(x, v) __atomic_store_n(&(x), (v), __ATOMIC_RELAXED)
+
+const enum metrics_kind metrics_counter_kinds[METRICS_COUNTERS] = {METRICS_SENSOR, METRICS_SENSOR, METRICS_SENSOR, METRICS_SENSOR, METRICS_SENSOR, METRICS_SENSOR, METRICS_SENSOR, METRICS_SENSOR, METRICS_SENSOR, METRICS_SENSOR, METRICS_SENSOR, METRICS_DAEMON, METRICS_DAEMON};
+const enum metrics_kind metrics_hist_kinds[METRICS_HISTS] = {METRICS_SENSOR, METRICS_SENSOR, METRICS_DAEMON, METRICS_SENSOR, METRICS_SENSOR};
+const char* metrics_counter_names[METRICS_COUNTERS] = {"ghpi_samples_total", "ghpi_idle_heartbeats_total", "ghpi_timestamp_blurs_total", "ghpi_timestamp_collisions_total", "ghpi_crc_errors_total", "ghpi_dropped_samples_total", "ghpi_glitches_total", "ghpi_missed_samples_total", "ghpi_i2c_transfers_total", "ghpi_i2c_bytes_total", "ghpi_i2c_microseconds_total", "ghpi_db_busy_retries_total", "ghpi_db_commits_total"};
+const char* metrics_counter_help[METRICS_COUNTERS] = {"Records logged", "Idle_heartbeats rows written", "Timestamps blurred forward to keep keys unique", "Log table primary key collisions, i.e. another writer", "Readings dropped for a bad CRC", "Records dropped because the writer queue was full", "Readings dropped as garbled", "Samples produced by the sensor but never read", "I2C_RDWR ioctls, i.e. syscalls, made by sensor steps", "Bytes put on the I2C bus by sensor steps", "Time in I2C_RDWR ioctls during sensor steps", "Sleeps in the DB busy handler", "Group commits"};
+const char* metrics_hist_names[METRICS_HISTS] = {"ghpi_step_seconds", "ghpi_insert_seconds", "ghpi_commit_seconds", "ghpi_read_seconds", "ghpi_capture_jitter_seconds"};
+const char* metrics_hist_help[METRICS_HISTS] = {"Sensor step time, excluding logging", "Time from insert_record to the row being inserted", "Group commit time", "Time to read one sample off the sensor", "Each capture's worst sample lateness behind its sampling grid"};
+
+// Exporter state. Each registered metrics_local is emptied into its entry's totals, which are then copied to its slot of the segment.
+struct metrics_entry {
+  struct metrics_local* m;
+  int slot;
+  struct metrics_slot totals; // Not shared; the slot's header is filled in for metrics_print_prometheus
+};
+struct metrics_entry metrics_entries[GHPI_METRICS_SLOTS_MAX];
+int n_metrics_entries;
+struct metrics_segment* metrics_seg;
+const char* metrics_daemon;
+char* metrics_file_name; // NULL if the text file's disabled
+struct timespec ts_metrics_export;
+
+int metrics_bucket(unsigned us) {
+  if(us<METRICS_SUB) return us;
+  int e = 31 - __builtin_clz(us); // us is in [2^e, 2^(e+1))
+  if(e>METRICS_EXP_MAX) return METRICS_BUCKETS-1;
+  return (e-METRICS_SUB_BITS+1)*METRICS_SUB + ((us >> (e-METRICS_SUB_BITS)) & (METRICS_SUB-1));
+}
+
+unsigned metrics_bucket_low(int bucket) {
+  if(bucket<METRICS_SUB) return bucket;
+  int e = bucket/METRICS_SUB + METRICS_SUB_BITS - 1;
+  return (unsigned)(METRICS_SUB + bucket%METRICS_SUB) << (e-METRICS_SUB_BITS);
+}
+
+unsigned metrics_percentile(struct metrics_values* v, int hist, double q) {
+  unsigned long long count = 0, seen = 0;
+  for(int b=0; b<METRICS_BUCKETS; b++) count += v->buckets[hist][b];
+  if(!count) return 0;
+  unsigned long long rank = (unsigned long long)(q*count);
+  if(rank>=count) rank = count-1;
+  for(int b=0; b<METRICS_BUCKETS; b++) {
+    seen += v->buckets[hist][b];
+    if(seen>rank) return (b<METRICS_BUCKETS-1)?metrics_bucket_low(b+1)-1:metrics_bucket_low(b);
+  }
+  return 0;
+}
+
+void metrics_count(struct metrics_local* m, int counter, unsigned n) {
+  __atomic_add_fetch(&m->counters[counter], n, __ATOMIC_RELAXED);
+}
+
+void metrics_hist_add(struct metrics_local* m, int hist, long long ns) {
+  unsigned us = (ns<=0)?0:((ns/1000 > 0xffffffffLL)?0xffffffffU:(unsigned)(ns/1000));
+  __atomic_add_fetch(&m->buckets[hist][metrics_bucket(us)], 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&m->sum_us[hist], us, __ATOMIC_RELAXED); // Only wraps if a period's values add up to over an hour
+}
+
+static const char* env_or(const char* var, const char* dflt) {
+  const char* value = getenv(var);
+  return value?value:dflt;
+}
+
+struct metrics_segment* metrics_map(bool writer_p) {
+  return (struct metrics_segment*)shm_segment_map(env_or("GHPI_METRICS_SHM", GHPI_METRICS_SHM_NAME), sizeof(struct metrics_segment), GHPI_METRICS_MAGIC, GHPI_METRICS_VERSION, "metrics", writer_p);
+}
+
+static void slot_begin(struct metrics_slot* s) {
+  STORE(s->seq, LOAD(s->seq)+1);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void slot_end(struct metrics_slot* s) {
+  __atomic_store_n(&s->seq, LOAD(s->seq)+1, __ATOMIC_RELEASE);
+}
+
+// Like live_claim: reuses the name's slot if it already has one (e.g. the daemon was restarted), else takes the first free one
+static int metrics_claim(const char* name, int kind) {
+  for(int i=0; i<GHPI_METRICS_SLOTS_MAX; i++) {
+    struct metrics_slot* s = &metrics_seg->slots[i];
+    unsigned state = LIVE_SLOT_FREE;
+    if(__atomic_compare_exchange_n(&s->state, &state, LIVE_SLOT_CLAIMING, false, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+      strcpy(s->name, name);
+      __atomic_store_n(&s->state, LIVE_SLOT_READY, __ATOMIC_RELEASE);
+    } else {
+      while(state==LIVE_SLOT_CLAIMING) {
+	usleep(1000);
+	state = __atomic_load_n(&s->state, __ATOMIC_ACQUIRE);
+      }
+      if(strncmp(s->name, name, GHPI_METRICS_NAME_LEN)) continue;
+    }
+    unsigned seq = LOAD(s->seq);
+    if(seq&1) __atomic_store_n(&s->seq, seq+1, __ATOMIC_RELEASE);
+    slot_begin(s);
+    for(size_t j=0; j<sizeof(s->daemon); j++) STORE(s->daemon[j], (j<strlen(metrics_daemon))?metrics_daemon[j]:'\0');
+    STORE(s->pid, (int)getpid());
+    STORE(s->kind, kind);
+    STORE(s->export_sec, 0); // Until the first export
+    slot_end(s);
+    return i;
+  }
+  fprintf(stderr, "No free metrics slot for %s; max is %d\n", name, GHPI_METRICS_SLOTS_MAX);
+  return -1;
+}
+
+bool metrics_read(struct metrics_segment* seg, int slot, struct metrics_slot* copy) {
+  struct metrics_slot* s = &seg->slots[slot];
+  if(__atomic_load_n(&s->state, __ATOMIC_ACQUIRE)!=LIVE_SLOT_READY) return false;
+  for(int tries=0; tries<METRICS_READ_RETRIES; tries++) {
+    unsigned seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+    if(seq&1) continue;
+    for(size_t j=0; j<sizeof(s->name); j++) copy->name[j] = LOAD(s->name[j]);
+    for(size_t j=0; j<sizeof(s->daemon); j++) copy->daemon[j] = LOAD(s->daemon[j]);
+    copy->pid = LOAD(s->pid);
+    copy->kind = LOAD(s->kind);
+    copy->export_sec = LOAD(s->export_sec);
+    unsigned *from = (unsigned*)&s->v, *to = (unsigned*)&copy->v;
+    for(size_t j=0; j<METRICS_WORDS; j++) to[j] = LOAD(from[j]);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if(LOAD(s->seq)!=seq) continue;
+    copy->name[GHPI_METRICS_NAME_LEN-1] = copy->daemon[GHPI_METRICS_NAME_LEN-1] = '\0';
+    return copy->export_sec && ((time(NULL) - copy->export_sec) < GHPI_METRICS_STALE);
+  }
+  return false;
+}
+
+static void print_labels(FILE* f, struct metrics_slot* s) {
+  fprintf(f, "daemon=\"%s\"", s->daemon);
+  if(s->kind==METRICS_SENSOR) fprintf(f, ",sensor=\"%s\"", s->name);
+}
+
+void metrics_print_prometheus(FILE* f, struct metrics_slot** slots, int n) {
+  for(int c=0; c<METRICS_COUNTERS; c++) {
+    fprintf(f, "# HELP %s %s\n# TYPE %s counter\n", metrics_counter_names[c], metrics_counter_help[c], metrics_counter_names[c]);
+    for(int i=0; i<n; i++) {
+      if(slots[i]->kind!=metrics_counter_kinds[c]) continue;
+      fprintf(f, "%s{", metrics_counter_names[c]);
+      print_labels(f, slots[i]);
+      fprintf(f, "} %llu\n", slots[i]->v.counters[c]);
+    }
+  }
+  for(int h=0; h<METRICS_HISTS; h++) {
+    const char* name = metrics_hist_names[h];
+    fprintf(f, "# HELP %s %s\n# TYPE %s histogram\n", name, metrics_hist_help[h], name);
+    for(int i=0; i<n; i++) {
+      struct metrics_slot* s = slots[i];
+      if(s->kind!=metrics_hist_kinds[h]) continue;
+      unsigned long long count = 0;
+      for(int b=0; b<METRICS_BUCKETS; b++) {
+	count += s->v.buckets[h][b];
+	if((b<METRICS_SUB-1) || (b==METRICS_BUCKETS-1) || ((b+1)%METRICS_SUB)) continue; // Only at powers of 2
+	fprintf(f, "%s_bucket{", name);
+	print_labels(f, s);
+	fprintf(f, ",le=\"%.9g\"} %llu\n", metrics_bucket_low(b+1)/1e6, count);
+      }
+      fprintf(f, "%s_bucket{", name);
+      print_labels(f, s);
+      fprintf(f, ",le=\"+Inf\"} %llu\n%s_sum{", count, name);
+      print_labels(f, s);
+      fprintf(f, "} %.6f\n%s_count{", s->v.sum_us[h]/1e6, name);
+      print_labels(f, s);
+      fprintf(f, "} %llu\n", count);
+    }
+  }
+}
+
+static void metrics_write_file() {
+  char* tmp_name = (char*)malloc(strlen(metrics_file_name)+5);
+  sprintf(tmp_name, "%s.tmp", metrics_file_name);
+  FILE* f = fopen(tmp_name, "w");
+  if(!f) {
+    fprintf(stderr, "Can't write metrics file %s: %s; no longer writing it\n", tmp_name, strerror(errno));
+    free(tmp_name);
+    free(metrics_file_name);
+    metrics_file_name = NULL;
+    return;
+  }
+  struct metrics_slot* slots[GHPI_METRICS_SLOTS_MAX];
+  for(int i=0; i<n_metrics_entries; i++) slots[i] = &metrics_entries[i].totals;
+  metrics_print_prometheus(f, slots, n_metrics_entries);
+  bool ok_p = !ferror(f);
+  if(fclose(f) || !ok_p || rename(tmp_name, metrics_file_name))
+    fprintf(stderr, "Failure writing metrics file %s: %s\n", metrics_file_name, strerror(errno));
+  free(tmp_name);
+}
+
+static void metrics_export() {
+  struct timespec rt;
+  clock_gettime(CLOCK_REALTIME, &rt);
+  for(int i=0; i<n_metrics_entries; i++) {
+    struct metrics_entry* e = &metrics_entries[i];
+    struct metrics_values* v = &e->totals.v;
+    for(int c=0; c<METRICS_COUNTERS; c++) v->counters[c] += __atomic_exchange_n(&e->m->counters[c], 0, __ATOMIC_RELAXED);
+    for(int h=0; h<METRICS_HISTS; h++) {
+      for(int b=0; b<METRICS_BUCKETS; b++)
+	if(LOAD(e->m->buckets[h][b])) v->buckets[h][b] += __atomic_exchange_n(&e->m->buckets[h][b], 0, __ATOMIC_RELAXED);
+      v->sum_us[h] += __atomic_exchange_n(&e->m->sum_us[h], 0, __ATOMIC_RELAXED);
+    }
+    if(e->slot<0) continue;
+    struct metrics_slot* s = &metrics_seg->slots[e->slot];
+    slot_begin(s);
+    unsigned *from = (unsigned*)v, *to = (unsigned*)&s->v;
+    for(size_t j=0; j<METRICS_WORDS; j++) STORE(to[j], from[j]);
+    STORE(s->export_sec, (int)rt.tv_sec);
+    slot_end(s);
+  }
+  if(metrics_file_name) metrics_write_file();
+  clock_gettime(CLOCK_MONOTONIC, &ts_metrics_export);
+}
+
+static void metrics_exit() { // Export what's left, and mark the slots dead
+  metrics_export();
+  for(int i=0; i<n_metrics_entries; i++) {
+    if(metrics_entries[i].slot<0) continue;
+    struct metrics_slot* s = &metrics_seg->slots[metrics_entries[i].slot];
+    slot_begin(s);
+    STORE(s->export_sec, 0);
+    slot_end(s);
+  }
+}
+
+void metrics_export_enable(const char* daemon, struct metrics_local* m) {
+  if(metrics_seg) return;
+  const char* slash = strrchr(daemon, '/');
+  metrics_daemon = slash?slash+1:daemon;
+  if(strlen(metrics_daemon)>=GHPI_METRICS_NAME_LEN) {
+    fprintf(stderr, "Daemon name %s too long for metrics; max is %d characters\n", metrics_daemon, GHPI_METRICS_NAME_LEN-1);
+    exit(-1);
+  }
+  metrics_seg = metrics_map(true);
+  const char* dir = env_or("GHPI_METRICS_DIR", GHPI_METRICS_DIR);
+  if(*dir) {
+    metrics_file_name = (char*)malloc(strlen(dir)+strlen(metrics_daemon)+7);
+    sprintf(metrics_file_name, "%s/%s.prom", dir, metrics_daemon);
+  }
+  metrics_register(m, metrics_daemon, METRICS_DAEMON);
+  clock_gettime(CLOCK_MONOTONIC, &ts_metrics_export);
+  atexit(&metrics_exit);
+}
+
+void metrics_register(struct metrics_local* m, const char* name, int kind) {
+  if(!metrics_seg) return;
+  for(int i=0; i<n_metrics_entries; i++)
+    if(metrics_entries[i].m==m) return;
+  if(strlen(name)>=GHPI_METRICS_NAME_LEN) {
+    fprintf(stderr, "Metrics name %s too long; max is %d characters\n", name, GHPI_METRICS_NAME_LEN-1);
+    exit(-1);
+  }
+  if(n_metrics_entries==GHPI_METRICS_SLOTS_MAX) {
+    fprintf(stderr, "Too many metrics for %s; max is %d\n", metrics_daemon, GHPI_METRICS_SLOTS_MAX);
+    return;
+  }
+  struct metrics_entry* e = &metrics_entries[n_metrics_entries++];
+  e->m = m;
+  e->slot = metrics_claim(name, kind);
+  strcpy(e->totals.name, name);
+  strcpy(e->totals.daemon, metrics_daemon);
+  e->totals.pid = getpid();
+  e->totals.kind = kind;
+}
+
+void metrics_export_poll() {
+  if(!metrics_seg) return;
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  if(now.tv_sec - ts_metrics_export.tv_sec >= GHPI_METRICS_PERIOD) metrics_export();
+}
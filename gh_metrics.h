@@ -0,0 +1,90 @@
+#include <stdio.h>
+#include <stdbool.h>
+
+// Performance metrics of each daemon: histograms of how long sampling, inserting, and committing take, and counters of the things that used to show up only as stderr chatter (busy retries, timestamp collisions, CRC errors, dropped samples), plus record and idle heartbeat counts, so where loop time goes can be seen without attaching a debugger.
+// They're kept per sensor, plus per daemon for the DB connection's, in a struct metrics_local that any thread updates with relaxed atomic adds, which cost next to nothing. Every GHPI_METRICS_PERIOD seconds, whichever thread owns the DB connection (see batch_poll) empties them into running totals, and exports those:
+//  - to a shared memory segment, with a seqlock slot per sensor or daemon, laid out like the live values segment (see gh_live.h), so readers never block the daemon; ghpi_metrics reads it
+//  - to <GHPI_METRICS_DIR>/<daemon>.prom, in the Prometheus text format, e.g. for node_exporter's textfile collector. Written to a temporary file, then renamed, so a scraper never sees half of it.
+// Histograms are HDR-style: log-linear buckets of microseconds, 8 per power of 2, so a percentile read from them is within 12.5%, from 1us up to 2^27us (about 134s; anything longer lands in the last bucket). The Prometheus export only gives the bucket boundaries at powers of 2, to keep the file small; the shared memory has them all.
+
+#define GHPI_METRICS_SHM_NAME "/ghpi-metrics" // Overridden by the GHPI_METRICS_SHM environment variable
+#define GHPI_METRICS_DIR "/var/lib/prometheus/node-exporter" // Debian's node_exporter textfile directory. Overridden by the GHPI_METRICS_DIR environment variable; set it empty to skip the text files.
+#define GHPI_METRICS_MAGIC 0x6d706867 // "ghpm"
+#define GHPI_METRICS_VERSION 4
+#define GHPI_METRICS_SLOTS_MAX 32
+#define GHPI_METRICS_NAME_LEN 32 // Including the terminating null
+#define GHPI_METRICS_PERIOD 10 // seconds between exports
+#define GHPI_METRICS_STALE (3*GHPI_METRICS_PERIOD) // seconds. A slot that hasn't been exported for this long is dead.
+#define METRICS_SUB_BITS 3 // Buckets per power of 2 are 2^METRICS_SUB_BITS
+#define METRICS_SUB (1<<METRICS_SUB_BITS)
+#define METRICS_EXP_MAX 26 // Last power of 2 with its own buckets
+#define METRICS_BUCKETS ((METRICS_EXP_MAX-METRICS_SUB_BITS+2)*METRICS_SUB) // Values below METRICS_SUB have a bucket each, then METRICS_SUB for each power of 2 from METRICS_SUB_BITS to METRICS_EXP_MAX
+
+enum metrics_kind {METRICS_DAEMON, METRICS_SENSOR};
+enum metrics_counter { // Each belongs to one kind; see metrics_counter_kinds
+  METRIC_SAMPLES, // Records passed to insert_record
+  METRIC_IDLE_HEARTBEATS, // Idle_heartbeats rows written
+  METRIC_BLURS, // Timestamps blurred forward by alloc_timestamp
+  METRIC_COLLISIONS, // Primary key collisions in the log table, i.e. another writer
+  METRIC_CRC_ERRORS, // Readings dropped by the driver for a bad CRC
+  METRIC_DROPPED, // Records dropped because the writer thread's queue was full
+  METRIC_GLITCHES, // Readings dropped as garbled, e.g. MAX11201B's, when DOUT isn't back high after the 25th clock
+  METRIC_MISSED, // Samples the sensor produced that were never read, e.g. MAX11201B conversions overwritten by the next one
+  METRIC_I2C_TRANSFERS, // I2C_RDWR ioctls made by the sensor's steps (see io_i2c_get_stats), i.e. syscalls
+  METRIC_I2C_BYTES, // Bytes those put on the bus
+  METRIC_I2C_US, // Time in those ioctls
+  METRIC_BUSY_RETRIES, // Calls to the busy handler, i.e. sleeps of GHPI_SQL_BUSY_WAIT
+  METRIC_COMMITS, // Group commits
+  METRICS_COUNTERS
+};
+enum metrics_hist {
+  METRIC_STEP, // A sensor's step, minus the time spent in insert_record and update_idle_heartbeat, i.e. the I2C transactions, bit-banging, and their waits
+  METRIC_INSERT, // From insert_record to the row being inserted, including the writer thread's queue and the time held for the group commit
+  METRIC_COMMIT, // A group commit's flush, from BEGIN to COMMIT
+  METRIC_READ, // Reading one sample off the sensor, for those that time it, e.g. MAX11201B's bit-banged 25 clocks
+  METRIC_JITTER, // For sensors that sample on a fixed grid, how far each sample was read behind its grid time, e.g. INA260's V and I bursts
+  METRICS_HISTS
+};
+
+struct metrics_local { // Zeroed by each export
+  unsigned counters[METRICS_COUNTERS];
+  unsigned buckets[METRICS_HISTS][METRICS_BUCKETS];
+  unsigned sum_us[METRICS_HISTS];
+};
+
+struct metrics_values { // Totals since the daemon started
+  unsigned long long counters[METRICS_COUNTERS];
+  unsigned long long buckets[METRICS_HISTS][METRICS_BUCKETS];
+  unsigned long long sum_us[METRICS_HISTS];
+};
+
+struct metrics_slot {
+  unsigned state; // enum live_slot_state, and claimed the same way
+  unsigned seq; // Odd while the exporter is updating the slot
+  char name[GHPI_METRICS_NAME_LEN]; // Sensor type, or the daemon's name. Set once, while the slot is being claimed.
+  char daemon[GHPI_METRICS_NAME_LEN];
+  int pid, kind;
+  int export_sec; // CLOCK_REALTIME of the latest export. 0 once the daemon has exited cleanly.
+  struct metrics_values v; // Copied a 32-bit word at a time, so nothing needs libatomic on the Pi
+} __attribute__((aligned(64)));
+
+struct metrics_segment {
+  unsigned magic, version;
+  struct metrics_slot slots[GHPI_METRICS_SLOTS_MAX] __attribute__((aligned(64)));
+};
+
+extern const enum metrics_kind metrics_counter_kinds[], metrics_hist_kinds[];
+
+int metrics_bucket(unsigned us);
+unsigned metrics_bucket_low(int bucket); // Smallest value in the bucket, in us
+unsigned metrics_percentile(struct metrics_values* v, int hist, double q); // In us, rounded up to the end of its bucket. 0 if there's nothing in the histogram.
+void metrics_count(struct metrics_local* m, int counter, unsigned n);
+void metrics_hist_add(struct metrics_local* m, int hist, long long ns);
+// Exporting side
+void metrics_export_enable(const char* daemon, struct metrics_local* m); // daemon is e.g. argv[0]; only the part after the last / is used. m is the daemon-wide metrics, which are exported under that name.
+void metrics_register(struct metrics_local* m, const char* name, int kind); // Export m as name. Must be called after metrics_export_enable.
+void metrics_export_poll(); // Export, if it's been GHPI_METRICS_PERIOD seconds since the last time
+// Reading side
+struct metrics_segment* metrics_map(bool writer_p); // Returns NULL for a reader if the segment doesn't exist (yet)
+bool metrics_read(struct metrics_segment* seg, int slot, struct metrics_slot* copy); // Returns whether the slot's daemon is alive, in which case copy holds its latest export
+void metrics_print_prometheus(FILE* f, struct metrics_slot** slots, int n); // Grouped by metric, as the format requires
@@ -0,0 +1,220 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <dirent.h>
+#include "gh_partition.h"
+
+#define PARTITION_BUSY_TIMEOUT 5000 // ms
+
+const struct partition_table partition_tables[] = {
+  {"DS18B20_logs", "sec", ""}, {"MAX11201B_logs", "sec", ""}, {"Furnace_logs", "sec", ""}, {"BME680_logs", "sec", ""}, {"SHT31_logs", "sec", ""}, {"TSL2591_logs", "sec", ""}, {"VEML6075_logs", "sec", ""}, {"INA260_logs", "sec", ""}, {"INA260_harmonics", "sec", ""}, {"INA260_events", "sec", ""},
+  {"Archive_blocks", "sec_first", ""}, // Small enough to scan
+  {"Checkpoint_logs", "sec", ""},
+  {"Rollups_1m", "sec", "channel_ID IN (SELECT channel_ID FROM main.Rollup_channels) AND "} // The other rollups are small enough to stay hot
+};
+const int n_partition_tables = sizeof(partition_tables)/sizeof(partition_tables[0]);
+
+static void check_conn(sqlite3* conn, int rc, const char* msg) {
+  if(rc!=SQLITE_OK && rc!=SQLITE_ROW && rc!=SQLITE_DONE) {
+    fprintf(stderr, "%s: %s\n", msg, sqlite3_errmsg(conn));
+    exit(rc);
+  }
+}
+
+void partition_month(long long sec, int* year, int* month, long long* sec_start, long long* sec_end) {
+  time_t t = sec;
+  struct tm tm;
+  gmtime_r(&t, &tm);
+  *year = tm.tm_year + 1900;
+  *month = tm.tm_mon + 1;
+  memset(&tm, 0, sizeof(tm));
+  tm.tm_year = *year - 1900;
+  tm.tm_mon = *month - 1;
+  tm.tm_mday = 1;
+  *sec_start = timegm(&tm);
+  tm.tm_mon++; // timegm normalizes December+1
+  *sec_end = timegm(&tm);
+}
+
+// dir, and base, i.e. the DB's file name minus any .db, of db_file_name
+static void split_name(const char* db_file_name, char** dir, char** base) {
+  const char* slash = strrchr(db_file_name, '/');
+  *dir = slash?sqlite3_mprintf("%.*s", (int)(slash-db_file_name), db_file_name):sqlite3_mprintf(".");
+  if(slash && (slash==db_file_name)) {
+    sqlite3_free(*dir);
+    *dir = sqlite3_mprintf("/");
+  }
+  const char* name = slash?slash+1:db_file_name;
+  size_t len = strlen(name);
+  if((len>3) && !strcmp(name+len-3, ".db")) len -= 3;
+  *base = sqlite3_mprintf("%.*s", (int)len, name);
+}
+
+char* partition_file_name(const char* db_file_name, int year, int month) {
+  char *dir, *base;
+  split_name(db_file_name, &dir, &base);
+  char* name = sqlite3_mprintf("%s/%s-%04d-%02d.db", dir, base, year, month);
+  sqlite3_free(dir);
+  sqlite3_free(base);
+  return name;
+}
+
+static int compare_partitions(const void* a, const void* b) {
+  const struct partition *pa = (const struct partition*)a, *pb = (const struct partition*)b;
+  return (pa->sec_start>pb->sec_start) - (pa->sec_start<pb->sec_start);
+}
+
+int partition_list(const char* db_file_name, long long sec_from, long long sec_to, struct partition** parts) {
+  char *dir, *base;
+  split_name(db_file_name, &dir, &base);
+  int n = 0, size = 0;
+  *parts = NULL;
+  DIR* d = opendir(dir);
+  if(!d) {
+    fprintf(stderr, "Can't read directory %s\n", dir);
+    exit(-1);
+  }
+  struct dirent* e;
+  size_t base_len = strlen(base);
+  while((e = readdir(d))) {
+    int year, month, end = 0;
+    if(strncmp(e->d_name, base, base_len)) continue;
+    if((sscanf(e->d_name+base_len, "-%4d-%2d.db%n", &year, &month, &end)!=2) || !end || e->d_name[base_len+end] || (month<1) || (month>12)) continue;
+    struct partition p;
+    p.year = year;
+    p.month = month;
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    tm.tm_year = year - 1900;
+    tm.tm_mon = month - 1;
+    tm.tm_mday = 1;
+    p.sec_start = timegm(&tm);
+    tm.tm_mon++;
+    p.sec_end = timegm(&tm);
+    if((p.sec_end<=sec_from) || (p.sec_start>=sec_to)) continue;
+    p.file_name = sqlite3_mprintf("%s/%s", dir, e->d_name);
+    if(n==size) {
+      size = size?size*2:16;
+      *parts = (struct partition*)realloc(*parts, size*sizeof(struct partition));
+      if(!*parts) {
+	fprintf(stderr, "Out of memory in partition_list\n");
+	exit(-1);
+      }
+    }
+    (*parts)[n++] = p;
+  }
+  closedir(d);
+  sqlite3_free(dir);
+  sqlite3_free(base);
+  if(n) qsort(*parts, n, sizeof(struct partition), compare_partitions);
+  return n;
+}
+
+void partition_list_free(struct partition* parts, int n) {
+  for(int i=0; i<n; i++) sqlite3_free(parts[i].file_name);
+  free(parts);
+}
+
+bool partition_has_table_p(sqlite3* conn, const char* schema, const char* table) {
+  sqlite3_stmt* pStmt;
+  char* zSql = sqlite3_mprintf("SELECT 1 FROM \"%w\".sqlite_master WHERE type='table' AND name=?", schema);
+  int rc = sqlite3_prepare_v3(conn, zSql, -1, 0, &pStmt, NULL);
+  sqlite3_free(zSql);
+  check_conn(conn, rc, "sqlite3_prepare failure in partition_has_table_p");
+  sqlite3_bind_text(pStmt, 1, table, -1, SQLITE_STATIC);
+  rc = sqlite3_step(pStmt);
+  check_conn(conn, rc, "sqlite3_step failure in partition_has_table_p");
+  sqlite3_finalize(pStmt);
+  return rc==SQLITE_ROW;
+}
+
+static void run_sql(sqlite3* conn, char** zLog, const char* zSql) { // And append it to the log of what was run
+  int rc = sqlite3_exec(conn, zSql, NULL, NULL, NULL);
+  check_conn(conn, rc, "sqlite3_exec failure in partition_attach");
+  char* tmp = sqlite3_mprintf("%s%s;\n", *zLog, zSql);
+  sqlite3_free(*zLog);
+  *zLog = tmp;
+}
+
+char* partition_attach(sqlite3* conn, const char* db_file_name, long long sec_from, long long sec_to, long long* sec_next) {
+  struct partition* parts;
+  int n_all = partition_list(db_file_name, sec_from, sec_to, &parts);
+  if(n_all>sqlite3_limit(conn, SQLITE_LIMIT_ATTACHED, -1)) sqlite3_limit(conn, SQLITE_LIMIT_ATTACHED, n_all); // Capped at SQLITE_MAX_ATTACHED; see ghpi-sqlite-build
+  int limit = sqlite3_limit(conn, SQLITE_LIMIT_ATTACHED, -1);
+  int n = (n_all>limit)?limit:n_all;
+  *sec_next = (n<n_all)?parts[n].sec_start:sec_to;
+  char* zLog = sqlite3_mprintf("");
+  char* schemas[n?n:1];
+  for(int i=0; i<n; i++) {
+    schemas[i] = sqlite3_mprintf(PARTITION_SCHEMA_PREFIX "%04d_%02d", parts[i].year, parts[i].month);
+    char* zSql = sqlite3_mprintf("ATTACH %Q AS %s", parts[i].file_name, schemas[i]);
+    run_sql(conn, &zLog, zSql);
+    sqlite3_free(zSql);
+  }
+  for(int t=0; t<n_partition_tables; t++) {
+    const char* table = partition_tables[t].name;
+    if(!partition_has_table_p(conn, "main", table)) continue;
+    char* zSql = sqlite3_mprintf("CREATE TEMP VIEW \"%w\" AS", table);
+    for(int i=0; i<n; i++) {
+      if(!partition_has_table_p(conn, schemas[i], table)) continue; // E.g. a partition from before the table was added
+      char* tmp = sqlite3_mprintf("%s SELECT * FROM %s.\"%w\" UNION ALL", zSql, schemas[i], table);
+      sqlite3_free(zSql);
+      zSql = tmp;
+    }
+    char* tmp = sqlite3_mprintf("%s SELECT * FROM main.\"%w\"", zSql, table);
+    sqlite3_free(zSql);
+    run_sql(conn, &zLog, tmp);
+    sqlite3_free(tmp);
+  }
+  // The hot DB's views only ever see its own tables, so shadow them with TEMP copies, which see the TEMP views
+  sqlite3_stmt* pStmt;
+  int rc = sqlite3_prepare_v3(conn, "SELECT sql FROM main.sqlite_master WHERE type='view' ORDER BY rowid", -1, 0, &pStmt, NULL);
+  check_conn(conn, rc, "sqlite3_prepare failure in partition_attach");
+  while((rc = sqlite3_step(pStmt))==SQLITE_ROW) {
+    const char* sql = (const char*)sqlite3_column_text(pStmt, 0);
+    if(sqlite3_strnicmp(sql, "CREATE VIEW ", 12)) continue;
+    char* zSql = sqlite3_mprintf("CREATE TEMP VIEW %s", sql+12);
+    run_sql(conn, &zLog, zSql);
+    sqlite3_free(zSql);
+  }
+  check_conn(conn, rc, "sqlite3_step failure in partition_attach");
+  sqlite3_finalize(pStmt);
+  for(int i=0; i<n; i++) sqlite3_free(schemas[i]);
+  partition_list_free(parts, n_all);
+  return zLog;
+}
+
+void partition_detach(sqlite3* conn) {
+  char* zSql = sqlite3_mprintf("");
+  sqlite3_stmt* pStmt;
+  int rc = sqlite3_prepare_v3(conn, "SELECT 'DROP VIEW temp.\"' || replace(name, '\"', '\"\"') || '\";' FROM temp.sqlite_master WHERE type='view'"
+			      " UNION ALL SELECT 'DETACH ' || name || ';' FROM pragma_database_list WHERE name GLOB '" PARTITION_SCHEMA_PREFIX "*'", -1, 0, &pStmt, NULL);
+  check_conn(conn, rc, "sqlite3_prepare failure in partition_detach");
+  while((rc = sqlite3_step(pStmt))==SQLITE_ROW) { // Gathered first, since they can't run while this is
+    char* tmp = sqlite3_mprintf("%s%s", zSql, sqlite3_column_text(pStmt, 0));
+    sqlite3_free(zSql);
+    zSql = tmp;
+  }
+  check_conn(conn, rc, "sqlite3_step failure in partition_detach");
+  sqlite3_finalize(pStmt);
+  rc = sqlite3_exec(conn, zSql, NULL, NULL, NULL);
+  check_conn(conn, rc, "sqlite3_exec failure in partition_detach");
+  sqlite3_free(zSql);
+}
+
+bool partition_last_before(const char* db_file_name, const char* table, bool ds18b20_p, int sensor_ID, const char** cols, int n_cols, long long sec, struct archive_row* r) {
+  struct partition* parts;
+  int n = partition_list(db_file_name, 0, sec, &parts);
+  bool found_p = false;
+  for(int i=n-1; (i>=0) && !found_p; i--) {
+    sqlite3* conn;
+    int rc = sqlite3_open_v2(parts[i].file_name, &conn, SQLITE_OPEN_READONLY, NULL);
+    check_conn(conn, rc, "sqlite3_open_v2 failure in partition_last_before");
+    sqlite3_busy_timeout(conn, PARTITION_BUSY_TIMEOUT);
+    if(partition_has_table_p(conn, "main", table)) found_p = archive_last_before(conn, table, ds18b20_p, sensor_ID, cols, n_cols, sec, r);
+    sqlite3_close(conn);
+  }
+  partition_list_free(parts, n);
+  return found_p;
+}
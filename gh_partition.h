@@ -0,0 +1,33 @@
+#include <stdbool.h>
+#include "sqlite3.h"
+#include "gh_archive.h"
+
+// Monthly partitions. The daemons always log to the DB they're given, i.e. the hot DB, and ghpi_partition moves each month out of it once it's over, into a file of its own next to it: <hot DB, minus any .db>-YYYY-MM.db (e.g. ghpi-2026-09.db), with the same tables and indexes, for the rows of that month (UTC). So the hot DB, its WAL checkpoints, backups, and index depth stay the size of a month or two, however long the greenhouse has been logging, and old months can be dropped or moved elsewhere whole.
+// Readers that don't go through partition_attach (or ghpi_export, or ghpi_rollup) see only the hot DB, which is all the dashboard needs.
+
+#define PARTITION_SCHEMA_PREFIX "part_" // Attached as part_YYYY_MM
+
+struct partition_table {
+  const char* name;
+  const char* sec_column; // Which month a row belongs to
+  const char* zWhere; // Prepended to a range condition on sec_column, so that it can use the primary key. "" if sec_column leads it.
+};
+extern const struct partition_table partition_tables[];
+extern const int n_partition_tables;
+
+struct partition {
+  int year, month; // month is 1 to 12
+  long long sec_start, sec_end; // UTC month
+  char* file_name;
+};
+
+void partition_month(long long sec, int* year, int* month, long long* sec_start, long long* sec_end); // The UTC month containing sec
+char* partition_file_name(const char* db_file_name, int year, int month); // Free with sqlite3_free
+int partition_list(const char* db_file_name, long long sec_from, long long sec_to, struct partition** parts); // The existing partitions overlapping the range, oldest first. Returns how many. Free them with partition_list_free.
+void partition_list_free(struct partition* parts, int n);
+bool partition_has_table_p(sqlite3* conn, const char* schema, const char* table); // E.g. a partition made before the table was added won't have it
+// ATTACH the partitions overlapping the range to conn, then shadow each partitioned table with a TEMP view that's the UNION ALL of it across the partitions and the hot DB, and each view of the hot DB with a TEMP copy, which therefore reads the TEMP views; so existing queries, like the *_formatted views, see the whole range. For reading only, since the TEMP views hide the tables. Returns the SQL it ran, e.g. for the sqlite3 shell; free it with sqlite3_free.
+// At most SQLITE_LIMIT_ATTACHED partitions can be attached at once (raised to SQLITE_MAX_ATTACHED, i.e. over 10 years of months), so it attaches only the oldest that fit, and sets *sec_next to where the first one left out starts, or to sec_to if none were. The views still include the whole hot DB, so a caller that goes on to the rest of the range, via partition_detach and another partition_attach from *sec_next, should limit its queries to sec_from to *sec_next.
+char* partition_attach(sqlite3* conn, const char* db_file_name, long long sec_from, long long sec_to, long long* sec_next);
+void partition_detach(sqlite3* conn); // Undo partition_attach
+bool partition_last_before(const char* db_file_name, const char* table, bool ds18b20_p, int sensor_ID, const char** cols, int n_cols, long long sec, struct archive_row* r); // Like archive_last_before, but searching the partitions before sec, newest first
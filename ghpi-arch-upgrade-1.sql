@@ -0,0 +1,96 @@
+-- Upgrade a DB created from the original ghpi-arch.sql to the current one, which has Latest_values: sqlite3 ghpi.db < ghpi-arch-upgrade-1.sql
+-- Stop ghpid first. New DBs are created from ghpi-arch.sql directly and don't need this.
+BEGIN;
+CREATE TABLE Latest_values(channel TEXT PRIMARY KEY, sec INT NOT NULL, cs INT NOT NULL, val) WITHOUT ROWID;
+
+CREATE TRIGGER DS18B20_logs_latest AFTER INSERT ON DS18B20_logs BEGIN
+INSERT INTO Latest_values VALUES ('sec', NEW.sec, NEW.cs, NEW.sec)
+ON CONFLICT(channel) DO UPDATE SET sec=excluded.sec, cs=excluded.cs, val=excluded.val WHERE (excluded.sec, excluded.cs) > (sec, cs);
+END;
+CREATE TRIGGER MAX11201B_logs_latest AFTER INSERT ON MAX11201B_logs BEGIN
+INSERT INTO Latest_values VALUES ('sec', NEW.sec, NEW.cs, NEW.sec), ('tflux', NEW.sec, NEW.cs, NEW.flux)
+ON CONFLICT(channel) DO UPDATE SET sec=excluded.sec, cs=excluded.cs, val=excluded.val WHERE (excluded.sec, excluded.cs) > (sec, cs);
+END;
+CREATE TRIGGER Furnace_logs_latest AFTER INSERT ON Furnace_logs BEGIN
+INSERT INTO Latest_values VALUES ('sec', NEW.sec, NEW.cs, NEW.sec), ('furnace_ctrl', NEW.sec, NEW.cs, (NEW.q1=0 and NEW.q2=0)), ('furnace_power', NEW.sec, NEW.cs, (NEW.q1=0 or NEW.q2=0))
+ON CONFLICT(channel) DO UPDATE SET sec=excluded.sec, cs=excluded.cs, val=excluded.val WHERE (excluded.sec, excluded.cs) > (sec, cs);
+END;
+CREATE TRIGGER BME680_logs_latest AFTER INSERT ON BME680_logs BEGIN
+INSERT INTO Latest_values VALUES ('sec', NEW.sec, NEW.cs, NEW.sec), ('tmp_ctrl_module', NEW.sec, NEW.cs, NEW.temp), ('plocal', NEW.sec, NEW.cs, NEW.pres), ('hum_in', NEW.sec, NEW.cs, NEW.hum), ('gas', NEW.sec, NEW.cs, NEW.gas)
+ON CONFLICT(channel) DO UPDATE SET sec=excluded.sec, cs=excluded.cs, val=excluded.val WHERE (excluded.sec, excluded.cs) > (sec, cs);
+END;
+CREATE TRIGGER SHT31_logs_latest AFTER INSERT ON SHT31_logs BEGIN
+INSERT INTO Latest_values VALUES ('sec', NEW.sec, NEW.cs, NEW.sec), ('tmp_outdoor_module', NEW.sec, NEW.cs, NEW.temp), ('hum_out', NEW.sec, NEW.cs, NEW.hum)
+ON CONFLICT(channel) DO UPDATE SET sec=excluded.sec, cs=excluded.cs, val=excluded.val WHERE (excluded.sec, excluded.cs) > (sec, cs);
+END;
+CREATE TRIGGER TSL2591_logs_latest AFTER INSERT ON TSL2591_logs BEGIN
+INSERT INTO Latest_values VALUES ('sec', NEW.sec, NEW.cs, NEW.sec), ('vis_ir', NEW.sec, NEW.cs, NEW.total), ('ired', NEW.sec, NEW.cs, NEW.ired)
+ON CONFLICT(channel) DO UPDATE SET sec=excluded.sec, cs=excluded.cs, val=excluded.val WHERE (excluded.sec, excluded.cs) > (sec, cs);
+END;
+CREATE TRIGGER VEML6075_logs_latest AFTER INSERT ON VEML6075_logs BEGIN
+INSERT INTO Latest_values VALUES ('sec', NEW.sec, NEW.cs, NEW.sec), ('uva', NEW.sec, NEW.cs, NEW.uva), ('uvb', NEW.sec, NEW.cs, NEW.uvb)
+ON CONFLICT(channel) DO UPDATE SET sec=excluded.sec, cs=excluded.cs, val=excluded.val WHERE (excluded.sec, excluded.cs) > (sec, cs);
+END;
+CREATE TRIGGER INA260_logs_latest AFTER INSERT ON INA260_logs BEGIN
+INSERT INTO Latest_values VALUES ('sec', NEW.sec, NEW.cs, NEW.sec), ('Vrms', NEW.sec, NEW.cs, NEW.Vrms), ('Irms', NEW.sec, NEW.cs, NEW.Irms), ('Pmean', NEW.sec, NEW.cs, NEW.Pmean)
+ON CONFLICT(channel) DO UPDATE SET sec=excluded.sec, cs=excluded.cs, val=excluded.val WHERE (excluded.sec, excluded.cs) > (sec, cs);
+END;
+CREATE TRIGGER Config_latest_insert AFTER INSERT ON Config WHEN NEW.var IN ('elevation', 'flux_area', 'exch_flow_rate') BEGIN
+INSERT INTO Latest_values VALUES (NEW.var, 0, 0, NEW.val) ON CONFLICT(channel) DO UPDATE SET val=excluded.val;
+END;
+CREATE TRIGGER Config_latest_update AFTER UPDATE OF val ON Config WHEN NEW.var IN ('elevation', 'flux_area', 'exch_flow_rate') BEGIN
+INSERT INTO Latest_values VALUES (NEW.var, 0, 0, NEW.val) ON CONFLICT(channel) DO UPDATE SET val=excluded.val;
+END;
+
+-- Populate from the existing logs
+INSERT INTO Latest_values SELECT 'sec', IFNULL(max(sec),0), 0, IFNULL(max(sec),0) FROM Last_log_times;
+UPDATE Latest_values SET cs=IFNULL((SELECT max(cs) FROM Last_log_times WHERE sec=Latest_values.sec),0) WHERE channel='sec';
+INSERT INTO Latest_values SELECT var, 0, 0, val FROM Config WHERE var IN ('elevation', 'flux_area', 'exch_flow_rate');
+INSERT INTO Latest_values SELECT 'tflux', sec, cs, flux FROM (SELECT * FROM MAX11201B_logs ORDER BY sec DESC, cs DESC LIMIT 1);
+INSERT INTO Latest_values SELECT 'furnace_ctrl', sec, cs, (q1=0 and q2=0) FROM (SELECT * FROM Furnace_logs ORDER BY sec DESC, cs DESC LIMIT 1);
+INSERT INTO Latest_values SELECT 'furnace_power', sec, cs, (q1=0 or q2=0) FROM (SELECT * FROM Furnace_logs ORDER BY sec DESC, cs DESC LIMIT 1);
+INSERT INTO Latest_values SELECT 'tmp_ctrl_module', sec, cs, temp FROM (SELECT * FROM BME680_logs ORDER BY sec DESC, cs DESC LIMIT 1);
+INSERT INTO Latest_values SELECT 'plocal', sec, cs, pres FROM (SELECT * FROM BME680_logs ORDER BY sec DESC, cs DESC LIMIT 1);
+INSERT INTO Latest_values SELECT 'hum_in', sec, cs, hum FROM (SELECT * FROM BME680_logs ORDER BY sec DESC, cs DESC LIMIT 1);
+INSERT INTO Latest_values SELECT 'gas', sec, cs, gas FROM (SELECT * FROM BME680_logs ORDER BY sec DESC, cs DESC LIMIT 1);
+INSERT INTO Latest_values SELECT 'tmp_outdoor_module', sec, cs, temp FROM (SELECT * FROM SHT31_logs ORDER BY sec DESC, cs DESC LIMIT 1);
+INSERT INTO Latest_values SELECT 'hum_out', sec, cs, hum FROM (SELECT * FROM SHT31_logs ORDER BY sec DESC, cs DESC LIMIT 1);
+INSERT INTO Latest_values SELECT 'vis_ir', sec, cs, total FROM (SELECT * FROM TSL2591_logs ORDER BY sec DESC, cs DESC LIMIT 1);
+INSERT INTO Latest_values SELECT 'ired', sec, cs, ired FROM (SELECT * FROM TSL2591_logs ORDER BY sec DESC, cs DESC LIMIT 1);
+INSERT INTO Latest_values SELECT 'uva', sec, cs, uva FROM (SELECT * FROM VEML6075_logs ORDER BY sec DESC, cs DESC LIMIT 1);
+INSERT INTO Latest_values SELECT 'uvb', sec, cs, uvb FROM (SELECT * FROM VEML6075_logs ORDER BY sec DESC, cs DESC LIMIT 1);
+INSERT INTO Latest_values SELECT 'Vrms', sec, cs, Vrms FROM (SELECT * FROM INA260_logs ORDER BY sec DESC, cs DESC LIMIT 1);
+INSERT INTO Latest_values SELECT 'Irms', sec, cs, Irms FROM (SELECT * FROM INA260_logs ORDER BY sec DESC, cs DESC LIMIT 1);
+INSERT INTO Latest_values SELECT 'Pmean', sec, cs, Pmean FROM (SELECT * FROM INA260_logs ORDER BY sec DESC, cs DESC LIMIT 1);
+
+DROP VIEW Last_logs;
+DROP VIEW Last_log_time;
+-- Formerly the max over Last_log_times, which is kept as a cross-check, since it's computed from the logs themselves
+CREATE VIEW Last_log_time AS
+SELECT sec, cs FROM Latest_values WHERE channel='sec';
+
+-- This excludes DS18B20_logs, since getting the last temperature for each DS18B20 would have to result in a variable-arity view. Sqlite doesn't support that (or even ordinary PIVOT).
+-- So pivot by hand. Formerly a join of a LIMIT 1 subquery per log table, and the Config lookups; the columns are the same.
+CREATE VIEW Last_logs AS SELECT
+max(CASE channel WHEN 'sec' THEN val END) AS sec,
+max(CASE channel WHEN 'elevation' THEN val END) AS elevation,
+max(CASE channel WHEN 'flux_area' THEN val END) AS flux_area,
+max(CASE channel WHEN 'exch_flow_rate' THEN val END) AS exch_flow_rate,
+max(CASE channel WHEN 'tflux' THEN val END) AS tflux,
+max(CASE channel WHEN 'furnace_ctrl' THEN val END) AS furnace_ctrl,
+max(CASE channel WHEN 'furnace_power' THEN val END) AS furnace_power,
+max(CASE channel WHEN 'tmp_ctrl_module' THEN val END) AS tmp_ctrl_module,
+max(CASE channel WHEN 'plocal' THEN val END) AS plocal,
+max(CASE channel WHEN 'hum_in' THEN val END) AS hum_in,
+max(CASE channel WHEN 'gas' THEN val END) AS gas,
+max(CASE channel WHEN 'tmp_outdoor_module' THEN val END) AS tmp_outdoor_module,
+max(CASE channel WHEN 'hum_out' THEN val END) AS hum_out,
+max(CASE channel WHEN 'vis_ir' THEN val END) AS vis_ir,
+max(CASE channel WHEN 'ired' THEN val END) AS ired,
+max(CASE channel WHEN 'uva' THEN val END) AS uva,
+max(CASE channel WHEN 'uvb' THEN val END) AS uvb,
+max(CASE channel WHEN 'Vrms' THEN val END) AS Vrms,
+max(CASE channel WHEN 'Irms' THEN val END) AS Irms,
+max(CASE channel WHEN 'Pmean' THEN val END) AS Pmean
+FROM Latest_values;
+COMMIT;
@@ -0,0 +1,10 @@
+-- Upgrade a DB from ghpi-arch-upgrade-1.sql to the current ghpi-arch.sql, which has Table_versions and the per-sensor DS18B20 index: sqlite3 ghpi.db < ghpi-arch-upgrade-2.sql
+-- Stop ghpid and poll_stream first. Building the index takes a while on a multi-year DB.
+BEGIN;
+CREATE TABLE Table_versions(table_name TEXT PRIMARY KEY, version INT NOT NULL) WITHOUT ROWID;
+INSERT INTO Table_versions VALUES ('DS18B20_IDs', 0);
+CREATE TRIGGER DS18B20_IDs_insert_version AFTER INSERT ON DS18B20_IDs BEGIN UPDATE Table_versions SET version=version+1 WHERE table_name='DS18B20_IDs'; END;
+CREATE TRIGGER DS18B20_IDs_update_version AFTER UPDATE ON DS18B20_IDs BEGIN UPDATE Table_versions SET version=version+1 WHERE table_name='DS18B20_IDs'; END;
+CREATE TRIGGER DS18B20_IDs_delete_version AFTER DELETE ON DS18B20_IDs BEGIN UPDATE Table_versions SET version=version+1 WHERE table_name='DS18B20_IDs'; END;
+CREATE INDEX DS18B20_logs_by_sensor ON DS18B20_logs(sensor_ID, sec, cs, temp);
+COMMIT;
@@ -0,0 +1,9 @@
+-- Upgrade a DB from ghpi-arch-upgrade-2.sql to the current ghpi-arch.sql, which has the rollup tables: sqlite3 ghpi.db < ghpi-arch-upgrade-3.sql
+-- Then start ghpi_rollup, which rolls up the whole history on its first pass. That takes a while on a multi-year DB, but it commits a day at a time, so the daemons and poll_stream needn't be stopped.
+BEGIN;
+CREATE TABLE Rollup_channels(channel_ID INTEGER PRIMARY KEY, name TEXT UNIQUE NOT NULL, log_table TEXT NOT NULL, column_name TEXT NOT NULL, sensor_ID INT, wm INT NOT NULL DEFAULT 0);
+CREATE TABLE Rollups_1m(channel_ID INT, sec INT, n INT NOT NULL, covered INT NOT NULL, mean REAL, min INT, max INT, first INT, last INT, PRIMARY KEY (channel_ID, sec)) WITHOUT ROWID;
+CREATE TABLE Rollups_1h(channel_ID INT, sec INT, n INT NOT NULL, covered INT NOT NULL, mean REAL, min INT, max INT, first INT, last INT, PRIMARY KEY (channel_ID, sec)) WITHOUT ROWID;
+CREATE TABLE Rollups_1d(channel_ID INT, sec INT, n INT NOT NULL, covered INT NOT NULL, mean REAL, min INT, max INT, first INT, last INT, PRIMARY KEY (channel_ID, sec)) WITHOUT ROWID;
+CREATE VIEW Rollup_channels_labeled AS SELECT channel_ID, CASE WHEN Rollup_channels.sensor_ID IS NULL THEN name ELSE label END AS label FROM Rollup_channels LEFT JOIN DS18B20_IDs ON Rollup_channels.sensor_ID = DS18B20_IDs.sensor_ID;
+COMMIT;
@@ -0,0 +1,6 @@
+-- Upgrade a DB from ghpi-arch-upgrade-3.sql to the current ghpi-arch.sql, which has the archive: sqlite3 ghpi.db < ghpi-arch-upgrade-4.sql
+-- Nothing is archived until ghpi_archive is run.
+BEGIN;
+CREATE TABLE Archive_blocks(log_table TEXT NOT NULL, sensor_ID INT, sec_first INT NOT NULL, sec_last INT NOT NULL, n_rows INT NOT NULL, columns TEXT NOT NULL, data BLOB NOT NULL);
+CREATE UNIQUE INDEX Archive_blocks_by_time ON Archive_blocks(log_table, sensor_ID, sec_first);
+COMMIT;
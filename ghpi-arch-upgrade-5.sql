@@ -0,0 +1,6 @@
+-- Upgrade a DB from ghpi-arch-upgrade-4.sql to the current ghpi-arch.sql, which logs WAL checkpoints: sqlite3 ghpi.db < ghpi-arch-upgrade-5.sql
+-- Once the daemons are rebuilt, they no longer checkpoint, so run ghpi_checkpoint alongside them.
+BEGIN;
+CREATE TABLE Checkpoint_logs(sec INT, cs INT, mode INT, busy INT NOT NULL, us INT NOT NULL, wal_frames INT, backfilled INT, pages_written INT, wal_bytes INT NOT NULL, PRIMARY KEY (sec, cs, mode)) WITHOUT ROWID;
+CREATE VIEW Checkpoint_logs_formatted AS SELECT sec, cs, strftime('%Y-%m-%d %H:%M:%S', sec, 'unixepoch', 'localtime') as Timestamp, CASE mode WHEN 0 THEN 'passive' WHEN 2 THEN 'restart' WHEN 3 THEN 'truncate' END AS Mode, busy AS Busy, us/1000.0 AS Duration_ms, pages_written AS Pages_written, wal_bytes/1048576.0 AS WAL_MiB from Checkpoint_logs;
+COMMIT;
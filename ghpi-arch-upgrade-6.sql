@@ -0,0 +1,13 @@
+-- Upgrade a DB from ghpi-arch-upgrade-5.sql to the current ghpi-arch.sql, which has the energy totals: sqlite3 ghpi.db < ghpi-arch-upgrade-6.sql
+-- They're empty until ghpi_energy is run, which then accumulates everything that's still in the DB (archived or not), from the first log on. Run it before ghpi_partition moves any months out, else they're left out.
+BEGIN;
+INSERT OR IGNORE INTO Config VALUES ('heating_season_start', 7); -- Month (1 to 12) in which each heating season starts, for Energy_seasons
+CREATE TABLE Energy_hours(sec INT PRIMARY KEY, kwh REAL NOT NULL, covered INT NOT NULL, burn REAL NOT NULL, ignitions INT NOT NULL, therms REAL NOT NULL, electricity_cost REAL NOT NULL, gas_cost REAL NOT NULL) WITHOUT ROWID;
+CREATE TABLE Energy_days(day TEXT PRIMARY KEY, kwh REAL NOT NULL, covered INT NOT NULL, burn REAL NOT NULL, ignitions INT NOT NULL, therms REAL NOT NULL, electricity_cost REAL NOT NULL, gas_cost REAL NOT NULL) WITHOUT ROWID; -- day is YYYY-MM-DD
+CREATE TABLE Energy_months(month TEXT PRIMARY KEY, kwh REAL NOT NULL, covered INT NOT NULL, burn REAL NOT NULL, ignitions INT NOT NULL, therms REAL NOT NULL, electricity_cost REAL NOT NULL, gas_cost REAL NOT NULL) WITHOUT ROWID; -- month is YYYY-MM
+CREATE TABLE Energy_seasons(season TEXT PRIMARY KEY, kwh REAL NOT NULL, covered INT NOT NULL, burn REAL NOT NULL, ignitions INT NOT NULL, therms REAL NOT NULL, electricity_cost REAL NOT NULL, gas_cost REAL NOT NULL) WITHOUT ROWID; -- season is YYYY-YY
+CREATE TABLE Energy_state(wm INT NOT NULL, Pmean INT, on_since INT); -- One row, once ghpi_energy has started. wm (watermark) is the sec before which the logs have been accumulated, Pmean the reading in effect then, and on_since the ms at which the furnace's current run started, or null if it was off.
+CREATE VIEW Energy_today AS SELECT * FROM Energy_days WHERE day=date('now', 'localtime');
+CREATE VIEW Energy_this_month AS SELECT * FROM Energy_months WHERE month=strftime('%Y-%m', 'now', 'localtime');
+CREATE VIEW Energy_this_season AS SELECT * FROM Energy_seasons WHERE season=(SELECT printf('%04d-%02d', y, (y+1)%100) FROM (SELECT CAST(strftime('%Y', 'now', 'localtime') AS INT) - (CAST(strftime('%m', 'now', 'localtime') AS INT) < ifnull((SELECT val FROM Config WHERE var='heating_season_start'), 7)) AS y));
+COMMIT;
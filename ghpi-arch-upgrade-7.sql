@@ -0,0 +1,7 @@
+-- Upgrade a DB from ghpi-arch-upgrade-6.sql to the current ghpi-arch.sql, which has the INA260's current harmonics: sqlite3 ghpi.db < ghpi-arch-upgrade-7.sql
+-- Needed before read_ina260 (or ghpid) is rebuilt, since it logs them.
+BEGIN;
+INSERT INTO Idle_heartbeats VALUES ('INA260_harmonics', 0);
+CREATE TABLE INA260_harmonics(sec INT, cs INT, THD INT, H2 INT, H3 INT, H5 INT, H7 INT, DPF INT, DistPF INT, PRIMARY KEY (sec, cs)) WITHOUT ROWID; -- Analysis of the current waveform, all in percent. THD is over harmonics 2 to 13, and H2 to H7 are relative to the fundamental. DistPF (distortion power factor) is the fundamental's share of the rms, and DPF (displacement power factor) is the rest of the true power factor, so that PF = DPF*DistPF. A row of nulls means the fundamental fell below 0.5 A, where the harmonics are mostly noise.
+CREATE VIEW INA260_harmonics_formatted AS SELECT sec, cs, strftime('%Y-%m-%d %H:%M:%S', sec, 'unixepoch', 'localtime') as Timestamp, THD AS THD_percent, H2 AS H2_percent, H3 AS H3_percent, H5 AS H5_percent, H7 AS H7_percent, DPF/100.0 AS Displacement_PF, DistPF/100.0 AS Distortion_PF from INA260_harmonics;
+COMMIT;
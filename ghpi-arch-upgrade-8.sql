@@ -0,0 +1,9 @@
+-- Upgrade a DB from ghpi-arch-upgrade-7.sql to the current ghpi-arch.sql, which has the INA260's power quality events: sqlite3 ghpi.db < ghpi-arch-upgrade-8.sql
+-- Needed before read_ina260 (or ghpid) is rebuilt, since it logs them.
+BEGIN;
+INSERT OR IGNORE INTO Config VALUES ('ina260_event_Irms_max', 16.0); -- A. read_ina260 logs a power quality event (see INA260_events) when a burst's Irms goes over this, e.g. 80% of the circuit's breaker rating
+INSERT OR IGNORE INTO Config VALUES ('ina260_event_Ipeak_max', 30.0); -- A. Or when a sample's |I| goes over this, e.g. a little over the peak of the breaker rating
+INSERT OR IGNORE INTO Config VALUES ('ina260_event_Vrms_min', 108); -- V. Or when Vrms goes under this, e.g. 90% of nominal
+CREATE TABLE INA260_events(sec INT, cs INT, kind INT NOT NULL, Irms INT NOT NULL, Ipeak INT NOT NULL, Vrms INT NOT NULL, pre INT NOT NULL, post INT NOT NULL, samples BLOB NOT NULL, PRIMARY KEY (sec, cs)) WITHOUT ROWID; -- Power quality events caught by read_ina260, timestamped at the first sample of the current burst that triggered it. kind is a bit for each trigger: 1 for Irms over the limit, 2 for a sample's |I| over the limit, and 4 for a Vrms sag. Irms is the highest and Vrms the lowest from the trigger on, and Ipeak the highest |I| of all the samples, in cA, V, and cA. samples holds pre bursts before the triggering one, that one, and post after, each as a series (see archive_encode_series) of the sample times in us from the trigger, and the raw current, in units of 1.25 mA. Print one with ghpi_events.
+CREATE VIEW INA260_events_formatted AS SELECT sec, cs, strftime('%Y-%m-%d %H:%M:%S', sec, 'unixepoch', 'localtime') as Timestamp, trim(CASE WHEN kind&1 THEN 'Irms ' ELSE '' END || CASE WHEN kind&2 THEN 'peak ' ELSE '' END || CASE WHEN kind&4 THEN 'sag' ELSE '' END) AS Kind, Irms/100.0 AS Irms_max_A, Ipeak/100.0 AS Ipeak_A, Vrms AS Vrms_min_V, pre+1+post AS Bursts, length(samples) AS Bytes from INA260_events;
+COMMIT;
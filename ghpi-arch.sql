@@ -1,5 +1,5 @@
 -- Sqlite schema for greenhouse monitoring system.
--- NOTE: when installing a new system, modify the Config table according to the calibration certificate for the PHFS_01e sensor. Also record electricity cost, gas cost, furnace burn rate, and furnace ignition delay.
+-- NOTE: when installing a new system, modify the Config table according to the calibration certificate for the PHFS_01e sensor. Also record electricity cost, gas cost, furnace burn rate, furnace ignition delay, and the INA260's power quality event thresholds.
 
 CREATE TABLE Config(var TEXT PRIMARY KEY COLLATE NOCASE, val BLOB NOT NULL) WITHOUT ROWID;
 INSERT INTO Config VALUES ('PHFS_01e_serial_number', 11053);
@@ -8,6 +8,10 @@ INSERT INTO Config VALUES ('electricity_cost', 0.15); -- $/kWh
 INSERT INTO Config VALUES ('gas_cost', 0.59); -- $/therm
 INSERT INTO Config VALUES ('furnace_burn_rate', 130000); -- BTU/hr
 INSERT INTO Config VALUES ('furnace_ignition_delay', 30); -- seconds
+INSERT INTO Config VALUES ('heating_season_start', 7); -- Month (1 to 12) in which each heating season starts, for Energy_seasons
+INSERT INTO Config VALUES ('ina260_event_Irms_max', 16.0); -- A. read_ina260 logs a power quality event (see INA260_events) when a burst's Irms goes over this, e.g. 80% of the circuit's breaker rating
+INSERT INTO Config VALUES ('ina260_event_Ipeak_max', 30.0); -- A. Or when a sample's |I| goes over this, e.g. a little over the peak of the breaker rating
+INSERT INTO Config VALUES ('ina260_event_Vrms_min', 108); -- V. Or when Vrms goes under this, e.g. 90% of nominal
 INSERT INTO Config VALUES ('elevation', 1482); -- meters
 INSERT INTO Config VALUES ('flux_area', 400); -- m² (cross section, parallel to sensor)
 INSERT INTO Config VALUES ('exch_flow_rate', 757); -- mL/s
@@ -25,9 +29,17 @@ INSERT INTO Idle_heartbeats VALUES ('SHT31', 0);
 INSERT INTO Idle_heartbeats VALUES ('TSL2591', 0);
 INSERT INTO Idle_heartbeats VALUES ('VEML6075', 0);
 INSERT INTO Idle_heartbeats VALUES ('INA260', 0);
+INSERT INTO Idle_heartbeats VALUES ('INA260_harmonics', 0);
 
 CREATE TABLE DS18B20_IDs(sensor_ID INTEGER PRIMARY KEY NOT NULL, serial_code TEXT UNIQUE NOT NULL, label TEXT UNIQUE NOT NULL, CHECK(serial_code!=''), CHECK(label!='')); -- This table will be auto-populated as sensors are found on the 1-wire bus.
 
+-- Bumped by triggers whenever the table changes, so that readers can cache it, and check the one row instead of rereading the table. Only for tables that are rarely written but frequently read.
+CREATE TABLE Table_versions(table_name TEXT PRIMARY KEY, version INT NOT NULL) WITHOUT ROWID;
+INSERT INTO Table_versions VALUES ('DS18B20_IDs', 0);
+CREATE TRIGGER DS18B20_IDs_insert_version AFTER INSERT ON DS18B20_IDs BEGIN UPDATE Table_versions SET version=version+1 WHERE table_name='DS18B20_IDs'; END;
+CREATE TRIGGER DS18B20_IDs_update_version AFTER UPDATE ON DS18B20_IDs BEGIN UPDATE Table_versions SET version=version+1 WHERE table_name='DS18B20_IDs'; END;
+CREATE TRIGGER DS18B20_IDs_delete_version AFTER DELETE ON DS18B20_IDs BEGIN UPDATE Table_versions SET version=version+1 WHERE table_name='DS18B20_IDs'; END;
+
 -- Timestamps are the primary keys for the *_log tables, but each monitoring daemon gets its own table, so timestamps are unique only intra-daemon, not inter-daemon, so collisions won't happen. And even in case they do, centiseconds are finer than the end application's necessary resolution, so insert_record blurs them when necessary to uniquify the keys.
 -- Sensor readings are recorded only when they change, to avoid bloating the DB with redundant data. Readings regularly fluctuate, so liveness can reliably be determined by recency of the latest logs. But if they didn't, then a solution would be a per-sensor heartbeat (with period of e.g. 15 seconds), with logging upon a heartbeat, or when readings change, whichever occurs first, so that a gap of more than 15 seconds would mean the system was down, or the sensor was down (or returning implausible readings, filtered out by the daemon).
 CREATE TABLE DS18B20_logs(sec INT, cs INT, sensor_ID INT, temp INT, PRIMARY KEY (sec, cs, sensor_ID), FOREIGN KEY (sensor_ID) REFERENCES DS18B20_IDs(sensor_ID)) WITHOUT ROWID; -- sec counts from Unix epoch. cs is approximate centiseconds (exactly timespec.tv_nsec >> 23); encodable in one signed byte. temp is in cC (centi-Celsius), so that each usually takes only 2 bytes, except when negative (since Sqlite doesn't compactly encode negatives).
@@ -38,6 +50,10 @@ CREATE TABLE SHT31_logs(sec INT, cs INT, temp INT, hum INT, PRIMARY KEY (sec, cs
 CREATE TABLE TSL2591_logs(sec INT, cs INT, total INT, ired INT, PRIMARY KEY (sec, cs)) WITHOUT ROWID; -- total and ired are each in μW/m², so each takes 1 to 4 bytes
 CREATE TABLE VEML6075_logs(sec INT, cs INT, uva INT, uvb INT, PRIMARY KEY (sec, cs)) WITHOUT ROWID; -- uva and uvb are each in mW/m², so each takes 1 to 3 bytes
 CREATE TABLE INA260_logs(sec INT, cs INT, Vrms INT, Irms INT, Pmean INT, PRIMARY KEY (sec, cs)) WITHOUT ROWID; -- Vrms is in V, Irms in cA, and Pmean in W.
+CREATE TABLE INA260_harmonics(sec INT, cs INT, THD INT, H2 INT, H3 INT, H5 INT, H7 INT, DPF INT, DistPF INT, PRIMARY KEY (sec, cs)) WITHOUT ROWID; -- Analysis of the current waveform, all in percent. THD is over harmonics 2 to 13, and H2 to H7 are relative to the fundamental. DistPF (distortion power factor) is the fundamental's share of the rms, and DPF (displacement power factor) is the rest of the true power factor, so that PF = DPF*DistPF. A row of nulls means the fundamental fell below 0.5 A, where the harmonics are mostly noise.
+CREATE TABLE INA260_events(sec INT, cs INT, kind INT NOT NULL, Irms INT NOT NULL, Ipeak INT NOT NULL, Vrms INT NOT NULL, pre INT NOT NULL, post INT NOT NULL, samples BLOB NOT NULL, PRIMARY KEY (sec, cs)) WITHOUT ROWID; -- Power quality events caught by read_ina260, timestamped at the first sample of the current burst that triggered it. kind is a bit for each trigger: 1 for Irms over the limit, 2 for a sample's |I| over the limit, and 4 for a Vrms sag. Irms is the highest and Vrms the lowest from the trigger on, and Ipeak the highest |I| of all the samples, in cA, V, and cA. samples holds pre bursts before the triggering one, that one, and post after, each as a series (see archive_encode_series) of the sample times in us from the trigger, and the raw current, in units of 1.25 mA. Print one with ghpi_events.
+-- For the latest reading of each DS18B20 without scanning every sensor's logs; see GHPI_SQL_DS18B20_LAST. Covering, so the seek never touches the table.
+CREATE INDEX DS18B20_logs_by_sensor ON DS18B20_logs(sensor_ID, sec, cs, temp);
 
 CREATE VIEW DS18B20_logs_labeled AS SELECT sec, cs, label, temp from DS18B20_logs JOIN DS18B20_IDs ON DS18B20_logs.sensor_ID = DS18B20_IDs.sensor_ID;
 CREATE VIEW Furnace_logs_state AS SELECT sec, cs, (q1=0 and q2=0) AS furnace_ctrl, (q1=0 or q2=0) AS furnace_power from Furnace_logs;
@@ -51,6 +67,8 @@ CREATE VIEW SHT31_logs_formatted AS SELECT sec, cs, strftime('%Y-%m-%d %H:%M:%S'
 CREATE VIEW TSL2591_logs_lux_formatted AS SELECT sec, cs, strftime('%Y-%m-%d %H:%M:%S', sec, 'unixepoch', 'localtime') as Timestamp, total/1000000.0 AS Ptotal_W_per_sq_m, ired/1000000.0 AS Pinfrared_W_per_sq_m, white/1000000.0 AS Pvisible_W_per_sq_m, lux from TSL2591_logs_lux;
 CREATE VIEW VEML6075_logs_formatted AS SELECT sec, cs, strftime('%Y-%m-%d %H:%M:%S', sec, 'unixepoch', 'localtime') as Timestamp, uva/1000.0 AS Puva_W_per_sq_m, uvb/1000.0 AS Puvb_W_per_sq_m from VEML6075_logs;
 CREATE VIEW INA260_logs_formatted AS SELECT sec, cs, strftime('%Y-%m-%d %H:%M:%S', sec, 'unixepoch', 'localtime') as Timestamp, Vrms AS Vrms_V, Irms/100.0 AS Irms_A, Pmean AS Pmean_W, Vrms*(Irms/100.0) AS Papparent_W, Pmean/(Vrms*(Irms/100.0)) AS Power_factor from INA260_logs;
+CREATE VIEW INA260_harmonics_formatted AS SELECT sec, cs, strftime('%Y-%m-%d %H:%M:%S', sec, 'unixepoch', 'localtime') as Timestamp, THD AS THD_percent, H2 AS H2_percent, H3 AS H3_percent, H5 AS H5_percent, H7 AS H7_percent, DPF/100.0 AS Displacement_PF, DistPF/100.0 AS Distortion_PF from INA260_harmonics;
+CREATE VIEW INA260_events_formatted AS SELECT sec, cs, strftime('%Y-%m-%d %H:%M:%S', sec, 'unixepoch', 'localtime') as Timestamp, trim(CASE WHEN kind&1 THEN 'Irms ' ELSE '' END || CASE WHEN kind&2 THEN 'peak ' ELSE '' END || CASE WHEN kind&4 THEN 'sag' ELSE '' END) AS Kind, Irms/100.0 AS Irms_max_A, Ipeak/100.0 AS Ipeak_A, Vrms AS Vrms_min_V, pre+1+post AS Bursts, length(samples) AS Bytes from INA260_events;
 
 /* Gets only sec, without matching cs
 CREATE VIEW Last_log_sec AS SELECT max(
@@ -89,41 +107,108 @@ UNION
 SELECT * FROM
 (SELECT sec,cs from INA260_logs ORDER BY sec DESC, cs DESC LIMIT 1);
 
+-- Latest value of each dashboard channel, maintained by the triggers below in the same transaction as each log insert (or Config change), so that the dashboard's read is a scan of one small table instead of a query per log table. Channel 'sec' is the last log time over all log tables, DS18B20 included. The config channels have sec and cs 0.
+-- A log row only replaces the latest value if its timestamp is later, so backfilling old rows doesn't clobber it.
+CREATE TABLE Latest_values(channel TEXT PRIMARY KEY, sec INT NOT NULL, cs INT NOT NULL, val) WITHOUT ROWID;
+INSERT INTO Latest_values VALUES ('sec', 0, 0, 0);
+INSERT INTO Latest_values SELECT var, 0, 0, val FROM Config WHERE var IN ('elevation', 'flux_area', 'exch_flow_rate');
+
+CREATE TRIGGER DS18B20_logs_latest AFTER INSERT ON DS18B20_logs BEGIN
+INSERT INTO Latest_values VALUES ('sec', NEW.sec, NEW.cs, NEW.sec)
+ON CONFLICT(channel) DO UPDATE SET sec=excluded.sec, cs=excluded.cs, val=excluded.val WHERE (excluded.sec, excluded.cs) > (sec, cs);
+END;
+CREATE TRIGGER MAX11201B_logs_latest AFTER INSERT ON MAX11201B_logs BEGIN
+INSERT INTO Latest_values VALUES ('sec', NEW.sec, NEW.cs, NEW.sec), ('tflux', NEW.sec, NEW.cs, NEW.flux)
+ON CONFLICT(channel) DO UPDATE SET sec=excluded.sec, cs=excluded.cs, val=excluded.val WHERE (excluded.sec, excluded.cs) > (sec, cs);
+END;
+CREATE TRIGGER Furnace_logs_latest AFTER INSERT ON Furnace_logs BEGIN
+INSERT INTO Latest_values VALUES ('sec', NEW.sec, NEW.cs, NEW.sec), ('furnace_ctrl', NEW.sec, NEW.cs, (NEW.q1=0 and NEW.q2=0)), ('furnace_power', NEW.sec, NEW.cs, (NEW.q1=0 or NEW.q2=0))
+ON CONFLICT(channel) DO UPDATE SET sec=excluded.sec, cs=excluded.cs, val=excluded.val WHERE (excluded.sec, excluded.cs) > (sec, cs);
+END;
+CREATE TRIGGER BME680_logs_latest AFTER INSERT ON BME680_logs BEGIN
+INSERT INTO Latest_values VALUES ('sec', NEW.sec, NEW.cs, NEW.sec), ('tmp_ctrl_module', NEW.sec, NEW.cs, NEW.temp), ('plocal', NEW.sec, NEW.cs, NEW.pres), ('hum_in', NEW.sec, NEW.cs, NEW.hum), ('gas', NEW.sec, NEW.cs, NEW.gas)
+ON CONFLICT(channel) DO UPDATE SET sec=excluded.sec, cs=excluded.cs, val=excluded.val WHERE (excluded.sec, excluded.cs) > (sec, cs);
+END;
+CREATE TRIGGER SHT31_logs_latest AFTER INSERT ON SHT31_logs BEGIN
+INSERT INTO Latest_values VALUES ('sec', NEW.sec, NEW.cs, NEW.sec), ('tmp_outdoor_module', NEW.sec, NEW.cs, NEW.temp), ('hum_out', NEW.sec, NEW.cs, NEW.hum)
+ON CONFLICT(channel) DO UPDATE SET sec=excluded.sec, cs=excluded.cs, val=excluded.val WHERE (excluded.sec, excluded.cs) > (sec, cs);
+END;
+CREATE TRIGGER TSL2591_logs_latest AFTER INSERT ON TSL2591_logs BEGIN
+INSERT INTO Latest_values VALUES ('sec', NEW.sec, NEW.cs, NEW.sec), ('vis_ir', NEW.sec, NEW.cs, NEW.total), ('ired', NEW.sec, NEW.cs, NEW.ired)
+ON CONFLICT(channel) DO UPDATE SET sec=excluded.sec, cs=excluded.cs, val=excluded.val WHERE (excluded.sec, excluded.cs) > (sec, cs);
+END;
+CREATE TRIGGER VEML6075_logs_latest AFTER INSERT ON VEML6075_logs BEGIN
+INSERT INTO Latest_values VALUES ('sec', NEW.sec, NEW.cs, NEW.sec), ('uva', NEW.sec, NEW.cs, NEW.uva), ('uvb', NEW.sec, NEW.cs, NEW.uvb)
+ON CONFLICT(channel) DO UPDATE SET sec=excluded.sec, cs=excluded.cs, val=excluded.val WHERE (excluded.sec, excluded.cs) > (sec, cs);
+END;
+CREATE TRIGGER INA260_logs_latest AFTER INSERT ON INA260_logs BEGIN
+INSERT INTO Latest_values VALUES ('sec', NEW.sec, NEW.cs, NEW.sec), ('Vrms', NEW.sec, NEW.cs, NEW.Vrms), ('Irms', NEW.sec, NEW.cs, NEW.Irms), ('Pmean', NEW.sec, NEW.cs, NEW.Pmean)
+ON CONFLICT(channel) DO UPDATE SET sec=excluded.sec, cs=excluded.cs, val=excluded.val WHERE (excluded.sec, excluded.cs) > (sec, cs);
+END;
+CREATE TRIGGER Config_latest_insert AFTER INSERT ON Config WHEN NEW.var IN ('elevation', 'flux_area', 'exch_flow_rate') BEGIN
+INSERT INTO Latest_values VALUES (NEW.var, 0, 0, NEW.val) ON CONFLICT(channel) DO UPDATE SET val=excluded.val;
+END;
+CREATE TRIGGER Config_latest_update AFTER UPDATE OF val ON Config WHEN NEW.var IN ('elevation', 'flux_area', 'exch_flow_rate') BEGIN
+INSERT INTO Latest_values VALUES (NEW.var, 0, 0, NEW.val) ON CONFLICT(channel) DO UPDATE SET val=excluded.val;
+END;
+
+-- Formerly the max over Last_log_times, which is kept as a cross-check, since it's computed from the logs themselves
 CREATE VIEW Last_log_time AS
-SELECT IFNULL(sec,0) AS sec, IFNULL(cs,0) AS cs from Last_log_times ORDER BY sec DESC, cs DESC LIMIT 1;
+SELECT sec, cs FROM Latest_values WHERE channel='sec';
 
 -- This excludes DS18B20_logs, since getting the last temperature for each DS18B20 would have to result in a variable-arity view. Sqlite doesn't support that (or even ordinary PIVOT).
-CREATE VIEW Last_logs AS
-SELECT * FROM
-(SELECT sec
-FROM Last_log_time)
-JOIN
-(SELECT val AS elevation
-FROM Config WHERE var='elevation')
-JOIN
-(SELECT val AS flux_area
-FROM Config WHERE var='flux_area')
-JOIN
-(SELECT val AS exch_flow_rate
-FROM Config WHERE var='exch_flow_rate')
-JOIN
-(SELECT flux AS tflux
-FROM MAX11201B_logs ORDER BY sec DESC, cs DESC LIMIT 1)
-JOIN
-(SELECT furnace_ctrl, furnace_power
-FROM Furnace_logs_state ORDER BY sec DESC, cs DESC LIMIT 1)
-JOIN
-(SELECT temp AS tmp_ctrl_module, pres AS plocal, hum AS hum_in, gas
-FROM BME680_logs ORDER BY sec DESC, cs DESC LIMIT 1)
-JOIN
-(SELECT temp AS tmp_outdoor_module, hum AS hum_out
-FROM SHT31_logs ORDER BY sec DESC, cs DESC LIMIT 1)
-JOIN
-(SELECT total AS vis_ir, ired
-FROM TSL2591_logs ORDER BY sec DESC, cs DESC LIMIT 1)
-JOIN
-(SELECT uva, uvb
-FROM VEML6075_logs ORDER BY sec DESC, cs DESC LIMIT 1)
-JOIN
-(SELECT Vrms, Irms, Pmean
-FROM INA260_logs ORDER BY sec DESC, cs DESC LIMIT 1);
+-- So pivot by hand. Formerly a join of a LIMIT 1 subquery per log table, and the Config lookups; the columns are the same.
+CREATE VIEW Last_logs AS SELECT
+max(CASE channel WHEN 'sec' THEN val END) AS sec,
+max(CASE channel WHEN 'elevation' THEN val END) AS elevation,
+max(CASE channel WHEN 'flux_area' THEN val END) AS flux_area,
+max(CASE channel WHEN 'exch_flow_rate' THEN val END) AS exch_flow_rate,
+max(CASE channel WHEN 'tflux' THEN val END) AS tflux,
+max(CASE channel WHEN 'furnace_ctrl' THEN val END) AS furnace_ctrl,
+max(CASE channel WHEN 'furnace_power' THEN val END) AS furnace_power,
+max(CASE channel WHEN 'tmp_ctrl_module' THEN val END) AS tmp_ctrl_module,
+max(CASE channel WHEN 'plocal' THEN val END) AS plocal,
+max(CASE channel WHEN 'hum_in' THEN val END) AS hum_in,
+max(CASE channel WHEN 'gas' THEN val END) AS gas,
+max(CASE channel WHEN 'tmp_outdoor_module' THEN val END) AS tmp_outdoor_module,
+max(CASE channel WHEN 'hum_out' THEN val END) AS hum_out,
+max(CASE channel WHEN 'vis_ir' THEN val END) AS vis_ir,
+max(CASE channel WHEN 'ired' THEN val END) AS ired,
+max(CASE channel WHEN 'uva' THEN val END) AS uva,
+max(CASE channel WHEN 'uvb' THEN val END) AS uvb,
+max(CASE channel WHEN 'Vrms' THEN val END) AS Vrms,
+max(CASE channel WHEN 'Irms' THEN val END) AS Irms,
+max(CASE channel WHEN 'Pmean' THEN val END) AS Pmean
+FROM Latest_values;
+
+-- Rollups of every logged channel at 1 minute, 1 hour, and 1 day, for historical queries, which would otherwise have to scan the logs. Maintained by ghpi_rollup, which catches each channel up from its watermark once a minute.
+-- Since readings are logged only when they change, each one holds until the channel's next row (a null, e.g. when a sensor disappears or its daemon restarts, ends it). So mean is weighted by time over the part of the bucket that had a reading, which is covered (in ms), and min, max, first, and last are of the readings in effect during the bucket, including the one carried in from before it. n is the number of (non-null) readings logged in the bucket.
+-- Buckets are aligned to UTC, and keyed by their start sec. A 1-minute bucket is stored only if a reading was logged in it, since otherwise the previous one's last still holds. 1-hour and 1-day buckets are stored whenever any reading was in effect.
+-- E.g. the daily mean of a DS18B20 last winter: SELECT date(sec, 'unixepoch'), mean/100.0 FROM Rollups_1d WHERE channel_ID=(SELECT channel_ID FROM Rollup_channels_labeled WHERE label='tank_1') AND sec BETWEEN strftime('%s', '2025-12-01') AND strftime('%s', '2026-03-01');
+CREATE TABLE Rollup_channels(channel_ID INTEGER PRIMARY KEY, name TEXT UNIQUE NOT NULL, log_table TEXT NOT NULL, column_name TEXT NOT NULL, sensor_ID INT, wm INT NOT NULL DEFAULT 0); -- Populated by ghpi_rollup. name is log_table.column_name, plus .sensor_ID for DS18B20_logs, for which sensor_ID is set. wm (watermark) is the sec before which all the channel's logs have been rolled up; 0 if none have been yet.
+CREATE TABLE Rollups_1m(channel_ID INT, sec INT, n INT NOT NULL, covered INT NOT NULL, mean REAL, min INT, max INT, first INT, last INT, PRIMARY KEY (channel_ID, sec)) WITHOUT ROWID;
+CREATE TABLE Rollups_1h(channel_ID INT, sec INT, n INT NOT NULL, covered INT NOT NULL, mean REAL, min INT, max INT, first INT, last INT, PRIMARY KEY (channel_ID, sec)) WITHOUT ROWID;
+CREATE TABLE Rollups_1d(channel_ID INT, sec INT, n INT NOT NULL, covered INT NOT NULL, mean REAL, min INT, max INT, first INT, last INT, PRIMARY KEY (channel_ID, sec)) WITHOUT ROWID;
+CREATE VIEW Rollup_channels_labeled AS SELECT channel_ID, CASE WHEN Rollup_channels.sensor_ID IS NULL THEN name ELSE label END AS label FROM Rollup_channels LEFT JOIN DS18B20_IDs ON Rollup_channels.sensor_ID = DS18B20_IDs.sensor_ID;
+
+-- Logs moved out of the log tables by ghpi_archive once they're old enough, compressed into a block per table (or DS18B20) per UTC day; see gh_archive.h for the encoding. Read them together with the log tables via the archive cursor in gh_archive.c, as ghpi_export and ghpi_rollup do.
+-- sensor_ID is set only for DS18B20_logs. sec_first and sec_last are of the block's first and last rows. columns lists the data columns, in order, as of when the block was archived.
+CREATE TABLE Archive_blocks(log_table TEXT NOT NULL, sensor_ID INT, sec_first INT NOT NULL, sec_last INT NOT NULL, n_rows INT NOT NULL, columns TEXT NOT NULL, data BLOB NOT NULL);
+CREATE UNIQUE INDEX Archive_blocks_by_time ON Archive_blocks(log_table, sensor_ID, sec_first);
+
+-- WAL checkpoints done by ghpi_checkpoint, which does them all, since the daemons' connections don't (see ghpi_wal_hook). mode is Sqlite's SQLITE_CHECKPOINT_*, i.e. 0 for passive, 2 for restart, 3 for truncate. busy is 1 if readers (or a writer) kept it from finishing, in which case a restart or truncate did nothing. us is how long it took. wal_frames and backfilled are as returned by sqlite3_wal_checkpoint_v2, i.e. frames in the WAL, and how many of them are now in the DB; pages_written is how many this checkpoint wrote. wal_bytes is the WAL file's size beforehand.
+-- Only checkpoints that wrote something, escalated, or were held up are logged.
+CREATE TABLE Checkpoint_logs(sec INT, cs INT, mode INT, busy INT NOT NULL, us INT NOT NULL, wal_frames INT, backfilled INT, pages_written INT, wal_bytes INT NOT NULL, PRIMARY KEY (sec, cs, mode)) WITHOUT ROWID;
+CREATE VIEW Checkpoint_logs_formatted AS SELECT sec, cs, strftime('%Y-%m-%d %H:%M:%S', sec, 'unixepoch', 'localtime') as Timestamp, CASE mode WHEN 0 THEN 'passive' WHEN 2 THEN 'restart' WHEN 3 THEN 'truncate' END AS Mode, busy AS Busy, us/1000.0 AS Duration_ms, pages_written AS Pages_written, wal_bytes/1048576.0 AS WAL_MiB from Checkpoint_logs;
+
+-- Running totals of electricity and furnace gas use, and their cost, per UTC hour, and per local day, month, and heating season (which starts in the Config heating_season_start month, and is named for the years it spans, e.g. 2025-26), so that reports don't have to integrate the logs. Maintained by ghpi_energy, which catches them up from Energy_state once a minute, about two minutes behind the logs.
+-- kwh is Pmean integrated over the part of the period that had a reading, which is covered (in ms), with each reading holding until the next, as in the rollups. burn is seconds that the furnace was on, minus furnace_ignition_delay at the start of each run, and ignitions is the number of runs that lasted longer than that, by when their burn started. therms is burn at furnace_burn_rate. The costs are at the Config prices as of when the period was accumulated, so a price change applies from then on.
+-- E.g. SELECT * FROM Energy_today; or the cost of gas per day last week: SELECT day, gas_cost FROM Energy_days WHERE day BETWEEN date('now', 'localtime', '-7 days') AND date('now', 'localtime');
+CREATE TABLE Energy_hours(sec INT PRIMARY KEY, kwh REAL NOT NULL, covered INT NOT NULL, burn REAL NOT NULL, ignitions INT NOT NULL, therms REAL NOT NULL, electricity_cost REAL NOT NULL, gas_cost REAL NOT NULL) WITHOUT ROWID;
+CREATE TABLE Energy_days(day TEXT PRIMARY KEY, kwh REAL NOT NULL, covered INT NOT NULL, burn REAL NOT NULL, ignitions INT NOT NULL, therms REAL NOT NULL, electricity_cost REAL NOT NULL, gas_cost REAL NOT NULL) WITHOUT ROWID; -- day is YYYY-MM-DD
+CREATE TABLE Energy_months(month TEXT PRIMARY KEY, kwh REAL NOT NULL, covered INT NOT NULL, burn REAL NOT NULL, ignitions INT NOT NULL, therms REAL NOT NULL, electricity_cost REAL NOT NULL, gas_cost REAL NOT NULL) WITHOUT ROWID; -- month is YYYY-MM
+CREATE TABLE Energy_seasons(season TEXT PRIMARY KEY, kwh REAL NOT NULL, covered INT NOT NULL, burn REAL NOT NULL, ignitions INT NOT NULL, therms REAL NOT NULL, electricity_cost REAL NOT NULL, gas_cost REAL NOT NULL) WITHOUT ROWID; -- season is YYYY-YY
+CREATE TABLE Energy_state(wm INT NOT NULL, Pmean INT, on_since INT); -- One row, once ghpi_energy has started. wm (watermark) is the sec before which the logs have been accumulated, Pmean the reading in effect then, and on_since the ms at which the furnace's current run started, or null if it was off.
+CREATE VIEW Energy_today AS SELECT * FROM Energy_days WHERE day=date('now', 'localtime');
+CREATE VIEW Energy_this_month AS SELECT * FROM Energy_months WHERE month=strftime('%Y-%m', 'now', 'localtime');
+CREATE VIEW Energy_this_season AS SELECT * FROM Energy_seasons WHERE season=(SELECT printf('%04d-%02d', y, (y+1)%100) FROM (SELECT CAST(strftime('%Y', 'now', 'localtime') AS INT) - (CAST(strftime('%m', 'now', 'localtime') AS INT) < ifnull((SELECT val FROM Config WHERE var='heating_season_start'), 7)) AS y));
@@ -0,0 +1,207 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "gh_ctrl.h"
+#include "gh_archive.h"
+
+// Moves logs older than the given number of days out of the log tables, into compressed blocks in Archive_blocks, one per table (or DS18B20) per UTC day. Run it daily, e.g. from cron. Readers that go through the archive cursor (see gh_archive.h), like ghpi_export and ghpi_rollup, see no difference.
+// Each day is moved in its own transaction, so the daemons are only held up briefly. The freed pages are reused for new logs, but the file only shrinks if it's vacuumed, which -v does afterward. That needs as much free disk as the result, and blocks the daemons meanwhile.
+// Usage: ghpi_archive [-v] db-file days
+
+const char* log_tables[] = {"MAX11201B_logs", "Furnace_logs", "BME680_logs", "SHT31_logs", "TSL2591_logs", "VEML6075_logs", "INA260_logs", "INA260_harmonics"}; // As in ghpi_rollup. DS18B20_logs is archived per sensor.
+#define N_LOG_TABLES (int)(sizeof(log_tables)/sizeof(log_tables[0]))
+#define ARCHIVE_DAY 86400
+#define ARCHIVE_SENSORS_MAX 256 // DS18B20s
+
+sqlite3_stmt *pStmt_begin, *pStmt_commit, *pStmt_insert;
+long total_rows, total_blocks;
+long long total_bytes;
+
+void step_done(sqlite3_stmt* pStmt, const char* msg) { // For statements that return no rows
+  int rc = sqlite3_step(pStmt);
+  check_sql(rc, msg);
+  sqlite3_reset(pStmt);
+}
+
+void exec_sql(const char* zSql, const char* msg) {
+  int rc = sqlite3_exec(db, zSql, NULL, NULL, NULL);
+  check_sql(rc, msg);
+}
+
+long long page_bytes() { // In use, i.e. excluding the free list
+  sqlite3_stmt* pStmt;
+  int rc = sqlite3_prepare_v3(db, "SELECT (page_count - freelist_count)*page_size FROM pragma_page_count, pragma_freelist_count, pragma_page_size", -1, 0, &pStmt, NULL);
+  check_sql(rc, "sqlite3_prepare failure in page_bytes");
+  rc = sqlite3_step(pStmt);
+  check_sql(rc, "sqlite3_step failure in page_bytes");
+  long long bytes = sqlite3_column_int64(pStmt, 0);
+  sqlite3_finalize(pStmt);
+  return bytes;
+}
+
+// Archive the table's (or the DS18B20's) rows before cutoff (a multiple of ARCHIVE_DAY), a day at a time, oldest first
+void archive_table(const char* table, bool ds18b20_p, int sensor_ID, long long cutoff) {
+  sqlite3_stmt *pStmt_first, *pStmt_rows, *pStmt_delete;
+  int n_cols = 0;
+  char* zCols = sqlite3_mprintf("");
+  char* zNames = sqlite3_mprintf("");
+  char* zSql = sqlite3_mprintf("SELECT name FROM pragma_table_info('%q') WHERE cid>=2 AND name!='sensor_ID' ORDER BY cid", table);
+  int rc = sqlite3_prepare_v3(db, zSql, -1, 0, &pStmt_first, NULL);
+  sqlite3_free(zSql);
+  check_sql(rc, "sqlite3_prepare failure in archive_table");
+  while((rc = sqlite3_step(pStmt_first))==SQLITE_ROW) {
+    if(n_cols==ARCHIVE_COLUMNS_MAX) {
+      fprintf(stderr, "%s has too many columns to archive; max is %d\n", table, ARCHIVE_COLUMNS_MAX);
+      exit(-1);
+    }
+    const char* name = (const char*)sqlite3_column_text(pStmt_first, 0);
+    n_cols++;
+    char* tmp = sqlite3_mprintf("%s, \"%w\"", zCols, name);
+    sqlite3_free(zCols);
+    zCols = tmp;
+    tmp = sqlite3_mprintf(*zNames?"%s,%s":"%s%s", zNames, name);
+    sqlite3_free(zNames);
+    zNames = tmp;
+  }
+  check_sql(rc, "sqlite3_step failure in archive_table");
+  sqlite3_finalize(pStmt_first);
+  const char* zWhere = ds18b20_p?"sensor_ID=? AND":"";
+  zSql = sqlite3_mprintf("SELECT min(sec) FROM \"%w\" WHERE %s sec<?", table, zWhere);
+  rc = sqlite3_prepare_v3(db, zSql, -1, 0, &pStmt_first, NULL);
+  sqlite3_free(zSql);
+  check_sql(rc, "sqlite3_prepare failure in archive_table");
+  zSql = sqlite3_mprintf("SELECT sec, cs%s FROM \"%w\" WHERE %s sec>=? AND sec<? ORDER BY sec, cs", zCols, table, zWhere);
+  rc = sqlite3_prepare_v3(db, zSql, -1, 0, &pStmt_rows, NULL);
+  sqlite3_free(zSql);
+  check_sql(rc, "sqlite3_prepare failure in archive_table");
+  zSql = sqlite3_mprintf("DELETE FROM \"%w\" WHERE %s sec>=? AND sec<?", table, zWhere);
+  rc = sqlite3_prepare_v3(db, zSql, -1, 0, &pStmt_delete, NULL);
+  sqlite3_free(zSql);
+  check_sql(rc, "sqlite3_prepare failure in archive_table");
+  struct archive_row* rows = NULL;
+  int rows_size = 0;
+  struct archive_buf buf;
+  memset(&buf, 0, sizeof(buf));
+  int i0 = ds18b20_p?2:1;
+  if(ds18b20_p) {
+    sqlite3_bind_int(pStmt_first, 1, sensor_ID);
+    sqlite3_bind_int(pStmt_rows, 1, sensor_ID);
+    sqlite3_bind_int(pStmt_delete, 1, sensor_ID);
+  }
+  sqlite3_bind_int64(pStmt_first, i0, cutoff);
+  while(1) {
+    step_done(pStmt_begin, "sqlite3_step failure in archive_table for begin");
+    rc = sqlite3_step(pStmt_first);
+    check_sql(rc, "sqlite3_step failure in archive_table");
+    bool done_p = sqlite3_column_type(pStmt_first, 0)==SQLITE_NULL;
+    long long day = sqlite3_column_int64(pStmt_first, 0);
+    sqlite3_reset(pStmt_first);
+    if(done_p) {
+      step_done(pStmt_commit, "sqlite3_step failure in archive_table for commit");
+      break;
+    }
+    day -= day%ARCHIVE_DAY;
+    int n_rows = 0;
+    sqlite3_bind_int64(pStmt_rows, i0, day);
+    sqlite3_bind_int64(pStmt_rows, i0+1, day+ARCHIVE_DAY);
+    while((rc = sqlite3_step(pStmt_rows))==SQLITE_ROW) {
+      if(n_rows==rows_size) {
+	rows_size = rows_size?rows_size*2:4096;
+	rows = (struct archive_row*)realloc(rows, rows_size*sizeof(struct archive_row));
+	if(!rows) {
+	  fprintf(stderr, "Out of memory in archive_table\n");
+	  exit(-1);
+	}
+      }
+      struct archive_row* r = &rows[n_rows++];
+      r->sec = sqlite3_column_int(pStmt_rows, 0);
+      r->cs = sqlite3_column_int(pStmt_rows, 1);
+      r->nulls = 0;
+      for(int c=0; c<n_cols; c++) {
+	if(sqlite3_column_type(pStmt_rows, c+2)==SQLITE_NULL) r->nulls |= 1u<<c;
+	r->vals[c] = sqlite3_column_int(pStmt_rows, c+2);
+      }
+    }
+    check_sql(rc, "sqlite3_step failure in archive_table for rows");
+    sqlite3_reset(pStmt_rows);
+    buf.len = 0;
+    archive_encode(rows, n_rows, n_cols, &buf);
+    sqlite3_bind_text(pStmt_insert, 1, table, -1, SQLITE_STATIC);
+    if(ds18b20_p) sqlite3_bind_int(pStmt_insert, 2, sensor_ID);
+    else sqlite3_bind_null(pStmt_insert, 2);
+    sqlite3_bind_int(pStmt_insert, 3, rows[0].sec);
+    sqlite3_bind_int(pStmt_insert, 4, rows[n_rows-1].sec);
+    sqlite3_bind_int(pStmt_insert, 5, n_rows);
+    sqlite3_bind_text(pStmt_insert, 6, zNames, -1, SQLITE_STATIC);
+    sqlite3_bind_blob(pStmt_insert, 7, buf.data, buf.len, SQLITE_STATIC);
+    step_done(pStmt_insert, "sqlite3_step failure in archive_table for insert");
+    sqlite3_bind_int64(pStmt_delete, i0, day);
+    sqlite3_bind_int64(pStmt_delete, i0+1, day+ARCHIVE_DAY);
+    step_done(pStmt_delete, "sqlite3_step failure in archive_table for delete");
+    step_done(pStmt_commit, "sqlite3_step failure in archive_table for commit");
+    total_rows += n_rows;
+    total_blocks++;
+    total_bytes += buf.len;
+  }
+  sqlite3_finalize(pStmt_first);
+  sqlite3_finalize(pStmt_rows);
+  sqlite3_finalize(pStmt_delete);
+  sqlite3_free(zCols);
+  sqlite3_free(zNames);
+  free(rows);
+  free(buf.data);
+}
+
+int main(int argc, char** argv) {
+  int opt;
+  bool vacuum_p = false;
+  while((opt = getopt(argc, argv, "v"))!=-1) {
+    if(opt=='v') vacuum_p = true;
+    else {
+      fprintf(stderr, "Usage: %s [-v] db-file days\n", argv[0]);
+      exit(-1);
+    }
+  }
+  if(argc-optind!=2 || atoi(argv[optind+1])<1) {
+    fprintf(stderr, "Usage: %s [-v] db-file days\n", argv[0]);
+    exit(-1);
+  }
+  struct timespec ts_start;
+  clock_gettime(CLOCK_MONOTONIC, &ts_start);
+  ghpi_sqlite_init(argv[0], argv[optind]);
+  if(!archive_present_p(db)) {
+    fprintf(stderr, "No Archive_blocks table; upgrade the DB with ghpi-arch-upgrade-4.sql\n");
+    exit(-1);
+  }
+  long long cutoff = time(NULL) - atoi(argv[optind+1])*(long long)ARCHIVE_DAY;
+  cutoff -= cutoff%ARCHIVE_DAY;
+  int rc = sqlite3_prepare_v3(db, "BEGIN IMMEDIATE", -1, SQLITE_PREPARE_PERSISTENT, &pStmt_begin, NULL);
+  check_sql(rc, "sqlite3_prepare failure in ghpi_archive for begin");
+  rc = sqlite3_prepare_v3(db, "COMMIT", -1, SQLITE_PREPARE_PERSISTENT, &pStmt_commit, NULL);
+  check_sql(rc, "sqlite3_prepare failure in ghpi_archive for commit");
+  rc = sqlite3_prepare_v3(db, "INSERT INTO Archive_blocks VALUES (?, ?, ?, ?, ?, ?, ?)", -1, SQLITE_PREPARE_PERSISTENT, &pStmt_insert, NULL);
+  check_sql(rc, "sqlite3_prepare failure in ghpi_archive for insert");
+  long long bytes_before = page_bytes();
+  for(int i=0; i<N_LOG_TABLES; i++) archive_table(log_tables[i], false, 0, cutoff);
+  sqlite3_stmt* pStmt;
+  rc = sqlite3_prepare_v3(db, "SELECT sensor_ID FROM DS18B20_IDs ORDER BY sensor_ID", -1, 0, &pStmt, NULL);
+  check_sql(rc, "sqlite3_prepare failure in ghpi_archive for DS18B20_IDs");
+  int sensor_IDs[ARCHIVE_SENSORS_MAX], n_sensors = 0;
+  while(((rc = sqlite3_step(pStmt))==SQLITE_ROW) && (n_sensors<ARCHIVE_SENSORS_MAX)) sensor_IDs[n_sensors++] = sqlite3_column_int(pStmt, 0);
+  check_sql(rc, "sqlite3_step failure in ghpi_archive for DS18B20_IDs");
+  sqlite3_finalize(pStmt); // Before archiving, which writes DS18B20_logs, since a read statement left open would hold a snapshot
+  for(int i=0; i<n_sensors; i++) archive_table("DS18B20_logs", true, sensor_IDs[i], cutoff);
+  long long bytes_after = page_bytes();
+  char ts_buf[64];
+  time_t now = time(NULL);
+  strftime(ts_buf, 64, "%Y-%m-%d %H:%M:%S", localtime(&now));
+  fprintf(stderr, "%s Archived %ld rows into %ld blocks of %lld bytes; pages in use went from %lld to %lld bytes, in %.1fs\n", ts_buf, total_rows, total_blocks, total_bytes, bytes_before, bytes_after, ms_since(&ts_start)/1000.0);
+  if(vacuum_p) {
+    exec_sql("VACUUM", "sqlite3_exec failure in ghpi_archive for vacuum");
+    exec_sql("PRAGMA wal_checkpoint(TRUNCATE)", "sqlite3_exec failure in ghpi_archive for checkpoint");
+  }
+  sqlite3_close(db);
+  return 0;
+}
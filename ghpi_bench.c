@@ -0,0 +1,471 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include "gh_ctrl.h"
+
+// Microbenchmarks for the write path (gh_ctrl) and the dashboard read path (poll_stream), printed as CSV on stdout: benchmark,variant,db_rows,metric,value. Progress goes to stderr.
+// Usage: ghpi_bench work-dir [scale]
+// The insert_record +contention variants also report the contending writer's throughput and busy retries. If it gave up on the write lock, contender_failed is 1, and ghpi_bench exits with 1.
+// The synthetic DBs for the read path are kept in work-dir, since the 5-year one takes a long time to generate. On later runs, they're topped up to the current time and trimmed to their span, since poll_stream's DS18B20 query depends on 'now'. They're named by span, scale, and a hash of the schema, so a schema change gets new ones. scale multiplies the synthetic row rates; use e.g. 0.01 for a quick run.
+
+#define BENCH_SCHEMA_FILE "ghpi-arch.sql"
+#define BENCH_READING_CHANGE_CALLS 10000000
+#define BENCH_INSERT_SECONDS 3
+#define BENCH_QUERY_ITERATIONS 400
+#define BENCH_N_DS18B20 8
+#define BENCH_LIVE_PUBLISHES 1000000
+
+// Rough guesses at the live system's change-only logging rates, in rows per hour
+struct bench_table {
+  const char* name;
+  int n_data; // Columns after sec and cs
+  double rows_per_hour;
+  int base; // Center of the random walk of the data values
+};
+struct bench_table bench_tables[] = {
+  {"INA260_logs", 3, 1800, 120},
+  {"MAX11201B_logs", 1, 600, 50},
+  {"Furnace_logs", 2, 12, 1},
+  {"BME680_logs", 4, 360, 2000},
+  {"SHT31_logs", 2, 240, 1500},
+  {"TSL2591_logs", 2, 900, 100000},
+  {"VEML6075_logs", 2, 300, 500},
+  {"DS18B20_logs", 2, 60*BENCH_N_DS18B20, 2000}, // sensor_ID and temp; one row per sensor per tick
+};
+#define N_BENCH_TABLES (int)(sizeof(bench_tables)/sizeof(bench_tables[0]))
+
+struct bench_db {
+  const char* variant;
+  long long span; // seconds
+};
+struct bench_db bench_dbs[] = {
+  {"1d", 86400LL},
+  {"1y", 365*86400LL},
+  {"5y", 5*365*86400LL},
+};
+#define N_BENCH_DBS (int)(sizeof(bench_dbs)/sizeof(bench_dbs[0]))
+
+const char* work_dir;
+double scale = 1;
+char* schema_sql;
+unsigned schema_hash; // In the cached DBs' names, so that they're regenerated when the schema changes
+bool failed_p; // A benchmark's run was invalid, e.g. a process it depends on died. Results are still printed, but the exit status is nonzero.
+
+long long now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts_to_ns(&ts);
+}
+
+void print_result(const char* benchmark, const char* variant, long long db_rows, const char* metric, double value) {
+  printf("%s,%s,%lld,%s,%.3f\n", benchmark, variant, db_rows, metric, value);
+  fflush(stdout);
+}
+
+int cmp_ll(const void* a, const void* b) {
+  long long x = *(const long long*)a, y = *(const long long*)b;
+  return (x>y) - (x<y);
+}
+
+// Mean, median, 99th percentile, and max, in μs
+void print_latencies(const char* benchmark, const char* variant, long long db_rows, long long* ns, int n) {
+  long long total = 0;
+  qsort(ns, n, sizeof(long long), &cmp_ll);
+  for(int i=0; i<n; i++) total += ns[i];
+  print_result(benchmark, variant, db_rows, "mean_us", total/1000.0/n);
+  print_result(benchmark, variant, db_rows, "p50_us", ns[n/2]/1000.0);
+  print_result(benchmark, variant, db_rows, "p99_us", ns[n*99/100]/1000.0);
+  print_result(benchmark, variant, db_rows, "max_us", ns[n-1]/1000.0);
+}
+
+void load_schema() {
+  FILE* fp = fopen(BENCH_SCHEMA_FILE, "r");
+  if(!fp) {
+    fprintf(stderr, "Can't open %s: %s\n", BENCH_SCHEMA_FILE, strerror(errno));
+    exit(-1);
+  }
+  fseek(fp, 0, SEEK_END);
+  long len = ftell(fp);
+  fseek(fp, 0, SEEK_SET);
+  schema_sql = (char*)malloc(len+1);
+  if(fread(schema_sql, 1, len, fp)!=(size_t)len) {
+    fprintf(stderr, "Can't read %s\n", BENCH_SCHEMA_FILE);
+    exit(-1);
+  }
+  schema_sql[len] = 0;
+  fclose(fp);
+  schema_hash = 2166136261u; // FNV-1a
+  for(long i=0; i<len; i++) schema_hash = (schema_hash ^ (unsigned char)schema_sql[i]) * 16777619u;
+}
+
+void exec_sql(sqlite3* conn, const char* zSql) {
+  char* zErrMsg = 0;
+  int rc = sqlite3_exec(conn, zSql, NULL, NULL, &zErrMsg);
+  if(rc!=SQLITE_OK) {
+    fprintf(stderr, "sqlite3_exec error in ghpi_bench: %s\n", zErrMsg);
+    exit(rc);
+  }
+}
+
+// Close the global connection opened by ghpi_sqlite_init, along with all its statements
+void close_db() {
+  sqlite3_stmt* pStmt;
+  while((pStmt = sqlite3_next_stmt(db, NULL))) sqlite3_finalize(pStmt);
+  sqlite3_close(db);
+  db = NULL;
+}
+
+void bench_reading_change() {
+  bool prev_inc_p = false;
+  int mem = 0, x = 0, changes = 0;
+  unsigned lcg = 1;
+  long long t0 = now_ns();
+  for(int i=0; i<BENCH_READING_CHANGE_CALLS; i++) {
+    lcg = lcg*1664525 + 1013904223;
+    x += (int)(lcg>>29) - 3; // Noisy random walk, -3..4 per step
+    changes += reading_change(&prev_inc_p, &mem, x);
+  }
+  long long elapsed = now_ns() - t0;
+  fprintf(stderr, "reading_change: %d changes\n", changes);
+  print_result("reading_change", "", 0, "ns_per_call", (double)elapsed/BENCH_READING_CHANGE_CALLS);
+  print_result("reading_change", "", 0, "calls_per_sec", BENCH_READING_CHANGE_CALLS*1e9/elapsed);
+}
+
+// Fresh DB from the schema, with one row so that ghpi_sqlite_init finds a last log time
+void create_insert_db(const char* file_name) {
+  sqlite3* conn;
+  unlink(file_name);
+  char* zWal = sqlite3_mprintf("%s-wal", file_name);
+  unlink(zWal);
+  sqlite3_free(zWal);
+  int rc = sqlite3_open_v2(file_name, &conn, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, NULL);
+  if(rc!=SQLITE_OK) {
+    fprintf(stderr, "Can't create %s\n", file_name);
+    exit(rc);
+  }
+  exec_sql(conn, schema_sql);
+  exec_sql(conn, "insert into INA260_logs values (1, 0, 0, 0, 0)");
+  sqlite3_close(conn);
+}
+
+long long step_null() {
+  return 0;
+}
+
+// Progress of the contender, in memory shared with it, since it's killed rather than exiting
+struct contender_stats {
+  long long rows;
+  unsigned busy_retries; // Its METRIC_BUSY_RETRIES
+};
+
+// Second writer process, inserting into its own table as fast as it can until killed, or until it gives up on the write lock
+pid_t start_contender(const char* file_name, struct contender_stats* stats) {
+  pid_t pid = fork();
+  if(pid<0) {
+    perror("fork failure in ghpi_bench");
+    exit(-1);
+  }
+  if(pid) return pid;
+  struct ghpi_sensor contender = {"SHT31", "SHT31_logs", &step_null, &step_null};
+  int arrData[2] = {0, 0};
+  ghpi_sqlite_init("ghpi_bench contender", file_name);
+  batch_commit_enable(0, 0); // Autocommit, even if an earlier run left group commit enabled in the parent
+  sensor_init(&contender);
+  while(1) {
+    arrData[0]++;
+    insert_record(&contender, arrData, 2);
+    __atomic_store_n(&stats->rows, stats->rows+1, __ATOMIC_RELAXED);
+    __atomic_store_n(&stats->busy_retries, __atomic_load_n(&metrics_db.counters[METRIC_BUSY_RETRIES], __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+  }
+}
+
+struct contender_stats contender_snapshot(struct contender_stats* stats) {
+  struct contender_stats snap;
+  snap.rows = __atomic_load_n(&stats->rows, __ATOMIC_RELAXED);
+  snap.busy_retries = __atomic_load_n(&stats->busy_retries, __ATOMIC_RELAXED);
+  return snap;
+}
+
+void bench_insert_record(bool batch_p, bool contention_p) {
+  char* file_name = sqlite3_mprintf("%s/bench-insert.db", work_dir);
+  struct ghpi_sensor sensor = {"INA260", "INA260_logs", &step_null, &step_null};
+  int arrData[3] = {120, 0, 0};
+  long long rows = 0;
+  pid_t contender = 0;
+  struct contender_stats* stats = NULL;
+  struct contender_stats c0, c1;
+  create_insert_db(file_name);
+  if(contention_p) { // Forked before this process opens the DB, since a connection mustn't be open across fork()
+    stats = (struct contender_stats*)mmap(NULL, sizeof(*stats), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if(stats==MAP_FAILED) {
+      perror("mmap failure in bench_insert_record");
+      exit(-1);
+    }
+    contender = start_contender(file_name, stats);
+  }
+  ghpi_sqlite_init("ghpi_bench", file_name);
+  if(batch_p) batch_commit_enable(GHPI_BATCH_MAX_ROWS, GHPI_BATCH_MAX_AGE);
+  sensor_init(&sensor);
+  if(contention_p) {
+    usleep(100000); // Let it get going
+    c0 = contender_snapshot(stats);
+  }
+  unsigned busy0 = metrics_db.counters[METRIC_BUSY_RETRIES];
+  long long t0 = now_ns();
+  while(now_ns() - t0 < BENCH_INSERT_SECONDS*NS_PER_SEC) {
+    arrData[1]++;
+    insert_record(&sensor, arrData, 3);
+    rows++;
+  }
+  batch_commit_flush();
+  long long elapsed = now_ns() - t0;
+  unsigned busy_retries = metrics_db.counters[METRIC_BUSY_RETRIES] - busy0;
+  int status = 0;
+  bool contender_exited_p = false; // On its own, i.e. it failed, e.g. on SQLITE_BUSY
+  if(contention_p) {
+    c1 = contender_snapshot(stats);
+    contender_exited_p = (waitpid(contender, &status, WNOHANG)==contender);
+    if(!contender_exited_p) {
+      kill(contender, SIGKILL);
+      waitpid(contender, NULL, 0);
+    }
+  }
+  close_db();
+  char variant[64];
+  snprintf(variant, sizeof(variant), "%s%s", batch_p?"batch":"autocommit", contention_p?"+contention":"");
+  print_result("insert_record", variant, 0, "rows_per_sec", rows*1e9/elapsed);
+  print_result("insert_record", variant, 0, "us_per_row", elapsed/1000.0/rows);
+  print_result("insert_record", variant, 0, "busy_retries", busy_retries);
+  if(contention_p) {
+    print_result("insert_record", variant, 0, "contender_rows_per_sec", (c1.rows - c0.rows)*1e9/elapsed);
+    print_result("insert_record", variant, 0, "contender_busy_retries", c1.busy_retries - c0.busy_retries);
+    print_result("insert_record", variant, 0, "contender_failed", contender_exited_p);
+    if(contender_exited_p) {
+      fprintf(stderr, "insert_record %s: the contender exited with status %d, so this run is invalid\n", variant, WIFEXITED(status)?WEXITSTATUS(status):-1);
+      failed_p = true;
+    }
+    munmap(stats, sizeof(*stats));
+  }
+  sqlite3_free(file_name);
+}
+
+sqlite3_stmt* prepare_insert(sqlite3* conn, struct bench_table* t) {
+  sqlite3_stmt* pStmt;
+  char zParams[32] = "?,?";
+  for(int i=0; i<t->n_data; i++) strcat(zParams, ",?");
+  char* zSql = sqlite3_mprintf("insert into %s values (%s)", t->name, zParams);
+  int rc = sqlite3_prepare_v3(conn, zSql, -1, 0, &pStmt, NULL);
+  sqlite3_free(zSql);
+  if(rc!=SQLITE_OK) {
+    fprintf(stderr, "Can't prepare insert for %s: %s\n", t->name, sqlite3_errmsg(conn));
+    exit(rc);
+  }
+  return pStmt;
+}
+
+// Append synthetic rows to each table from its last row (or from now - span, if that's later) up to now, and delete rows older than the span. Returns the total row count.
+long long refresh_synthetic_db(sqlite3* conn, struct bench_db* b) {
+  time_t now = time(NULL);
+  long long start = now - b->span;
+  long long total = 0;
+  unsigned lcg = 12345;
+  exec_sql(conn, "BEGIN");
+  for(int i=0; i<BENCH_N_DS18B20; i++) {
+    char* zSql = sqlite3_mprintf("insert or ignore into DS18B20_IDs values (%d, 'bench-%d', 'T%d')", i+1, i+1, i+1);
+    exec_sql(conn, zSql);
+    sqlite3_free(zSql);
+  }
+  for(int i=0; i<N_BENCH_TABLES; i++) {
+    struct bench_table* t = &bench_tables[i];
+    bool ds18b20_p = !strcmp(t->name, "DS18B20_logs");
+    double interval = 3600.0/(t->rows_per_hour*scale); // seconds between ticks
+    if(ds18b20_p) interval *= BENCH_N_DS18B20;
+    sqlite3_stmt* pStmt;
+    char* zSql = sqlite3_mprintf("select max(sec) from %s", t->name);
+    sqlite3_prepare_v3(conn, zSql, -1, 0, &pStmt, NULL);
+    sqlite3_free(zSql);
+    double tick = start;
+    if((sqlite3_step(pStmt)==SQLITE_ROW) && (sqlite3_column_type(pStmt, 0)!=SQLITE_NULL))
+      tick = max((double)sqlite3_column_int64(pStmt, 0) + 1, (double)start);
+    sqlite3_finalize(pStmt);
+    pStmt = prepare_insert(conn, t);
+    int val = t->base;
+    for(; tick<now; tick+=interval) {
+      int sec = (int)tick;
+      int cs = (int)((tick - sec)*(TS_CS_MAX+1));
+      for(int id=1; id<=(ds18b20_p?BENCH_N_DS18B20:1); id++) {
+	lcg = lcg*1664525 + 1013904223;
+	val += (int)(lcg>>29) - 3;
+	sqlite3_bind_int(pStmt, 1, sec);
+	sqlite3_bind_int(pStmt, 2, cs);
+	if(ds18b20_p) {
+	  sqlite3_bind_int(pStmt, 3, id);
+	  sqlite3_bind_int(pStmt, 4, val + id*10);
+	} else for(int c=0; c<t->n_data; c++) sqlite3_bind_int(pStmt, c+3, val + c);
+	int rc = sqlite3_step(pStmt);
+	if(rc!=SQLITE_DONE) {
+	  fprintf(stderr, "Synthetic insert into %s failed: %s\n", t->name, sqlite3_errmsg(conn));
+	  exit(rc);
+	}
+	sqlite3_reset(pStmt);
+      }
+    }
+    sqlite3_finalize(pStmt);
+    zSql = sqlite3_mprintf("delete from %s where sec<%lld", t->name, start);
+    exec_sql(conn, zSql);
+    sqlite3_free(zSql);
+    zSql = sqlite3_mprintf("select count(*) from %s", t->name);
+    sqlite3_prepare_v3(conn, zSql, -1, 0, &pStmt, NULL);
+    sqlite3_free(zSql);
+    sqlite3_step(pStmt);
+    total += sqlite3_column_int64(pStmt, 0);
+    sqlite3_finalize(pStmt);
+  }
+  exec_sql(conn, "COMMIT");
+  return total;
+}
+
+long long prepare_synthetic_db(struct bench_db* b, const char* file_name) {
+  sqlite3* conn;
+  bool new_p = access(file_name, F_OK)!=0;
+  int rc = sqlite3_open_v2(file_name, &conn, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, NULL);
+  if(rc!=SQLITE_OK) {
+    fprintf(stderr, "Can't open %s\n", file_name);
+    exit(rc);
+  }
+  exec_sql(conn, "pragma cache_size = -65536; pragma synchronous = off");
+  if(new_p) {
+    fprintf(stderr, "Generating %s; this takes a while for the longer spans...\n", file_name);
+    exec_sql(conn, schema_sql);
+  }
+  long long t0 = now_ns();
+  long long rows = refresh_synthetic_db(conn, b);
+  exec_sql(conn, "pragma journal_mode = WAL; pragma wal_checkpoint(TRUNCATE)");
+  sqlite3_close(conn);
+  fprintf(stderr, "%s: %lld rows, refreshed in %.1fs\n", file_name, rows, (now_ns() - t0)/1e9);
+  return rows;
+}
+
+// The dashboard queries that poll_stream runs, i.e. gh_ctrl.h's GHPI_SQL_LAST_LOGS, GHPI_SQL_DS18B20_LAST, and the data_version and DS18B20_IDs version checks that it caches the IDs and labels by, minus the printing
+void bench_dashboard(struct bench_db* b) {
+  char* file_name = sqlite3_mprintf("%s/bench-%s-x%g-%08x.db", work_dir, b->variant, scale, schema_hash);
+  long long db_rows = prepare_synthetic_db(b, file_name);
+  sqlite3_stmt *pStmt_logs, *pStmt_data_version, *pStmt_DS18B20_IDs_version, *pStmt_DS18B20_IDs, *pStmt_DS18B20_logs;
+  long long ns[BENCH_QUERY_ITERATIONS];
+  long long data_version = -1, IDs_version = -1;
+  long long sink = 0;
+  ghpi_sqlite_init("ghpi_bench", file_name);
+  int rc = sqlite3_prepare_v3(db, GHPI_SQL_LAST_LOGS, -1, SQLITE_PREPARE_PERSISTENT, &pStmt_logs, NULL);
+  check_sql(rc, "sqlite3_prepare failure in bench_dashboard");
+  rc = sqlite3_prepare_v3(db, GHPI_SQL_DATA_VERSION, -1, SQLITE_PREPARE_PERSISTENT, &pStmt_data_version, NULL);
+  check_sql(rc, "sqlite3_prepare failure in bench_dashboard");
+  rc = sqlite3_prepare_v3(db, GHPI_SQL_DS18B20_IDS_VERSION, -1, SQLITE_PREPARE_PERSISTENT, &pStmt_DS18B20_IDs_version, NULL);
+  check_sql(rc, "sqlite3_prepare failure in bench_dashboard");
+  rc = sqlite3_prepare_v3(db, GHPI_SQL_DS18B20_IDS, -1, SQLITE_PREPARE_PERSISTENT, &pStmt_DS18B20_IDs, NULL);
+  check_sql(rc, "sqlite3_prepare failure in bench_dashboard");
+  rc = sqlite3_prepare_v3(db, GHPI_SQL_DS18B20_LAST, -1, SQLITE_PREPARE_PERSISTENT, &pStmt_DS18B20_logs, NULL);
+  check_sql(rc, "sqlite3_prepare failure in bench_dashboard");
+  int ncols = sqlite3_column_count(pStmt_logs);
+  for(int i=0; i<BENCH_QUERY_ITERATIONS; i++) {
+    long long t0 = now_ns();
+    rc = sqlite3_step(pStmt_logs);
+    check_sql(rc, "sqlite3_step failure in bench_dashboard");
+    if(rc==SQLITE_ROW)
+      for(int c=0; c<ncols; c++) sink += sqlite3_column_int(pStmt_logs, c);
+    sqlite3_reset(pStmt_logs);
+    ns[i] = now_ns() - t0;
+  }
+  print_latencies("poll_stream_Last_logs", b->variant, db_rows, ns, BENCH_QUERY_ITERATIONS);
+  for(int i=0; i<BENCH_QUERY_ITERATIONS; i++) {
+    long long t0 = now_ns();
+    sqlite3_step(pStmt_data_version);
+    long long version = sqlite3_column_int64(pStmt_data_version, 0);
+    sqlite3_reset(pStmt_data_version);
+    if(version!=data_version) {
+      data_version = version;
+      sqlite3_step(pStmt_DS18B20_IDs_version);
+      version = sqlite3_column_int64(pStmt_DS18B20_IDs_version, 0);
+      sqlite3_reset(pStmt_DS18B20_IDs_version);
+      if(version!=IDs_version) {
+	IDs_version = version;
+	while(sqlite3_step(pStmt_DS18B20_IDs)==SQLITE_ROW)
+	  sink += sqlite3_column_int(pStmt_DS18B20_IDs, 0) + sqlite3_column_bytes(pStmt_DS18B20_IDs, 1);
+	sqlite3_reset(pStmt_DS18B20_IDs);
+      }
+    }
+    while((rc = sqlite3_step(pStmt_DS18B20_logs))==SQLITE_ROW)
+      sink += sqlite3_column_int(pStmt_DS18B20_logs, 0) + sqlite3_column_int(pStmt_DS18B20_logs, 1) + sqlite3_column_int(pStmt_DS18B20_logs, 2);
+    check_sql(rc, "sqlite3_step failure in bench_dashboard");
+    sqlite3_reset(pStmt_DS18B20_logs);
+    ns[i] = now_ns() - t0;
+  }
+  print_latencies("poll_stream_DS18B20", b->variant, db_rows, ns, BENCH_QUERY_ITERATIONS);
+  fprintf(stderr, "%s checksum %lld\n", b->variant, sink);
+  close_db();
+  sqlite3_free(file_name);
+}
+
+// The live values segment, as poll_stream's overlay_live reads it: one live_read per channel. Independent of the DB, so there's no db_rows. Uses a segment of its own, so as not to disturb the real one.
+void bench_live() {
+  char* name = sqlite3_mprintf("/ghpi-live-bench-%d", (int)getpid());
+  struct live_segment* seg = live_map(name, true);
+  int slots[GHPI_LIVE_SLOTS_MAX];
+  int n = 0;
+  struct timespec rt;
+  struct live_reading r;
+  long long ns[BENCH_QUERY_ITERATIONS];
+  long long sink = 0;
+  for(int t=0; t<N_BENCH_TABLES; t++) {
+    if(!strcmp(bench_tables[t].name, "DS18B20_logs")) continue; // Not published; read_DS18B20.py writes only to the DB
+    for(int c=0; c<bench_tables[t].n_data; c++) {
+      char* zChannel = sqlite3_mprintf("%s.%d", bench_tables[t].name, c);
+      slots[n++] = live_claim(seg, zChannel);
+      sqlite3_free(zChannel);
+    }
+  }
+  clock_gettime(CLOCK_REALTIME, &rt);
+  long long t0 = now_ns();
+  for(int i=0; i<BENCH_LIVE_PUBLISHES; i++) live_publish(seg, slots[i%n], i, false, &rt);
+  long long elapsed = now_ns() - t0;
+  print_result("live_publish", "", 0, "ns_per_call", (double)elapsed/BENCH_LIVE_PUBLISHES);
+  for(int i=0; i<BENCH_QUERY_ITERATIONS; i++) {
+    t0 = now_ns();
+    sink += live_generation(seg);
+    for(int j=0; j<n; j++)
+      if(live_read(seg, slots[j], &r)) sink += r.val;
+    ns[i] = now_ns() - t0;
+  }
+  print_latencies("poll_stream_live", "", 0, ns, BENCH_QUERY_ITERATIONS);
+  fprintf(stderr, "live checksum %lld\n", sink);
+  live_unmap(seg);
+  shm_unlink(name);
+  sqlite3_free(name);
+}
+
+int main(int argc, char** argv) {
+  if((argc<2) || (argc>3)) {
+    fprintf(stderr, "Usage: %s work-dir [scale]\n", argv[0]);
+    exit(-1);
+  }
+  work_dir = argv[1];
+  if(argc==3) scale = atof(argv[2]);
+  if(scale<=0) {
+    fprintf(stderr, "scale must be positive\n");
+    exit(-1);
+  }
+  load_schema();
+  printf("benchmark,variant,db_rows,metric,value\n");
+  bench_reading_change();
+  bench_insert_record(false, false);
+  bench_insert_record(false, true);
+  bench_insert_record(true, false);
+  bench_insert_record(true, true);
+  bench_live();
+  for(int i=0; i<N_BENCH_DBS; i++) bench_dashboard(&bench_dbs[i]);
+  return failed_p?1:0;
+}
@@ -0,0 +1,50 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "gh_live.h"
+#include "gh_bus.h"
+
+// Prints the I2C bus's occupancy by each device, over an interval, from the counters that the processes sharing it keep in shared memory (see gh_bus.h): transfers, bytes, the share of the time the bus was busy with the device's transfers, and how often and long they waited for another process's reservation. Then the reservations held now, and the bus recoveries.
+// Usage: ghpi_bus [seconds]
+
+#define BUS_INTERVAL_DEFAULT 10 // seconds
+
+const char* class_names[] = {"normal", "realtime", "recovery"};
+
+struct bus_device before[GHPI_BUS_ADDRS];
+
+int main(int argc, char** argv) {
+  if(argc>2) {
+    fprintf(stderr, "Usage: %s [seconds]\n", argv[0]);
+    exit(-1);
+  }
+  int seconds = (argc==2)?atoi(argv[1]):BUS_INTERVAL_DEFAULT;
+  struct bus_segment* seg = bus_map(false);
+  if(!seg) {
+    fprintf(stderr, "No bus segment; nothing has used the I2C bus yet\n");
+    exit(-1);
+  }
+  memcpy(before, (void*)seg->devices, sizeof(before));
+  unsigned t0 = bus_now_us();
+  sleep(seconds);
+  unsigned elapsed = bus_now_us() - t0;
+  printf("addr,transfers/s,bytes/s,busy_%%,waits,wait_ms_mean,errors\n");
+  for(int a=0; a<GHPI_BUS_ADDRS; a++) {
+    struct bus_device* d = &seg->devices[a];
+    struct bus_device* b = &before[a];
+    unsigned transfers = d->transfers - b->transfers, waits = d->waits - b->waits;
+    if(!transfers) continue;
+    printf("0x%02x,%.1f,%.1f,%.2f,%u,%.3f,%u\n", a, transfers*1e6/elapsed, (d->bytes - b->bytes)*1e6/elapsed, (d->busy_us - b->busy_us)*100.0/elapsed,
+	   waits, waits?(d->wait_us - b->wait_us)/1000.0/waits:0, d->errors - b->errors);
+  }
+  unsigned now = bus_now_us();
+  for(int i=0; i<GHPI_BUS_WINDOWS_MAX; i++) {
+    struct bus_window w = seg->windows[i];
+    if(!w.owner || ((int)(w.end_us - now)<=0)) continue;
+    printf("Reserved by thread %d (%s) from %+.1fms to %+.1fms\n", w.owner, ((w.cls>=0) && (w.cls<=BUS_RECOVERY))?class_names[w.cls]:"?",
+	   (int)(w.start_us - now)/1000.0, (int)(w.end_us - now)/1000.0);
+  }
+  if(seg->recoveries) printf("%u bus recoveries, the last %.1fs ago\n", seg->recoveries, (now - seg->last_recovery_us)/1e6);
+  return 0;
+}
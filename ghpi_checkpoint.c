@@ -0,0 +1,217 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "gh_ctrl.h"
+
+// Does the DB's WAL checkpoints in the background, since the daemons' connections no longer do them (see ghpi_wal_hook), so that no daemon stalls for one.
+// A passive checkpoint, which never waits for anything, is done every CHECKPOINT_PERIOD seconds if anything's been committed, or as soon as the WAL has grown by CHECKPOINT_GROWTH. Once the WAL is fully checkpointed, the next writer starts it over from the beginning, unless a reader is still using it. Escalating to a restart (which waits for those readers) or a truncate (which also shrinks the file) is tried only once a passive checkpoint has caught up and nothing has been committed for a poll, and only if no reader or writer is in the way right then, since both take the write lock; otherwise it waits for a later round, though past CHECKPOINT_FORCE_BYTES a truncate is tried even while commits are coming in.
+// Each checkpoint that wrote anything, escalated, or was held up by a reader is logged in Checkpoint_logs (see ghpi-arch.sql), and stats are printed every CHECKPOINT_STATS_PERIOD seconds.
+// Usage: ghpi_checkpoint db-file
+
+#define CHECKPOINT_POLL 200 // ms between looks at the WAL
+#define CHECKPOINT_PERIOD 10 // seconds
+#define CHECKPOINT_GROWTH (4<<20) // bytes
+#define CHECKPOINT_CATCHUP_PASSES 4 // Passive checkpoints repeated straight away while the previous one wrote anything, i.e. while commits came in during it, so that it ends caught up, and the next writer can start the WAL over
+#define CHECKPOINT_RESTART_FRAMES 4096 // Try a restart if a caught-up passive checkpoint leaves this many frames, i.e. writers haven't been starting the WAL over.
+#define CHECKPOINT_TRUNCATE_BYTES (16<<20) // Try a truncate if the WAL file is bigger, e.g. after a burst, since it never shrinks otherwise
+#define CHECKPOINT_FORCE_BYTES (64<<20) // Try a truncate even if commits are still coming in
+#define CHECKPOINT_LOG_MAX 64 // Rows of Checkpoint_logs held until the next round
+#define CHECKPOINT_STATS_PERIOD 600 // seconds
+
+// A row of Checkpoint_logs. They're written at the start of the next round, just before its first checkpoint, since a commit right after a checkpoint would keep it from leaving the WAL caught up.
+struct checkpoint_log {
+  struct timespec rt;
+  int mode, busy_p;
+  long us;
+  int nLog, nCkpt, pages;
+  long long wal_bytes;
+};
+
+sqlite3* ckpt; // Own connection for checkpointing, without a busy handler, so that a restart or truncate fails at once rather than waiting
+sqlite3_stmt *pStmt_version, *pStmt_log;
+struct checkpoint_log logs[CHECKPOINT_LOG_MAX];
+int n_logs;
+char* wal_file_name;
+int nLog_prev, nCkpt_prev; // As of the previous checkpoint, in the WAL generation with salt_prev
+unsigned salt_prev;
+struct timespec ts_stats;
+long stats_checkpoints, stats_busy, stats_pages, stats_max_us;
+long long stats_max_wal_bytes;
+
+// The WAL file's size, and its salt, which changes whenever the WAL is started over. 0 and 0 if there's no WAL.
+void wal_state(long long* bytes, unsigned* salt) {
+  *bytes = 0;
+  *salt = 0;
+  int fd = open(wal_file_name, O_RDONLY);
+  if(fd<0) return;
+  struct stat st;
+  unsigned char header[20];
+  if(!fstat(fd, &st)) *bytes = st.st_size;
+  if(pread(fd, header, sizeof(header), 0)==sizeof(header)) *salt = ((unsigned)header[16]<<24) | (header[17]<<16) | (header[18]<<8) | header[19]; // Salt-1, big-endian
+  close(fd);
+}
+
+long long data_version() { // Changes whenever another connection commits
+  int rc = sqlite3_step(pStmt_version);
+  if(rc!=SQLITE_ROW) {
+    fprintf(stderr, "sqlite3_step failure in data_version: %s\n", sqlite3_errmsg(ckpt));
+    exit(rc);
+  }
+  long long version = sqlite3_column_int64(pStmt_version, 0);
+  sqlite3_reset(pStmt_version);
+  return version;
+}
+
+void flush_logs() {
+  if(!n_logs) return;
+  int rc = sqlite3_exec(db, "BEGIN IMMEDIATE", NULL, NULL, NULL);
+  check_sql(rc, "sqlite3_exec failure in flush_logs for begin");
+  for(int i=0; i<n_logs; i++) {
+    struct checkpoint_log* l = &logs[i];
+    sqlite3_bind_int64(pStmt_log, 1, l->rt.tv_sec);
+    sqlite3_bind_int(pStmt_log, 2, l->rt.tv_nsec >> TS_TV_NSEC_SHIFT);
+    sqlite3_bind_int(pStmt_log, 3, l->mode);
+    sqlite3_bind_int(pStmt_log, 4, l->busy_p);
+    sqlite3_bind_int64(pStmt_log, 5, l->us);
+    if(l->nCkpt>=0) {
+      sqlite3_bind_int(pStmt_log, 6, l->nLog);
+      sqlite3_bind_int(pStmt_log, 7, l->nCkpt);
+      sqlite3_bind_int(pStmt_log, 8, l->pages);
+    }
+    else for(int c=6; c<=8; c++) sqlite3_bind_null(pStmt_log, c);
+    sqlite3_bind_int64(pStmt_log, 9, l->wal_bytes);
+    rc = sqlite3_step(pStmt_log);
+    check_sql(rc, "sqlite3_step failure in flush_logs");
+    sqlite3_reset(pStmt_log);
+  }
+  rc = sqlite3_exec(db, "COMMIT", NULL, NULL, NULL);
+  check_sql(rc, "sqlite3_exec failure in flush_logs for commit");
+  n_logs = 0;
+}
+
+// Returns the number of pages written. done_p is set to whether the WAL was fully checkpointed, as of when it started.
+int checkpoint(int mode, bool* done_p) {
+  long long wal_bytes;
+  unsigned salt;
+  wal_state(&wal_bytes, &salt);
+  int nLog = -1, nCkpt = -1;
+  struct timespec ts_start, ts_end, ts_elapsed;
+  clock_gettime(CLOCK_MONOTONIC, &ts_start);
+  int rc = sqlite3_wal_checkpoint_v2(ckpt, NULL, mode, &nLog, &nCkpt);
+  clock_gettime(CLOCK_MONOTONIC, &ts_end);
+  if(rc!=SQLITE_OK && rc!=SQLITE_BUSY) {
+    fprintf(stderr, "sqlite3_wal_checkpoint_v2 failure: %s\n", sqlite3_errmsg(ckpt));
+    exit(rc);
+  }
+  ts_diff(&ts_elapsed, &ts_end, &ts_start);
+  long us = ts_elapsed.tv_sec*1000000L + ts_elapsed.tv_nsec/1000;
+  bool busy_p = (rc==SQLITE_BUSY) || (nCkpt<nLog);
+  *done_p = (rc==SQLITE_OK) && (nCkpt==nLog);
+  int pages = 0;
+  if(nCkpt>=0) {
+    pages = ((salt==salt_prev) && (nCkpt>=nCkpt_prev) && (nLog>=nLog_prev))?(nCkpt - nCkpt_prev):nCkpt; // Else the WAL was started over since
+    nLog_prev = nLog;
+    nCkpt_prev = nCkpt;
+    salt_prev = salt;
+  }
+  if(*done_p && (mode!=SQLITE_CHECKPOINT_PASSIVE)) nLog_prev = nCkpt_prev = 0; // Started over
+  stats_checkpoints++;
+  stats_busy += busy_p;
+  stats_pages += pages;
+  stats_max_us = max(stats_max_us, us);
+  stats_max_wal_bytes = max(stats_max_wal_bytes, wal_bytes);
+  if(pages || busy_p || (mode!=SQLITE_CHECKPOINT_PASSIVE)) {
+    struct timespec rt;
+    clock_gettime(CLOCK_REALTIME, &rt);
+    struct checkpoint_log* l = n_logs?&logs[n_logs-1]:NULL;
+    if(l && (l->rt.tv_sec==rt.tv_sec) && ((l->rt.tv_nsec >> TS_TV_NSEC_SHIFT)==(rt.tv_nsec >> TS_TV_NSEC_SHIFT)) && (l->mode==mode)) { // Catch-up passes in the same tick share its row
+      l->busy_p |= busy_p;
+      l->us += us;
+      l->pages += pages;
+    }
+    else if(n_logs<CHECKPOINT_LOG_MAX) {
+      l = &logs[n_logs++];
+      l->rt = rt;
+      l->mode = mode;
+      l->busy_p = busy_p;
+      l->us = us;
+      l->pages = pages;
+      l->wal_bytes = wal_bytes;
+    }
+    else l = NULL;
+    if(l) {
+      l->nLog = nLog;
+      l->nCkpt = nCkpt;
+    }
+  }
+  return pages;
+}
+
+void print_stats() {
+  char ts_buf[64];
+  time_t now = time(NULL);
+  strftime(ts_buf, 64, "%Y-%m-%d %H:%M:%S", localtime(&now));
+  fprintf(stderr, "%s Checkpoints: %ld (%ld held up by readers), %ld pages written, longest %.1fms, largest WAL %.1fMiB, over %lds\n", ts_buf,
+	  stats_checkpoints, stats_busy, stats_pages, stats_max_us/1000.0, stats_max_wal_bytes/1048576.0, ms_since(&ts_stats)/1000);
+  stats_checkpoints = stats_busy = stats_pages = stats_max_us = 0;
+  stats_max_wal_bytes = 0;
+  clock_gettime(CLOCK_MONOTONIC, &ts_stats);
+}
+
+int main(int argc, char** argv) {
+  daemon_init(argc, argv);
+  int rc = sqlite3_open_v2(argv[1], &ckpt, SQLITE_OPEN_READWRITE, NULL);
+  if(rc!=SQLITE_OK) {
+    fprintf(stderr, "sqlite3_open_v2 failure for checkpoint connection: %s\n", sqlite3_errmsg(ckpt));
+    exit(rc);
+  }
+  sqlite3_wal_hook(ckpt, NULL, NULL); // It never writes, but just in case, no auto-checkpoint
+  rc = sqlite3_prepare_v3(ckpt, "PRAGMA data_version", -1, SQLITE_PREPARE_PERSISTENT, &pStmt_version, NULL);
+  if(rc!=SQLITE_OK) {
+    fprintf(stderr, "sqlite3_prepare failure in ghpi_checkpoint: %s\n", sqlite3_errmsg(ckpt));
+    exit(rc);
+  }
+  rc = sqlite3_prepare_v3(db, "INSERT INTO Checkpoint_logs VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?)", -1, SQLITE_PREPARE_PERSISTENT, &pStmt_log, NULL);
+  if(rc!=SQLITE_OK) {
+    fprintf(stderr, "No Checkpoint_logs table; upgrade the DB with ghpi-arch-upgrade-5.sql\n");
+    exit(rc);
+  }
+  wal_file_name = sqlite3_mprintf("%s-wal", argv[1]);
+  long long wal_bytes_last;
+  unsigned salt;
+  wal_state(&wal_bytes_last, &salt);
+  long long version_last = -1, version_poll = -1;
+  struct timespec ts_last;
+  clock_gettime(CLOCK_MONOTONIC, &ts_last);
+  clock_gettime(CLOCK_MONOTONIC, &ts_stats);
+  while(1) {
+    struct timespec ts = {0, CHECKPOINT_POLL*1000000L};
+    nanosleep(&ts, NULL);
+    if(ms_since(&ts_stats) >= CHECKPOINT_STATS_PERIOD*1000) print_stats();
+    long long wal_bytes;
+    wal_state(&wal_bytes, &salt);
+    long long version = data_version();
+    bool quiet_p = (version==version_poll); // Nothing committed since the previous poll
+    version_poll = version;
+    if((wal_bytes < wal_bytes_last + CHECKPOINT_GROWTH)
+       && ((ms_since(&ts_last) < CHECKPOINT_PERIOD*1000) || (version==version_last)))
+      continue;
+    flush_logs();
+    version_last = version_poll = data_version(); // After logging, so that the log's own commit doesn't count
+    bool done_p;
+    int pages = checkpoint(SQLITE_CHECKPOINT_PASSIVE, &done_p);
+    for(int i=0; done_p && pages && (i<CHECKPOINT_CATCHUP_PASSES); i++) pages = checkpoint(SQLITE_CHECKPOINT_PASSIVE, &done_p);
+    wal_state(&wal_bytes, &salt);
+    if(done_p && ((quiet_p && !pages) || (wal_bytes>CHECKPOINT_FORCE_BYTES))) { // Caught up, and nothing committed for a poll, so a writer is unlikely to be held up (and sleep in its busy handler) by the write lock
+      if(wal_bytes>CHECKPOINT_TRUNCATE_BYTES) checkpoint(SQLITE_CHECKPOINT_TRUNCATE, &done_p);
+      else if(nLog_prev>=CHECKPOINT_RESTART_FRAMES) checkpoint(SQLITE_CHECKPOINT_RESTART, &done_p);
+    }
+    wal_state(&wal_bytes_last, &salt);
+    clock_gettime(CLOCK_MONOTONIC, &ts_last);
+  }
+  return 0;
+}
@@ -0,0 +1,288 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "gh_ctrl.h"
+#include "gh_partition.h"
+
+// Keeps Energy_hours, Energy_days, Energy_months, and Energy_seasons (see ghpi-arch.sql) up to date with INA260_logs and Furnace_logs. Like ghpi_rollup, each pass accumulates the logs from the watermark in Energy_state to ENERGY_LAG before now, a chunk per transaction, then waits for the next minute; so on its first run, or after downtime, it catches up by itself. Each chunk adds to the totals of the periods it overlaps, and advances the watermark, in the same transaction, so no log is ever counted twice, or missed.
+// The reading in effect at the watermark, and when the furnace's current run started, are kept in Energy_state, since a run can span any number of chunks, and its start may since have been archived or partitioned.
+// Periods are split at UTC hours, and each hour is counted in the local day, month, and season that it starts in; so in a time zone that's not a whole number of hours off UTC, the hour that straddles local midnight is counted in the day it starts in.
+// Usage: ghpi_energy db-file
+
+#define ENERGY_LAG 60 // seconds. As ROLLUP_LAG.
+#define ENERGY_CHUNK 86400 // seconds of logs per transaction
+#define ENERGY_PERIODS_MAX 32 // Of each level, per chunk. A chunk is at most 25 hours, over at most 2 days, months, or seasons.
+#define ENERGY_STATS_THRESHOLD 1000 // ms. Passes that take longer, i.e. catching up, are reported.
+#define BTU_PER_THERM 100000.0
+
+enum {LEVEL_HOUR, LEVEL_DAY, LEVEL_MONTH, LEVEL_SEASON, N_LEVELS};
+struct level {
+  const char* table;
+  const char* key_column;
+  sqlite3_stmt* pStmt_upsert;
+};
+struct level levels[N_LEVELS] = {
+  {"Energy_hours", "sec"},
+  {"Energy_days", "day"},
+  {"Energy_months", "month"},
+  {"Energy_seasons", "season"}
+};
+
+const char zSql_upsert[] = "INSERT INTO %s VALUES (?, ?, ?, ?, ?, ?, ?, ?) ON CONFLICT(%s) DO UPDATE SET \
+kwh=kwh+excluded.kwh, covered=covered+excluded.covered, burn=burn+excluded.burn, ignitions=ignitions+excluded.ignitions, \
+therms=therms+excluded.therms, electricity_cost=electricity_cost+excluded.electricity_cost, gas_cost=gas_cost+excluded.gas_cost";
+
+// A period's accumulation within a chunk, to be added to its row
+struct period {
+  long long sec; // For hours
+  char key[32]; // For the others
+  double wms; // Pmean integrated, in W*ms
+  long long covered; // ms
+  long long burn; // ms
+  int ignitions;
+};
+struct period periods[N_LEVELS][ENERGY_PERIODS_MAX];
+int n_periods[N_LEVELS];
+
+// Config, reloaded each pass
+double electricity_cost, gas_cost, burn_rate;
+long long ignition_delay; // ms
+int season_start;
+
+// Energy_state
+long long wm; // sec
+bool pmean_null_p;
+int pmean;
+long long on_since; // ms, or -1 if the furnace is off
+
+sqlite3_stmt *pStmt_begin, *pStmt_commit, *pStmt_clear_state, *pStmt_set_state;
+
+void step_done(sqlite3_stmt* pStmt, const char* msg) { // For statements that return no rows
+  int rc = sqlite3_step(pStmt);
+  check_sql(rc, msg);
+  sqlite3_reset(pStmt);
+}
+
+void prepare(const char* zSql, sqlite3_stmt** ppStmt) {
+  int rc = sqlite3_prepare_v3(db, zSql, -1, SQLITE_PREPARE_PERSISTENT, ppStmt, NULL);
+  check_sql(rc, "sqlite3_prepare failure in ghpi_energy");
+}
+
+void setup() {
+  if(!partition_has_table_p(db, "main", "Energy_state")) {
+    fprintf(stderr, "No Energy_state table; upgrade the DB with ghpi-arch-upgrade-6.sql\n");
+    exit(-1);
+  }
+  for(int l=0; l<N_LEVELS; l++) {
+    char* zSql = sqlite3_mprintf(zSql_upsert, levels[l].table, levels[l].key_column);
+    prepare(zSql, &levels[l].pStmt_upsert);
+    sqlite3_free(zSql);
+  }
+  prepare("BEGIN IMMEDIATE", &pStmt_begin);
+  prepare("COMMIT", &pStmt_commit);
+  prepare("DELETE FROM Energy_state", &pStmt_clear_state);
+  prepare("INSERT INTO Energy_state VALUES (?, ?, ?)", &pStmt_set_state);
+}
+
+void load_config() {
+  electricity_cost = config_double("electricity_cost", 0);
+  gas_cost = config_double("gas_cost", 0);
+  burn_rate = config_double("furnace_burn_rate", 0);
+  ignition_delay = config_double("furnace_ignition_delay", 0)*1000;
+  season_start = config_double("heating_season_start", 7);
+  if((season_start<1) || (season_start>12)) season_start = 7;
+}
+
+// Returns false if there's no state yet
+bool load_state() {
+  sqlite3_stmt* pStmt;
+  int rc = sqlite3_prepare_v3(db, "SELECT wm, Pmean, on_since FROM Energy_state", -1, 0, &pStmt, NULL);
+  check_sql(rc, "sqlite3_prepare failure in load_state");
+  rc = sqlite3_step(pStmt);
+  check_sql(rc, "sqlite3_step failure in load_state");
+  bool found_p = rc==SQLITE_ROW;
+  if(found_p) {
+    wm = sqlite3_column_int64(pStmt, 0);
+    pmean_null_p = sqlite3_column_type(pStmt, 1)==SQLITE_NULL;
+    pmean = sqlite3_column_int(pStmt, 1);
+    on_since = (sqlite3_column_type(pStmt, 2)==SQLITE_NULL)?-1:sqlite3_column_int64(pStmt, 2);
+  }
+  sqlite3_finalize(pStmt);
+  return found_p;
+}
+
+// The period of the level that the hour starting at sec is in
+struct period* period_of(int level, long long sec) {
+  char key[32] = "";
+  if(level!=LEVEL_HOUR) {
+    time_t t = sec;
+    struct tm tm;
+    localtime_r(&t, &tm);
+    int year = tm.tm_year + 1900;
+    if(level==LEVEL_DAY) snprintf(key, sizeof(key), "%04d-%02d-%02d", year, tm.tm_mon+1, tm.tm_mday);
+    else if(level==LEVEL_MONTH) snprintf(key, sizeof(key), "%04d-%02d", year, tm.tm_mon+1);
+    else {
+      if(tm.tm_mon+1 < season_start) year--;
+      snprintf(key, sizeof(key), "%04d-%02d", year, (year+1)%100);
+    }
+  }
+  for(int i=0; i<n_periods[level]; i++) {
+    struct period* p = &periods[level][i];
+    if((level==LEVEL_HOUR)?(p->sec==sec):!strcmp(p->key, key)) return p;
+  }
+  if(n_periods[level]==ENERGY_PERIODS_MAX) { // Can't happen with ENERGY_CHUNK a day
+    fprintf(stderr, "More than %d periods in a chunk\n", ENERGY_PERIODS_MAX);
+    exit(-1);
+  }
+  struct period* p = &periods[level][n_periods[level]++];
+  memset(p, 0, sizeof(*p));
+  p->sec = sec;
+  strcpy(p->key, key);
+  return p;
+}
+
+enum {ACC_POWER, ACC_BURN};
+
+// Add t0 to t1 (ms) of power at watts, or of burn, to the periods it overlaps
+void accumulate(int what, long long t0, long long t1, int watts) {
+  while(t0<t1) {
+    long long hour = t0/3600000*3600;
+    long long t = (t1 < (hour+3600)*1000)?t1:(hour+3600)*1000;
+    for(int l=0; l<N_LEVELS; l++) {
+      struct period* p = period_of(l, hour);
+      if(what==ACC_POWER) {
+	p->wms += (double)watts*(t - t0);
+	p->covered += t - t0;
+      } else p->burn += t - t0;
+    }
+    t0 = t;
+  }
+}
+
+void ignition(long long t) {
+  for(int l=0; l<N_LEVELS; l++) period_of(l, t/3600000*3600)->ignitions++;
+}
+
+long long row_ms(struct archive_row* r) {
+  return r->sec*1000LL + ((long long)r->cs << TS_TV_NSEC_SHIFT)/1000000;
+}
+
+// The furnace was on (if on_since>=0) from t0 to t1. Its burn starts ignition_delay into the run.
+void burn(long long t0, long long t1) {
+  if(on_since<0) return;
+  long long burn_from = on_since + ignition_delay;
+  if(t0<burn_from) t0 = burn_from;
+  if(t0>=t1) return;
+  if(t0==burn_from) ignition(burn_from); // The part of the run that contains its burn's start, which is only ever one
+  accumulate(ACC_BURN, t0, t1, 0);
+}
+
+void store_periods() {
+  for(int l=0; l<N_LEVELS; l++)
+    for(int i=0; i<n_periods[l]; i++) {
+      struct period* p = &periods[l][i];
+      sqlite3_stmt* pStmt = levels[l].pStmt_upsert;
+      double kwh = p->wms/3.6e9;
+      double therms = p->burn/3.6e6*burn_rate/BTU_PER_THERM;
+      if(l==LEVEL_HOUR) sqlite3_bind_int64(pStmt, 1, p->sec);
+      else sqlite3_bind_text(pStmt, 1, p->key, -1, SQLITE_STATIC);
+      sqlite3_bind_double(pStmt, 2, kwh);
+      sqlite3_bind_int64(pStmt, 3, p->covered);
+      sqlite3_bind_double(pStmt, 4, p->burn/1000.0);
+      sqlite3_bind_int(pStmt, 5, p->ignitions);
+      sqlite3_bind_double(pStmt, 6, therms);
+      sqlite3_bind_double(pStmt, 7, kwh*electricity_cost);
+      sqlite3_bind_double(pStmt, 8, therms*gas_cost);
+      step_done(pStmt, "sqlite3_step failure in store_periods");
+    }
+}
+
+// Accumulate the logs (archived or not) from wm to sec_end, and advance wm, in one transaction. Returns the number of log rows.
+long energy_chunk(long long sec_end) {
+  struct archive_row row;
+  long rows = 0;
+  step_done(pStmt_begin, "sqlite3_step failure in energy_chunk for begin");
+  memset(n_periods, 0, sizeof(n_periods));
+  const char* col_pmean = "Pmean";
+  long long t = wm*1000;
+  struct archive_cursor* c = archive_open(db, "INA260_logs", false, 0, &col_pmean, 1, wm, sec_end);
+  while(archive_step(c, &row)) {
+    long long t_row = row_ms(&row);
+    if(!pmean_null_p) accumulate(ACC_POWER, t, t_row, pmean);
+    pmean_null_p = row.nulls & 1;
+    pmean = row.vals[0];
+    t = t_row;
+    rows++;
+  }
+  archive_close(c);
+  if(!pmean_null_p) accumulate(ACC_POWER, t, sec_end*1000, pmean);
+  const char* cols_q[] = {"q1", "q2"};
+  t = wm*1000;
+  c = archive_open(db, "Furnace_logs", false, 0, cols_q, 2, wm, sec_end);
+  while(archive_step(c, &row)) {
+    long long t_row = row_ms(&row);
+    burn(t, t_row);
+    bool on_p = !(row.nulls & 3) && (row.vals[0]==0) && (row.vals[1]==0); // As Furnace_logs_state.furnace_ctrl
+    if(!on_p) on_since = -1;
+    else if(on_since<0) on_since = t_row; // Else it's logged again while on, e.g. when read_furnace restarts, and the run goes on
+    t = t_row;
+    rows++;
+  }
+  archive_close(c);
+  burn(t, sec_end*1000);
+  store_periods();
+  wm = sec_end;
+  step_done(pStmt_clear_state, "sqlite3_step failure in energy_chunk for state");
+  sqlite3_bind_int64(pStmt_set_state, 1, wm);
+  if(pmean_null_p) sqlite3_bind_null(pStmt_set_state, 2);
+  else sqlite3_bind_int(pStmt_set_state, 2, pmean);
+  if(on_since<0) sqlite3_bind_null(pStmt_set_state, 3);
+  else sqlite3_bind_int64(pStmt_set_state, 3, on_since);
+  step_done(pStmt_set_state, "sqlite3_step failure in energy_chunk for state");
+  step_done(pStmt_commit, "sqlite3_step failure in energy_chunk for commit");
+  return rows;
+}
+
+void energy_pass() {
+  struct timespec ts_start;
+  clock_gettime(CLOCK_MONOTONIC, &ts_start);
+  long long horizon = time(NULL) - ENERGY_LAG;
+  horizon -= horizon%60;
+  load_config();
+  if(!load_state()) { // Start from the first row of either table, with no reading in effect, and the furnace off
+    long long first_ina260, first_furnace;
+    bool ina260_p = archive_first_sec(db, "INA260_logs", false, 0, &first_ina260);
+    bool furnace_p = archive_first_sec(db, "Furnace_logs", false, 0, &first_furnace);
+    if(!ina260_p && !furnace_p) return; // Nothing logged yet
+    wm = (ina260_p && furnace_p)?((first_ina260<first_furnace)?first_ina260:first_furnace):(ina260_p?first_ina260:first_furnace);
+    wm -= wm%3600;
+    pmean_null_p = true;
+    on_since = -1;
+  }
+  long rows = 0;
+  while(wm<horizon) {
+    long long sec_end = wm - wm%ENERGY_CHUNK + ENERGY_CHUNK; // Chunks aligned to UTC days, so that each has at most 25 hours
+    rows += energy_chunk((sec_end<horizon)?sec_end:horizon);
+  }
+  long ms = ms_since(&ts_start);
+  if(ms>=ENERGY_STATS_THRESHOLD) {
+    char ts_buf[64];
+    time_t now = time(NULL);
+    strftime(ts_buf, 64, "%Y-%m-%d %H:%M:%S", localtime(&now));
+    fprintf(stderr, "%s Accumulated %ld log rows in %.1fs\n", ts_buf, rows, ms/1000.0);
+  }
+}
+
+int main(int argc, char** argv) {
+  daemon_init(argc, argv);
+  setup();
+  while(1) {
+    energy_pass();
+    struct timespec ts;
+    ts.tv_sec = 60 - (time(NULL) - ENERGY_LAG)%60;
+    ts.tv_nsec = 0;
+    nanosleep(&ts, NULL);
+  }
+  return 0;
+}
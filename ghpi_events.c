@@ -0,0 +1,79 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+#include "gh_ctrl.h"
+#include "gh_partition.h"
+
+// Prints the INA260's power quality events (see INA260_events in ghpi-arch.sql), including those in months that ghpi_partition has moved out: without sec and cs, a line per event, as CSV; with them, that event's samples, as CSV of burst (0 being the triggering one), ms from the trigger, and A, e.g. to plot an inrush.
+// Usage: ghpi_events db-file [sec cs]
+
+#define EVENTS_BUSY_TIMEOUT 5000 // ms
+#define EVENTS_SAMPLES_MAX 4096 // Per burst
+
+long long t_ev[EVENTS_SAMPLES_MAX];
+int n_ev[EVENTS_SAMPLES_MAX];
+
+void list_events(long long sec_from, long long sec_to) {
+  sqlite3_stmt* pStmt;
+  int rc = sqlite3_prepare_v3(db, "SELECT sec, cs, Timestamp, Kind, Irms_max_A, Ipeak_A, Vrms_min_V, Bursts, Bytes FROM INA260_events_formatted WHERE sec>=? AND sec<? ORDER BY sec, cs", -1, 0, &pStmt, NULL);
+  check_sql(rc, "sqlite3_prepare failure in list_events");
+  sqlite3_bind_int64(pStmt, 1, sec_from);
+  sqlite3_bind_int64(pStmt, 2, sec_to);
+  while((rc = sqlite3_step(pStmt))==SQLITE_ROW)
+    printf("%d,%d,%s,%s,%.2f,%.2f,%d,%d,%d\n", sqlite3_column_int(pStmt, 0), sqlite3_column_int(pStmt, 1), sqlite3_column_text(pStmt, 2), sqlite3_column_text(pStmt, 3),
+	   sqlite3_column_double(pStmt, 4), sqlite3_column_double(pStmt, 5), sqlite3_column_int(pStmt, 6), sqlite3_column_int(pStmt, 7), sqlite3_column_int(pStmt, 8));
+  check_sql(rc, "sqlite3_step failure in list_events");
+  sqlite3_finalize(pStmt);
+}
+
+void print_event(int sec, int cs) {
+  sqlite3_stmt* pStmt;
+  int rc = sqlite3_prepare_v3(db, "SELECT pre, pre+1+post, samples FROM INA260_events WHERE sec=? AND cs=?", -1, 0, &pStmt, NULL);
+  check_sql(rc, "sqlite3_prepare failure in print_event");
+  sqlite3_bind_int(pStmt, 1, sec);
+  sqlite3_bind_int(pStmt, 2, cs);
+  rc = sqlite3_step(pStmt);
+  check_sql(rc, "sqlite3_step failure in print_event");
+  if(rc!=SQLITE_ROW) {
+    fprintf(stderr, "No event at %d.%d\n", sec, cs);
+    exit(-1);
+  }
+  int pre = sqlite3_column_int(pStmt, 0), n_bursts = sqlite3_column_int(pStmt, 1);
+  const unsigned char* p = (const unsigned char*)sqlite3_column_blob(pStmt, 2);
+  const unsigned char* end = p + sqlite3_column_bytes(pStmt, 2);
+  printf("burst,ms,A\n");
+  for(int b=0; b<n_bursts; b++) {
+    int n;
+    if(!archive_decode_series(&p, end, t_ev, n_ev, EVENTS_SAMPLES_MAX, &n)) {
+      fprintf(stderr, "Event %d.%d is corrupt at burst %d\n", sec, cs, b);
+      exit(-1);
+    }
+    for(int i=0; i<n; i++) printf("%d,%.3f,%.3f\n", b-pre, t_ev[i]/1000.0, n_ev[i]*1.25/1000); // Chip output unit is 1.25 mA
+  }
+  sqlite3_finalize(pStmt);
+}
+
+int main(int argc, char** argv) {
+  if((argc!=2) && (argc!=4)) {
+    fprintf(stderr, "Usage: %s db-file [sec cs]\n", argv[0]);
+    exit(-1);
+  }
+  int rc = sqlite3_open_v2(argv[1], &db, SQLITE_OPEN_READONLY, NULL);
+  check_sql(rc, "sqlite3_open_v2 failure in ghpi_events");
+  sqlite3_busy_timeout(db, EVENTS_BUSY_TIMEOUT);
+  long long sec_next;
+  if(argc==2) {
+    printf("sec,cs,timestamp,kind,Irms_max_A,Ipeak_A,Vrms_min_V,bursts,bytes\n");
+    for(long long sec_from = 0; sec_from<LLONG_MAX; sec_from = sec_next) { // As many partitions at a time as can be attached
+      sqlite3_free(partition_attach(db, argv[1], sec_from, LLONG_MAX, &sec_next));
+      list_events(sec_from, sec_next);
+      partition_detach(db);
+    }
+  } else {
+    int sec = atoi(argv[2]);
+    sqlite3_free(partition_attach(db, argv[1], sec, sec+1, &sec_next));
+    print_event(sec, atoi(argv[3]));
+  }
+  sqlite3_close(db);
+  return 0;
+}
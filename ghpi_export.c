@@ -0,0 +1,521 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // For strptime and F_SETPIPE_SZ
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "gh_ctrl.h"
+#include "gh_partition.h"
+
+// Export logs for a time range, as CSV or NDJSON on stdout. Replaces export_last_log_data.sh.
+// Usage: ghpi_export [-f csv|ndjson] [-s start] [-e end] [-g grid] db-file name...
+//   name: a log table, for all its data columns (or for DS18B20_logs, every sensor); a column, e.g. INA260_logs.Vrms; or one DS18B20, e.g. DS18B20_logs.temp.tank_1 (by label or sensor_ID).
+//   start, end: Unix seconds, or local time as YYYY-MM-DD or "YYYY-MM-DD HH:MM:SS". end is exclusive. Default: all of it.
+//   Without -g, there's a line per reading, merged in time order: sec,cs,channel,value (value empty for null), or {"sec":…,"cs":…,"channel":"…","value":…}.
+//   With -g, there's a line per grid seconds from start: sec, then each channel's reading in effect at that time, i.e. forward-filled, since readings are logged only when they change. -g needs -s.
+// Each table (or DS18B20) is read by its own process, on its own read-only connection, with the archive cursor (see gh_archive.h), i.e. from the archive blocks overlapping the range, then a range scan of its primary key (or of DS18B20_logs_by_sensor), into blocks of rows that it writes to a pipe, from which the main process merges them. Processes rather than threads, since libghpi-sqlite3 is built with SQLITE_THREADSAFE=0 (see ghpi-sqlite-build), so only one thread in a process may use SQLite. Months that ghpi_partition has moved out of the DB (see gh_partition.h) are read the same way from their partition files first, each on a connection of its own. So memory use doesn't depend on the range, since a reader blocks once its pipe is full, and the connections don't block the daemons.
+
+#define EXPORT_SOURCES_MAX 64
+#define EXPORT_BLOCK_ROWS 512
+#define EXPORT_PIPE_BLOCKS 4 // Per source. Its pipe holds about this many full blocks before the reader blocks.
+#define EXPORT_OUT_BUF_SIZE (1<<16)
+#define EXPORT_BUSY_TIMEOUT 5000 // ms
+#define EXPORT_CACHE_SIZE "-256" // KiB per connection, as for the daemons. Each scan reads each page once, so a bigger cache doesn't help.
+
+enum {FORMAT_CSV, FORMAT_NDJSON};
+
+struct export_block {
+  int n;
+  struct archive_row rows[EXPORT_BLOCK_ROWS];
+};
+
+// A table, or one DS18B20's rows of DS18B20_logs, and the columns of it being exported
+struct source {
+  char* table;
+  bool ds18b20_p;
+  int sensor_ID;
+  int n_cols;
+  char* cols[ARCHIVE_COLUMNS_MAX];
+  int chans[ARCHIVE_COLUMNS_MAX]; // Index into channel_names, i.e. output order for -g
+  pid_t pid; // Reader process
+  int fd; // Read end of its pipe
+  struct export_block block; // Latest read from the pipe
+  int pos; // Main process's position in block
+  bool done_p; // No more blocks coming
+};
+struct source sources[EXPORT_SOURCES_MAX];
+int n_sources;
+char* channel_names[EXPORT_SOURCES_MAX*ARCHIVE_COLUMNS_MAX]; // Already quoted for the output format
+int n_channels;
+
+const char* db_file_name;
+int format = FORMAT_CSV;
+long long t_start = 0, t_end = -1; // sec
+int grid; // sec. 0 for no grid.
+
+char out_buf[EXPORT_OUT_BUF_SIZE];
+int out_len;
+
+void out_flush() {
+  if(out_len && (fwrite(out_buf, 1, out_len, stdout)!=(size_t)out_len)) exit(-1); // E.g. EPIPE from head
+  out_len = 0;
+}
+
+void out_str(const char* s) {
+  while(*s) {
+    if(out_len==EXPORT_OUT_BUF_SIZE) out_flush();
+    out_buf[out_len++] = *s++;
+  }
+}
+
+void out_char(char c) {
+  if(out_len==EXPORT_OUT_BUF_SIZE) out_flush();
+  out_buf[out_len++] = c;
+}
+
+void out_int(long long x) { // printf is most of the time otherwise
+  char buf[24];
+  int i = sizeof(buf);
+  bool neg_p = x<0;
+  unsigned long long u = neg_p?-(unsigned long long)x:x;
+  buf[--i] = 0;
+  do buf[--i] = '0' + u%10; while(u /= 10);
+  if(neg_p) buf[--i] = '-';
+  out_str(buf+i);
+}
+
+char* quote_name(const char* name) {
+  if(format==FORMAT_NDJSON) { // Names are table and column names, and DS18B20 labels, so no control characters
+    char* q = sqlite3_mprintf("\"");
+    for(const char* p=name; *p; p++) {
+      char* tmp = sqlite3_mprintf((*p=='"' || *p=='\\')?"%s\\%c":"%s%c", q, *p);
+      sqlite3_free(q);
+      q = tmp;
+    }
+    char* tmp = sqlite3_mprintf("%s\"", q);
+    sqlite3_free(q);
+    return tmp;
+  }
+  if(strpbrk(name, ",\"\n")) { // RFC 4180
+    char* q = sqlite3_mprintf("\"");
+    for(const char* p=name; *p; p++) {
+      char* tmp = sqlite3_mprintf((*p=='"')?"%s\"%c":"%s%c", q, *p);
+      sqlite3_free(q);
+      q = tmp;
+    }
+    char* tmp = sqlite3_mprintf("%s\"", q);
+    sqlite3_free(q);
+    return tmp;
+  }
+  return sqlite3_mprintf("%s", name);
+}
+
+long long parse_time(const char* arg) {
+  struct tm tm;
+  const char* p = arg;
+  while(isdigit((unsigned char)*p)) p++;
+  if(*arg && !*p) return atoll(arg);
+  memset(&tm, 0, sizeof(tm));
+  p = strptime(arg, "%Y-%m-%d %H:%M:%S", &tm);
+  if(!p || *p) {
+    memset(&tm, 0, sizeof(tm));
+    p = strptime(arg, "%Y-%m-%d", &tm);
+  }
+  if(!p || *p) {
+    fprintf(stderr, "Can't parse time %s\n", arg);
+    exit(-1);
+  }
+  tm.tm_isdst = -1;
+  return mktime(&tm);
+}
+
+void add_column(const char* table, bool ds18b20_p, int sensor_ID, const char* col, const char* name) {
+  struct source* s = NULL;
+  for(int i=0; i<n_sources; i++)
+    if(!strcmp(sources[i].table, table) && (sources[i].ds18b20_p==ds18b20_p) && (sources[i].sensor_ID==sensor_ID)) s = &sources[i];
+  if(!s) {
+    if(n_sources==EXPORT_SOURCES_MAX) {
+      fprintf(stderr, "Too many tables and DS18B20s; max is %d\n", EXPORT_SOURCES_MAX);
+      exit(-1);
+    }
+    s = &sources[n_sources++];
+    s->table = sqlite3_mprintf("%s", table);
+    s->ds18b20_p = ds18b20_p;
+    s->sensor_ID = sensor_ID;
+  }
+  for(int i=0; i<s->n_cols; i++) if(!strcmp(s->cols[i], col)) return; // Named twice
+  if(s->n_cols==ARCHIVE_COLUMNS_MAX) {
+    fprintf(stderr, "Too many columns of %s; max is %d\n", table, ARCHIVE_COLUMNS_MAX);
+    exit(-1);
+  }
+  s->cols[s->n_cols] = sqlite3_mprintf("%s", col);
+  s->chans[s->n_cols++] = n_channels;
+  channel_names[n_channels++] = quote_name(name);
+}
+
+// Add the DS18B20s matching key (a label or sensor_ID), or all of them if key is NULL
+void add_DS18B20s(const char* key) {
+  sqlite3_stmt* pStmt;
+  int rc = sqlite3_prepare_v3(db, key?"SELECT sensor_ID, label FROM DS18B20_IDs WHERE label=?1 OR CAST(sensor_ID AS TEXT)=?1":"SELECT sensor_ID, label FROM DS18B20_IDs ORDER BY sensor_ID", -1, 0, &pStmt, NULL);
+  check_sql(rc, "sqlite3_prepare failure in add_DS18B20s");
+  if(key) sqlite3_bind_text(pStmt, 1, key, -1, SQLITE_STATIC);
+  int n = 0;
+  while((rc = sqlite3_step(pStmt))==SQLITE_ROW) {
+    char* zName = sqlite3_mprintf("DS18B20_logs.temp.%s", sqlite3_column_text(pStmt, 1));
+    add_column("DS18B20_logs", true, sqlite3_column_int(pStmt, 0), "temp", zName);
+    sqlite3_free(zName);
+    n++;
+  }
+  check_sql(rc, "sqlite3_step failure in add_DS18B20s");
+  sqlite3_finalize(pStmt);
+  if(key && !n) {
+    fprintf(stderr, "No DS18B20 labeled or numbered %s\n", key);
+    exit(-1);
+  }
+}
+
+// Add the channels named by arg: a table, table.column, or DS18B20_logs.temp.sensor
+void add_name(const char* arg) {
+  char* table = sqlite3_mprintf("%s", arg);
+  char* col = strchr(table, '.');
+  if(col) *col++ = 0;
+  if(!strcmp(table, "DS18B20_logs")) {
+    char* key = col?strchr(col, '.'):NULL;
+    if(key) *key++ = 0;
+    if(col && strcmp(col, "temp")) {
+      fprintf(stderr, "DS18B20_logs has no data column %s\n", col);
+      exit(-1);
+    }
+    add_DS18B20s(key);
+    sqlite3_free(table);
+    return;
+  }
+  sqlite3_stmt* pStmt;
+  int rc = sqlite3_prepare_v3(db, "SELECT cid, name FROM pragma_table_info(?) ORDER BY cid", -1, 0, &pStmt, NULL);
+  check_sql(rc, "sqlite3_prepare failure in add_name");
+  sqlite3_bind_text(pStmt, 1, table, -1, SQLITE_STATIC);
+  int n = 0;
+  bool log_table_p = true;
+  while((rc = sqlite3_step(pStmt))==SQLITE_ROW) {
+    int cid = sqlite3_column_int(pStmt, 0);
+    const char* name = (const char*)sqlite3_column_text(pStmt, 1);
+    if(cid<2) { // Log tables are keyed by sec and cs
+      log_table_p = log_table_p && !strcmp(name, cid?"cs":"sec");
+      continue;
+    }
+    if(!log_table_p || (col && strcmp(name, col))) continue;
+    char* zName = sqlite3_mprintf("%s.%s", table, name);
+    add_column(table, false, 0, name, zName);
+    sqlite3_free(zName);
+    n++;
+  }
+  check_sql(rc, "sqlite3_step failure in add_name");
+  sqlite3_finalize(pStmt);
+  if(!n) {
+    fprintf(stderr, log_table_p?"No such log table or column: %s\n":"Not a log table: %s\n", arg);
+    exit(-1);
+  }
+  sqlite3_free(table);
+}
+
+void check_conn(sqlite3* conn, int rc, const char* msg) {
+  if(rc!=SQLITE_OK && rc!=SQLITE_ROW && rc!=SQLITE_DONE) {
+    fprintf(stderr, "%s: %s\n", msg, sqlite3_errmsg(conn));
+    exit(rc);
+  }
+}
+
+// Reader process side of the pipe. Writes only the rows the block holds, and empties it.
+void block_write(int fd, struct export_block* b) {
+  const char* p = (const char*)b;
+  size_t len = offsetof(struct export_block, rows) + b->n*sizeof(b->rows[0]);
+  while(len) {
+    ssize_t n = write(fd, p, len);
+    if(n<0) {
+      if(errno==EINTR) continue;
+      perror("write failure in block_write");
+      exit(-1);
+    }
+    p += n;
+    len -= n;
+  }
+  b->n = 0;
+}
+
+sqlite3* source_open(const char* file_name) {
+  sqlite3* conn;
+  int rc = sqlite3_open_v2(file_name, &conn, SQLITE_OPEN_READONLY, NULL);
+  check_conn(conn, rc, "sqlite3_open_v2 failure in source_open");
+  sqlite3_busy_timeout(conn, EXPORT_BUSY_TIMEOUT);
+  rc = sqlite3_exec(conn, "pragma cache_size = " EXPORT_CACHE_SIZE, NULL, NULL, NULL);
+  check_conn(conn, rc, "sqlite3_exec failure in source_open");
+  return conn;
+}
+
+// Copy the source's rows from conn after the last one copied, i.e. skipping any that ghpi_partition is midway through moving, and so are in both a partition and the hot DB
+void source_scan(struct source* s, int fd, sqlite3* conn, struct export_block* b, long long* last_tick) {
+  struct archive_cursor* c = archive_open(conn, s->table, s->ds18b20_p, s->sensor_ID, (const char**)s->cols, s->n_cols, t_start, t_end);
+  while(1) {
+    if(b->n==EXPORT_BLOCK_ROWS) block_write(fd, b);
+    if(!archive_step(c, &b->rows[b->n])) break;
+    long long tick = b->rows[b->n].sec*(long long)ARCHIVE_TICKS_PER_SEC + b->rows[b->n].cs;
+    if(tick<=*last_tick) continue;
+    *last_tick = tick;
+    b->n++;
+  }
+  archive_close(c);
+}
+
+// The reader process: write the source's rows to fd, in blocks. The end of the pipe marks the end of the rows.
+void source_read(struct source* s, int fd) {
+  sqlite3* conn = source_open(db_file_name);
+  int rc = sqlite3_exec(conn, "BEGIN; SELECT 1 FROM sqlite_master LIMIT 1", NULL, NULL, NULL); // Take the hot DB's snapshot before reading any partition, since ghpi_partition copies each day to its partition before deleting it from the hot DB. So a day being moved is seen twice, rather than not at all.
+  check_conn(conn, rc, "sqlite3_exec failure in source_read for begin");
+  struct export_block* b = &s->block; // This process's copy
+  b->n = 0;
+  long long last_tick = -1;
+  if(grid) { // The reading in effect at start
+    struct archive_row* r = &b->rows[b->n];
+    if(archive_last_before(conn, s->table, s->ds18b20_p, s->sensor_ID, (const char**)s->cols, s->n_cols, t_start, r)
+       || partition_last_before(db_file_name, s->table, s->ds18b20_p, s->sensor_ID, (const char**)s->cols, s->n_cols, t_start, r)) {
+      last_tick = r->sec*(long long)ARCHIVE_TICKS_PER_SEC + r->cs;
+      b->n++;
+    }
+  }
+  struct partition* parts;
+  int n_parts = partition_list(db_file_name, t_start, t_end, &parts);
+  for(int i=0; i<n_parts; i++) {
+    sqlite3* part_conn = source_open(parts[i].file_name);
+    if(partition_has_table_p(part_conn, "main", s->table)) source_scan(s, fd, part_conn, b, &last_tick);
+    sqlite3_close(part_conn);
+  }
+  partition_list_free(parts, n_parts);
+  source_scan(s, fd, conn, b, &last_tick);
+  rc = sqlite3_exec(conn, "COMMIT", NULL, NULL, NULL);
+  check_conn(conn, rc, "sqlite3_exec failure in source_read for commit");
+  sqlite3_close(conn);
+  if(b->n) block_write(fd, b);
+}
+
+// Fork the source's reader process, with a pipe back to this one
+void source_start(struct source* s) {
+  int fds[2];
+  if(pipe(fds)<0) {
+    perror("pipe failure in source_start");
+    exit(-1);
+  }
+  fcntl(fds[1], F_SETPIPE_SZ, EXPORT_PIPE_BLOCKS*(int)sizeof(struct export_block)); // If it fails, the default size, 64 KiB, is big enough
+  s->pid = fork();
+  if(s->pid<0) {
+    perror("fork failure in source_start");
+    exit(-1);
+  }
+  if(!s->pid) {
+    close(fds[0]);
+    source_read(s, fds[1]);
+    _exit(0);
+  }
+  close(fds[1]);
+  s->fd = fds[0];
+}
+
+// Read len bytes from the source's pipe. Returns false if it's at its end.
+bool pipe_read(struct source* s, void* buf, size_t len) {
+  size_t got = 0;
+  while(got<len) {
+    ssize_t n = read(s->fd, (char*)buf + got, len - got);
+    if(n<0) {
+      if(errno==EINTR) continue;
+      perror("read failure in pipe_read");
+      exit(-1);
+    }
+    if(!n) break;
+    got += n;
+  }
+  if(got && (got<len)) {
+    fprintf(stderr, "Reader of %s stopped midway through a block\n", s->table);
+    exit(-1);
+  }
+  return got==len;
+}
+
+// The source's pipe is at its end. Check that's because its reader finished, rather than failed.
+void source_end(struct source* s) {
+  int status;
+  close(s->fd);
+  if((waitpid(s->pid, &status, 0)<0) || !WIFEXITED(status) || WEXITSTATUS(status)) {
+    fprintf(stderr, "Reader of %s failed\n", s->table);
+    exit(-1);
+  }
+  s->done_p = true;
+}
+
+// Main process side of the pipe. Returns the source's next row, or NULL if it has no more.
+struct archive_row* source_peek(struct source* s) {
+  while(!s->done_p && (s->pos>=s->block.n)) {
+    s->pos = 0;
+    s->block.n = 0;
+    if(!pipe_read(s, &s->block.n, sizeof(s->block.n))) source_end(s);
+    else pipe_read(s, s->block.rows, s->block.n*sizeof(s->block.rows[0]));
+  }
+  return s->done_p?NULL:&s->block.rows[s->pos];
+}
+
+void source_next(struct source* s) {
+  s->pos++;
+}
+
+long long row_ms(struct archive_row* r) {
+  return r->sec*1000LL + ((long long)r->cs << TS_TV_NSEC_SHIFT)/1000000;
+}
+
+void out_value(struct archive_row* r, int col) {
+  if(r->nulls & (1u<<col)) {
+    if(format==FORMAT_NDJSON) out_str("null");
+  } else out_int(r->vals[col]);
+}
+
+// One line per reading, in time order across all the sources
+void export_readings() {
+  if(format==FORMAT_CSV) out_str("sec,cs,channel,value\n");
+  while(1) {
+    struct source* min_s = NULL;
+    struct archive_row* min_r = NULL;
+    for(int i=0; i<n_sources; i++) {
+      struct archive_row* r = source_peek(&sources[i]);
+      if(r && (!min_r || (r->sec<min_r->sec) || ((r->sec==min_r->sec) && (r->cs<min_r->cs)))) {
+	min_s = &sources[i];
+	min_r = r;
+      }
+    }
+    if(!min_r) break;
+    for(int c=0; c<min_s->n_cols; c++) {
+      if(format==FORMAT_CSV) {
+	out_int(min_r->sec);
+	out_char(',');
+	out_int(min_r->cs);
+	out_char(',');
+	out_str(channel_names[min_s->chans[c]]);
+	out_char(',');
+	out_value(min_r, c);
+      } else {
+	out_str("{\"sec\":");
+	out_int(min_r->sec);
+	out_str(",\"cs\":");
+	out_int(min_r->cs);
+	out_str(",\"channel\":");
+	out_str(channel_names[min_s->chans[c]]);
+	out_str(",\"value\":");
+	out_value(min_r, c);
+	out_char('}');
+      }
+      out_char('\n');
+    }
+    source_next(min_s);
+  }
+}
+
+// One line per grid point, with each channel's reading in effect then
+void export_grid() {
+  struct archive_row last[EXPORT_SOURCES_MAX];
+  bool have_p[EXPORT_SOURCES_MAX];
+  memset(have_p, 0, sizeof(have_p));
+  if(format==FORMAT_CSV) {
+    out_str("sec");
+    for(int c=0; c<n_channels; c++) {
+      out_char(',');
+      out_str(channel_names[c]);
+    }
+    out_char('\n');
+  }
+  for(long long t=t_start; t<t_end; t+=grid) {
+    for(int i=0; i<n_sources; i++) {
+      struct archive_row* r;
+      while((r = source_peek(&sources[i])) && (row_ms(r)<=t*1000)) {
+	last[i] = *r;
+	have_p[i] = true;
+	source_next(&sources[i]);
+      }
+    }
+    if(format==FORMAT_CSV) out_int(t);
+    else {
+      out_str("{\"sec\":");
+      out_int(t);
+    }
+    // Output in the order the channels were named, which isn't necessarily source order
+    for(int c=0; c<n_channels; c++)
+      for(int i=0; i<n_sources; i++)
+	for(int j=0; j<sources[i].n_cols; j++) {
+	  if(sources[i].chans[j]!=c) continue;
+	  if(format==FORMAT_CSV) out_char(',');
+	  else {
+	    out_char(',');
+	    out_str(channel_names[c]);
+	    out_char(':');
+	  }
+	  if(have_p[i]) out_value(&last[i], j);
+	  else if(format==FORMAT_NDJSON) out_str("null");
+	}
+    if(format==FORMAT_NDJSON) out_char('}');
+    out_char('\n');
+  }
+}
+
+void usage(const char* argv0) {
+  fprintf(stderr, "Usage: %s [-f csv|ndjson] [-s start] [-e end] [-g grid] db-file name...\n", argv0);
+  exit(-1);
+}
+
+int main(int argc, char** argv) {
+  int opt;
+  bool start_p = false;
+  while((opt = getopt(argc, argv, "f:s:e:g:"))!=-1) {
+    switch(opt) {
+    case 'f':
+      if(!strcmp(optarg, "csv")) format = FORMAT_CSV;
+      else if(!strcmp(optarg, "ndjson")) format = FORMAT_NDJSON;
+      else usage(argv[0]);
+      break;
+    case 's':
+      t_start = parse_time(optarg);
+      start_p = true;
+      break;
+    case 'e':
+      t_end = parse_time(optarg);
+      break;
+    case 'g':
+      grid = atoi(optarg);
+      if(grid<=0) usage(argv[0]);
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  if(argc-optind<2) usage(argv[0]);
+  if(grid && !start_p) {
+    fprintf(stderr, "-g needs -s\n");
+    exit(-1);
+  }
+  if(t_end<0) t_end = grid?time(NULL):(1LL<<31); // For a grid, up to now. Otherwise everything, even if the clock's been set back.
+  db_file_name = argv[optind];
+  int rc = sqlite3_open_v2(db_file_name, &db, SQLITE_OPEN_READONLY, NULL);
+  check_sql(rc, "sqlite3_open_v2 failure in ghpi_export");
+  sqlite3_busy_timeout(db, EXPORT_BUSY_TIMEOUT);
+  for(int i=optind+1; i<argc; i++) add_name(argv[i]);
+  sqlite3_close(db);
+  db = NULL;
+  for(int i=0; i<n_sources; i++) source_start(&sources[i]);
+  if(grid) export_grid();
+  else export_readings();
+  out_flush();
+  for(int i=0; i<n_sources; i++) // Reap the readers, checking they all finished
+    while(source_peek(&sources[i])) source_next(&sources[i]);
+  return 0;
+}
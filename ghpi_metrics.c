@@ -0,0 +1,62 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "gh_live.h"
+#include "gh_metrics.h"
+
+// Prints the metrics that the running daemons export to shared memory (see gh_metrics.h): by default in the Prometheus text format, e.g. for a scraper that runs it, or with -s, as a summary of each histogram's percentiles and the counters, for a person.
+// Usage: ghpi_metrics [-s]
+
+const char* counter_labels[METRICS_COUNTERS] = {"samples", "idle heartbeats", "blurs", "collisions", "CRC errors", "dropped", "glitches", "missed", "I2C transfers", "I2C bytes", "I2C us", "busy retries", "commits"};
+const char* hist_labels[METRICS_HISTS] = {"step", "insert", "commit", "read", "jitter"};
+
+struct metrics_slot slots[GHPI_METRICS_SLOTS_MAX];
+
+void print_summary(struct metrics_slot* s) {
+  printf("%s %s (pid %d):", s->daemon, (s->kind==METRICS_SENSOR)?s->name:"DB", s->pid);
+  for(int c=0; c<METRICS_COUNTERS; c++)
+    if(metrics_counter_kinds[c]==s->kind) printf(" %llu %s,", s->v.counters[c], counter_labels[c]);
+  printf("\n");
+  for(int h=0; h<METRICS_HISTS; h++) {
+    if(metrics_hist_kinds[h]!=s->kind) continue;
+    unsigned long long count = 0;
+    int last = 0;
+    for(int b=0; b<METRICS_BUCKETS; b++) {
+      count += s->v.buckets[h][b];
+      if(s->v.buckets[h][b]) last = b;
+    }
+    printf("  %-6s %10llu", hist_labels[h], count);
+    if(count) printf("  mean %.3fms  p50 %.3fms  p99 %.3fms  p99.9 %.3fms  max <%.3fms", s->v.sum_us[h]/1000.0/count,
+		     metrics_percentile(&s->v, h, 0.5)/1000.0, metrics_percentile(&s->v, h, 0.99)/1000.0, metrics_percentile(&s->v, h, 0.999)/1000.0,
+		     ((last<METRICS_BUCKETS-1)?metrics_bucket_low(last+1):metrics_bucket_low(last))/1000.0);
+    printf("\n");
+  }
+}
+
+int main(int argc, char** argv) {
+  bool summary_p = false;
+  int opt;
+  while((opt = getopt(argc, argv, "s"))!=-1) {
+    if(opt=='s') summary_p = true;
+    else {
+      fprintf(stderr, "Usage: %s [-s]\n", argv[0]);
+      exit(-1);
+    }
+  }
+  struct metrics_segment* seg = metrics_map(false);
+  if(!seg) {
+    fprintf(stderr, "No metrics segment; no daemon is exporting metrics\n");
+    exit(-1);
+  }
+  struct metrics_slot* live[GHPI_METRICS_SLOTS_MAX];
+  int n = 0;
+  for(int i=0; i<GHPI_METRICS_SLOTS_MAX; i++)
+    if(metrics_read(seg, i, &slots[n])) {
+      live[n] = &slots[n];
+      n++;
+    }
+  if(summary_p)
+    for(int i=0; i<n; i++) print_summary(live[i]);
+  else metrics_print_prometheus(stdout, live, n);
+  return 0;
+}
@@ -0,0 +1,295 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include "gh_ctrl.h"
+#include "gh_partition.h"
+
+// Moves each month of logs (and of archive blocks and 1-minute rollups) out of the DB, once it's more than the given number of months ago, into a partition file of its own (see gh_partition.h). Run it daily, e.g. from cron. Retention is then a matter of dropping or moving whole partition files, which -r does.
+// Months are moved only once every rollup channel's watermark, and ghpi_energy's, is past them, so that ghpi_rollup never needs to write to a partition, and ghpi_energy never misses a month. Each day is copied to its partition in one transaction, then deleted from the DB in another, since transactions across a WAL DB and an attached one aren't atomic; so if it's interrupted, the next run finds the day in both, and copies it over again. ghpi_export skips the rows it would otherwise see twice, but partition_attach's views don't, so a query that runs meanwhile can see that day twice.
+// Partitions use a rollback journal rather than WAL, since they're written once. They get a copy of DS18B20_IDs, so that each can be read on its own.
+// Usage: ghpi_partition [-k months] [-r months [-d dir]] [-v] db-file
+//   -k: months to keep in the DB before the current one. Default 1.
+//   -r: months of partitions to keep before the current one; older ones are deleted, or with -d, moved into dir (which must be on the same filesystem).
+//   -v: vacuum the DB afterward, as for ghpi_archive.
+//        ghpi_partition -q [-s YYYY-MM] [-e YYYY-MM] db-file
+//   Prints the SQL that attaches the partitions from month -s to month -e (inclusive), or as many of them as one connection can attach (see partition_attach), and shadows the tables and views with their union, e.g. for: sqlite3 -cmd "$(ghpi_partition -q -s 2025-01 ghpi.db)" ghpi.db
+
+#define PARTITION_DAY 86400
+#define PARTITION_KEEP_DEFAULT 1 // months
+const char* copied_tables[] = {"DS18B20_IDs"}; // Copied whole to each partition, rather than moved
+
+sqlite3_stmt *pStmt_begin, *pStmt_commit;
+const char* db_file_name;
+long total_rows, total_months;
+
+void step_done(sqlite3_stmt* pStmt, const char* msg) { // For statements that return no rows
+  int rc = sqlite3_step(pStmt);
+  check_sql(rc, msg);
+  sqlite3_reset(pStmt);
+}
+
+void exec_sql(const char* zSql, const char* msg) {
+  int rc = sqlite3_exec(db, zSql, NULL, NULL, NULL);
+  check_sql(rc, msg);
+}
+
+long long month_start(int year, int month) { // month may be out of 1 to 12
+  struct tm tm;
+  memset(&tm, 0, sizeof(tm));
+  tm.tm_year = year - 1900;
+  tm.tm_mon = month - 1;
+  tm.tm_mday = 1;
+  return timegm(&tm);
+}
+
+long long months_ago(int months) { // Start of the month that many before the current one
+  int year, month;
+  long long sec_start, sec_end;
+  partition_month(time(NULL), &year, &month, &sec_start, &sec_end);
+  return month_start(year, month - months);
+}
+
+bool query_int64(const char* zSql, long long* val) { // Returns false if the result is null
+  sqlite3_stmt* pStmt;
+  int rc = sqlite3_prepare_v3(db, zSql, -1, 0, &pStmt, NULL);
+  check_sql(rc, "sqlite3_prepare failure in query_int64");
+  rc = sqlite3_step(pStmt);
+  check_sql(rc, "sqlite3_step failure in query_int64");
+  bool found_p = (rc==SQLITE_ROW) && (sqlite3_column_type(pStmt, 0)!=SQLITE_NULL);
+  if(found_p) *val = sqlite3_column_int64(pStmt, 0);
+  sqlite3_finalize(pStmt);
+  return found_p;
+}
+
+// Create the table and its indexes in the partition (attached as part), from the DB's schema
+void create_in_partition(const char* table) {
+  const char* prefixes[] = {"CREATE TABLE ", "CREATE INDEX ", "CREATE UNIQUE INDEX "};
+  sqlite3_stmt* pStmt;
+  int rc = sqlite3_prepare_v3(db, "SELECT sql FROM main.sqlite_master WHERE type IN ('table', 'index') AND tbl_name=? AND sql IS NOT NULL ORDER BY type DESC", -1, 0, &pStmt, NULL); // Table first
+  check_sql(rc, "sqlite3_prepare failure in create_in_partition");
+  sqlite3_bind_text(pStmt, 1, table, -1, SQLITE_STATIC);
+  while((rc = sqlite3_step(pStmt))==SQLITE_ROW) {
+    const char* sql = (const char*)sqlite3_column_text(pStmt, 0);
+    for(int i=0; i<3; i++) {
+      size_t len = strlen(prefixes[i]);
+      if(sqlite3_strnicmp(sql, prefixes[i], len)) continue;
+      char* zSql = sqlite3_mprintf("%sIF NOT EXISTS part.%s", prefixes[i], sql+len);
+      rc = sqlite3_exec(db, zSql, NULL, NULL, NULL);
+      sqlite3_free(zSql);
+      check_sql(rc, "sqlite3_exec failure in create_in_partition");
+      break;
+    }
+  }
+  check_sql(rc, "sqlite3_step failure in create_in_partition");
+  sqlite3_finalize(pStmt);
+}
+
+sqlite3_stmt* prepare_range(const char* zFormat, const struct partition_table* table) {
+  sqlite3_stmt* pStmt;
+  char* zSql = sqlite3_mprintf(zFormat, table->name, table->zWhere, table->sec_column, table->sec_column);
+  int rc = sqlite3_prepare_v3(db, zSql, -1, 0, &pStmt, NULL);
+  sqlite3_free(zSql);
+  check_sql(rc, "sqlite3_prepare failure in prepare_range");
+  return pStmt;
+}
+
+void step_range(sqlite3_stmt* pStmt, long long sec_from, long long sec_to, const char* msg) {
+  sqlite3_bind_int64(pStmt, 1, sec_from);
+  sqlite3_bind_int64(pStmt, 2, sec_to);
+  step_done(pStmt, msg);
+}
+
+// Move the month's rows of the partitioned tables (those in tables[]) to its partition, a day at a time
+void move_month(int year, int month, const struct partition_table** tables, int n_tables) {
+  char* file_name = partition_file_name(db_file_name, year, month);
+  sqlite3* conn; // ATTACH opens it with the DB's flags, i.e. without SQLITE_OPEN_CREATE, so create it first
+  int rc = sqlite3_open_v2(file_name, &conn, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, NULL);
+  if(rc!=SQLITE_OK) {
+    fprintf(stderr, "Can't create %s: %s\n", file_name, sqlite3_errmsg(conn));
+    exit(rc);
+  }
+  sqlite3_close(conn);
+  char* zSql = sqlite3_mprintf("ATTACH %Q AS part", file_name);
+  exec_sql(zSql, "sqlite3_exec failure in move_month for attach");
+  sqlite3_free(zSql);
+  exec_sql("BEGIN IMMEDIATE", "sqlite3_exec failure in move_month for begin");
+  for(int t=0; t<n_tables; t++) create_in_partition(tables[t]->name);
+  for(int t=0; t<(int)(sizeof(copied_tables)/sizeof(copied_tables[0])); t++) {
+    create_in_partition(copied_tables[t]);
+    zSql = sqlite3_mprintf("INSERT OR REPLACE INTO part.\"%w\" SELECT * FROM main.\"%w\"", copied_tables[t], copied_tables[t]);
+    exec_sql(zSql, "sqlite3_exec failure in move_month for copied table");
+    sqlite3_free(zSql);
+  }
+  exec_sql("COMMIT", "sqlite3_exec failure in move_month for commit");
+  sqlite3_stmt *pStmt_clear[n_tables], *pStmt_copy[n_tables], *pStmt_delete[n_tables];
+  for(int t=0; t<n_tables; t++) {
+    pStmt_clear[t] = prepare_range("DELETE FROM part.\"%w\" WHERE %s%s>=?1 AND %s<?2", tables[t]);
+    zSql = sqlite3_mprintf("INSERT INTO part.\"%w\" SELECT * FROM main.\"%w\" WHERE %s%s>=?1 AND %s<?2", tables[t]->name, tables[t]->name, tables[t]->zWhere, tables[t]->sec_column, tables[t]->sec_column);
+    rc = sqlite3_prepare_v3(db, zSql, -1, 0, &pStmt_copy[t], NULL);
+    sqlite3_free(zSql);
+    check_sql(rc, "sqlite3_prepare failure in move_month for copy");
+    pStmt_delete[t] = prepare_range("DELETE FROM main.\"%w\" WHERE %s%s>=?1 AND %s<?2", tables[t]);
+  }
+  long long sec_start = month_start(year, month), sec_end = month_start(year, month+1);
+  for(long long day=sec_start; day<sec_end; day+=PARTITION_DAY) {
+    step_done(pStmt_begin, "sqlite3_step failure in move_month for begin");
+    for(int t=0; t<n_tables; t++) {
+      step_range(pStmt_clear[t], day, day+PARTITION_DAY, "sqlite3_step failure in move_month for clear"); // Left by an interrupted run
+      step_range(pStmt_copy[t], day, day+PARTITION_DAY, "sqlite3_step failure in move_month for copy");
+      total_rows += sqlite3_changes(db);
+    }
+    step_done(pStmt_commit, "sqlite3_step failure in move_month for commit");
+    step_done(pStmt_begin, "sqlite3_step failure in move_month for begin");
+    for(int t=0; t<n_tables; t++) step_range(pStmt_delete[t], day, day+PARTITION_DAY, "sqlite3_step failure in move_month for delete");
+    step_done(pStmt_commit, "sqlite3_step failure in move_month for commit");
+  }
+  for(int t=0; t<n_tables; t++) {
+    sqlite3_finalize(pStmt_clear[t]);
+    sqlite3_finalize(pStmt_copy[t]);
+    sqlite3_finalize(pStmt_delete[t]);
+  }
+  exec_sql("DETACH part", "sqlite3_exec failure in move_month for detach");
+  sqlite3_free(file_name);
+  total_months++;
+}
+
+void rotate(int keep) {
+  long long horizon = months_ago(keep);
+  long long wm;
+  if(partition_has_table_p(db, "main", "Rollup_channels") && query_int64("SELECT min(wm) FROM Rollup_channels WHERE wm>0", &wm) && (wm<horizon)) { // Channels with no watermark have nothing logged yet
+    int year, month;
+    long long sec_end;
+    partition_month(wm, &year, &month, &horizon, &sec_end);
+  }
+  if(partition_has_table_p(db, "main", "Energy_state") && query_int64("SELECT wm FROM Energy_state", &wm) && (wm<horizon)) { // Likewise for ghpi_energy
+    int year, month;
+    long long sec_end;
+    partition_month(wm, &year, &month, &horizon, &sec_end);
+  }
+  const struct partition_table* tables[n_partition_tables];
+  int n_tables = 0;
+  for(int t=0; t<n_partition_tables; t++)
+    if(partition_has_table_p(db, "main", partition_tables[t].name)) tables[n_tables++] = &partition_tables[t]; // Unless not upgraded
+  while(1) { // Move the oldest month left, skipping any with nothing logged
+    long long first = horizon;
+    for(int t=0; t<n_tables; t++) {
+      if(*tables[t]->zWhere) continue; // Rollups, which are never older than the logs they're of
+      char* zSql = sqlite3_mprintf("SELECT min(%s) FROM main.\"%w\"", tables[t]->sec_column, tables[t]->name);
+      long long sec;
+      if(query_int64(zSql, &sec) && (sec<first)) first = sec;
+      sqlite3_free(zSql);
+    }
+    int year, month;
+    long long sec_start, sec_end;
+    partition_month(first, &year, &month, &sec_start, &sec_end);
+    if(sec_end>horizon) break;
+    move_month(year, month, tables, n_tables);
+  }
+}
+
+void retire(int retain, const char* dir) { // Partitions before the retention period
+  struct partition* parts;
+  int n = partition_list(db_file_name, 0, months_ago(retain), &parts);
+  for(int i=0; i<n; i++) {
+    if(parts[i].sec_end>months_ago(retain)) continue;
+    char* journal = sqlite3_mprintf("%s-journal", parts[i].file_name);
+    if(!access(journal, F_OK)) {
+      fprintf(stderr, "%s has a hot journal, i.e. ghpi_partition was interrupted writing it; run it again first\n", parts[i].file_name);
+      exit(-1);
+    }
+    sqlite3_free(journal);
+    if(dir) {
+      const char* slash = strrchr(parts[i].file_name, '/');
+      char* to = sqlite3_mprintf("%s/%s", dir, slash?slash+1:parts[i].file_name);
+      if(rename(parts[i].file_name, to)) {
+	fprintf(stderr, (errno==EXDEV)?"Can't move %s to %s, which is on another filesystem\n":"Can't move %s to %s\n", parts[i].file_name, to);
+	exit(-1);
+      }
+      sqlite3_free(to);
+    }
+    else if(unlink(parts[i].file_name)) {
+      fprintf(stderr, "Can't delete %s\n", parts[i].file_name);
+      exit(-1);
+    }
+    fprintf(stderr, dir?"Moved %s to %s\n":"Deleted %s\n", parts[i].file_name, dir);
+  }
+  partition_list_free(parts, n);
+}
+
+long long parse_month(const char* arg, char** argv) {
+  int year, month, end = 0;
+  if((sscanf(arg, "%4d-%2d%n", &year, &month, &end)!=2) || arg[end] || (month<1) || (month>12)) {
+    fprintf(stderr, "%s: bad month %s; use YYYY-MM\n", argv[0], arg);
+    exit(-1);
+  }
+  return month_start(year, month);
+}
+
+void usage(char** argv) {
+  fprintf(stderr, "Usage: %s [-k months] [-r months [-d dir]] [-v] db-file\n       %s -q [-s YYYY-MM] [-e YYYY-MM] db-file\n", argv[0], argv[0]);
+  exit(-1);
+}
+
+int main(int argc, char** argv) {
+  int opt, keep = PARTITION_KEEP_DEFAULT, retain = -1;
+  bool vacuum_p = false, query_p = false;
+  const char* dir = NULL;
+  long long q_start = 0, q_end = 1LL<<40;
+  while((opt = getopt(argc, argv, "k:r:d:vqs:e:"))!=-1) {
+    if(opt=='k') keep = atoi(optarg);
+    else if(opt=='r') retain = atoi(optarg);
+    else if(opt=='d') dir = optarg;
+    else if(opt=='v') vacuum_p = true;
+    else if(opt=='q') query_p = true;
+    else if(opt=='s') q_start = parse_month(optarg, argv);
+    else if(opt=='e') q_end = parse_month(optarg, argv) + 1; // Within the month, so that it overlaps it
+    else usage(argv);
+  }
+  if((argc-optind!=1) || (keep<0) || (dir && (retain<0))) usage(argv);
+  db_file_name = argv[optind];
+  if(query_p) {
+    sqlite3* conn;
+    int rc = sqlite3_open_v2(db_file_name, &conn, SQLITE_OPEN_READONLY, NULL);
+    if(rc!=SQLITE_OK) {
+      fprintf(stderr, "Can't open %s: %s\n", db_file_name, sqlite3_errmsg(conn));
+      exit(rc);
+    }
+    long long q_next;
+    char* zSql = partition_attach(conn, db_file_name, q_start, q_end, &q_next);
+    fputs(zSql, stdout);
+    if(q_next<q_end) { // More months than one connection can attach
+      int year, month;
+      long long sec_start, sec_end;
+      partition_month(q_next, &year, &month, &sec_start, &sec_end);
+      fprintf(stderr, "Only the months before %04d-%02d fit in one connection; for the rest, run again with -s %04d-%02d\n", year, month, year, month);
+    }
+    sqlite3_free(zSql);
+    sqlite3_close(conn);
+    return 0;
+  }
+  struct timespec ts_start;
+  clock_gettime(CLOCK_MONOTONIC, &ts_start);
+  ghpi_sqlite_init(argv[0], db_file_name);
+  exec_sql("pragma foreign_keys = off", "sqlite3_exec failure in ghpi_partition"); // DS18B20_logs references DS18B20_IDs, which partitions get a copy of, but only once the month's attached
+  int rc = sqlite3_prepare_v3(db, "BEGIN IMMEDIATE", -1, SQLITE_PREPARE_PERSISTENT, &pStmt_begin, NULL);
+  check_sql(rc, "sqlite3_prepare failure in ghpi_partition for begin");
+  rc = sqlite3_prepare_v3(db, "COMMIT", -1, SQLITE_PREPARE_PERSISTENT, &pStmt_commit, NULL);
+  check_sql(rc, "sqlite3_prepare failure in ghpi_partition for commit");
+  rotate(keep);
+  char ts_buf[64];
+  time_t now = time(NULL);
+  strftime(ts_buf, 64, "%Y-%m-%d %H:%M:%S", localtime(&now));
+  fprintf(stderr, "%s Moved %ld rows of %ld months to partitions in %.1fs\n", ts_buf, total_rows, total_months, ms_since(&ts_start)/1000.0);
+  if(retain>=0) retire(retain, dir);
+  sqlite3_finalize(pStmt_begin);
+  sqlite3_finalize(pStmt_commit);
+  if(vacuum_p) {
+    exec_sql("VACUUM", "sqlite3_exec failure in ghpi_partition for vacuum");
+    exec_sql("PRAGMA wal_checkpoint(TRUNCATE)", "sqlite3_exec failure in ghpi_partition for checkpoint");
+  }
+  sqlite3_close(db);
+  return 0;
+}
@@ -0,0 +1,283 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "gh_ctrl.h"
+#include "gh_partition.h"
+
+// Keeps Rollups_1m, Rollups_1h, and Rollups_1d (see ghpi-arch.sql) up to date with the logs. Each pass rolls up every channel from its watermark to ROLLUP_LAG before now, then waits for the next minute. So on its first run, or after downtime, it catches up by itself.
+// Rolling up afterward, rather than by triggers on the log tables, keeps the cost off the write path, and lets each reading be weighted by how long it held, which isn't known until the next one's logged.
+// Months that ghpi_partition has moved out (see gh_partition.h) aren't rolled up again, since it only moves them once every watermark is past them; so to rebuild the rollups from scratch, do it before partitioning.
+// Usage: ghpi_rollup db-file
+
+#define ROLLUP_LAG 60 // seconds. Rows are timestamped when acquired, but committed up to GHPI_BATCH_MAX_AGE later (and a DS18B20 pass takes a while), so a minute isn't rolled up until well after it's over.
+#define ROLLUP_CHUNK 86400 // seconds of logs per transaction, so that catching up doesn't hold the write lock for long
+#define ROLLUP_CHANNELS_MAX 256
+#define ROLLUP_STATS_THRESHOLD 1000 // ms. Passes that take longer, i.e. catching up, are reported.
+
+// Log tables whose data columns are each a channel. DS18B20_logs is instead a channel per sensor; see discover_channels.
+const char* log_tables[] = {"MAX11201B_logs", "Furnace_logs", "BME680_logs", "SHT31_logs", "TSL2591_logs", "VEML6075_logs", "INA260_logs", "INA260_harmonics"};
+#define N_LOG_TABLES (int)(sizeof(log_tables)/sizeof(log_tables[0]))
+
+struct resolution {
+  const char* table;
+  int period; // seconds. Each is a multiple of the previous one.
+  bool sparse_p; // Store only buckets in which a reading was logged
+  sqlite3_stmt* pStmt_upsert;
+};
+struct resolution resolutions[] = {
+  {"Rollups_1m", 60, true},
+  {"Rollups_1h", 3600, false},
+  {"Rollups_1d", 86400, false}
+};
+#define N_RESOLUTIONS (int)(sizeof(resolutions)/sizeof(resolutions[0]))
+
+// A chunk can start or end partway through an hour or day, so the same bucket may be written by several chunks. This merges them.
+const char zSql_upsert[] = "INSERT INTO %s VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?) ON CONFLICT(channel_ID, sec) DO UPDATE SET \
+n=n+excluded.n, \
+mean=CASE WHEN covered+excluded.covered>0 THEN (ifnull(mean*covered, 0)+ifnull(excluded.mean*excluded.covered, 0))/(covered+excluded.covered) END, \
+covered=covered+excluded.covered, \
+min=coalesce(min(min, excluded.min), min, excluded.min), \
+max=coalesce(max(max, excluded.max), max, excluded.max), \
+first=coalesce(first, excluded.first), \
+last=coalesce(excluded.last, last)";
+
+struct channel {
+  int ID;
+  char* log_table;
+  char* column_name;
+  bool ds18b20_p;
+  int sensor_ID;
+  long long wm;
+};
+struct channel channels[ROLLUP_CHANNELS_MAX];
+int n_channels;
+const char* db_file_name; // For finding partitions
+
+struct bucket {
+  long long sec; // Start
+  int n;
+  long long covered; // ms
+  double integral; // Sum of reading*ms
+  bool have_p; // Whether any reading was in effect, i.e. whether min, max, first, and last are set
+  int min, max, first, last;
+};
+
+// Walking one channel's logs through a chunk
+struct rollup_state {
+  struct channel* ch;
+  long long t; // ms. Everything before this has been added to the buckets.
+  bool null_p; // No reading in effect
+  int val; // The reading in effect
+  struct bucket buckets[N_RESOLUTIONS];
+  long rows;
+};
+
+sqlite3_stmt *pStmt_begin, *pStmt_commit, *pStmt_set_wm;
+
+void step_done(sqlite3_stmt* pStmt, const char* msg) { // For statements that return no rows
+  int rc = sqlite3_step(pStmt);
+  check_sql(rc, msg);
+  sqlite3_reset(pStmt);
+}
+
+void exec_sql(const char* zSql, const char* msg) {
+  int rc = sqlite3_exec(db, zSql, NULL, NULL, NULL);
+  check_sql(rc, msg);
+}
+
+// Add a channel for every data column of the log tables, and every DS18B20. New ones start with no watermark.
+void discover_channels() {
+  for(int i=0; i<N_LOG_TABLES; i++) {
+    char* zSql = sqlite3_mprintf("INSERT OR IGNORE INTO Rollup_channels(name, log_table, column_name) SELECT '%q.'||name, '%q', name FROM pragma_table_info('%q') WHERE cid>=2", log_tables[i], log_tables[i], log_tables[i]);
+    exec_sql(zSql, "sqlite3_exec failure in discover_channels");
+    sqlite3_free(zSql);
+  }
+  exec_sql("INSERT OR IGNORE INTO Rollup_channels(name, log_table, column_name, sensor_ID) SELECT 'DS18B20_logs.temp.'||sensor_ID, 'DS18B20_logs', 'temp', sensor_ID FROM DS18B20_IDs", "sqlite3_exec failure in discover_channels");
+}
+
+void load_channels() {
+  sqlite3_stmt* pStmt;
+  int rc = sqlite3_prepare_v3(db, "SELECT channel_ID, log_table, column_name, sensor_ID, wm FROM Rollup_channels ORDER BY channel_ID", -1, 0, &pStmt, NULL);
+  check_sql(rc, "sqlite3_prepare failure in load_channels");
+  for(int i=0; i<n_channels; i++) {
+    sqlite3_free(channels[i].log_table);
+    sqlite3_free(channels[i].column_name);
+  }
+  n_channels = 0;
+  while((rc = sqlite3_step(pStmt))==SQLITE_ROW) {
+    if(n_channels==ROLLUP_CHANNELS_MAX) {
+      fprintf(stderr, "More than %d rollup channels; ignoring the rest\n", ROLLUP_CHANNELS_MAX);
+      break;
+    }
+    struct channel* ch = &channels[n_channels++];
+    ch->ID = sqlite3_column_int(pStmt, 0);
+    ch->log_table = sqlite3_mprintf("%s", sqlite3_column_text(pStmt, 1));
+    ch->column_name = sqlite3_mprintf("%s", sqlite3_column_text(pStmt, 2));
+    ch->ds18b20_p = sqlite3_column_type(pStmt, 3)!=SQLITE_NULL;
+    ch->sensor_ID = sqlite3_column_int(pStmt, 3);
+    ch->wm = sqlite3_column_int64(pStmt, 4);
+  }
+  check_sql(rc, "sqlite3_step failure in load_channels");
+  sqlite3_finalize(pStmt);
+}
+
+void setup() {
+  int rc;
+  for(int r=0; r<N_RESOLUTIONS; r++) {
+    char* zSql = sqlite3_mprintf(zSql_upsert, resolutions[r].table);
+    rc = sqlite3_prepare_v3(db, zSql, -1, SQLITE_PREPARE_PERSISTENT, &resolutions[r].pStmt_upsert, NULL);
+    sqlite3_free(zSql);
+    check_sql(rc, "sqlite3_prepare failure in ghpi_rollup for upsert");
+  }
+  rc = sqlite3_prepare_v3(db, "BEGIN IMMEDIATE", -1, SQLITE_PREPARE_PERSISTENT, &pStmt_begin, NULL);
+  check_sql(rc, "sqlite3_prepare failure in ghpi_rollup for begin");
+  rc = sqlite3_prepare_v3(db, "COMMIT", -1, SQLITE_PREPARE_PERSISTENT, &pStmt_commit, NULL);
+  check_sql(rc, "sqlite3_prepare failure in ghpi_rollup for commit");
+  rc = sqlite3_prepare_v3(db, "UPDATE Rollup_channels SET wm=? WHERE channel_ID=?", -1, SQLITE_PREPARE_PERSISTENT, &pStmt_set_wm, NULL);
+  check_sql(rc, "sqlite3_prepare failure in ghpi_rollup for watermark");
+}
+
+void bucket_reset(struct bucket* b, long long sec) {
+  memset(b, 0, sizeof(*b));
+  b->sec = sec;
+}
+
+void bucket_note(struct bucket* b, int val) { // A reading in effect during the bucket
+  if(!b->have_p) {
+    b->have_p = true;
+    b->min = b->max = b->first = val;
+  }
+  if(val<b->min) b->min = val;
+  if(val>b->max) b->max = val;
+  b->last = val;
+}
+
+void bucket_store(struct rollup_state* s, int r) {
+  struct bucket* b = &s->buckets[r];
+  sqlite3_stmt* pStmt = resolutions[r].pStmt_upsert;
+  if(!b->n && (resolutions[r].sparse_p || !b->have_p)) return;
+  sqlite3_bind_int(pStmt, 1, s->ch->ID);
+  sqlite3_bind_int64(pStmt, 2, b->sec);
+  sqlite3_bind_int(pStmt, 3, b->n);
+  sqlite3_bind_int64(pStmt, 4, b->covered);
+  if(b->covered) sqlite3_bind_double(pStmt, 5, b->integral/b->covered);
+  else sqlite3_bind_null(pStmt, 5);
+  if(b->have_p) {
+    sqlite3_bind_int(pStmt, 6, b->min);
+    sqlite3_bind_int(pStmt, 7, b->max);
+    sqlite3_bind_int(pStmt, 8, b->first);
+    sqlite3_bind_int(pStmt, 9, b->last);
+  } else for(int i=6; i<=9; i++) sqlite3_bind_null(pStmt, i);
+  step_done(pStmt, "sqlite3_step failure in bucket_store");
+}
+
+// Add the reading in effect from s->t to t_end, storing each bucket as it ends
+void advance(struct rollup_state* s, long long t_end) {
+  while(s->t < t_end) {
+    long long boundary = (s->buckets[0].sec + resolutions[0].period)*1000; // The finest bucket ends first
+    long long t = (t_end<boundary)?t_end:boundary;
+    if(!s->null_p)
+      for(int r=0; r<N_RESOLUTIONS; r++) {
+	s->buckets[r].covered += t - s->t;
+	s->buckets[r].integral += (double)s->val*(t - s->t);
+	bucket_note(&s->buckets[r], s->val);
+      }
+    s->t = t;
+    if(t<boundary) break;
+    for(int r=0; r<N_RESOLUTIONS; r++)
+      if((t/1000)%resolutions[r].period==0) {
+	bucket_store(s, r);
+	bucket_reset(&s->buckets[r], t/1000);
+      }
+  }
+}
+
+// The latest reading before sec, to carry into the chunk. It may have been archived, or moved to a partition, e.g. for a channel that's logged rarely.
+void load_carry(struct rollup_state* s, long long sec) {
+  struct channel* ch = s->ch;
+  struct archive_row r;
+  bool found_p = archive_last_before(db, ch->log_table, ch->ds18b20_p, ch->sensor_ID, (const char**)&ch->column_name, 1, sec, &r)
+    || partition_last_before(db_file_name, ch->log_table, ch->ds18b20_p, ch->sensor_ID, (const char**)&ch->column_name, 1, sec, &r);
+  s->null_p = !found_p || (r.nulls & 1);
+  s->val = found_p?r.vals[0]:0;
+}
+
+// Roll up the channel's logs (archived or not) from sec_start to sec_end (both multiples of 60), and advance its watermark, in one transaction
+void rollup_chunk(struct rollup_state* s, long long sec_start, long long sec_end) {
+  struct channel* ch = s->ch;
+  struct archive_row row;
+  step_done(pStmt_begin, "sqlite3_step failure in rollup_chunk for begin");
+  load_carry(s, sec_start);
+  s->t = sec_start*1000;
+  for(int r=0; r<N_RESOLUTIONS; r++) bucket_reset(&s->buckets[r], sec_start - sec_start%resolutions[r].period);
+  struct archive_cursor* c = archive_open(db, ch->log_table, ch->ds18b20_p, ch->sensor_ID, (const char**)&ch->column_name, 1, sec_start, sec_end);
+  while(archive_step(c, &row)) {
+    advance(s, row.sec*1000LL + ((long long)row.cs << TS_TV_NSEC_SHIFT)/1000000);
+    s->null_p = row.nulls & 1;
+    s->val = row.vals[0];
+    if(!s->null_p)
+      for(int r=0; r<N_RESOLUTIONS; r++) {
+	s->buckets[r].n++;
+	bucket_note(&s->buckets[r], s->val); // Even if it's replaced within the same ms
+      }
+    s->rows++;
+  }
+  archive_close(c);
+  advance(s, sec_end*1000); // Stores all the 1-minute buckets, since sec_end is a multiple of 60
+  for(int r=1; r<N_RESOLUTIONS; r++) bucket_store(s, r); // Partial, unless sec_end happens to be a boundary, in which case there's nothing left in them. The next chunk merges into them.
+  sqlite3_bind_int64(pStmt_set_wm, 1, sec_end);
+  sqlite3_bind_int(pStmt_set_wm, 2, ch->ID);
+  step_done(pStmt_set_wm, "sqlite3_step failure in rollup_chunk for watermark");
+  step_done(pStmt_commit, "sqlite3_step failure in rollup_chunk for commit");
+  ch->wm = sec_end;
+}
+
+// Returns the number of log rows rolled up
+long rollup_channel(struct channel* ch, long long horizon) {
+  struct rollup_state s;
+  memset(&s, 0, sizeof(s));
+  s.ch = ch;
+  if(ch->wm==0) { // Start from the channel's first row
+    long long first;
+    if(!archive_first_sec(db, ch->log_table, ch->ds18b20_p, ch->sensor_ID, &first)) return 0; // Nothing logged yet, so leave the watermark unset
+    ch->wm = first - first%60;
+  }
+  while(ch->wm<horizon) {
+    long long sec_end = ch->wm + ROLLUP_CHUNK;
+    rollup_chunk(&s, ch->wm, (sec_end<horizon)?sec_end:horizon);
+  }
+  return s.rows;
+}
+
+void rollup_pass() {
+  struct timespec ts_start;
+  clock_gettime(CLOCK_MONOTONIC, &ts_start);
+  long long horizon = time(NULL) - ROLLUP_LAG;
+  horizon -= horizon%60;
+  long rows = 0;
+  discover_channels();
+  load_channels();
+  for(int i=0; i<n_channels; i++) rows += rollup_channel(&channels[i], horizon);
+  long ms = ms_since(&ts_start);
+  if(ms>=ROLLUP_STATS_THRESHOLD) {
+    char ts_buf[64];
+    time_t now = time(NULL);
+    strftime(ts_buf, 64, "%Y-%m-%d %H:%M:%S", localtime(&now));
+    fprintf(stderr, "%s Rolled up %ld rows of %d channels in %.1fs\n", ts_buf, rows, n_channels, ms/1000.0);
+  }
+}
+
+int main(int argc, char** argv) {
+  daemon_init(argc, argv);
+  db_file_name = argv[1];
+  setup();
+  while(1) {
+    rollup_pass();
+    struct timespec ts;
+    ts.tv_sec = 60 - (time(NULL) - ROLLUP_LAG)%60; // Until the next minute is past the lag
+    ts.tv_nsec = 0;
+    nanosleep(&ts, NULL);
+  }
+  return 0;
+}
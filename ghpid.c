@@ -0,0 +1,104 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include "gh_ctrl.h"
+
+// Single-process host for all the sensor drivers: one epoll loop with one timerfd per driver, and one DB connection shared by all of them, so the daemons no longer contend for the WAL write lock, and there's one process footprint instead of seven.
+// Each driver keeps its own cadence, since its step function returns when it wants to run next, exactly as in its standalone daemon. A driver that's woken by events (e.g. read_furnace's GPIO edges) has its event fd in the epoll set too, and is stepped as soon as it's readable.
+// poll_stream isn't hosted here, since websocketd runs a separate instance of it for each connected client, and it's a reader anyway. Neither is read_DS18B20.py.
+// So ghpid isn't the DB's only writer: read_DS18B20.py, ghpi_checkpoint, ghpi_rollup, ghpi_energy, and ghpi_partition write too, and must get the write lock within their busy timeouts. Group commit only holds it while a batch is being written, not while it's gathered.
+
+#define USE_BATCH_COMMIT true // Group commit; see batch_commit_enable
+#define USE_WRITER_THREAD true // So that sampling never blocks on the DB; see writer_thread_enable
+
+extern struct ghpi_sensor ina260_sensor, max11201b_sensor, furnace_sensor, bme680_sensor, sht31_sensor, tsl2591_sensor, veml6075_sensor;
+
+struct ghpi_sensor* sensors[] = {
+  &ina260_sensor, // First, so that its sample bursts get first dibs when several timers expire together
+  &max11201b_sensor,
+  &furnace_sensor,
+  &bme680_sensor,
+  &sht31_sensor,
+  &tsl2591_sensor,
+  &veml6075_sensor
+};
+#define N_SENSORS (int)(sizeof(sensors)/sizeof(sensors[0]))
+
+int timer_fds[N_SENSORS];
+
+// Schedule the next step of sensor i, ns from now
+void arm_timer(int i, long long ns) {
+  struct itimerspec its;
+  memset(&its, 0, sizeof(its));
+  if(io_replay_p()) ns = 1; // Replay at full speed, still round-robin
+  ns_to_ts(&its.it_value, ns>0?ns:1); // Zero would disarm the timer
+  if(timerfd_settime(timer_fds[i], 0, &its, NULL)<0) {
+    fprintf(stderr, "timerfd_settime failure for %s: %s\n", sensors[i]->sensor_type, strerror(errno));
+    exit(-1);
+  }
+}
+
+int main(int argc, char** argv) {
+  daemon_init(argc, argv);
+  if(USE_BATCH_COMMIT) batch_commit_enable(GHPI_BATCH_MAX_ROWS, GHPI_BATCH_MAX_AGE);
+  if(USE_WRITER_THREAD) writer_thread_enable();
+  live_publish_enable();
+  metrics_enable();
+  int epfd = epoll_create1(0);
+  if(epfd<0) {
+    fprintf(stderr, "epoll_create1 failure: %s\n", strerror(errno));
+    exit(-1);
+  }
+  for(int i=0; i<N_SENSORS; i++) {
+    timer_fds[i] = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    if(timer_fds[i]<0) {
+      fprintf(stderr, "timerfd_create failure: %s\n", strerror(errno));
+      exit(-1);
+    }
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.u32 = i;
+    if(epoll_ctl(epfd, EPOLL_CTL_ADD, timer_fds[i], &ev)<0) {
+      fprintf(stderr, "epoll_ctl failure: %s\n", strerror(errno));
+      exit(-1);
+    }
+    sensor_init(sensors[i]);
+    arm_timer(i, sensors[i]->init());
+    if(sensors[i]->event_fd>=0) {
+      ev.data.u32 = N_SENSORS + i;
+      if(epoll_ctl(epfd, EPOLL_CTL_ADD, sensors[i]->event_fd, &ev)<0) {
+	fprintf(stderr, "epoll_ctl failure: %s\n", strerror(errno));
+	exit(-1);
+      }
+    }
+  }
+  writer_thread_start();
+  struct epoll_event events[2*N_SENSORS];
+  while(1) {
+    int n = epoll_wait(epfd, events, 2*N_SENSORS, -1);
+    if(n<0) {
+      if(errno==EINTR) { // E.g. SIGTERM, for which batch_poll flushes and exits
+	batch_poll();
+	continue;
+      }
+      fprintf(stderr, "epoll_wait failure: %s\n", strerror(errno));
+      exit(-1);
+    }
+    for(int e=0; e<n; e++) {
+      int i = events[e].data.u32;
+      if(i>=N_SENSORS) i -= N_SENSORS; // Event fd. Stepping re-arms the timer, so it doesn't also fire.
+      else {
+	uint64_t expirations;
+	if(read(timer_fds[i], &expirations, sizeof(expirations))<0) continue; // Spurious wakeup; timer not actually expired
+      }
+      arm_timer(i, sensor_step(sensors[i]));
+    }
+    batch_poll();
+  }
+  return 0;
+}
@@ -1,7 +1,14 @@
 var Ifans = 400; // cA. Assumption is that the fans draw more than 4A.
 var Ifurnace = 230; // cA
 var Ifurnace_least = 150; // cA
-var EMA_alpha = 0.8;
+var stream_proto = 2; // poll_stream output protocol: 1 is the original CSV lines, 2 text deltas, 3 binary deltas
+var stream_paths = {
+    1: "/data_stream",
+    2: "/data_stream?proto=2",
+    3: "/data_stream_bin?proto=3" // Needs a second websocketd, run with --binary
+};
+var EMA_alpha = 0.8; // Per EMA_period
+var EMA_period = 250; // ms. The server used to send every 250 ms, but now sends only on change, so the smoothing is scaled by the time between updates.
 
 // Latest data
 var dat = {sec:null,elevation:null,flux_area:null,exch_flow_rate:null,tmp_ctrl_module:null,tmp_outdoor_module:null,fencepost:null,underground:null,ceiling:null,floor_hub:null,heat_exch_inlet:null,heat_exch_outlet:null,delta_exch:null,csp_outlet:null,delta_csp:null,swamp:null,tank_1:null,tank_2:null,tank_3:null,tank_4:null,aux:null,furnace_ctrl:null,furnace_power:null,vent_sys:null,vent:null,swamp_pump:null,vfans:null,tflux:null,tflow:null,plocal:null,psea:null,gas:null,Vrms:null,Irms:null,Pmean:null,S:null,PF:null,hum_in:null,hum_out:null,lux:null,vis:null,ired:null,uva:null,uvb:null,vis_ir:null,wlan0_level:null};
@@ -135,8 +142,13 @@ function updateTables(field, datum) {
     if(((field in dat) && (dat[field]!=int_datum)) || (field in dependees)) {
 	if(field=='Irms') {
 	    // Don't need to do Vrms or Pmean too; they're already pretty stable
+	    var now = Date.now();
 	    if(dat[field] == null) dat[field]=int_datum; // Initial value
-	    else dat[field]=dat[field]*EMA_alpha + int_datum*(1-EMA_alpha);
+	    else {
+		var alpha = Math.pow(EMA_alpha, (now-Irms_time)/EMA_period);
+		dat[field]=dat[field]*alpha + int_datum*(1-alpha);
+	    }
+	    Irms_time = now;
 	}
 	else dat[field]=int_datum;
 	if(field in temp_sensors) {
@@ -169,6 +181,11 @@ function updateTables(field, datum) {
     }
 }
 
+function markConnected() {
+    heartbeat=1;
+    document.getElementById('status').innerHTML = "connected";
+}
+
 function processRecord(sheading, sdata) {
     var fields = sheading.split(',');
     var data = sdata.split(',');
@@ -179,11 +196,89 @@ function processRecord(sheading, sdata) {
 	var datum = data[i];
 	updateTables(field, datum);
     }
-    heartbeat=1;
-    document.getElementById('status').innerHTML = "connected";
+    markConnected();
+}
+
+// Delta protocols (stream_proto 2 and 3); see poll_stream.c
+var schema = []; // Field names, indexed by ID
+var raw = {}; // Latest datum of each field, as passed to updateTables
+var carry = new Uint8Array(0); // Incomplete binary record, continued in the next message
+
+function processUpdate(ids, data) {
+    var changed = {};
+    for(var i=0; i<ids.length; i++) {
+	var field = schema[ids[i]];
+	raw[field] = data[i];
+	changed[field] = null;
+	updateTables(field, data[i]);
+    }
+    // Dependees are updated on every message regardless, as they were when every message had every field
+    for(var field in dependees)
+	if(!(field in changed) && (field in raw)) updateTables(field, raw[field]);
+    markConnected();
+}
+
+function processDeltaText(line) {
+    if(line[0]=='S') schema = line.substring(1).split(',');
+    else if(line[0]=='U') {
+	var ids = [];
+	var data = [];
+	if(line.length>1) {
+	    var pairs = line.substring(1).split(',');
+	    for(var i=0; i<pairs.length; i++) {
+		var colon = pairs[i].indexOf(':');
+		var datum = pairs[i].substring(colon+1);
+		ids.push(parseInt(pairs[i].substring(0, colon), 10));
+		data.push(datum=='n'?"null":(datum=='x'?"n/a":datum));
+	    }
+	}
+	processUpdate(ids, data);
+    }
+}
+
+function processDeltaBinary(buf) {
+    var b = new Uint8Array(carry.length + buf.byteLength);
+    b.set(carry);
+    b.set(new Uint8Array(buf), carry.length);
+    var i = 0;
+    while(i<b.length) {
+	var start = i;
+	if(b[i]==0x53) { // 'S'
+	    if(i+3>b.length) break;
+	    var len = b[i+1] | (b[i+2]<<8);
+	    if(i+3+len>b.length) break;
+	    schema = new TextDecoder().decode(b.subarray(i+3, i+3+len)).split(',');
+	    i += 3+len;
+	} else if(b[i]==0x55) { // 'U'
+	    if(i+2>b.length) break;
+	    var n = b[i+1];
+	    var ids = [];
+	    var data = [];
+	    var complete = true;
+	    i += 2;
+	    for(var k=0; (k<n) && complete; k++) {
+		var x = 0, mul = 1, byte = 0x80;
+		if(i<b.length) ids.push(b[i++]);
+		while((byte & 0x80) && (complete = (i<b.length))) { // Varint
+		    byte = b[i++];
+		    x += (byte & 0x7f)*mul;
+		    mul *= 128;
+		}
+		// 0 is null, 1 is n/a, and the rest are zigzag encoded, plus 2
+		data.push(x==0?"null":(x==1?"n/a":(((x%2)==0)?(x-2)/2:-(x-1)/2).toString()));
+	    }
+	    if(!complete) {
+		i = start;
+		break;
+	    }
+	    processUpdate(ids, data);
+	} else i = b.length; // Corrupt; drop it all
+    }
+    carry = b.slice(i);
 }
 
 var e_lock = 0;
+var Irms_time = null; // When Irms was last updated, for EMA_period
 var reqSerial = 0;
 var ws = null
 var lastMod = null;
@@ -262,7 +357,11 @@ function init() {
 	 :"<b>not connected</b>");
     document.getElementById('sec').innerHTML = "";
     if(ws) ws.close();
-    ws = new WebSocket("ws://" + (location.hostname) + "/data_stream");
+    ws = new WebSocket("ws://" + (location.hostname) + stream_paths[stream_proto]);
+    if(stream_proto==3) ws.binaryType = "arraybuffer";
+    schema = [];
+    raw = {};
+    carry = new Uint8Array(0);
     ws.onopen = function() {
     };
     ws.onclose = function() {
@@ -275,11 +374,17 @@ function init() {
     ws.onmessage=function(e) {
 	if(e_lock==1) document.getElementById('status').innerHTML = "LOCKED";
 	e_lock = 1;
-	var rows = e.data.split('\n'); // Should be just 1, but just in case...
-	for(var i=0; i<rows.length; i++) {
-	    // Format is comma-separated headers, then '!', then comma-separated values
-	    var pair = rows[i].split('!');
-	    processRecord(pair[0], pair[1]);
+	if(stream_proto==3) processDeltaBinary(e.data);
+	else {
+	    var rows = e.data.split('\n'); // Should be just 1, but just in case...
+	    for(var i=0; i<rows.length; i++) {
+		if(stream_proto==2) processDeltaText(rows[i]);
+		else {
+		    // Format is comma-separated headers, then '!', then comma-separated values
+		    var pair = rows[i].split('!');
+		    processRecord(pair[0], pair[1]);
+		}
+	    }
 	}
 	e_lock = 0;
     }
@@ -1,17 +1,6 @@
-#include <wiringPi.h>
-int main() {
-  wiringPiSetupGpio();
-
-  // Toggle clock
-  for (int i=0; i<16; i++) {
-    pinMode (3, OUTPUT); digitalWrite(3, LOW); delay(1);
-    pinMode (3, INPUT); delay(1); //Don't drive high; bus is open collector
-  }
+#include "gh_io.h"
 
-  // Issue STOP condition
-  pinMode (3, OUTPUT); digitalWrite(3, LOW); delay(1);
-  pinMode (2, OUTPUT); digitalWrite(2, LOW); delay(1);
-  pinMode (3, INPUT); delay(1);
-  pinMode (2, INPUT);
-  return 0;
+// Clears a stuck I2C bus by hand; see io_i2c_recover, which the daemons also do themselves when their transfers start failing. Exits nonzero if SDA is still held low.
+int main() {
+  return io_i2c_recover()?0:1;
 }
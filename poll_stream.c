@@ -4,13 +4,31 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <limits.h>
+#include <unistd.h>
+#include <libgen.h>
+#include <poll.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/inotify.h>
 #include "gh_ctrl.h"
 
-#define LOOP_PERIOD 250*1000000 // ns
+// Instead of requerying every 250 ms, wait for a commit (which writes to the DB's WAL file), and send only the lines that changed.
+// The readings that the sensor daemons publish to the live values segment (see gh_live.h) are read from there instead, as soon as they're acquired, rather than from the DB once they're committed.
+#define MIN_PERIOD 50 // ms. Coalesces bursts of commits, and caps the rate per client.
+#define MAX_LATENCY 2000 // ms. Requery at least this often even without a commit, since the DS18B20 readings expire after an hour, and the wlan stats aren't in the DB. Also bounds the latency if an inotify event is ever missed.
+#define KEEPALIVE_PERIOD 10000 // ms. Send something at least this often, even if nothing changed, since showdata.js reconnects if it gets nothing for 15 s: all the lines in protocol 1, or an empty update in the others.
 #define N_DS18B20_MAX 64 // 64 DS18B20 sensors ought to be enough for anybody...
 #define STATBUFLEN 1024
+#define N_FIELDS_MAX 255 // Field IDs are one byte in protocol 3
+
+// Output protocol, selected by the client with e.g. ws://host/data_stream?proto=2 (which websocketd passes in QUERY_STRING):
+// 1 (default): Three lines, each comma-separated field names, then "!", then comma-separated values, all resent whenever any value in the line changes. Values are integers, "null", "n/a" (no DS18B20 reading in the last hour), or "err".
+// 2: Text deltas. "S" then comma-separated field names, sent on connection and whenever the fields change (e.g. a DS18B20 is added or relabeled); a field's ID is its index. Then "U" then comma-separated id:value pairs for only the fields that changed since the last update, with value an integer, "n" for null or err, or "x" for n/a. A keepalive is just "U".
+// 3: Binary deltas, for websocketd --binary (which doesn't split messages by line, so records aren't necessarily one per message). Schema record: 'S', u16 length (little endian), then the names as in protocol 2. Update record: 'U', u8 count, then count pairs of u8 ID and varint value (LEB128), where 0 is null or err, 1 is n/a, and otherwise the value zigzag encoded, plus 2.
+#define PROTO_CSV 1
+#define PROTO_TEXT_DELTA 2
+#define PROTO_BINARY_DELTA 3
 
 bool have_wireless;
 FILE* proc_wireless_fp;
@@ -18,104 +36,275 @@ const char* statfile = "/proc/net/wireless";
 char statbuf[STATBUFLEN];
 
 int ncols;
+int n_DS18B20;
 int DS18B20_IDs[N_DS18B20_MAX];
-int DS18B20_readings[N_DS18B20_MAX];
+char* DS18B20_labels[N_DS18B20_MAX];
+long long data_version = -1;
+long long DS18B20_IDs_version = -1;
 sqlite3_stmt* pStmt_logs;
+sqlite3_stmt* pStmt_data_version;
+sqlite3_stmt* pStmt_DS18B20_IDs_version;
 sqlite3_stmt* pStmt_DS18B20_IDs;
 sqlite3_stmt* pStmt_DS18B20_logs;
 
-void read_print_logs() { // Get the single-row result from the view, and print in CSV format, with header separated by "!" instead of "\n" (for easy transmission as one message via websocketd, which splits messages by "\n")
+int inotify_fd;
+char* wal_name; // Basename of the WAL file, to filter the events for its directory
+long long notify_data_version = -1;
+
+int proto = PROTO_CSV;
+
+enum field_state {FIELD_VALUE, FIELD_NULL, FIELD_NA, FIELD_ERR};
+struct field {
+  const char* name; // Not owned. Valid until the next read.
+  int state; // enum field_state
+  int val;
+};
+
+// For protocol 1
+struct stream_line { // One line of output, as a separate websocketd message
+  int (*read)(struct field* f);
+  char* buf; // Last sent
+  size_t len;
+};
+
+// Live values segment (see gh_live.h). Each live field overrides its column of Last_logs, which is only as fresh as the latest commit. This mirrors the Latest_values triggers in ghpi-arch.sql.
+enum live_op {LIVE_COPY, LIVE_BOTH_ZERO, LIVE_EITHER_ZERO}; // The furnace state is derived from q1 and q2, as in Furnace_logs_state
+struct live_field {
+  const char* name; // Column of Last_logs
+  const char* channel;
+  const char* channel2; // Second operand, for the derived ops
+  int op; // enum live_op
+  int col, slot, slot2; // Found at runtime; -1 if not (yet)
+};
+struct live_field live_fields[] = {
+  {"tflux", "MAX11201B_logs.flux"},
+  {"furnace_ctrl", "Furnace_logs.q1", "Furnace_logs.q2", LIVE_BOTH_ZERO},
+  {"furnace_power", "Furnace_logs.q1", "Furnace_logs.q2", LIVE_EITHER_ZERO},
+  {"tmp_ctrl_module", "BME680_logs.temp"},
+  {"plocal", "BME680_logs.pres"},
+  {"hum_in", "BME680_logs.hum"},
+  {"gas", "BME680_logs.gas"},
+  {"tmp_outdoor_module", "SHT31_logs.temp"},
+  {"hum_out", "SHT31_logs.hum"},
+  {"vis_ir", "TSL2591_logs.total"},
+  {"ired", "TSL2591_logs.ired"},
+  {"uva", "VEML6075_logs.uva"},
+  {"uvb", "VEML6075_logs.uvb"},
+  {"Vrms", "INA260_logs.Vrms"},
+  {"Irms", "INA260_logs.Irms"},
+  {"Pmean", "INA260_logs.Pmean"}
+};
+#define N_LIVE_FIELDS (int)(sizeof(live_fields)/sizeof(live_fields[0]))
+struct live_segment* live;
+struct timespec ts_live_map; // Last attempt
+unsigned live_gen_read; // Generation as of the last overlay_live
+int n_live_prev = -1; // Live fields as of the last overlay_live
+int sec_col = -1; // Of Last_logs
+struct field logs[N_FIELDS_MAX]; // Last_logs as of ts_logs_query
+int n_logs;
+struct timespec ts_logs_query;
+
+// For protocols 2 and 3: what the client has
+int n_sent = -1;
+char* sent_names[N_FIELDS_MAX];
+struct field sent[N_FIELDS_MAX];
+
+// Each read_* function fills in f with its fields, and returns how many
+
+void map_live() {
+  clock_gettime(CLOCK_MONOTONIC, &ts_live_map);
+  if(live) live_unmap(live);
+  live = live_map(live_shm_name(), false);
+  for(int i=0; i<N_LIVE_FIELDS; i++) live_fields[i].slot = live_fields[i].slot2 = -1;
+}
+
+int query_logs() { // The single-row result from the view
   int rc, i;
+  clock_gettime(CLOCK_MONOTONIC, &ts_logs_query);
   rc = sqlite3_step(pStmt_logs);
-  check_sql(rc, "sqlite3_step failure in poll_stream/read_print_logs");
+  check_sql(rc, "sqlite3_step failure in poll_stream/query_logs");
   if(rc!=SQLITE_ROW) {
     sqlite3_reset(pStmt_logs);
-    return;
-  }
-  for(i=0; i<ncols; i++) {
-    printf("%s%s", sqlite3_column_name(pStmt_logs, i),
-	   (i==(ncols-1))?"":",");
+    return 0;
   }
-  printf("!");
   for(i=0; i<ncols; i++) {
-    if(sqlite3_column_type(pStmt_logs, i)==SQLITE_NULL)
-      printf("null%s", (i==(ncols-1))?"":",");
-    else printf("%d%s", sqlite3_column_int(pStmt_logs, i),
-		(i==(ncols-1))?"":",");
+    logs[i].name = sqlite3_column_name(pStmt_logs, i);
+    logs[i].state = (sqlite3_column_type(pStmt_logs, i)==SQLITE_NULL)?FIELD_NULL:FIELD_VALUE;
+    logs[i].val = sqlite3_column_int(pStmt_logs, i);
   }
-  printf("\n");
   sqlite3_reset(pStmt_logs);
+  return ncols;
 }
 
-void read_print_DS18B20_logs() {
-  int rc, i, n_DS18B20=0;
-  while(1) { // Print all the labels, and get all the readings
-    rc = sqlite3_step(pStmt_DS18B20_IDs);
-    check_sql(rc, "sqlite3_step failure in poll_stream/read_print_DS18B20_logs");
-    if(rc==SQLITE_ROW) {
-      if(n_DS18B20!=0) printf(","); // Delimit previous output of this loop
-      DS18B20_IDs[n_DS18B20++] = sqlite3_column_int(pStmt_DS18B20_IDs, 0);
-      printf("%s", sqlite3_column_text(pStmt_DS18B20_IDs, 1));
+// Overlay the live values on the columns from the DB. Returns how many of live_fields are live.
+int overlay_live(struct field* f) {
+  int i, n_live = 0;
+  struct live_reading r, r2;
+  if(!live) return 0;
+  live_gen_read = live_generation(live); // Before reading, so that wait_for_change catches anything published meanwhile
+  for(i=0; i<N_LIVE_FIELDS; i++) {
+    struct live_field* lf = &live_fields[i];
+    if(lf->col<0) continue;
+    if(lf->slot<0) lf->slot = live_find(live, lf->channel); // Slots never move once claimed, so this only needs finding once
+    if(lf->channel2 && (lf->slot2<0)) lf->slot2 = live_find(live, lf->channel2);
+    if(!live_read(live, lf->slot, &r)) continue;
+    struct field* x = &f[lf->col];
+    if(lf->op==LIVE_COPY) {
+      x->state = r.null_p?FIELD_NULL:FIELD_VALUE;
+      x->val = r.val;
     } else {
-      sqlite3_reset(pStmt_DS18B20_IDs);
-      break;
+      if(!live_read(live, lf->slot2, &r2)) continue;
+      x->state = (r.null_p || r2.null_p)?FIELD_NULL:FIELD_VALUE;
+      x->val = (lf->op==LIVE_BOTH_ZERO)?((r.val==0) && (r2.val==0)):((r.val==0) || (r2.val==0));
+      if(r2.acq.tv_sec>r.acq.tv_sec) r.acq = r2.acq;
     }
+    if((sec_col>=0) && (r.acq.tv_sec>f[sec_col].val)) {
+      f[sec_col].state = FIELD_VALUE;
+      f[sec_col].val = r.acq.tv_sec;
+    }
+    n_live++;
   }
-  printf("!");
-  for(i=0; i<n_DS18B20; i++) { // Print all the readings
-    rc = sqlite3_bind_int(pStmt_DS18B20_logs, 1, DS18B20_IDs[i]);
-    check_sql(rc, "sqlite3_bind_int failure in read_print_DS18B20_logs");
-    rc = sqlite3_step(pStmt_DS18B20_logs);
-    check_sql(rc, "sqlite3_step failure in read_print_DS18B20_logs");
-    if(rc==SQLITE_DONE) printf("n/a%s", (i==(n_DS18B20-1))?"":","); // No data
-    else if(sqlite3_column_type(pStmt_DS18B20_logs, 0)==SQLITE_NULL)
-      printf("null%s", (i==(n_DS18B20-1))?"":",");
-    else printf("%d%s", sqlite3_column_int(pStmt_DS18B20_logs, 0),
-		(i==(n_DS18B20-1))?"":",");
-    sqlite3_reset(pStmt_DS18B20_logs);
+  return n_live;
+}
+
+int read_logs(struct field* f) {
+  // The DB's only needed for the columns that aren't live (e.g. the Config values, and the readings of any daemon that isn't running), so while all the rest are, requery only every MAX_LATENCY.
+  if((n_live_prev<N_LIVE_FIELDS) || (n_logs==0) || (ms_since(&ts_logs_query)>=MAX_LATENCY)) n_logs = query_logs();
+  if(n_logs==0) return 0;
+  memcpy(f, logs, n_logs*sizeof(struct field));
+  if(!live && (ms_since(&ts_live_map)>=MAX_LATENCY)) map_live(); // The daemons might not have started yet
+  n_live_prev = overlay_live(f);
+  if(live && (n_live_prev==0) && (ms_since(&ts_live_map)>=MAX_LATENCY)) map_live(); // No writers, so maybe the segment was removed and recreated
+  return n_logs;
+}
+
+long long step_int64(sqlite3_stmt* pStmt, const char* msg) { // For single-value queries
+  int rc = sqlite3_step(pStmt);
+  check_sql(rc, msg);
+  long long val = (rc==SQLITE_ROW)?sqlite3_column_int64(pStmt, 0):-1;
+  sqlite3_reset(pStmt);
+  return val;
+}
+
+void refresh_DS18B20_IDs() { // Reread the IDs and labels only if DS18B20_IDs has changed, which it rarely does, and only check that if anything has been committed since last time
+  int rc;
+  long long version = step_int64(pStmt_data_version, "sqlite3_step failure in poll_stream/refresh_DS18B20_IDs for data_version");
+  if(version==data_version) return;
+  data_version = version;
+  version = step_int64(pStmt_DS18B20_IDs_version, "sqlite3_step failure in poll_stream/refresh_DS18B20_IDs for Table_versions");
+  if(version==DS18B20_IDs_version) return;
+  DS18B20_IDs_version = version;
+  for(int i=0; i<n_DS18B20; i++) sqlite3_free(DS18B20_labels[i]);
+  n_DS18B20 = 0;
+  while(1) {
+    rc = sqlite3_step(pStmt_DS18B20_IDs);
+    check_sql(rc, "sqlite3_step failure in poll_stream/refresh_DS18B20_IDs");
+    if(rc!=SQLITE_ROW) break;
+    if(n_DS18B20==N_DS18B20_MAX) continue; // Excess sensors are ignored
+    DS18B20_IDs[n_DS18B20] = sqlite3_column_int(pStmt_DS18B20_IDs, 0);
+    DS18B20_labels[n_DS18B20++] = sqlite3_mprintf("%s", sqlite3_column_text(pStmt_DS18B20_IDs, 1));
   }
-  printf("\n");
+  sqlite3_reset(pStmt_DS18B20_IDs);
 }
 
-void read_print_wlan_stats() {
-  int retval = fseek(proc_wireless_fp, 0, SEEK_SET);
-  if(retval) {
-    printf("wlan0_level!err\n");
-    return;
+int read_DS18B20_logs(struct field* f) {
+  int rc, i, j=0;
+  refresh_DS18B20_IDs();
+  for(i=0; i<n_DS18B20; i++) {
+    f[i].name = DS18B20_labels[i];
+    f[i].state = FIELD_NA; // Unless there's a row for it
   }
-  size_t len = fread(statbuf, sizeof(char), STATBUFLEN, proc_wireless_fp);
-  if(ferror(proc_wireless_fp)!=0) {
-    printf("wlan0_level!err\n");
-    return;
+  while(1) { // Rows and labels are both in sensor_ID order, but a sensor added or removed since the labels were read may be in one and not the other, until the next refresh.
+    rc = sqlite3_step(pStmt_DS18B20_logs);
+    check_sql(rc, "sqlite3_step failure in read_DS18B20_logs");
+    if(rc!=SQLITE_ROW) break;
+    int ID = sqlite3_column_int(pStmt_DS18B20_logs, 0);
+    while((j<n_DS18B20) && (DS18B20_IDs[j]<ID)) j++;
+    if((j==n_DS18B20) || (DS18B20_IDs[j]!=ID)) continue; // Not in the labels yet
+    if(!sqlite3_column_int(pStmt_DS18B20_logs, 1)) f[j].state = FIELD_NA; // No data
+    else if(sqlite3_column_type(pStmt_DS18B20_logs, 2)==SQLITE_NULL) f[j].state = FIELD_NULL;
+    else {
+      f[j].state = FIELD_VALUE;
+      f[j].val = sqlite3_column_int(pStmt_DS18B20_logs, 2);
+    }
+    j++;
   }
-  if(len>=STATBUFLEN) { // Data too big for static buffer
-    printf("wlan0_level!err\n");
-    return;
+  sqlite3_reset(pStmt_DS18B20_logs);
+  return n_DS18B20;
+}
+
+int read_wlan_stats(struct field* f) {
+  f->name = "wlan0_level";
+  f->state = FIELD_ERR;
+  if(!have_wireless) {
+    f->state = FIELD_NULL;
+    return 1;
   }
+  int retval = fseek(proc_wireless_fp, 0, SEEK_SET);
+  if(retval) return 1;
+  size_t len = fread(statbuf, sizeof(char), STATBUFLEN, proc_wireless_fp);
+  if(ferror(proc_wireless_fp)!=0) return 1;
+  if(len>=STATBUFLEN) return 1; // Data too big for static buffer
   statbuf[len]=(char)0;
   char* wlan0 = strstr(statbuf, "wlan0");
   if(wlan0==NULL) {
-    printf("wlan0_level!null\n");
-    return;
+    f->state = FIELD_NULL;
+    return 1;
   }
   char* state;
   char* val = strtok_r(wlan0, " .", &state); // iface
   val = strtok_r(NULL, " .", &state); // status
   val = strtok_r(NULL, " .", &state); // link quality
   val = strtok_r(NULL, " .", &state); // signal level
-  printf("wlan0_level!%s\n", val);
+  char* end;
+  if(val) f->val = strtol(val, &end, 10);
+  if(val && (end!=val) && (*end==0)) f->state = FIELD_VALUE;
+  return 1;
+}
+
+int (*readers[])(struct field* f) = {&read_logs, &read_DS18B20_logs, &read_wlan_stats};
+#define N_READERS (int)(sizeof(readers)/sizeof(readers[0]))
+
+// Protocol 1. In CSV format, with header separated by "!" instead of "\n" (for easy transmission as one message via websocketd, which splits messages by "\n")
+void print_csv(FILE* out, struct field* f, int n) {
+  int i;
+  const char* states[] = {NULL, "null", "n/a", "err"};
+  for(i=0; i<n; i++) fprintf(out, "%s%s", f[i].name, (i==(n-1))?"":",");
+  fprintf(out, "!");
+  for(i=0; i<n; i++) {
+    if(f[i].state==FIELD_VALUE) fprintf(out, "%d%s", f[i].val, (i==(n-1))?"":",");
+    else fprintf(out, "%s%s", states[f[i].state], (i==(n-1))?"":",");
+  }
+  fprintf(out, "\n");
 }
 
 void setup() {
   int rc;
-  char zSql_get_logs[] = "SELECT * FROM Last_logs";
-  char zSql_get_DS18B20_IDs[] = "SELECT sensor_ID, label from DS18B20_IDs";
-  char zSql_get_DS18B20_logs[] =
-    "SELECT temp from DS18B20_logs WHERE sensor_ID=? AND sec>(strftime('%s', 'now')-3600) ORDER BY sec DESC, cs DESC LIMIT 1";
+  char zSql_get_logs[] = GHPI_SQL_LAST_LOGS;
+  char zSql_get_data_version[] = GHPI_SQL_DATA_VERSION;
+  char zSql_get_DS18B20_IDs_version[] = GHPI_SQL_DS18B20_IDS_VERSION;
+  char zSql_get_DS18B20_IDs[] = GHPI_SQL_DS18B20_IDS;
+  char zSql_get_DS18B20_logs[] = GHPI_SQL_DS18B20_LAST;
   rc = sqlite3_prepare_v3(db, zSql_get_logs, -1,
 			  SQLITE_PREPARE_PERSISTENT, &pStmt_logs, NULL);
   check_sql(rc, "sqlite3_prepare failure in poll_stream for logs");
   ncols = sqlite3_column_count(pStmt_logs);
+  if(ncols+N_DS18B20_MAX+1 > N_FIELDS_MAX) {
+    fprintf(stderr, "Too many fields for the stream protocols: %d\n", ncols+N_DS18B20_MAX+1);
+    exit(-1);
+  }
+  for(int i=0; i<ncols; i++) if(!strcmp(sqlite3_column_name(pStmt_logs, i), "sec")) sec_col = i;
+  for(int i=0; i<N_LIVE_FIELDS; i++) {
+    live_fields[i].col = -1;
+    for(int j=0; j<ncols; j++) if(!strcmp(sqlite3_column_name(pStmt_logs, j), live_fields[i].name)) live_fields[i].col = j;
+  }
+  map_live();
+  rc = sqlite3_prepare_v3(db, zSql_get_data_version, -1,
+			  SQLITE_PREPARE_PERSISTENT, &pStmt_data_version, NULL);
+  check_sql(rc, "sqlite3_prepare failure in poll_stream for data_version");
+  rc = sqlite3_prepare_v3(db, zSql_get_DS18B20_IDs_version, -1,
+			  SQLITE_PREPARE_PERSISTENT, &pStmt_DS18B20_IDs_version, NULL);
+  check_sql(rc, "sqlite3_prepare failure in poll_stream for Table_versions");
   rc = sqlite3_prepare_v3(db, zSql_get_DS18B20_IDs, -1,
 			  SQLITE_PREPARE_PERSISTENT, &pStmt_DS18B20_IDs, NULL);
   check_sql(rc, "sqlite3_prepare failure in poll_stream for DS18B20_IDs");
@@ -127,18 +316,171 @@ void setup() {
   else have_wireless = true;
 }
 
+// Watch the directory rather than the WAL file itself, since the WAL is deleted and recreated when all connections close and one opens again.
+void setup_notify(const char* db_file_name) {
+  char* dir_buf = strdup(db_file_name);
+  char* base_buf = strdup(db_file_name);
+  wal_name = sqlite3_mprintf("%s-wal", basename(base_buf));
+  inotify_fd = inotify_init1(IN_NONBLOCK);
+  if(inotify_fd<0) {
+    fprintf(stderr, "inotify_init1 failure: %s\n", strerror(errno));
+    exit(-1);
+  }
+  if(inotify_add_watch(inotify_fd, dirname(dir_buf), IN_MODIFY | IN_CREATE)<0) {
+    fprintf(stderr, "inotify_add_watch failure for %s: %s\n", dir_buf, strerror(errno));
+    exit(-1);
+  }
+  free(dir_buf);
+  free(base_buf);
+}
+
+// Wait until another connection has committed, or MAX_LATENCY has passed since ts_last_query, whichever is first
+void wait_for_change(struct timespec* ts_last_query) {
+  char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  bool wal_written_p = false;
+  long recheck = 1; // ms
+  while(1) {
+    long timeout = MAX_LATENCY - ms_since(ts_last_query);
+    if(timeout<=0) return;
+    // A commit is visible only once the writer updates the WAL index, which is after it writes the WAL, and which doesn't generate an event (since the index is mmapped), so after a WAL write, poll data_version until it changes, with backoff. The WAL is also written by checkpoints, which don't change it, in which case this polls until MAX_LATENCY.
+    if(wal_written_p) {
+      if(timeout>recheck) timeout = recheck;
+      recheck = (recheck*2<MIN_PERIOD)?recheck*2:MIN_PERIOD;
+    }
+    if(live && (timeout>MIN_PERIOD)) timeout = MIN_PERIOD; // Publishing to the live segment doesn't generate an event either, so poll its generation
+
+    struct pollfd pfd = {inotify_fd, POLLIN, 0};
+    int n = poll(&pfd, 1, timeout);
+    if(n<0) {
+      if(errno==EINTR) continue;
+      fprintf(stderr, "poll failure: %s\n", strerror(errno));
+      exit(-1);
+    }
+    ssize_t len;
+    if(n>0) while((len = read(inotify_fd, buf, sizeof(buf)))>0) // Drain all pending events
+      for(char* p=buf; p<buf+len; p+=sizeof(struct inotify_event)+((struct inotify_event*)p)->len) {
+	struct inotify_event* ev = (struct inotify_event*)p;
+	if(ev->len && !strcmp(ev->name, wal_name)) wal_written_p = true; // Not some other file in the directory
+      }
+    if(live && (live_generation(live)!=live_gen_read)) return;
+    if(!wal_written_p) continue;
+    long long version = step_int64(pStmt_data_version, "sqlite3_step failure in poll_stream/wait_for_change");
+    if(version!=notify_data_version) {
+      notify_data_version = version;
+      return;
+    }
+  }
+}
+
+// Protocol 1: send the line if it's changed since last sent, or if forced
+void stream_csv(struct stream_line* line, bool force_p) {
+  struct field f[N_FIELDS_MAX];
+  char* buf;
+  size_t len;
+  FILE* out = open_memstream(&buf, &len);
+  print_csv(out, f, line->read(f));
+  fclose(out);
+  if(force_p || (len!=line->len) || memcmp(buf, line->buf, len)) {
+    fwrite(buf, 1, len, stdout);
+    free(line->buf);
+    line->buf = buf;
+    line->len = len;
+  } else free(buf);
+}
+
+void put_varint(unsigned long long x) { // LEB128
+  do {
+    putchar((x&0x7f) | ((x>0x7f)?0x80:0));
+    x >>= 7;
+  } while(x);
+}
+
+void send_schema(struct field* f, int n) {
+  char* names;
+  size_t len;
+  FILE* out = open_memstream(&names, &len);
+  for(int i=0; i<n; i++) fprintf(out, "%s%s", f[i].name, (i==(n-1))?"":",");
+  fclose(out);
+  if(proto==PROTO_TEXT_DELTA) printf("S%s\n", names);
+  else {
+    putchar('S');
+    putchar(len&0xff);
+    putchar(len>>8);
+    fwrite(names, 1, len, stdout);
+  }
+  free(names);
+}
+
+void send_update(struct field* f, int* ids, int n_ids) {
+  if(proto==PROTO_TEXT_DELTA) {
+    putchar('U');
+    for(int i=0; i<n_ids; i++) {
+      struct field* x = &f[ids[i]];
+      if(x->state==FIELD_VALUE) printf("%s%d:%d", i?",":"", ids[i], x->val);
+      else printf("%s%d:%s", i?",":"", ids[i], (x->state==FIELD_NA)?"x":"n");
+    }
+    putchar('\n');
+  } else {
+    putchar('U');
+    putchar(n_ids);
+    for(int i=0; i<n_ids; i++) {
+      struct field* x = &f[ids[i]];
+      putchar(ids[i]);
+      if(x->state==FIELD_VALUE) put_varint(((x->val<0)?(-2LL*x->val-1):(2LL*x->val)) + 2); // Zigzag
+      else put_varint((x->state==FIELD_NA)?1:0);
+    }
+  }
+}
+
+// Protocols 2 and 3: send the fields that changed since last sent, and the schema first if the fields themselves changed. If there are no changes, send an empty update if keepalive_p.
+void stream_delta(bool keepalive_p) {
+  struct field f[N_FIELDS_MAX];
+  int ids[N_FIELDS_MAX];
+  int i, n = 0, n_ids = 0;
+  for(i=0; i<N_READERS; i++) n += readers[i](f+n);
+  bool schema_p = (n!=n_sent);
+  for(i=0; (i<n) && !schema_p; i++) schema_p = strcmp(f[i].name, sent_names[i]);
+  if(schema_p) {
+    for(i=0; i<n_sent; i++) sqlite3_free(sent_names[i]);
+    for(i=0; i<n; i++) sent_names[i] = sqlite3_mprintf("%s", f[i].name);
+    send_schema(f, n);
+  }
+  for(i=0; i<n; i++)
+    if(schema_p || (f[i].state!=sent[i].state) || ((f[i].state==FIELD_VALUE) && (f[i].val!=sent[i].val)))
+      ids[n_ids++] = i;
+  if(n_ids || keepalive_p) send_update(f, ids, n_ids);
+  memcpy(sent, f, n*sizeof(struct field));
+  n_sent = n;
+}
+
 int main(int argc, char** argv) {
-  struct timespec ts;
-  ts.tv_sec = 0;
-  ts.tv_nsec = LOOP_PERIOD;
+  struct stream_line lines[N_READERS];
+  memset(lines, 0, sizeof(lines));
+  for(int i=0; i<N_READERS; i++) lines[i].read = readers[i];
+  const char* query = getenv("QUERY_STRING");
+  const char* proto_arg = query?strstr(query, "proto="):NULL;
+  if(proto_arg) proto = atoi(proto_arg+strlen("proto="));
+  if((proto<PROTO_CSV) || (proto>PROTO_BINARY_DELTA)) {
+    fprintf(stderr, "Unsupported protocol: %d\n", proto);
+    exit(-1);
+  }
+  struct timespec ts_min_period, ts_last_query, ts_keepalive;
+  ns_to_ts(&ts_min_period, MIN_PERIOD*1000000LL);
   daemon_init(argc, argv);
   setup();
+  setup_notify(argv[1]);
+  clock_gettime(CLOCK_MONOTONIC, &ts_keepalive);
+  bool keepalive_p = true; // Send everything on connection
   while(1) {
-    read_print_logs();
-    read_print_DS18B20_logs();
-    read_print_wlan_stats();
+    clock_gettime(CLOCK_MONOTONIC, &ts_last_query);
+    if(proto==PROTO_CSV)
+      for(int i=0; i<N_READERS; i++) stream_csv(&lines[i], keepalive_p);
+    else stream_delta(keepalive_p);
     fflush(stdout);
-    nanosleep(&ts, NULL);
+    if(keepalive_p) clock_gettime(CLOCK_MONOTONIC, &ts_keepalive);
+    nanosleep(&ts_min_period, NULL);
+    wait_for_change(&ts_last_query);
+    keepalive_p = ms_since(&ts_keepalive) >= KEEPALIVE_PERIOD;
   }
   return 0;
 }
@@ -1,12 +1,12 @@
-#include <wiringPiI2C.h>
 #include <errno.h>
 #include <stdio.h>
+#include "gh_io.h"
 
 int main (void)
 {
-  int fd9808 = wiringPiI2CSetup (0x18) ;
+  int fd9808 = io_i2c_open (0x18) ;
   if(fd9808==-1) return errno;
-  int tmpr = wiringPiI2CReadReg16(fd9808, 5);
+  int tmpr = io_i2c_read_reg16(fd9808, 5);
   int upper = (tmpr&0x000f)<<8;
   int sign = upper & 0x1000;
   if(sign) upper|=(-1>>12)<<12;
@@ -1,4 +1,3 @@
-#include <wiringPi.h>
 #include <time.h>
 #include <stdio.h>
 #include <errno.h>
@@ -10,6 +9,9 @@
 #define DEBUG_PRINT_ADC false
 #define DEBUG_PRINT_FLUX false
 #define DEBUG_PRINT_FLUX_CHANGE_ONLY true
+#define USE_BATCH_COMMIT true // Group commit; see batch_commit_enable
+#define USE_WRITER_THREAD true // So that sampling never blocks on the DB; see writer_thread_enable
+#define USE_RDY_EVENTS true // Sleep until DOUT falls, i.e. a conversion is ready (see io_gpio_watch), rather than polling it every POLL_PERIOD
 
 //RPi BCM pins
 #define SCLK 23
@@ -17,7 +19,9 @@
 
 // MAX11201B updates at 13.75 sps, but polling slower than that introduces occasional glitched data due to the chip unilaterally pulsing DOUT high to indicate a new conversion has been performed, which introduces a race condition between verifying DOUT is low and initiating a read, and the glitch can't be definitively filtered out since there's no CRC. And interrupts are impractical because wiringPi is crap.
 // The solution is to poll faster than the update period, so the chip never gets a chance to send its unilateral pulse.
+// Better still is to be told: with DOUT's falling edges from the kernel's line events, a conversion is read within a scheduling latency of its being ready, nowhere near the next one, and the daemon sleeps in between. The data bits clocked out by a read fall too, so their events are drained afterward, and only DOUT's level decides whether a conversion is ready.
 #define POLL_PERIOD (40*1000*1000) // ns
+#define RDY_TIMEOUT (200*1000*1000) // ns. With RDY events, how long to wait for one before checking DOUT anyway, in case one was lost.
 #define UPDATE_PERIOD ((double)1/13.75) // sec
 
 #define ONE_SECOND (1000*1000*1000) // ns
@@ -27,71 +31,82 @@
 #define SPIN_UP_DELAY_SEC (SPIN_UP_DELAY*POLL_PERIOD/ONE_SECOND)
 #define SPIN_UP_DELAY_SEC_LIMITED (SPIN_UP_DELAY*UPDATE_PERIOD) // Approximation, since polling will delay for another full POLL_PERIOD each time ADC isn't ready yet
 
-#define SCLK_PERIOD 10000 // ns. 100kHz is adequate
+#define SCLK_PERIOD 10000 // ns. 100kHz is adequate. Timed by busy-waiting (see io_spin_until), since each io_nanosleep of a half period would take tens of us, and a syscall.
+#define GLITCHES_MAX 10 // Consecutive glitched reads before giving up on the ADC
 
 #define REFP 3.3 // ADC positive reference voltage
 #define FRAC_SCALE 8388608 // 2^23; ADC is 24-bit two's complement
 #define MICROV_SCALE ((double)1000000*REFP/FRAC_SCALE)
 
-char zSql_log[] = "insert into MAX11201B_logs values (?,?,?)";
-const char* sensor_type = "MAX11201B";
-double S_calib, ema_accum;
-bool now_reading_p, flux_prev_inc_p;
-int flux_mem;
+extern struct ghpi_sensor max11201b_sensor;
+static double S_calib, ema_accum;
+static bool flux_prev_inc_p;
+static int flux_mem;
+static int per_calib_count, total_count;
+static int glitches; // Consecutive
+static long long t_last_read; // io_now_ns at the start of the last read, or 0 if there's been a calibration since
+static const int rdy_pins[] = {DOUT};
 
-void ADC_calibrate() {
+static void ADC_calibrate() {
   int in;
-  struct timespec half_tick;
-  half_tick.tv_sec = 0;
-  half_tick.tv_nsec = SCLK_PERIOD/2;
+  long long t = io_now_ns();
   for(int i=0; i<26; i++) {
-    digitalWrite(SCLK, 1);
-    nanosleep(&half_tick, NULL);
-    digitalWrite(SCLK, 0);
-    nanosleep(&half_tick, NULL);
+    io_gpio_write(SCLK, 1);
+    io_spin_until(t += SCLK_PERIOD/2);
+    io_gpio_write(SCLK, 0);
+    io_spin_until(t += SCLK_PERIOD/2);
   }
-  in=digitalRead(DOUT);
+  t_last_read = 0;
+  in=io_gpio_read(DOUT);
   if(!in) {
     fprintf(stderr, "ADC failure during calibration\n");
     exit(-1);
   }
 }
 
-int ADC_read() {
+// Returns false if the read was glitched, i.e. DOUT isn't high after the 25th clock, in which case val is garbage
+static bool ADC_read(int* val) {
   int in;
-  struct timespec half_tick;
-  int val=0;
-  half_tick.tv_sec = 0;
-  half_tick.tv_nsec = SCLK_PERIOD/2;
+  long long t = io_now_ns();
+  *val=0;
   for(int i=0; i<24; i++) {
     int x;
-    digitalWrite(SCLK, 1);
-    nanosleep(&half_tick, NULL);
-    digitalWrite(SCLK, 0);
-    x=digitalRead(DOUT);
-    if(x && (i==0)) val=-1; //First bit is sign bit
+    io_gpio_write(SCLK, 1);
+    io_spin_until(t += SCLK_PERIOD/2);
+    io_gpio_write(SCLK, 0);
+    x=io_gpio_read(DOUT);
+    if(x && (i==0)) *val=-1; //First bit is sign bit
     else {
-      val<<=1;
-      val|=x;
+      *val<<=1;
+      *val|=x;
     }
-    nanosleep(&half_tick, NULL);
+    io_spin_until(t += SCLK_PERIOD/2);
   }
   //25th clock per datasheet protocol to pull DOUT (i.e. RDY/DOUT) high until conversion ready
-  digitalWrite(SCLK, 1);
-  nanosleep(&half_tick, NULL);
-  digitalWrite(SCLK, 0);
-  nanosleep(&half_tick, NULL);
-  in=digitalRead(DOUT);
-  if(!in) {
-    fprintf(stderr, "ADC failure during read\n");
-    exit(-1);
-  }
-  ema_accum=(EMA_ALPHA*ema_accum)+(1.0 - EMA_ALPHA)*(double)val;
-  return val;
+  io_gpio_write(SCLK, 1);
+  io_spin_until(t += SCLK_PERIOD/2);
+  io_gpio_write(SCLK, 0);
+  io_spin_until(t += SCLK_PERIOD/2);
+  in=io_gpio_read(DOUT);
+  return in;
   // And there's no CRC. Great job, Maxim... :-(
 }
 
-void output_val(int val) {
+// With RDY events, conversions should be read at exactly the update rate, so a longer gap since the last read means some were overwritten unread
+static void count_missed(long long t_read) {
+  if(USE_RDY_EVENTS && t_last_read) {
+    int missed = (int)((t_read - t_last_read)/(UPDATE_PERIOD*ONE_SECOND) + 0.5) - 1;
+    if(missed>0) metrics_count(&max11201b_sensor.metrics, METRIC_MISSED, missed);
+  }
+  t_last_read = t_read;
+}
+
+static void drain_rdy_events() {
+  struct io_gpio_event ev;
+  while(io_gpio_event(rdy_pins, 1, &ev));
+}
+
+static void output_val(int val) {
   if(DEBUG_PRINT_ADC) {
     double f_val = (double)val;
     double frac=(f_val)/FRAC_SCALE; //Range -1 to 1
@@ -115,65 +130,44 @@ void output_val(int val) {
   }
   if(changed) {
     int data = flux_mem/HYST_SCALE;
-    insert_record(pStmt_log, &data, 1);
-  } else update_idle_heartbeat();
-
+    insert_record(&max11201b_sensor, &data, 1);
+  } else update_idle_heartbeat(&max11201b_sensor);
 }
 
-void ready_interrupt() {
+static long long step() {
   int val;
-  if(now_reading_p) return; //Ready line is same as data line (RDY/DOUT), so ignore interrupt while reading
-  val=digitalRead(DOUT);
-  if(val) return; //XXX: Spurious interrupt. Happens after every read; seems the wiringPi library delays the ISR call for a new interrupt until the previous call returns. Which also means the now_reading_p mutex is unnecessary.
-  now_reading_p=true;
-  val=ADC_read();
-  output_val(val);
-  now_reading_p=false;
-}
-
-//Using interrupts produces 100% CPU usage, even in test case with do-nothing ISR and only 14 interrupts per second. Crapware kernel or libraries.
-//And at least wiringPi is crapware, apparently providing no way to unregister the ISR to avoid triggering when the MAX11201B RDY/DOUT pin is being used as DOUT (triggering is only needed when the pin is used as RDY).
-void use_interrupts() {
-  now_reading_p=false;
-  struct timespec sleep;
-  sleep.tv_sec = 0;
-  sleep.tv_nsec = ONE_SECOND;
-  if(wiringPiISR(DOUT, INT_EDGE_FALLING, &ready_interrupt)<0) {
-    fprintf(stderr, "wiringPiISR setup failure: %s\n", strerror(errno));
-    exit(-1);
-  }
-  while(1) {
-    nanosleep(&sleep, NULL);
-  }
-}
-
-void use_polling() {
-  struct timespec sleep;
-  sleep.tv_sec = 0;
-  sleep.tv_nsec = POLL_PERIOD;
-  int per_calib_count=0;
-  int total_count=0;
-  fprintf(stderr, "MAX11201B spin-up delay approx %ds...\n", (int)SPIN_UP_DELAY_SEC_LIMITED);
-  while(1) {
-    nanosleep(&sleep, NULL);
-    int val;
-    val=digitalRead(DOUT);
-    if(val) continue; // ADC not ready yet
-    val=ADC_read();
-    per_calib_count++;
+  long long next = USE_RDY_EVENTS?RDY_TIMEOUT:POLL_PERIOD;
+  if(USE_RDY_EVENTS) drain_rdy_events(); // They only woke us
+  val=io_gpio_read(DOUT);
+  if(val) return next; // ADC not ready yet
+  long long t_read = io_now_ns();
+  count_missed(t_read);
+  bool ok_p = ADC_read(&val);
+  metrics_hist_add(&max11201b_sensor.metrics, METRIC_READ, io_now_ns() - t_read);
+  if(ok_p) {
+    glitches = 0;
+    ema_accum=(EMA_ALPHA*ema_accum)+(1.0 - EMA_ALPHA)*(double)val;
     total_count++;
     if(total_count>(int)SPIN_UP_DELAY) output_val(val);
-    if(per_calib_count==RECALIBRATION_PERIOD) {
-      per_calib_count=0;
-      ADC_calibrate();
+  } else {
+    metrics_count(&max11201b_sensor.metrics, METRIC_GLITCHES, 1);
+    if(++glitches==GLITCHES_MAX) {
+      fprintf(stderr, "ADC failure during read\n");
+      exit(-1);
     }
   }
+  per_calib_count++;
+  if(per_calib_count==RECALIBRATION_PERIOD) {
+    per_calib_count=0;
+    ADC_calibrate();
+  }
+  if(USE_RDY_EVENTS) drain_rdy_events(); // The data bits' falling edges
+  return next;
 }
 
-int main(int argc, char** argv) {
+static long long init() {
   int rc;
   sqlite3_stmt* pStmt_tmp;
-  daemon_init(argc, argv);
   char zSql_select[]="select val from Config where var='PHFS_01e_S_calib'";
   rc = sqlite3_prepare_v3(db, zSql_select, -1, 0, &pStmt_tmp, NULL);
   check_sql(rc, "sqlite3_prepare failure");
@@ -192,12 +186,25 @@ int main(int argc, char** argv) {
   S_calib = sqlite3_column_double(pStmt_tmp, 0);
   check_sql(rc, "sqlite3_column_double failure");
   sqlite3_finalize(pStmt_tmp);
-  wiringPiSetupGpio();
-  pinMode(SCLK, OUTPUT);
-  pullUpDnControl(DOUT, PUD_UP);
+  io_gpio_output(SCLK, 0);
+  if(USE_RDY_EVENTS) {
+    io_gpio_watch(DOUT, true, IO_EDGE_FALLING, 0);
+    max11201b_sensor.event_fd = io_gpio_event_fd(rdy_pins, 1);
+  } else io_gpio_input(DOUT, true);
   ADC_calibrate();
   ema_accum=0;
-  //use_interrupts();
-  use_polling();
+  fprintf(stderr, "MAX11201B spin-up delay approx %ds...\n", (int)SPIN_UP_DELAY_SEC_LIMITED);
+  return USE_RDY_EVENTS?RDY_TIMEOUT:POLL_PERIOD;
+}
+
+struct ghpi_sensor max11201b_sensor = {"MAX11201B", "MAX11201B_logs", &init, &step};
+
+#ifndef GHPID
+int main(int argc, char** argv) {
+  daemon_init(argc, argv);
+  if(USE_BATCH_COMMIT) batch_commit_enable(GHPI_BATCH_MAX_ROWS, GHPI_BATCH_MAX_AGE);
+  if(USE_WRITER_THREAD) writer_thread_enable();
+  run_sensor(&max11201b_sensor);
   return 0;
 }
+#endif
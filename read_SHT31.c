@@ -1,10 +1,4 @@
 #include <string.h>
-#include <sys/ioctl.h>
-#include <linux/i2c-dev.h>
-#include <linux/i2c.h>
-#include <unistd.h>
-#include <sys/stat.h>
-#include <fcntl.h>
 #include <stdio.h>
 #include <errno.h>
 #include <stdlib.h>
@@ -20,18 +14,19 @@
 #define INTEGRATION_TIME 15000000 // ns (i.e. 15ms)
 #define LOGGING_PERIOD 5 // seconds
 
-const char zSql_log[] = "insert into SHT31_logs values (?,?,?,?)";
-const char* sensor_type = "SHT31";
-int fd;
-bool temp_prev_inc_p, hum_prev_inc_p;
-int temp_mem, hum_mem;
+extern struct ghpi_sensor sht31_sensor;
+static int fd;
+static bool temp_prev_inc_p, hum_prev_inc_p;
+static int temp_mem, hum_mem;
+static bool conv_started_p;
 
-void setup() {
-  fd = open("/dev/i2c-1", O_RDWR /* | O_NONBLOCK */);
+static long long init() {
+  fd = io_i2c_open(SHT31_I2C_ADDRESS);
   if(fd==-1) exit(errno);
+  return 0;
 }
 
-int crc(uint8_t* m) {
+static int crc(uint8_t* m) {
   uint8_t rem = 0xff;
   uint8_t bit, byte;
   for(byte=0; byte<2; byte++) {
@@ -44,40 +39,29 @@ int crc(uint8_t* m) {
   return rem;
 }
 
-void read_all() {
+static void start_conversion() {
   uint16_t cmd = CONV_COMMAND;
   struct i2c_msg m_write[] = {
     {
-      .addr = SHT31_I2C_ADDRESS,
-      .buf = (void*)(&cmd),
       .len = sizeof(cmd),
+      .buf = (__u8*)(&cmd),
     },
   };
-    struct i2c_rdwr_ioctl_data d_write = {
-    .msgs = m_write,
-    .nmsgs = 1,
-    };
-    int ret = ioctl(fd, I2C_RDWR, &d_write);
-    if(ret < 0) exit(errno);
+  int ret = io_i2c_rdwr(fd, m_write, 1);
+  if(ret < 0) exit(errno);
+}
+
+static void read_conversion() {
+  int ret;
   uint8_t buf[6];
   struct i2c_msg m_read[] = {
     {
-      .addr = SHT31_I2C_ADDRESS,
       .flags = I2C_M_RD,
-      .buf = (void*)buf,
       .len = sizeof(buf),
+      .buf = buf,
     },
   };
-  struct i2c_rdwr_ioctl_data d_read = {
-    .msgs = m_read,
-    .nmsgs = 1,
-  };
-  struct timespec ts;
-  ts.tv_sec = LOGGING_PERIOD;
-  // ts.tv_nsec = max(LOGGING_PERIOD, INTEGRATION_TIME); // When INTEGRATION_TIME is ns instead of seconds
-  ts.tv_nsec = 0;
-  nanosleep(&ts, NULL); // Allow time for conversion to complete
-  ret = ioctl(fd, I2C_RDWR, &d_read);
+  ret = io_i2c_rdwr(fd, m_read, 1);
   if(ret != 1)
     fprintf(stderr, "SHT31 read failed with error code %d\n", ret);
   else { // Read succeeded
@@ -85,8 +69,10 @@ void read_all() {
     uint16_t hum = buf[4] + (buf[3]<<8);
     uint8_t temp_crc = crc(buf);
     uint8_t hum_crc = crc(buf+3);
-    if((temp_crc!=*(buf+2)) || (hum_crc!=*(buf+5)))
+    if((temp_crc!=*(buf+2)) || (hum_crc!=*(buf+5))) {
       fprintf(stderr, "SHT31 CRC error\n");
+      metrics_count(&sht31_sensor.metrics, METRIC_CRC_ERRORS, 1);
+    }
     else { // Readings are good
       int i_temp = (-45 * HYST_SCALE * 100)
 	+ (int)temp * 175 * HYST_SCALE * 100 / 65535;
@@ -105,18 +91,26 @@ void read_all() {
 	  printf("temp: %d, hum: %d %d %d\n", arrData[0], arrData[1], temp_changed, hum_changed);
 	}
       }
-      if(temp_changed || hum_changed) insert_record(pStmt_log, arrData, 2);
-      else update_idle_heartbeat();
+      if(temp_changed || hum_changed) insert_record(&sht31_sensor, arrData, 2);
+      else update_idle_heartbeat(&sht31_sensor);
     }
   }
 }
 
+// Each conversion is read one logging period after it's started
+static long long step() {
+  if(conv_started_p) read_conversion();
+  start_conversion();
+  conv_started_p = true;
+  return LOGGING_PERIOD*NS_PER_SEC; // Allow time for conversion to complete. Would be max(LOGGING_PERIOD, INTEGRATION_TIME) if LOGGING_PERIOD were ns instead of seconds.
+}
+
+struct ghpi_sensor sht31_sensor = {"SHT31", "SHT31_logs", &init, &step};
+
+#ifndef GHPID
 int main(int argc, char** argv) {
-  setup();
   daemon_init(argc, argv);
-  while(1) {
-    read_all();
-  }
-  close(fd);
+  run_sensor(&sht31_sensor);
   return 0;
 }
+#endif
@@ -1,8 +1,8 @@
-#include <wiringPiI2C.h>
 #include <errno.h>
 #include <stdio.h>
 #include <time.h>
 #include <stdlib.h>
+#include <string.h>
 #include "gh_ctrl.h"
 
 #define PRINT_DEBUG false
@@ -13,9 +13,6 @@
 #define ENABLE_VALUE 0x13
 #define CONFIG_REGISTER 0xa1
 #define C0DATAL 0xb4
-#define C0DATAH 0xb5
-#define C1DATAL 0xb6
-#define C1DATAH 0xb7
 #define INTEGRATION_TIME 100000000 // ns (i.e. 100ms)
 #define ADC_MAX_COUNT 36863 // Per the data sheet, though the chip actually outputs up to 37888 at saturation
 
@@ -29,55 +26,62 @@
 
 #define C1_IRED_WHITE_RATIO ((1/C1_IRED_COEF)/((1/C1_IRED_COEF)+(1/C1_WHITE_COEF)))
 
-double gain_divisor[2][4] = { // First dimension is channel; second is divisor. /400 because specs give sensitivity at AGAIN = High (gain #2)
+static double gain_divisor[2][4] = { // First dimension is channel; second is divisor. /400 because specs give sensitivity at AGAIN = High (gain #2)
   {400, (double)400/24.5, 1, (double)400/9200},
   {400, (double)400/24.5, 1, (double)400/9900}};
 
-char zSql_log[] = "insert into TSL2591_logs values (?,?,?,?)";
-const char* sensor_type = "TSL2591";
-int fd_tsl2591;
+extern struct ghpi_sensor tsl2591_sensor;
+static int fd_tsl2591;
 
-bool total_prev_inc_p, ired_prev_inc_p;
-int total_mem, ired_mem;
+static bool total_prev_inc_p, ired_prev_inc_p;
+static int total_mem, ired_mem;
 
-void set_gain(int gain) {
-  struct timespec ts;
-  ts.tv_sec = 0;
-  ts.tv_nsec = INTEGRATION_TIME * 2; // *2 since the datasheet lies about the actual time
-  wiringPiI2CWriteReg8(fd_tsl2591, CONFIG_REGISTER, gain<<4);
-  nanosleep(&ts, NULL); // Allow time for conversion to complete
+// AGC sweeps all four gains, one conversion per step
+static int gain; // Gain of the conversion in progress
+static uint C[2][4]; // First dimension is channel; second is gain
+
+static void set_gain(int g) {
+  io_i2c_write_reg8(fd_tsl2591, CONFIG_REGISTER, g<<4);
 }
 
-uint get_C(int channel) {
-  wiringPiI2CWrite(fd_tsl2591, channel?C1DATAL:C0DATAL);
-  uint val_L = wiringPiI2CRead(fd_tsl2591);
-  wiringPiI2CWrite(fd_tsl2591, channel?C1DATAH:C0DATAH);
-  uint val_H = wiringPiI2CRead(fd_tsl2591);
-  return val_L + (val_H << 8);
+// Both channels, C0DATAL through C1DATAH, in one auto-incrementing read, rather than a register write and a byte read for each of the four. That's also how the datasheet says to read them, so that both are from the same integration.
+static void get_C(uint* C0, uint* C1) {
+  unsigned char buf[4];
+  if(io_i2c_read_regs(fd_tsl2591, C0DATAL, buf, sizeof(buf))) {
+    fprintf(stderr, "TSL2591 read failed: %s\n", strerror(errno));
+    *C0 = *C1 = ADC_MAX_COUNT+1; // As if saturated, so this gain isn't used
+    return;
+  }
+  *C0 = buf[0] + (buf[1] << 8);
+  *C1 = buf[2] + (buf[3] << 8);
 }
 
-void setup() {
-  fd_tsl2591 = wiringPiI2CSetup(TSL2591_I2C_ADDRESS);
+static long long init() {
+  fd_tsl2591 = io_i2c_open(TSL2591_I2C_ADDRESS);
   if(fd_tsl2591==-1) exit(errno);
-  wiringPiI2CWriteReg8(fd_tsl2591, ENABLE_REGISTER, ENABLE_VALUE);
+  io_i2c_write_reg8(fd_tsl2591, ENABLE_REGISTER, ENABLE_VALUE);
+  gain = 0;
+  set_gain(gain);
+  return INTEGRATION_TIME * 2; // *2 since the datasheet lies about the actual time
 }
 
 void print_all() {
+  struct timespec ts;
+  ts.tv_sec = 0;
+  ts.tv_nsec = INTEGRATION_TIME * 2;
   for(int g=0; g<4; g++) {
     set_gain(g);
-    uint C0 = get_C(0);
-    uint C1 = get_C(1);
+    io_nanosleep(&ts); // Allow time for conversion to complete
+    uint C0, C1;
+    get_C(&C0, &C1);
     printf("Gain %d  C0 0x%x  C1 0x%x\n", g, C0, C1);
   }
 }
 
-void read_and_AGC() {
-  uint C[2][4] = {{0, 0, 0, 0,}, {0, 0, 0, 0}}; // First dimension is channel; second is gain
+static void log_AGC() {
   int limit[2] = {0, 0}; // Highest unsaturated gain level for each channel
   for(int g=0; g<4; g++) {
-    set_gain(g);
     for(int c=0; c<2; c++) {
-      C[c][g] = get_C(c);
       if(C[c][g]<=ADC_MAX_COUNT) limit[c] = g;
     }
   }
@@ -111,15 +115,26 @@ void read_and_AGC() {
 	     lux);
     else printf("%d total %d ired %d %d\n", arrData[0], arrData[1], total_changed, ired_changed);
   }
-  if(total_changed || ired_changed) insert_record(pStmt_log, arrData, 2);
-  else update_idle_heartbeat();
+  if(total_changed || ired_changed) insert_record(&tsl2591_sensor, arrData, 2);
+  else update_idle_heartbeat(&tsl2591_sensor);
+}
+
+static long long step() {
+  get_C(&C[0][gain], &C[1][gain]);
+  if(gain==3) {
+    log_AGC();
+    gain = 0;
+  } else gain++;
+  set_gain(gain);
+  return INTEGRATION_TIME * 2;
 }
 
+struct ghpi_sensor tsl2591_sensor = {"TSL2591", "TSL2591_logs", &init, &step};
+
+#ifndef GHPID
 int main(int argc, char** argv) {
-  setup();
   daemon_init(argc, argv);
-  while(1) {
-    read_and_AGC();
-  }
+  run_sensor(&tsl2591_sensor);
   return 0;
 }
+#endif
@@ -1,8 +1,8 @@
-#include <wiringPiI2C.h>
 #include <errno.h>
 #include <stdio.h>
 #include <time.h>
 #include <stdlib.h>
+#include <string.h>
 #include "gh_ctrl.h"
 
 #define PRINT_DEBUG false
@@ -19,26 +19,28 @@
 #define UVA_COEF ((double)1/0.93)
 #define UVB_COEF ((double)1/2.1)
 
-char zSql_log[] = "insert into VEML6075_logs values (?,?,?,?)";
-const char* sensor_type = "VEML6075";
-int fd_veml6075;
+extern struct ghpi_sensor veml6075_sensor;
+static int fd_veml6075;
 
-bool uva_prev_inc_p, uvb_prev_inc_p;
-int uva_mem, uvb_mem;
+static bool uva_prev_inc_p, uvb_prev_inc_p;
+static int uva_mem, uvb_mem;
 
-void setup() {
-  fd_veml6075 = wiringPiI2CSetup(VEML6075_I2C_ADDRESS);
+static long long init() {
+  fd_veml6075 = io_i2c_open(VEML6075_I2C_ADDRESS);
   if(fd_veml6075==-1) exit(errno);
-  wiringPiI2CWriteReg16(fd_veml6075, UV_CONF_REGISTER, 0);
+  io_i2c_write_reg16(fd_veml6075, UV_CONF_REGISTER, 0);
+  return max(LOGGING_PERIOD, INTEGRATION_TIME * 2); // *2 in case the datasheet lies about the actual conversion time, as is the case for the TSL2591
 }
 
-void read_all() {
-  struct timespec ts;
-  ts.tv_sec = 0;
-  ts.tv_nsec = max(LOGGING_PERIOD, INTEGRATION_TIME * 2); // *2 in case the datasheet lies about the actual conversion time, as is the case for the TSL2591
-  nanosleep(&ts, NULL); // Allow time for conversion to complete
-  uint uva = wiringPiI2CReadReg16(fd_veml6075, UVA_REGISTER);
-  uint uvb = wiringPiI2CReadReg16(fd_veml6075, UVB_REGISTER);
+static long long step() {
+  static const int regs[2] = {UVA_REGISTER, UVB_REGISTER}; // Not adjacent, and the chip doesn't auto-increment anyway, so two register reads, but in one transfer
+  int vals[2];
+  if(io_i2c_read_reg16s(fd_veml6075, regs, vals, 2)) {
+    fprintf(stderr, "VEML6075 read failed: %s\n", strerror(errno));
+    return max(LOGGING_PERIOD, INTEGRATION_TIME * 2);
+  }
+  uint uva = vals[0];
+  uint uvb = vals[1];
   double uva_power = uva * UVA_COEF/100; // /100 to scale from μW/cm² to W/m²
   double uvb_power = uvb * UVB_COEF/100;
   int i_uva = uva_power * HYST_SCALE *1000;
@@ -52,16 +54,17 @@ void read_all() {
     if(PRINT_DEBUG_RAW) printf("UVA 0x%x %.3f  UVB 0x%x %.3f\n", uva, uva_power, uvb, uvb_power);
     else printf("%d uva %d uvb %d %d\n", arrData[0], arrData[1], uva_changed, uvb_changed);
   }
-  if(uva_changed || uvb_changed) insert_record(pStmt_log, arrData, 2);
-  else update_idle_heartbeat();
+  if(uva_changed || uvb_changed) insert_record(&veml6075_sensor, arrData, 2);
+  else update_idle_heartbeat(&veml6075_sensor);
+  return max(LOGGING_PERIOD, INTEGRATION_TIME * 2);
 }
 
+struct ghpi_sensor veml6075_sensor = {"VEML6075", "VEML6075_logs", &init, &step};
+
+#ifndef GHPID
 int main(int argc, char** argv) {
-  int rc;
-  setup();
   daemon_init(argc, argv);
-  while(1) {
-    read_all();
-  }
+  run_sensor(&veml6075_sensor);
   return 0;
 }
+#endif
@@ -1,48 +1,85 @@
-#include <wiringPi.h>
 #include <stdio.h>
 #include <time.h>
 #include "gh_ctrl.h"
 
 #define DEBUG_PRINT false
+#define USE_BATCH_COMMIT true // Group commit; see batch_commit_enable
+#define USE_EDGE_EVENTS true // Sleep until Q1 or Q2 changes, and log it as of when it did (see io_gpio_watch), rather than polling them every LOGGING_PERIOD
 
-#define LOGGING_PERIOD 100000000 // ns (i.e. 100ms)
+#define LOGGING_PERIOD 100000000 // ns (i.e. 100ms). When polling.
+#define HEARTBEAT_PERIOD 5000000000LL // ns. With edge events, how often to read Q1 and Q2 anyway, in case the kernel's event queue overflowed, and write an idle heartbeat. Under GHPI_LIVE_STALE, so live readers see the furnace as alive.
+#define DEBOUNCE_US 20000 // The kernel reports an edge once the line has held its new level for this long
 
 //RPi BCM pins
 #define FURNACE_SENSE_Q1 5
 #define FURNACE_SENSE_Q2 6
 
-// Transistors are numbered from 1; array elements are numbered from zero. I already got one bug because of this; let's prevent recurrence. Array q is in the loop in main() below.
+// Transistors are numbered from 1; array elements are numbered from zero. I already got one bug because of this; let's prevent recurrence. Array q is in step() below.
 #define Q1 (q[0])
 #define Q2 (q[1])
 
-char zSql_log[] = "insert into Furnace_logs values (?,?,?,?)";
-const char* sensor_type = "Furnace";
-int q1_prev, q2_prev;
+extern struct ghpi_sensor furnace_sensor;
 
-int main(int argc, char** argv) {
-  int rc;
-  daemon_init(argc, argv);
-  wiringPiSetupGpio();
-  pullUpDnControl(FURNACE_SENSE_Q1, PUD_UP);
-  pullUpDnControl(FURNACE_SENSE_Q2, PUD_UP);
-  struct timespec ts;
-  ts.tv_sec = 0;
-  ts.tv_nsec = LOGGING_PERIOD;
-
-  while(1) {
-    int q[2];
-    Q1=digitalRead(FURNACE_SENSE_Q1);
-    Q2=digitalRead(FURNACE_SENSE_Q2);
-    if(DEBUG_PRINT) {
-      printf("%d %d furnace is %s\n", Q1, Q2, ((Q1==0)&&(Q2==0))?"on":"off");
-      fflush(stdout);
+static int q1_prev, q2_prev;
+static const int sense_pins[] = {FURNACE_SENSE_Q1, FURNACE_SENSE_Q2};
+
+static long long init() {
+  if(USE_EDGE_EVENTS) {
+    io_gpio_watch(FURNACE_SENSE_Q1, true, IO_EDGE_BOTH, DEBOUNCE_US);
+    io_gpio_watch(FURNACE_SENSE_Q2, true, IO_EDGE_BOTH, DEBOUNCE_US);
+    furnace_sensor.event_fd = io_gpio_event_fd(sense_pins, 2);
+  } else {
+    io_gpio_input(FURNACE_SENSE_Q1, true);
+    io_gpio_input(FURNACE_SENSE_Q2, true);
+  }
+  return 0;
+}
+
+// Log q if it's changed. rt is when it did, or NULL for now. Returns whether it had.
+static bool log_change(int* q, struct timespec* rt) {
+  if(DEBUG_PRINT) {
+    printf("%d %d furnace is %s\n", Q1, Q2, ((Q1==0)&&(Q2==0))?"on":"off");
+    fflush(stdout);
+  }
+  if((q1_prev==Q1) && (q2_prev==Q2)) return false;
+  q1_prev = Q1;
+  q2_prev = Q2;
+  if(rt) insert_record_at(&furnace_sensor, rt, q, 2, NULL);
+  else insert_record(&furnace_sensor, q, 2);
+  return true;
+}
+
+static long long step() {
+  int q[2];
+  if(USE_EDGE_EVENTS) {
+    struct io_gpio_event ev;
+    bool event_p = false;
+    Q1 = q1_prev;
+    Q2 = q2_prev;
+    while(io_gpio_event(sense_pins, 2, &ev)) {
+      event_p = true;
+      if(ev.pin==FURNACE_SENSE_Q1) Q1 = ev.value;
+      else Q2 = ev.value;
+      long long ns = ts_to_ns(&ev.rt) - DEBOUNCE_US*1000LL; // The edge itself
+      ns_to_ts(&ev.rt, ns);
+      log_change(q, &ev.rt);
     }
-    if((q1_prev!=Q1) || (q2_prev!=Q2)) {
-      q1_prev = Q1;
-      q2_prev = Q2;
-      insert_record(pStmt_log, q, 2);
-    } else update_idle_heartbeat();
-    nanosleep(&ts, NULL);
+    if(event_p) return HEARTBEAT_PERIOD;
   }
+  // Polling, or the heartbeat's check, which is also the first step's, to log the initial state
+  Q1=io_gpio_read(FURNACE_SENSE_Q1);
+  Q2=io_gpio_read(FURNACE_SENSE_Q2);
+  if(!log_change(q, NULL)) update_idle_heartbeat(&furnace_sensor);
+  return USE_EDGE_EVENTS?HEARTBEAT_PERIOD:LOGGING_PERIOD;
+}
+
+struct ghpi_sensor furnace_sensor = {"Furnace", "Furnace_logs", &init, &step};
+
+#ifndef GHPID
+int main(int argc, char** argv) {
+  daemon_init(argc, argv);
+  if(USE_BATCH_COMMIT) batch_commit_enable(GHPI_BATCH_MAX_ROWS, GHPI_BATCH_MAX_AGE);
+  run_sensor(&furnace_sensor);
   return 0;
 }
+#endif
@@ -1,11 +1,17 @@
-#include <wiringPiI2C.h>
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // For sched_setaffinity and the CPU_* macros
+#endif
 #include <errno.h>
 #include <stdio.h>
 #include <time.h>
 #include <math.h>
 #include <stdbool.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <pthread.h>
 #include "gh_ctrl.h"
+#include "gh_archive.h"
 
 #define DEBUG_TIMING false
 #define DEBUG_AC_CYCLE false
@@ -15,6 +21,12 @@
 #define DEBUG_CURRENT_LIMIT 0.5
 #define DEBUG_SUMMARY false
 #define DEBUG_PRINT_RAW false
+#define USE_BATCH_COMMIT true // Group commit; see batch_commit_enable
+#define USE_WRITER_THREAD true // So that sampling never blocks on the DB; see writer_thread_enable
+#define USE_SCHED_FIFO false // Run each V or I sample burst at SCHED_FIFO_PRIORITY, so nothing else on the CPU can delay a sample. Needs CAP_SYS_NICE, e.g. root.
+#define SCHED_FIFO_PRIORITY 50
+#define CAPTURE_CPU -1 // If not -1, run each sample burst on this CPU, e.g. one kept free of other tasks with isolcpus
+#define USE_EVENT_CAPTURE true // Keep the latest current bursts in a ring, and save them to INA260_events around any that crosses an event threshold
 
 #define VP_MULTIPLIER 4.746 // To cancel the voltage divider that's used since the ina260 can only handle up to 40V (and read accurately up to 36V), but the circuit is measuring 120VAC, which is 170Vp. Divider top is 66kΩ, bottom is 18kΩ ∥ (Z_vbus=830kΩ). Within 1% of scope-measured 4.7826 (with 124Vrms, 176Vp, and 36.8V divider peak; Kill-a-watt read 122.7V, and multimeter read 120V).
 #define DIODE_DROP 0.6 // To compensate the rectifier diode's voltage drop
@@ -26,7 +38,7 @@
 
 #define USE_TRUE_Vrms false // The ina260 internal Vmean is more stable than jittery samples read by the Pi to compute true Vrms
 
-#define VIP_AVERAGING_MODE 0xdf68 // Mode is 0x68df, but wiringPi writes little endian and the chip reads big endian.
+#define VIP_AVERAGING_MODE 0xdf68 // Mode is 0x68df, but io_i2c_write_reg16 writes little endian and the chip reads big endian.
 // Mode 0x68df configures the chip as follows:
 #define VI_CONVERSION_TIME 588000 // ns
 #define NUM_AVERAGES 128
@@ -38,27 +50,60 @@
 
 #define AC_PERIOD 16666667 // ns (60Hz)
 #define N_CYCLES 2 // Quantity of 60Hz power cycles to read per V or I RMS measurement
-#define N_SAMPLES AC_PERIOD*N_CYCLES*3/2/N_CONVERSION_TIME+1 // Need 3/2 of a power cycle to ensure two zero-positive crossings are sampled, since sampling will begin at an unknown position of the cycle.
+#define N_SAMPLES (AC_PERIOD*N_CYCLES*3/2/N_CONVERSION_TIME+2) // Need 3/2 of a power cycle to ensure two zero-positive crossings are sampled, since sampling will begin at an unknown position of the cycle. Plus a sample of margin, since on the fixed grid the burst no longer stretches with each read's lateness, and without it about 1 in 400 bursts just missed the last crossing.
+#define BURST_WINDOW ((long long)(N_SAMPLES+2)*N_CONVERSION_TIME + 2000000) // ns. The bus is reserved for each burst (see io_i2c_reserve): for the config write, the settling conversion, the samples, and 2ms for the restoring write and the samples' lateness.
+#define CAPTURE_WINDOW ((USE_TRUE_Vrms?2:1)*BURST_WINDOW + 5000000) // ns. Reserved ahead of each step: the averages read, then the bursts, plus 5ms for the computation between them
+#define N_HARMONICS 13 // Highest harmonic of the current to analyse. The sample grid's Nyquist frequency is at the 14th.
+#define HARMONICS_MIN_I 0.5 // A. With less fundamental current than this, the harmonics are mostly noise, so they're logged as null.
+#define HARMONICS_COLUMNS 7 // Of INA260_harmonics
+// Power quality events, e.g. a motor's inrush, or a sag. They're caught by the current bursts that are read anyway, so they cost no more I2C; but those only cover about a quarter of the time (each burst is about 50ms, then the averaging cycle takes 150ms), so a spike between bursts is missed, though not the Irms of an inrush lasting longer than that.
+// An event is when a condition becomes true: a burst's Irms over event_Irms_max, a sample's |I| over event_Ipeak_max, or Vrms under event_Vrms_min, which are read from Config at init, since they depend on the site's circuit and line voltage. Its row holds the EVENT_PRE_BURSTS bursts before the one that triggered it, that one, and the EVENT_POST_BURSTS after, as one series per burst (see archive_encode_series); further triggers during the post bursts are added to the same event.
+#define EVENT_PRE_BURSTS 4
+#define EVENT_POST_BURSTS 8
+#define EVENT_BURSTS (EVENT_PRE_BURSTS+1+EVENT_POST_BURSTS)
+#define EVENT_IRMS_MAX 16.0 // A. Default for Config ina260_event_Irms_max: 80% of a 20A circuit.
+#define EVENT_IPEAK_MAX 30.0 // A. Default for Config ina260_event_Ipeak_max: a little over the peak of 20A rms.
+#define EVENT_VRMS_MIN 108 // V. Default for Config ina260_event_Vrms_min: 90% of nominal 120V.
+enum {EVENT_IRMS=1, EVENT_IPEAK=2, EVENT_SAG=4}; // INA260_events.kind bits
+// Samples are read on a fixed grid of N_CONVERSION_TIME from the start of the burst, by absolute deadlines, so a late sample doesn't delay the ones after it; and each is timestamped, at the middle of its register read, so that the RMS can be integrated over the time each actually covers. The integral runs between zero crossings interpolated between the samples either side of them, rather than from the first sample after each, which would add up to a sample period of error at each end.
 
-char zSql_log[] = "insert into INA260_logs values (?,?,?,?,?)";
-const char* sensor_type = "INA260";
-int fd_ina260, Vmean_raw, Pmean_raw;
-double Vmean_raw_V, Pmean_raw_W, Vmean, Pmean, Nrms, Vrms, Irms, S, PF;
-bool Vrms_success, Irms_success;
+extern struct ghpi_sensor ina260_sensor;
+static int fd_ina260, Vmean_raw, Pmean_raw;
+static double Vmean_raw_V, Pmean_raw_W, Vmean, Pmean, Nrms, Vrms, Irms, S, PF;
+static bool Vrms_success, Irms_success;
+static int AC_period_start, AC_period_end; // Of the last get_n, the sample indices after the first and last zero crossings
+static double t_cross_start, t_cross_end; // And the crossings' times
+static double event_Irms_max, event_Ipeak_max, event_Vrms_min;
+static double harm_a[N_HARMONICS+1]; // A, rms. Of the current, by get_harmonics; harm_a[1] is the fundamental.
+static double THD, DPF, DistPF; // Total harmonic distortion, displacement power factor, and distortion power factor, of the current
 
-int n_a[N_SAMPLES];
-struct timespec read_times[N_SAMPLES];
-struct timespec remaining[N_SAMPLES];
+static int n_a[N_SAMPLES];
+static long long t_a[N_SAMPLES]; // ns, CLOCK_MONOTONIC. When each of n_a was read.
+static long long late_a[N_SAMPLES]; // ns. How far behind its grid time each read started.
+static bool rt_failed_p; // Setting USE_SCHED_FIFO or CAPTURE_CPU failed, e.g. for lack of permission, so they're no longer tried
 
-bool Vrms_prev_inc_p, Irms_prev_inc_p, Pmean_prev_inc_p;
-int Vrms_mem, Irms_mem, Pmean_mem;
+static bool Vrms_prev_inc_p, Irms_prev_inc_p, Pmean_prev_inc_p;
+static int Vrms_mem, Irms_mem, Pmean_mem;
+static bool harm_prev_inc_p[HARMONICS_COLUMNS];
+static int harm_mem[HARMONICS_COLUMNS];
+static bool harm_null_p; // The last INA260_harmonics row logged was null
+static struct ghpi_sensor ina260_harmonics_sensor = {"INA260_harmonics", "INA260_harmonics"}; // Logged by read_all along with ina260_sensor, so it has no init or step of its own
 
-struct timespec ts_conv_period, // How long a single-shot conversion takes. Constant.
-  ts_avg_conv_period, // How long an averaging cycle takes. Constant.
+static int ring_n[EVENT_BURSTS][N_SAMPLES]; // The latest current bursts, i.e. n_a and t_a of each. ring_pos is the oldest, and next to be overwritten.
+static long long ring_t[EVENT_BURSTS][N_SAMPLES];
+static int ring_pos, ring_count;
+static int event_cond; // Conditions true as of the last burst, as EVENT_* bits
+static int event_kind, event_pre, event_post_left; // Of the event being captured, if event_post_left>0
+static double event_Irms_max, event_Vrms_min;
+static long long event_t0; // ns, CLOCK_MONOTONIC. Of the triggering burst's first sample.
+static struct timespec event_rt; // And when that was in CLOCK_REALTIME
+static struct archive_buf event_buf;
+static struct ghpi_sensor ina260_events_sensor = {"INA260_events", "INA260_events"}; // Also logged by read_all. No idle heartbeats, since events are rare by nature.
+
+static struct timespec ts_avg_conv_period, // How long an averaging cycle takes. Constant.
   ts_avg_conv_start; // For sleeping until averaging cycle is done.
 
-int read_reg(int fd, int reg) { // 16 bit, signed, big endian from chip
-  int val = wiringPiI2CReadReg16(fd, reg);
+static int from_chip(int val) { // 16 bit, signed, big endian from chip, but read little endian
   int upper = (val&0x00ff)<<8;
   int sign = upper & 0x8000;
   if(sign) upper|=(-1>>16)<<16;
@@ -66,31 +111,91 @@ int read_reg(int fd, int reg) { // 16 bit, signed, big endian from chip
   return upper+lower;
 }
 
+static int read_reg(int fd, int reg) {
+  return from_chip(io_i2c_read_reg16(fd, reg));
+}
+
 // Return first zero positive crossing at or following the start offset, or return len if none found
-int find_zero_positive_crossing(int* array, int len, int start) {
+static int find_zero_positive_crossing(int* array, int len, int start) {
   for(int x=start; x<len-1; x++) {
     if((array[x] <= 0) && (array[x+1] > 0)) return x+1;
   }
   return len;
 }
 
-bool ts_positive_p(struct timespec* ts) {
+// When the samples crossed zero, between sample x-1 and x, as returned by find_zero_positive_crossing
+static double crossing_time(int x) {
+  double frac = -(double)n_a[x-1]/(n_a[x] - n_a[x-1]);
+  return t_a[x-1] + frac*(t_a[x] - t_a[x-1]);
+}
+
+// Integral over dt of the square of the line from a to b. Only used for the partial segments at the crossings, where it's exact for a line through zero; between samples, the trapezoid of the squares does better, since the chip's conversions are averages over their whole conversion time rather than points on the line.
+static double sq_integral(double a, double b, double dt) {
+  return (a*a + a*b + b*b)/3*dt;
+}
+
+static int cmp_ll(const void* a, const void* b) {
+  long long x = *(const long long*)a, y = *(const long long*)b;
+  return (x>y) - (x<y);
+}
+
+// Raise this thread to SCHED_FIFO, and move it to CAPTURE_CPU, for the burst; then put it back as it was, since in ghpid the other drivers share it
+static void capture_rt(bool begin_p) {
+  static int policy_saved;
+  static struct sched_param param_saved;
+  static cpu_set_t cpus_saved;
+  if(rt_failed_p || io_replay_p()) return;
+  int rc = 0;
+  if(USE_SCHED_FIFO) {
+    if(begin_p) {
+      struct sched_param param;
+      memset(&param, 0, sizeof(param));
+      param.sched_priority = SCHED_FIFO_PRIORITY;
+      pthread_getschedparam(pthread_self(), &policy_saved, &param_saved);
+      rc = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+    } else rc = pthread_setschedparam(pthread_self(), policy_saved, &param_saved);
+  }
+  if(!rc && (CAPTURE_CPU>=0)) {
+    if(begin_p) {
+      cpu_set_t cpus;
+      CPU_ZERO(&cpus);
+      CPU_SET(CAPTURE_CPU, &cpus);
+      sched_getaffinity(0, sizeof(cpus_saved), &cpus_saved);
+      rc = sched_setaffinity(0, sizeof(cpus), &cpus)?errno:0;
+    } else rc = sched_setaffinity(0, sizeof(cpus_saved), &cpus_saved)?errno:0;
+  }
+  if(rc) {
+    fprintf(stderr, "Can't set SCHED_FIFO or CPU affinity for the sample bursts, so sampling without: %s\n", strerror(rc));
+    rt_failed_p = true;
+  }
+}
+
+static bool ts_positive_p(struct timespec* ts) {
   if((ts->tv_sec>0) ||
      ((ts->tv_sec==0) && (ts->tv_nsec>0)))
     return true;
   return false;
 }
 
-void get_averages() {
-  struct timespec ts, ts_avg_conv_elapsed;
-  clock_gettime(CLOCK_MONOTONIC, &ts);
-  ts_diff(&ts_avg_conv_elapsed, &ts, &ts_avg_conv_start);
-  ts_diff(&ts, &ts_avg_conv_period, &ts_avg_conv_elapsed); // How much longer to wait for averaging cycle to complete
-  if(DEBUG_TIMING) printf("Averaging cycle elapsed: %ld:%ld ;  Will sleep: %ld:%ld\n", ts_avg_conv_elapsed.tv_sec, ts_avg_conv_elapsed.tv_nsec, ts.tv_sec, ts.tv_nsec);
-  nanosleep(&ts, NULL);
-  Vmean_raw = read_reg(fd_ina260, INA260_V_REG);
-  // int Imean_raw = read_reg(fd_ina260, 1); // Current not read here, since the chip outputs average of samples instead of average of absolute values of samples, so for AC the average is a useless near-zero result
-  Pmean_raw = read_reg(fd_ina260, INA260_P_REG);
+// How much longer until the averaging cycle in progress is complete
+static void avg_conv_remaining(struct timespec* ts) {
+  struct timespec ts_avg_conv_elapsed;
+  clock_gettime(CLOCK_MONOTONIC, ts);
+  ts_diff(&ts_avg_conv_elapsed, ts, &ts_avg_conv_start);
+  ts_diff(ts, &ts_avg_conv_period, &ts_avg_conv_elapsed);
+}
+
+static void get_averages() {
+  struct timespec ts;
+  avg_conv_remaining(&ts); // Normally not positive, since step is scheduled for when the cycle completes
+  if(DEBUG_TIMING) printf("Averaging cycle remaining: %ld:%ld\n", ts.tv_sec, ts.tv_nsec);
+  if(ts_positive_p(&ts)) io_nanosleep(&ts);
+  // Current not read here, since the chip outputs average of samples instead of average of absolute values of samples, so for AC the average is a useless near-zero result
+  static const int regs[2] = {INA260_V_REG, INA260_P_REG}; // The chip doesn't auto-increment, but both can go in one transfer
+  int vals[2];
+  if(io_i2c_read_reg16s(fd_ina260, regs, vals, 2)) vals[0] = vals[1] = -1; // As io_i2c_read_reg16 would have returned
+  Vmean_raw = from_chip(vals[0]);
+  Pmean_raw = from_chip(vals[1]);
   clock_gettime(CLOCK_MONOTONIC, &ts_avg_conv_start); // Avoid reading registers again until next averaging cycle is complete
   Vmean_raw_V = (double)(Vmean_raw)*1.25/1000; // Chip output unit is 1.25 mV.
   Vmean = Vmean_raw_V*VP_MULTIPLIER*2; // The *2 is because the circuit uses a half-wave diode rectifier (since the ina260 can't handle negative voltages), so half the voltage samples are zero (since the circuit is reading AC), so the average output by the chip is half the true average (of absolute values).
@@ -98,40 +203,51 @@ void get_averages() {
   Pmean = Pmean_raw_W*VP_MULTIPLIER*2; // Chip output is average of V*I samples, so the output is useful even for AC. But since half the voltage sine wave is missing due to the half-wave rectifier, the measured power is only 1/2 of the true power.
 }
 
-bool get_n(int mode, int reg, double multiplier, double additive) { // Get Vrms or Irms
-  struct timespec ts, ts_start, ts_end, ts_elapsed;
-  wiringPiI2CWriteReg16(fd_ina260, INA260_CONFIG_REG, mode);
-  ts.tv_sec = 0;
-  ts.tv_nsec = N_CONVERSION_TIME;
-  nanosleep(&ts, NULL); // Give time for first conversion after the config change
-  for(int i=0; i<N_SAMPLES; i++) {
-    clock_gettime(CLOCK_MONOTONIC, &ts_start);
+static bool get_n(int mode, int reg, double multiplier, double additive) { // Get Vrms or Irms
+  long long t_now = io_now_ns();
+  io_i2c_reserve(fd_ina260, t_now, t_now + BURST_WINDOW); // So other processes' transfers wait until the burst is done, rather than landing between samples
+  io_i2c_write_reg16(fd_ina260, INA260_CONFIG_REG, mode);
+  capture_rt(true);
+  long long t_grid = io_now_ns() + N_CONVERSION_TIME; // Give time for first conversion after the config change
+  for(int i=0; i<N_SAMPLES; i++, t_grid+=N_CONVERSION_TIME) {
+    io_sleep_until(t_grid);
+    long long t_start = io_now_ns();
     n_a[i] = read_reg(fd_ina260, reg);
-    clock_gettime(CLOCK_MONOTONIC, &ts_end);
-    ts_diff(&ts_elapsed, &ts_end, &ts_start); // How long read_reg took
-    ts_diff(&ts, &ts_conv_period, &ts_elapsed); // How much longer to wait for next conversion
-    if(DEBUG_TIMING) read_times[i] = ts_elapsed;
-    if(DEBUG_TIMING) remaining[i] = ts;
-    if(ts_positive_p(&ts)) nanosleep(&ts, NULL);
-  }
-  wiringPiI2CWriteReg16(fd_ina260, INA260_CONFIG_REG, VIP_AVERAGING_MODE); // Restore it now, since one averaging cycle takes a long time (over 150ms).
+    long long t_end = io_now_ns();
+    t_a[i] = io_replay_p()?t_grid:(t_start + t_end)/2; // Replay doesn't wait, so its own timing is meaningless
+    late_a[i] = io_replay_p()?0:t_start - t_grid;
+  }
+  capture_rt(false);
+  io_i2c_write_reg16(fd_ina260, INA260_CONFIG_REG, VIP_AVERAGING_MODE); // Restore it now, since one averaging cycle takes a long time (over 150ms).
+  io_i2c_reserve(fd_ina260, 0, 0); // Done with the bus until the next burst
   clock_gettime(CLOCK_MONOTONIC, &ts_avg_conv_start);
-  int AC_period_start = find_zero_positive_crossing(n_a, N_SAMPLES, 0);
-  int AC_period_end = AC_period_start;
+  for(int i=0; i<N_SAMPLES; i++) metrics_hist_add(&ina260_sensor.metrics, METRIC_JITTER, late_a[i]);
+  if(DEBUG_TIMING) {
+    qsort(late_a, N_SAMPLES, sizeof(late_a[0]), cmp_ll); // For the percentiles
+    printf("Register %d sample lateness: p50 %lldus p90 %lldus p99 %lldus max %lldus\n", reg,
+	   late_a[N_SAMPLES/2]/1000, late_a[N_SAMPLES*9/10]/1000, late_a[N_SAMPLES*99/100]/1000, late_a[N_SAMPLES-1]/1000);
+  }
+  AC_period_start = find_zero_positive_crossing(n_a, N_SAMPLES, 0);
+  AC_period_end = AC_period_start;
   for(int i=0; i<N_CYCLES; i++)
     AC_period_end = find_zero_positive_crossing(n_a, N_SAMPLES, AC_period_end);
-  Nrms = 0;
-  for(int i=AC_period_start; i<AC_period_end; i++) {
-    double N = (double)(n_a[i])*1.25/1000*multiplier + additive; // Chip output unit is 1.25 mV or mA.
-    Nrms += N*N;
-  }
   bool Nrms_success = false;
   if((AC_period_start==AC_period_end) ||
      (AC_period_end == N_SAMPLES)) { // Failed to find the end of a full cycle
     Nrms=0;
   }
-  else {
-    Nrms /= (AC_period_end - AC_period_start);
+  else { // Integrate the square of the samples from one crossing to the other: by trapezoids between samples, and from the samples either side to the interpolated crossings, where the raw value is 0.
+    t_cross_start = crossing_time(AC_period_start);
+    t_cross_end = crossing_time(AC_period_end);
+    double N_prev = (double)(n_a[AC_period_start])*1.25/1000*multiplier + additive; // Chip output unit is 1.25 mV or mA.
+    Nrms = sq_integral(additive, N_prev, t_a[AC_period_start] - t_cross_start);
+    for(int i=AC_period_start+1; i<AC_period_end; i++) {
+      double N = (double)(n_a[i])*1.25/1000*multiplier + additive;
+      Nrms += (N_prev*N_prev + N*N)/2*(t_a[i] - t_a[i-1]);
+      N_prev = N;
+    }
+    Nrms += sq_integral(N_prev, additive, t_cross_end - t_a[AC_period_end-1]);
+    Nrms /= t_cross_end - t_cross_start;
     Nrms = sqrt(Nrms);
     Nrms_success = true;
   }
@@ -139,7 +255,7 @@ bool get_n(int mode, int reg, double multiplier, double additive) { // Get Vrms
     printf("Register %d:\n", reg);
     for(int i=0; i<N_SAMPLES; i++) {
       double N = (double)(n_a[i])*1.25/1000;
-      if(DEBUG_TIMING) printf("[timing%ld:%ld %ld:%ld] ", read_times[i].tv_sec, read_times[i].tv_nsec, remaining[i].tv_sec, remaining[i].tv_nsec);
+      if(DEBUG_TIMING) printf("[t+%lldus] ", (t_a[i] - t_a[0])/1000);
       printf(reg==INA260_V_REG?"%fV":"%fA", N);
       if(DEBUG_AC_CYCLE) {
 	if((AC_period_start<=i) && (i<AC_period_end)) printf(" ***");
@@ -153,20 +269,138 @@ bool get_n(int mode, int reg, double multiplier, double additive) { // Get Vrms
   return Nrms_success;
 }
 
-void setup() {
-  ts_conv_period.tv_sec = 0;
-  ts_conv_period.tv_nsec = N_CONVERSION_TIME;
+// Fourier series of the current samples from the last get_n, over the whole cycles between its crossings. The samples aren't evenly spaced in time (see t_a), so Goertzel's recurrence, which assumes they are, doesn't apply; instead each harmonic is projected directly, with each sample weighted by the time it covers, as in the RMS integral. That's N_HARMONICS complex multiply-adds per sample, i.e. about a thousand per burst, which is nothing beside the burst itself.
+// Each sample is the chip's average over its conversion time, which attenuates a harmonic by sinc of its frequency times that time (to 0.69 at the 13th), so that's divided back out.
+// THD is over harmonics 2 to N_HARMONICS. The distortion PF is the fundamental's share of the rms over all of them, and the displacement PF is what's left of the true PF after that; which assumes the voltage is a sine, as Vrms already does.
+static void get_harmonics() {
+  double re[N_HARMONICS+1], im[N_HARMONICS+1];
+  double T = (t_cross_end - t_cross_start)/N_CYCLES; // ns. Of the fundamental.
+  memset(re, 0, sizeof(re));
+  memset(im, 0, sizeof(im));
+  for(int i=AC_period_start; i<AC_period_end; i++) {
+    double t_before = (i==AC_period_start)?t_cross_start:t_a[i-1];
+    double t_after = (i==AC_period_end-1)?t_cross_end:t_a[i+1];
+    double x = (double)(n_a[i])*1.25/1000*(t_after - t_before)/2; // At the crossings, the raw value is 0
+    double theta = 2*M_PI*(t_a[i] - t_cross_start)/T;
+    double c1 = cos(theta), s1 = sin(theta), c = 1, s = 0;
+    for(int h=1; h<=N_HARMONICS; h++) { // cos and sin of h*theta, by rotating those of (h-1)*theta
+      double c_next = c*c1 - s*s1;
+      s = s*c1 + c*s1;
+      c = c_next;
+      re[h] += x*c;
+      im[h] += x*s;
+    }
+  }
+  double sum_sq = 0;
+  for(int h=1; h<=N_HARMONICS; h++) {
+    double u = M_PI*h*N_CONVERSION_TIME/T;
+    harm_a[h] = sqrt(re[h]*re[h] + im[h]*im[h])*2/(t_cross_end - t_cross_start)/sqrt(2)/(sin(u)/u); // Peak to rms
+    if(h>1) sum_sq += harm_a[h]*harm_a[h];
+  }
+  THD = (harm_a[1]>0)?sqrt(sum_sq)/harm_a[1]:0;
+  DistPF = 1/sqrt(1 + THD*THD);
+  DPF = PF/DistPF;
+  if(DPF>1) DPF = 1; // Pmean is averaged over a different, longer, window than the current burst
+}
+
+// Log THD, harmonics 2, 3, 5, and 7, and the PFs, all in percent (permil would change with nearly every burst), under the usual hysteresis; or a null row, once, if there's nothing meaningful to log
+static void log_harmonics(bool success_p) {
+  int arrData[HARMONICS_COLUMNS];
+  bool arrNull[HARMONICS_COLUMNS];
+  if(!success_p || (harm_a[1]<HARMONICS_MIN_I)) {
+    if(!harm_null_p) {
+      for(int i=0; i<HARMONICS_COLUMNS; i++) arrNull[i] = true;
+      insert_record(&ina260_harmonics_sensor, arrData, HARMONICS_COLUMNS, arrNull);
+      harm_null_p = true;
+    } else update_idle_heartbeat(&ina260_harmonics_sensor);
+    return;
+  }
+  double x[HARMONICS_COLUMNS] = {THD, harm_a[2]/harm_a[1], harm_a[3]/harm_a[1], harm_a[5]/harm_a[1], harm_a[7]/harm_a[1], DPF, DistPF};
+  bool changed = harm_null_p;
+  for(int i=0; i<HARMONICS_COLUMNS; i++) {
+    changed |= reading_change(&harm_prev_inc_p[i], &harm_mem[i], x[i]*100*HYST_SCALE);
+    arrData[i] = harm_mem[i]/HYST_SCALE;
+  }
+  if(changed) {
+    insert_record(&ina260_harmonics_sensor, arrData, HARMONICS_COLUMNS);
+    harm_null_p = false;
+  } else update_idle_heartbeat(&ina260_harmonics_sensor);
+}
+
+// Log the event whose bursts are now the newest in the ring
+static void event_save() {
+  int n_bursts = event_pre + 1 + EVENT_POST_BURSTS;
+  long long t_rel[N_SAMPLES];
+  int Ipeak_raw = 0;
+  event_buf.len = 0;
+  for(int k=0; k<n_bursts; k++) {
+    int b = (ring_pos - n_bursts + k + EVENT_BURSTS) % EVENT_BURSTS;
+    for(int i=0; i<N_SAMPLES; i++) {
+      t_rel[i] = (ring_t[b][i] - event_t0)/1000; // us
+      Ipeak_raw = max(Ipeak_raw, abs(ring_n[b][i]));
+    }
+    archive_encode_series(t_rel, ring_n[b], N_SAMPLES, &event_buf);
+  }
+  int arrData[6] = {event_kind, (int)(event_Irms_max*100), (int)(Ipeak_raw*1.25/10), (int)event_Vrms_min, event_pre, EVENT_POST_BURSTS};
+  insert_record_blob(&ina260_events_sensor, &event_rt, arrData, 6, event_buf.data, event_buf.len);
+  if(DEBUG_SUMMARY) printf("Event kind %d: %d bursts in %zu bytes\n", event_kind, n_bursts, event_buf.len);
+}
+
+// Add the current burst in n_a to the ring, and check it for events
+static void event_capture() {
+  memcpy(ring_n[ring_pos], n_a, sizeof(n_a));
+  memcpy(ring_t[ring_pos], t_a, sizeof(t_a));
+  ring_pos = (ring_pos + 1) % EVENT_BURSTS;
+  if(ring_count<EVENT_BURSTS) ring_count++;
+  int Ipeak_raw = 0;
+  for(int i=0; i<N_SAMPLES; i++) Ipeak_raw = max(Ipeak_raw, abs(n_a[i]));
+  int cond = 0;
+  if(Irms_success && (Irms>event_Irms_max)) cond |= EVENT_IRMS;
+  if(Ipeak_raw*1.25/1000 > event_Ipeak_max) cond |= EVENT_IPEAK;
+  if(Vrms_success && (Vrms<event_Vrms_min)) cond |= EVENT_SAG;
+  int trig = cond & ~event_cond;
+  event_cond = cond;
+  if(!event_post_left) {
+    if(!trig) return;
+    struct timespec ts_mono;
+    clock_gettime(CLOCK_MONOTONIC, &ts_mono);
+    clock_gettime(CLOCK_REALTIME, &event_rt);
+    ns_to_ts(&event_rt, ts_to_ns(&event_rt) - (ts_to_ns(&ts_mono) - t_a[0]));
+    event_t0 = t_a[0];
+    event_kind = 0;
+    event_pre = ring_count - 1;
+    if(event_pre>EVENT_PRE_BURSTS) event_pre = EVENT_PRE_BURSTS;
+    event_post_left = EVENT_POST_BURSTS + 1; // Counting this one
+    event_Irms_max = 0;
+    event_Vrms_min = Vrms; // The last good one, if this one failed
+  }
+  event_kind |= trig;
+  if(Irms_success && (Irms>event_Irms_max)) event_Irms_max = Irms;
+  if(Vrms_success && (Vrms<event_Vrms_min)) event_Vrms_min = Vrms;
+  if(!--event_post_left) event_save();
+}
+
+static long long init() {
   ts_avg_conv_period.tv_sec = 0;
   ts_avg_conv_period.tv_nsec = VI_CONVERSION_TIME * NUM_AVERAGES * 2; // *2 because VI_CONVERSION_TIME is for each of voltage and current (measured sequentially, since the chip has only one ADC)
 
-  fd_ina260 = wiringPiI2CSetup(INA260_I2C_ADDRESS) ;
+  sensor_init(&ina260_harmonics_sensor);
+  if(USE_EVENT_CAPTURE) {
+    sensor_init(&ina260_events_sensor);
+    event_Irms_max = config_double("ina260_event_Irms_max", EVENT_IRMS_MAX);
+    event_Ipeak_max = config_double("ina260_event_Ipeak_max", EVENT_IPEAK_MAX);
+    event_Vrms_min = config_double("ina260_event_Vrms_min", EVENT_VRMS_MIN);
+  }
+  fd_ina260 = io_i2c_open(INA260_I2C_ADDRESS);
   if(fd_ina260==-1) exit(errno);
-  wiringPiI2CWriteReg16(fd_ina260, INA260_CONFIG_REG, VIP_AVERAGING_MODE);
+  io_i2c_set_class(fd_ina260, BUS_REALTIME);
+  io_i2c_write_reg16(fd_ina260, INA260_CONFIG_REG, VIP_AVERAGING_MODE);
   clock_gettime(CLOCK_MONOTONIC, &ts_avg_conv_start);
+  return ts_to_ns(&ts_avg_conv_period);
 }
 
 
-void read_all() {
+static void read_all() {
   struct timespec ts_all_start, ts_all_end, ts_all_elapsed;
   if(DEBUG_SPEED) clock_gettime(CLOCK_MONOTONIC, &ts_all_start);
   get_averages();
@@ -184,6 +418,7 @@ void read_all() {
     S = Vrms * Irms;
     Pmean += Pmean*DIODE_DROP/Vrms;
     (S==0)?(PF=1):(PF = Pmean / S);
+    get_harmonics(); // n_a still has the current samples
   } else fprintf(stderr, "Vrms_success=%d Irms_success=%d; skipping since not both true\n", Vrms_success, Irms_success);
 
   if(DEBUG_SPEED) {
@@ -219,6 +454,8 @@ void read_all() {
 	if(USE_TRUE_Vrms)
 	  printf("Vrms/Vmean=%f\n", Vrms/Vmean);
 	printf("%fVrms %fArms %fVA  PF=%f\n", Vrms, Irms, S, PF);
+	printf("%fA fundamental  THD=%f  H2=%f H3=%f H5=%f H7=%f  DPF=%f DistPF=%f\n", harm_a[1], THD,
+	       harm_a[2]/harm_a[1], harm_a[3]/harm_a[1], harm_a[5]/harm_a[1], harm_a[7]/harm_a[1], DPF, DistPF);
 	printf("%fVmean_raw_V %fPmean_raw_W\n", Vmean_raw_V, Pmean_raw_W);
 	if(DEBUG_SPEED) printf("Total time: %fms\n", ts_all_elapsed.tv_sec+(double)ts_all_elapsed.tv_nsec/1000000);
 	printf("********\n\n");
@@ -228,16 +465,30 @@ void read_all() {
   }
   if((Vrms_success && Irms_success)
      &&(Vrms_changed || Irms_changed || Pmean_changed))
-    insert_record(pStmt_log, arrData, 3);
-  else update_idle_heartbeat();
+    insert_record(&ina260_sensor, arrData, 3);
+  else update_idle_heartbeat(&ina260_sensor);
+  log_harmonics(Vrms_success && Irms_success);
+  if(USE_EVENT_CAPTURE) event_capture();
+}
+
+// The V and I sample bursts in get_n block for the whole capture (about 50ms each), since they can't be interleaved with anything else without corrupting the AC cycle timing. Otherwise, wait out the averaging cycle between steps.
+static long long step() {
+  struct timespec ts;
+  read_all();
+  avg_conv_remaining(&ts);
+  long long t_next = io_now_ns() + ts_to_ns(&ts);
+  io_i2c_reserve(fd_ina260, t_next, t_next + CAPTURE_WINDOW); // Ahead of time, so that a slow transfer isn't started just before the next step's bursts
+  return ts_to_ns(&ts);
 }
 
+struct ghpi_sensor ina260_sensor = {"INA260", "INA260_logs", &init, &step};
+
+#ifndef GHPID
 int main(int argc, char** argv) {
-  int rc;
-  setup();
   daemon_init(argc, argv);
-  while(true) {
-    read_all();
-  }
+  if(USE_BATCH_COMMIT) batch_commit_enable(GHPI_BATCH_MAX_ROWS, GHPI_BATCH_MAX_AGE);
+  if(USE_WRITER_THREAD) writer_thread_enable();
+  run_sensor(&ina260_sensor);
   return 0;
 }
+#endif